@@ -0,0 +1,271 @@
+// Benchmarks and checks of the CPU code paths on synthetic lines, without a GPU or a data set (see CMakeLists.txt).
+// Every benchmark returns whether its results agree with its reference; the exit code is the number of failed ones.
+// The SIMD paths are chosen at compile time, so the build runs this once per instruction set.
+
+#include "../rasterizer.hpp"
+#include "../fragmentsort.hpp"
+#include "../fourier.hpp"
+#include "../mingather.hpp"
+#include "../opacity.hpp"
+#include "../smoothing.hpp"
+#include "../fade.hpp"
+#include "../parameterization.hpp"
+#include "../controlpoints.hpp"
+#include "../lineset.hpp"
+#include <vector>
+#include <random>
+#include <string>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+
+// Helices with random axes, radii and pitches in the box [0, 20]^3, with a smoothly varying importance.
+struct SyntheticLines
+{
+	SyntheticLines(int numLines, int verticesPerLine, int totalNumCPs) : NumLines(numLines), TotalNumCPs(totalNumCPs)
+	{
+		std::mt19937 rng(42);
+		std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+		LineOffsets.assign(1, 0);
+		for (int line = 0; line < numLines; ++line)
+		{
+			Vec3f center(2 + 16 * uniform(rng), 2 + 16 * uniform(rng), 2 + 16 * uniform(rng));
+			float radius = 0.2f + 1.5f * uniform(rng), pitch = 0.02f + 0.1f * uniform(rng), phase = 6.2831853f * uniform(rng);
+			float turns = 2 + 6 * uniform(rng), frequency = 1 + 4 * uniform(rng);
+			int axis = line % 3;
+			for (int v = 0; v < verticesPerLine; ++v)
+			{
+				float s = (float)v / (verticesPerLine - 1), angle = phase + 6.2831853f * turns * s;
+				float p[3] = { radius * cosf(angle), radius * sinf(angle), pitch * (angle - phase) - pitch * 3.14159265f * turns };
+				Positions.push_back(Vec3f(center.x + p[axis], center.y + p[(axis + 1) % 3], center.z + p[(axis + 2) % 3]));
+				ID.push_back(line);
+				Importance.push_back(0.05f + 0.95f * (0.5f + 0.5f * sinf(frequency * angle)));
+			}
+			LineOffsets.push_back((int)Positions.size());
+		}
+
+		// the parameterization of LineSet
+		std::vector<float> lineLengths(numLines);
+		std::vector<int> numberOfControlPointsOfLine(numLines);
+		AlphaWeights.resize(Positions.size());
+		LineParameterization::ComputeArcLengths(Positions.data(), LineOffsets.data(), numLines, lineLengths.data(), AlphaWeights.data());
+		ControlPointAllocator::Allocate(lineLengths.data(), numLines, totalNumCPs, numberOfControlPointsOfLine.data());
+		LineParameterization::NormalizeArcLengths(LineOffsets.data(), numLines, lineLengths.data(), numberOfControlPointsOfLine.data(), AlphaWeights.data());
+		ControlPointLineIndices.resize(totalNumCPs);
+		LineParameterization::ComputeControlPointLineIndices(numberOfControlPointsOfLine.data(), numLines, ControlPointLineIndices.data());
+	}
+
+	int GetNumVertices() const { return (int)Positions.size(); }
+
+	int NumLines;
+	int TotalNumCPs;
+	std::vector<Vec3f> Positions;
+	std::vector<int> ID;
+	std::vector<float> Importance;
+	std::vector<float> AlphaWeights;
+	std::vector<int> LineOffsets;
+	std::vector<unsigned int> ControlPointLineIndices;
+};
+
+// Left-handed look-at and perspective matrices for row vectors, like XMMatrixLookAtLH and XMMatrixPerspectiveFovLH.
+static Mat4f LookAt(const Vec3f& eye, const Vec3f& at)
+{
+	float z[3] = { at.x - eye.x, at.y - eye.y, at.z - eye.z };
+	float length = sqrtf(z[0] * z[0] + z[1] * z[1] + z[2] * z[2]);
+	for (int i = 0; i < 3; ++i) z[i] /= length;
+	float x[3] = { z[2], 0, -z[0] };	// up (0, 1, 0) x z
+	length = sqrtf(x[0] * x[0] + x[2] * x[2]);
+	for (int i = 0; i < 3; ++i) x[i] /= length;
+	float y[3] = { z[1] * x[2] - z[2] * x[1], z[2] * x[0] - z[0] * x[2], z[0] * x[1] - z[1] * x[0] };
+	float e[3] = { eye.x, eye.y, eye.z };
+	Mat4f m;
+	memset(&m, 0, sizeof(Mat4f));
+	for (int i = 0; i < 3; ++i)
+	{
+		m.m[i][0] = x[i];
+		m.m[i][1] = y[i];
+		m.m[i][2] = z[i];
+		m.m[3][0] -= x[i] * e[i];
+		m.m[3][1] -= y[i] * e[i];
+		m.m[3][2] -= z[i] * e[i];
+	}
+	m.m[3][3] = 1;
+	return m;
+}
+
+static Mat4f Perspective(float fovY, float aspect, float zNear, float zFar)
+{
+	Mat4f m;
+	memset(&m, 0, sizeof(Mat4f));
+	float yScale = 1 / tanf(fovY / 2);
+	m.m[0][0] = yScale / aspect;
+	m.m[1][1] = yScale;
+	m.m[2][2] = zFar / (zFar - zNear);
+	m.m[2][3] = 1;
+	m.m[3][2] = -zNear * zFar / (zFar - zNear);
+	return m;
+}
+
+// Writes the lines as an OBJ file. The importance goes into 'vt' records, only for the first numImportance vertices.
+static bool WriteObj(const std::string& path, const SyntheticLines& lines, int numImportance)
+{
+	FILE* file = fopen(path.c_str(), "w");
+	if (!file) return false;
+	for (int line = 0; line < lines.NumLines; ++line)
+	{
+		for (int v = lines.LineOffsets[line]; v < lines.LineOffsets[line + 1]; ++v)
+		{
+			fprintf(file, "v %f %f %f\n", lines.Positions[v].x, lines.Positions[v].y, lines.Positions[v].z);
+			if (v < numImportance) fprintf(file, "vt %f\n", lines.Importance[v]);
+		}
+		fprintf(file, "l");
+		for (int v = lines.LineOffsets[line]; v < lines.LineOffsets[line + 1]; ++v)
+			fprintf(file, " %i", v + 1);
+		fprintf(file, "\n");
+	}
+	return fclose(file) == 0;
+}
+
+template <typename T>
+static bool Equal(const CachedArray<T>& a, const CachedArray<T>& b)
+{
+	return a.size() == b.size() && (a.empty() || memcmp(a.data(), b.data(), a.size() * sizeof(T)) == 0);
+}
+
+static bool Equal(const LineSet& a, const LineSet& b)
+{
+	return a.GetNumLines() == b.GetNumLines() && Equal(a.GetPositions(), b.GetPositions()) && Equal(a.GetImportance(), b.GetImportance())
+		&& Equal(a.GetLineOffsets(), b.GetLineOffsets()) && Equal(a.GetID(), b.GetID()) && Equal(a.GetAlphaWeights(), b.GetAlphaWeights());
+}
+
+// The lines of a reordered line set are those of the line set in file order, at GetOriginalLineID.
+static bool SameLines(const LineSet& reordered, const LineSet& original)
+{
+	if (reordered.GetNumLines() != original.GetNumLines() || reordered.GetNumVertices() != original.GetNumVertices()) return false;
+	for (int line = 0; line < reordered.GetNumLines(); ++line)
+	{
+		int source = reordered.GetOriginalLineID(line);
+		int begin = reordered.GetLineOffsets()[line], count = reordered.GetLineOffsets()[line + 1] - begin;
+		int sourceBegin = original.GetLineOffsets()[source];
+		if (count != original.GetLineOffsets()[source + 1] - sourceBegin
+			|| memcmp(&reordered.GetPositions()[begin], &original.GetPositions()[sourceBegin], count * sizeof(Vec3f)) != 0)
+			return false;
+		if (reordered.GetImportance().size() == (size_t)reordered.GetNumVertices()
+			&& memcmp(&reordered.GetImportance()[begin], &original.GetImportance()[sourceBegin], count * sizeof(float)) != 0)
+			return false;
+		for (int v = 0; v < count; ++v)
+			if (reordered.GetID()[begin + v] != line) return false;
+	}
+	return true;
+}
+
+// Loads the OBJ file cold (parsed, writes the cache), warm (from the cache) and, without reordering, streamed with a small budget,
+// and compares the line sets. A reordered line set is also compared line by line with the one in file order.
+static bool CheckLoading(const std::string& path, int totalNumCPs, const LineSimplifier::Settings& simplification, LineReorder::Curve reordering)
+{
+	remove(LineCache::GetPath(path).c_str());
+	bool warmSame, otherSame;
+	int numLines, numVertices, numImportance;
+	{
+		LineSet cold(path, totalNumCPs, 0, simplification, reordering);
+		LineSet warm(path, totalNumCPs, 0, simplification, reordering);
+		warmSame = cold.GetNumLines() > 0 && !cold.IsCached() && warm.IsCached() && Equal(cold, warm);
+		numLines = cold.GetNumLines();
+		numVertices = cold.GetNumVertices();
+		numImportance = (int)cold.GetImportance().size();
+		remove(LineCache::GetPath(path).c_str());
+		if (reordering == LineReorder::NONE)
+		{
+			LineSet streamed(path, totalNumCPs, 1 << 16, simplification);
+			otherSame = streamed.IsCached() && Equal(cold, streamed);
+		}
+		else
+		{
+			LineSet original(path, totalNumCPs, 0, simplification);
+			otherSame = SameLines(cold, original);
+		}
+	}
+	remove(LineCache::GetPath(path).c_str());
+	printf("  %i lines, %i vertices, %i importance values: warm %s, %s %s\n", numLines, numVertices, numImportance, warmSame ? "same" : "DIFFERENT",
+		reordering == LineReorder::NONE ? "streamed" : "lines in file order", otherSame ? "same" : "DIFFERENT");
+	return warmSame && otherSame;
+}
+
+static int Check(const char* name, bool ok)
+{
+	printf("%s: %s\n\n", name, ok ? "ok" : "FAILED");
+	return ok ? 0 : 1;
+}
+
+int main()
+{
+	printf("SIMD: %s, %i threads\n\n", FourierOpacity::SimdName(), ThreadPool::Global().GetNumThreads());
+	int failed = 0;
+
+	SyntheticLines lines(2000, 200, 20000);
+	Mat4f view = LookAt(Vec3f(30, 25, 35), Vec3f(10, 10, 10)), projection = Perspective(0.785f, 1, 0.01f, 1000);
+
+	LineRasterizer::Settings raster;
+	raster.Width = raster.Height = 256;
+	raster.StripWidth = 0.08f;
+	LineRasterizer rasterizer(raster);
+	failed += Check("rasterizer", rasterizer.Benchmark(lines.Positions.data(), lines.ID.data(), lines.Importance.data(), lines.AlphaWeights.data(),
+		lines.GetNumVertices(), view, projection, NULL));
+
+	LineRasterizer::FragmentArrays arrays;
+	rasterizer.Rasterize(lines.Positions.data(), lines.ID.data(), lines.Importance.data(), lines.AlphaWeights.data(), lines.GetNumVertices(),
+		view, projection, NULL, arrays);
+	FragmentSorter sorter;
+	failed += Check("fragment sort", sorter.Benchmark(arrays.Offsets.data(), (size_t)arrays.Width * arrays.Height, arrays.Fragments.data()));
+
+	// every K; 31 fragments go through the blocks of every SIMD width of the build and the scalar rest
+	failed += Check("fourier (7 fragments)", FourierOpacity::Benchmark(1 << 14, 7));
+	failed += Check("fourier (31 fragments)", FourierOpacity::Benchmark(1 << 13, 31));
+	failed += Check("fourier (64 fragments)", FourierOpacity::Benchmark(1 << 12, 64));
+
+	failed += Check("min gather", MinGather::Benchmark(lines.TotalNumCPs, 1 << 22, 0.1f));
+
+	OpacityOptimizer<4>::Settings opacity;
+	opacity.Raster = raster;
+	OpacityOptimizer<4> optimizer(opacity);
+	failed += Check("opacity", optimizer.Benchmark(lines.Positions.data(), lines.ID.data(), lines.Importance.data(), lines.AlphaWeights.data(),
+		lines.GetNumVertices(), lines.TotalNumCPs, view, projection, NULL));
+
+	// the control points without fragments are untouched (NaN) in the smoothing, like on the GPU
+	std::vector<float> alphas;
+	optimizer.Optimize(lines.Positions.data(), lines.ID.data(), lines.Importance.data(), lines.AlphaWeights.data(), lines.GetNumVertices(),
+		lines.TotalNumCPs, view, projection, NULL);
+	optimizer.GetAlphas(alphas);
+	std::vector<float> untouched(alphas);
+	for (float& alpha : untouched)
+		if (alpha == 1) alpha = NAN;
+	AlphaSmoother smoother;
+	smoother.SetLines(lines.ControlPointLineIndices.data(), lines.TotalNumCPs);
+	failed += Check("smoothing (10 iterations)", smoother.Benchmark(untouched.data(), 10, 0.1f));
+	failed += Check("smoothing (100 iterations)", smoother.Benchmark(untouched.data(), 100, 0.1f, 3));
+	failed += Check("smoothing (10000 iterations, clamped to the halo)", smoother.Benchmark(untouched.data(), 10000, 0.1f, 1));
+
+	AlphaFader fader;
+	failed += Check("fade", fader.Benchmark(alphas.data(), lines.TotalNumCPs, lines.AlphaWeights.data(), lines.GetNumVertices(), 0.1f));
+
+	// line sets with importance for every vertex, for none, and for all but the last one (the cache keeps as many as the reader)
+	SyntheticLines small(200, 100, 2000);
+	std::string path = std::string("bench_lines_") + FourierOpacity::SimdName() + ".obj";
+	LineSimplifier::Settings simplification;
+	simplification.Type = LineSimplifier::DOUGLAS_PEUCKER;
+	simplification.Tolerance = 0.01f;
+	const int numImportance[] = { small.GetNumVertices(), 0, small.GetNumVertices() - 1 };
+	const char* names[] = { "with vt", "without vt", "vt missing for the last vertex" };
+	for (int i = 0; i < 3; ++i)
+	{
+		bool written = WriteObj(path, small, numImportance[i]);
+		failed += Check((std::string("loading ") + names[i]).c_str(), written && CheckLoading(path, small.TotalNumCPs, LineSimplifier::Settings(), LineReorder::NONE));
+	}
+	bool written = WriteObj(path, small, small.GetNumVertices());
+	failed += Check("loading simplified", written && CheckLoading(path, small.TotalNumCPs, simplification, LineReorder::NONE));
+	failed += Check("loading reordered", written && CheckLoading(path, small.TotalNumCPs, LineSimplifier::Settings(), LineReorder::HILBERT));
+	remove(path.c_str());
+
+	printf("%i failed\n", failed);
+	return failed;
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <assert.h>
+
+// Distributes polyline segments (here sometimes called control points) among the lines so that they are roughly equally-sized.
+// Lines that are shorter than the average segment length receive two segments. The remaining segments are shared among the
+// other lines in proportion to their length and rounded down. The segments that are left over go to the lines with the largest
+// remainders (largest remainder method). They are selected with nth_element in linear time; equal remainders are ordered by line index.
+
+class ControlPointAllocator
+{
+public:
+
+	static void Allocate(const float* lineLengths, int numLines, int totalNumCPs, int* numberOfControlPointsOfLine)
+	{
+		if (numLines <= 0) return;
+
+		float accumLineLength = 0;
+		for (int lineId = 0; lineId < numLines; ++lineId)
+			accumLineLength += lineLengths[lineId];
+
+		assert(totalNumCPs * 2 > numLines);
+
+		// calculate the average length of a polyline segment
+		float lengthPerPatch = accumLineLength / totalNumCPs;
+
+		// we first make sure that lines shorter than this length receive two polyline segments
+		int remPatches = totalNumCPs;
+		float remLength = accumLineLength;
+		for (int lineId = 0; lineId < numLines; ++lineId)
+		{
+			float length = lineLengths[lineId];
+			if (length <= lengthPerPatch)
+			{
+				numberOfControlPointsOfLine[lineId] = 2;
+				remPatches -= 2;
+				remLength -= length;
+			}
+		}
+
+		// the remaining polyline segments are distributed among the other lines
+		std::vector<Remainder> remainders;
+		int assignedPatches = 0;
+		for (int lineId = 0; lineId < numLines; ++lineId)
+		{
+			float length = lineLengths[lineId];
+			if (length > lengthPerPatch)
+			{
+				float numPatches = length / remLength * remPatches;
+				numberOfControlPointsOfLine[lineId] = (int)numPatches;
+				assignedPatches += (int)numPatches;
+				remainders.push_back(Remainder(numPatches - (int)numPatches, lineId));
+			}
+			else if (!(length <= lengthPerPatch))	// NaN
+				numberOfControlPointsOfLine[lineId] = 0;
+		}
+
+		// due to rounding a few segments are not yet assigned. do so now.
+		int missing = remPatches - assignedPatches;
+		if (missing > 0)
+		{
+			// if there are no long lines, the segments are spread over all lines
+			if (remainders.empty())
+			{
+				for (int lineId = 0; lineId < numLines; ++lineId)
+					remainders.push_back(Remainder(0, lineId));
+			}
+
+			// every line gets the same share of what remains after whole rounds, the lines with the largest remainders one more
+			int numCandidates = (int)remainders.size();
+			int rounds = missing / numCandidates;
+			int rest = missing % numCandidates;
+			if (rounds > 0)
+			{
+				for (const Remainder& r : remainders)
+					numberOfControlPointsOfLine[r.LineId] += rounds;
+			}
+			SelectLargest(remainders, rest);
+			for (int i = 0; i < rest; ++i)
+				numberOfControlPointsOfLine[remainders[i].LineId] += 1;
+		}
+		else if (missing < 0)
+		{
+			// the floats rounded up: take the surplus from the lines with the smallest remainders
+			std::vector<Remainder> candidates;
+			for (const Remainder& r : remainders)
+			{
+				if (numberOfControlPointsOfLine[r.LineId] > 0)
+					candidates.push_back(Remainder(-r.Value, -r.LineId));
+			}
+			int surplus = std::min(-missing, (int)candidates.size());
+			SelectLargest(candidates, surplus);
+			for (int i = 0; i < surplus; ++i)
+				numberOfControlPointsOfLine[-candidates[i].LineId] -= 1;
+		}
+	}
+
+private:
+
+	struct Remainder
+	{
+		Remainder(float value, int lineId) : Value(value), LineId(lineId) {}
+		float Value;
+		int LineId;
+	};
+
+	// Moves the 'count' largest remainders to the front (in any order). Equal values are ordered by line index.
+	static void SelectLargest(std::vector<Remainder>& remainders, int count)
+	{
+		if (count <= 0 || count >= (int)remainders.size()) return;
+		std::nth_element(remainders.begin(), remainders.begin() + count - 1, remainders.end(), [](const Remainder& a, const Remainder& b) {
+			return a.Value > b.Value || (a.Value == b.Value && a.LineId < b.LineId);
+		});
+	}
+};
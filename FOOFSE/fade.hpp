@@ -0,0 +1,213 @@
+#pragma once
+
+#include "parallel.hpp"
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cfloat>
+#include <math.h>
+#include <string.h>
+#include <stdio.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define FADE_AVX2
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_IX86)
+#include <emmintrin.h>
+#define FADE_SSE
+#endif
+
+// Fade of the per vertex alphas towards the alphas of the control points (the CPU version of shader_FadeToAlphaPerVertex).
+// Every vertex blends the two control points around its alpha weight with a smoothstep and moves its current alpha by the
+// fraction 'fadeToAlpha' towards it. Untouched control points (NaN) and control points past the end count as 0, like the
+// zeros of out of range loads on the GPU.
+// The vertices are processed in parallel; within a chunk eight (AVX2, with gathers of the control point alphas) or four
+// (SSE2, scalar loads) vertices at a time. The fade also returns the largest change of an alpha: once it stays below an
+// epsilon, the alphas converged and the fade (and the optimization, while the view does not change) can be skipped.
+
+class AlphaFader
+{
+public:
+
+	AlphaFader() : _MaxDelta(FLT_MAX), _Epsilon(1e-4f) {}
+
+	// One fade step of all vertices, 'current' is updated in place. Returns the largest change of an alpha.
+	float Fade(const float* controlPointAlphas, int numControlPoints, const float* alphaWeights, int numVertices, float fadeToAlpha, float* current)
+	{
+		std::atomic<unsigned int> maxDeltaBits(0);
+		ParallelFor(0, numVertices, 1 << 14, [&](long long first, long long last) {
+			float maxDelta = FadeRange(controlPointAlphas, numControlPoints, alphaWeights, (int)first, (int)last, fadeToAlpha, current);
+			// positive floats compare like their bits
+			unsigned int bits = FloatBits(maxDelta);
+			unsigned int old = maxDeltaBits.load();
+			while (old < bits && !maxDeltaBits.compare_exchange_weak(old, bits)) {}
+		});
+		_MaxDelta = BitsFloat(maxDeltaBits.load());
+		return _MaxDelta;
+	}
+
+	// Scalar single threaded fade (for comparison).
+	static float FadeReference(const float* controlPointAlphas, int numControlPoints, const float* alphaWeights, int numVertices, float fadeToAlpha, float* current)
+	{
+		float maxDelta = 0;
+		for (int v = 0; v < numVertices; ++v)
+		{
+			float target = GetTarget(controlPointAlphas, numControlPoints, alphaWeights[v]);
+			float newAlpha = current[v] + (target - current[v]) * fadeToAlpha;
+			maxDelta = std::max(maxDelta, fabsf(newAlpha - current[v]));
+			current[v] = newAlpha;
+		}
+		return maxDelta;
+	}
+
+	float GetMaxDelta() const { return _MaxDelta; }
+	bool IsConverged() const { return _MaxDelta <= _Epsilon; }
+	// The alphas count as changing until the next fade (e.g. after the view or the control point alphas changed).
+	void Invalidate() { _MaxDelta = FLT_MAX; }
+	void SetEpsilon(float epsilon) { _Epsilon = epsilon; }
+	float GetEpsilon() const { return _Epsilon; }
+
+	// Fades from 0 to fixed control point alphas until convergence (at most maxFrames): time per frame of the vectorized and
+	// the reference fade, their difference and the number of frames until convergence.
+	// Returns whether the fade converged and agrees with the reference to 1e-5.
+	bool Benchmark(const float* controlPointAlphas, int numControlPoints, const float* alphaWeights, int numVertices, float fadeToAlpha, int maxFrames = 1000)
+	{
+		std::vector<float> current(numVertices, 0.0f), reference(numVertices, 0.0f);
+		double seconds = 0, secondsReference = 0;
+		int numFrames = 0;
+		Invalidate();
+		while (!IsConverged() && numFrames < maxFrames)
+		{
+			std::chrono::high_resolution_clock::time_point timeStart = std::chrono::high_resolution_clock::now();
+			Fade(controlPointAlphas, numControlPoints, alphaWeights, numVertices, fadeToAlpha, current.data());
+			std::chrono::high_resolution_clock::time_point timeFade = std::chrono::high_resolution_clock::now();
+			FadeReference(controlPointAlphas, numControlPoints, alphaWeights, numVertices, fadeToAlpha, reference.data());
+			std::chrono::high_resolution_clock::time_point timeEnd = std::chrono::high_resolution_clock::now();
+			seconds += std::chrono::duration<double>(timeFade - timeStart).count();
+			secondsReference += std::chrono::duration<double>(timeEnd - timeFade).count();
+			numFrames++;
+		}
+
+		float maxDifference = 0;
+		for (int v = 0; v < numVertices; ++v)
+			maxDifference = std::max(maxDifference, fabsf(current[v] - reference[v]));
+		const char* path =
+#if defined(FADE_AVX2)
+			"avx2";
+#elif defined(FADE_SSE)
+			"sse2";
+#else
+			"parallel";
+#endif
+		printf("Fade of %i vertices (%i control points, fade %.3f, epsilon %.1e)\n", numVertices, numControlPoints, fadeToAlpha, _Epsilon);
+		printf("  %s: %8.3f ms / frame\n  scalar: %8.3f ms / frame (difference max %.2e)\n  %s after %i frames (last delta %.2e)\n",
+			path, seconds * 1000 / std::max(numFrames, 1), secondsReference * 1000 / std::max(numFrames, 1), maxDifference,
+			IsConverged() ? "converged" : "not converged", numFrames, _MaxDelta);
+		return IsConverged() && maxDifference <= 1e-5f;
+	}
+
+private:
+
+	static inline unsigned int FloatBits(float f) { unsigned int u; memcpy(&u, &f, sizeof(u)); return u; }
+	static inline float BitsFloat(unsigned int u) { float f; memcpy(&f, &u, sizeof(f)); return f; }
+
+	static inline float GetAlpha(const float* controlPointAlphas, int numControlPoints, int cp)
+	{
+		if (cp < 0 || cp >= numControlPoints) return 0;
+		float alpha = controlPointAlphas[cp];
+		return alpha == alpha ? alpha : 0;
+	}
+
+	// the blended control point alpha at the alpha weight (lerp with a smoothstep, as in the shader)
+	static inline float GetTarget(const float* controlPointAlphas, int numControlPoints, float weight)
+	{
+		int first = (int)weight;
+		float s = std::min(std::max(weight - (float)first, 0.0f), 1.0f);
+		s = s * s * (3 - 2 * s);
+		float a0 = GetAlpha(controlPointAlphas, numControlPoints, first);
+		float a1 = GetAlpha(controlPointAlphas, numControlPoints, first + 1);
+		return a0 + s * (a1 - a0);
+	}
+
+	static float FadeRange(const float* controlPointAlphas, int numControlPoints, const float* alphaWeights, int first, int last, float fadeToAlpha, float* current)
+	{
+		int v = first;
+		float maxDelta = 0;
+#ifdef FADE_AVX2
+		{
+			const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.0f), two = _mm256_set1_ps(2.0f), three = _mm256_set1_ps(3.0f);
+			const __m256 fade = _mm256_set1_ps(fadeToAlpha), absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+			const __m256i count = _mm256_set1_epi32(numControlPoints), minusOne = _mm256_set1_epi32(-1), oneIndex = _mm256_set1_epi32(1);
+			__m256 maxDelta8 = zero;
+			for (; v + 8 <= last; v += 8)
+			{
+				__m256 weight = _mm256_loadu_ps(alphaWeights + v);
+				__m256i index0 = _mm256_cvttps_epi32(weight), index1 = _mm256_add_epi32(index0, oneIndex);
+				__m256 s = _mm256_min_ps(_mm256_max_ps(_mm256_sub_ps(weight, _mm256_cvtepi32_ps(index0)), zero), one);
+				s = _mm256_mul_ps(_mm256_mul_ps(s, s), _mm256_sub_ps(three, _mm256_mul_ps(two, s)));
+
+				// gather only the control points in [0, count)
+				__m256i in0 = _mm256_and_si256(_mm256_cmpgt_epi32(count, index0), _mm256_cmpgt_epi32(index0, minusOne));
+				__m256i in1 = _mm256_and_si256(_mm256_cmpgt_epi32(count, index1), _mm256_cmpgt_epi32(index1, minusOne));
+				__m256 a0 = _mm256_mask_i32gather_ps(zero, controlPointAlphas, index0, _mm256_castsi256_ps(in0), 4);
+				__m256 a1 = _mm256_mask_i32gather_ps(zero, controlPointAlphas, index1, _mm256_castsi256_ps(in1), 4);
+				a0 = _mm256_and_ps(a0, _mm256_cmp_ps(a0, a0, _CMP_ORD_Q));
+				a1 = _mm256_and_ps(a1, _mm256_cmp_ps(a1, a1, _CMP_ORD_Q));
+
+				__m256 target = _mm256_add_ps(a0, _mm256_mul_ps(s, _mm256_sub_ps(a1, a0)));
+				__m256 alpha = _mm256_loadu_ps(current + v);
+				__m256 newAlpha = _mm256_add_ps(alpha, _mm256_mul_ps(_mm256_sub_ps(target, alpha), fade));
+				_mm256_storeu_ps(current + v, newAlpha);
+				maxDelta8 = _mm256_max_ps(maxDelta8, _mm256_and_ps(_mm256_sub_ps(newAlpha, alpha), absMask));
+			}
+			float lanes[8];
+			_mm256_storeu_ps(lanes, maxDelta8);
+			for (int i = 0; i < 8; ++i) maxDelta = std::max(maxDelta, lanes[i]);
+		}
+#endif
+#ifdef FADE_SSE
+		{
+			const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f), two = _mm_set1_ps(2.0f), three = _mm_set1_ps(3.0f);
+			const __m128 fade = _mm_set1_ps(fadeToAlpha), absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+			__m128 maxDelta4 = zero;
+			for (; v + 4 <= last; v += 4)
+			{
+				__m128 weight = _mm_loadu_ps(alphaWeights + v);
+				__m128i index = _mm_cvttps_epi32(weight);
+				__m128 s = _mm_min_ps(_mm_max_ps(_mm_sub_ps(weight, _mm_cvtepi32_ps(index)), zero), one);
+				s = _mm_mul_ps(_mm_mul_ps(s, s), _mm_sub_ps(three, _mm_mul_ps(two, s)));
+
+				// no gathers in SSE2: the control point alphas are loaded one by one
+				int indices[4];
+				_mm_storeu_si128((__m128i*)indices, index);
+				__m128 a0 = _mm_setr_ps(GetAlpha(controlPointAlphas, numControlPoints, indices[0]), GetAlpha(controlPointAlphas, numControlPoints, indices[1]),
+					GetAlpha(controlPointAlphas, numControlPoints, indices[2]), GetAlpha(controlPointAlphas, numControlPoints, indices[3]));
+				__m128 a1 = _mm_setr_ps(GetAlpha(controlPointAlphas, numControlPoints, indices[0] + 1), GetAlpha(controlPointAlphas, numControlPoints, indices[1] + 1),
+					GetAlpha(controlPointAlphas, numControlPoints, indices[2] + 1), GetAlpha(controlPointAlphas, numControlPoints, indices[3] + 1));
+
+				__m128 target = _mm_add_ps(a0, _mm_mul_ps(s, _mm_sub_ps(a1, a0)));
+				__m128 alpha = _mm_loadu_ps(current + v);
+				__m128 newAlpha = _mm_add_ps(alpha, _mm_mul_ps(_mm_sub_ps(target, alpha), fade));
+				_mm_storeu_ps(current + v, newAlpha);
+				maxDelta4 = _mm_max_ps(maxDelta4, _mm_and_ps(_mm_sub_ps(newAlpha, alpha), absMask));
+			}
+			float lanes[4];
+			_mm_storeu_ps(lanes, maxDelta4);
+			for (int i = 0; i < 4; ++i) maxDelta = std::max(maxDelta, lanes[i]);
+		}
+#endif
+		for (; v < last; ++v)
+		{
+			float target = GetTarget(controlPointAlphas, numControlPoints, alphaWeights[v]);
+			float newAlpha = current[v] + (target - current[v]) * fadeToAlpha;
+			maxDelta = std::max(maxDelta, fabsf(newAlpha - current[v]));
+			current[v] = newAlpha;
+		}
+		return maxDelta;
+	}
+
+	float _MaxDelta;	// largest change of an alpha in the last fade
+	float _Epsilon;
+};
@@ -0,0 +1,449 @@
+#pragma once
+
+#include "parallel.hpp"
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <math.h>
+#include <stdio.h>
+
+#if defined(__AVX__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+#if defined(__AVX512F__)
+#define FOURIER_AVX512
+#endif
+#if defined(__AVX__) || defined(__AVX512F__)
+#define FOURIER_AVX
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_IX86)
+#include <emmintrin.h>
+#define FOURIER_SSE
+#endif
+
+// The Fourier opacity estimate of shader_MinGather_FOM.hlsl on the CPU, for the fragments of one pixel.
+// The squared importance g_i^2 of the fragments along depth d_i is approximated by K harmonics:
+//   a_k = sum 2 g_i^2 cos(2 pi k d_i),   b_k = sum 2 g_i^2 sin(2 pi k d_i)
+// and the importance in front of a depth d is the integral of the series:
+//   G(d) = a_0 d / 2 + sum_{k >= 1} (a_k sin(2 pi k d) + b_k (1 - cos(2 pi k d))) / (2 pi k)
+// The shader calls sin and cos for every harmonic of every fragment. Here, sin and cos of 2 pi d are evaluated once per fragment
+// (by a polynomial) and the higher harmonics follow from the angle addition theorem:
+//   cos((k + 1) t) = cos(k t) cos(t) - sin(k t) sin(t),   sin((k + 1) t) = sin(k t) cos(t) + cos(k t) sin(t)
+// The fragments are processed 16 (AVX-512), 8 (AVX) or 4 (SSE2) at a time, the rest one by one with the same arithmetic.
+// The Reference functions are the scalar shader math.
+// The number of harmonics K is a template parameter, so that the loops over the harmonics have a fixed length and are unrolled
+// (FOURIER_HARMONICS of shader_Common.hlsli for the renderer, 2, 4, 8 or 16 in the benchmark).
+
+class FourierOpacity
+{
+public:
+
+	static const int MAX_HARMONICS = 16;
+
+	// Computes the coefficients a[0] ... a[K - 1] and b[0] ... b[K - 1] of n fragments with importance g and depth d.
+	template <int K>
+	static void Accumulate(const float* g, const float* d, int n, float* a, float* b)
+	{
+		static_assert(K >= 1 && K <= MAX_HARMONICS, "unsupported number of harmonics");
+		std::fill(a, a + K, 0.0f);
+		std::fill(b, b + K, 0.0f);
+		int i = 0;
+#ifdef FOURIER_AVX512
+		i += AccumulateBlocks<Avx512, K>(g + i, d + i, n - i, a, b);
+#endif
+#ifdef FOURIER_AVX
+		i += AccumulateBlocks<Avx, K>(g + i, d + i, n - i, a, b);
+#endif
+#ifdef FOURIER_SSE
+		i += AccumulateBlocks<Sse, K>(g + i, d + i, n - i, a, b);
+#endif
+		AccumulateBlocks<Scalar, K>(g + i, d + i, n - i, a, b);
+	}
+
+	// Evaluates G at the n depths d.
+	template <int K>
+	static void Evaluate(const float* d, int n, const float* a, const float* b, float* G)
+	{
+		float as[K], bs[K];
+		ScaleCoefficients<K>(a, b, as, bs);
+		int i = 0;
+#ifdef FOURIER_AVX512
+		i += EvaluateBlocks<Avx512, K>(d + i, n - i, as, bs, G + i);
+#endif
+#ifdef FOURIER_AVX
+		i += EvaluateBlocks<Avx, K>(d + i, n - i, as, bs, G + i);
+#endif
+#ifdef FOURIER_SSE
+		i += EvaluateBlocks<Sse, K>(d + i, n - i, as, bs, G + i);
+#endif
+		EvaluateBlocks<Scalar, K>(d + i, n - i, as, bs, G + i);
+	}
+
+	// The alpha values of the fragments of a pixel, as in PS_FOM: the importance behind a fragment is G(d_i) - g_i^2, in front of it gall - G(d_i).
+	// The importance and depth are expected in (0, 1), clamped as in the shader.
+	template <int K>
+	static void ComputeAlphas(const float* g, const float* d, int n, float q, float r, float lambda, float* alpha)
+	{
+		float a[K], b[K];
+		Accumulate<K>(g, d, n, a, b);
+		Evaluate<K>(d, n, a, b, alpha);
+		float gall = a[0] * 0.5f;
+		for (int i = 0; i < n; ++i)
+			alpha[i] = Alpha(g[i], alpha[i], gall, q, r, lambda);
+	}
+
+	// Adds a single fragment to the coefficients, for fragments that arrive one at a time.
+	template <int K>
+	static inline void AccumulateFragment(float g, float d, float* a, float* b)
+	{
+		AccumulateBlocks<Scalar, K>(&g, &d, 1, a, b);
+	}
+
+	// The coefficients in the form that EvaluateFragment takes: a_0 / 2 (which is gall) in as[0], a_k / (2 pi k) and b_k / (2 pi k).
+	// Can be done in place.
+	template <int K>
+	static void ScaleCoefficients(const float* a, const float* b, float* as, float* bs)
+	{
+		const float pi = 3.1415926f;
+		as[0] = a[0] * 0.5f;
+		bs[0] = 0;
+		for (int k = 1; k < K; ++k)
+		{
+			as[k] = a[k] / (2 * pi * k);
+			bs[k] = b[k] / (2 * pi * k);
+		}
+	}
+
+	// G at a single depth d, from the scaled coefficients.
+	template <int K>
+	static inline float EvaluateFragment(float d, const float* as, const float* bs)
+	{
+		float G;
+		EvaluateBlocks<Scalar, K>(&d, 1, as, bs, &G);
+		return G;
+	}
+
+	// The alpha value of a fragment with importance gi, importance G(d_i) up to its depth, and gall in total (PS_FOM).
+	static inline float Alpha(float gi, float Gdi, float gall, float q, float r, float lambda)
+	{
+		float Rgf = Gdi - gi * gi;
+		float Qgb = gall - Gdi;
+		float alpha = 1 / (1 + powf(Saturate(1 - gi), 2 * lambda) * (r * Saturate(Rgf) + q * Saturate(Qgb)));
+		return Saturate(alpha);
+	}
+
+	// The scalar shader math (Gak, Gbk and Gd).
+	template <int K>
+	static void AccumulateReference(const float* g, const float* d, int n, float* a, float* b)
+	{
+		const float pi = 3.1415926f;
+		std::fill(a, a + K, 0.0f);
+		std::fill(b, b + K, 0.0f);
+		for (int i = 0; i < n; ++i)
+			for (int k = 0; k < K; ++k)
+			{
+				a[k] += 2 * g[i] * g[i] * cosf(2 * pi * d[i] * k);
+				b[k] += 2 * g[i] * g[i] * sinf(2 * pi * d[i] * k);
+			}
+	}
+
+	template <int K>
+	static void EvaluateReference(const float* d, int n, const float* a, const float* b, float* G)
+	{
+		const float pi = 3.1415926f;
+		for (int i = 0; i < n; ++i)
+		{
+			float Gdi = a[0] * d[i] / 2;
+			for (int k = 1; k < K; ++k)
+				Gdi += (a[k] * sinf(2 * pi * k * d[i]) + b[k] * (1 - cosf(2 * pi * k * d[i]))) / (2 * pi * k);
+			G[i] = Gdi;
+		}
+	}
+
+	template <int K>
+	static void ComputeAlphasReference(const float* g, const float* d, int n, float q, float r, float lambda, float* alpha)
+	{
+		float a[K], b[K];
+		AccumulateReference<K>(g, d, n, a, b);
+		EvaluateReference<K>(d, n, a, b, alpha);
+		float gall = 0;
+		for (int i = 0; i < n; ++i)
+			gall += g[i] * g[i];
+		for (int i = 0; i < n; ++i)
+			alpha[i] = Alpha(g[i], alpha[i], gall, q, r, lambda);
+	}
+
+	// Cost and quality of the estimate for K = 2, 4, 8 and 16 on random pixels with fragmentsPerPixel fragments each.
+	// Per K, it prints the time of the shader math and of the kernels (multithreaded over the pixels), the largest difference between
+	// them (relative to a_0), and the error of the approximation itself: the mean and maximal difference of G(d_i) to the exact
+	// importance in front of the fragment (half of its own included, where the series converges to), relative to gall, and the
+	// resulting mean difference of the alpha values.
+	// Returns whether the kernels agree with the shader math to 1e-4 of a_0 for all K.
+	static bool Benchmark(int numPixels, int fragmentsPerPixel, float q = 80, float r = 40, float lambda = 1.5f)
+	{
+		std::vector<float> g((size_t)numPixels * fragmentsPerPixel), d(g.size());
+		std::mt19937 rng(1234);
+		std::uniform_real_distribution<float> uniform(0.001f, 0.999f);
+		for (size_t i = 0; i < g.size(); ++i)
+		{
+			g[i] = uniform(rng);
+			d[i] = uniform(rng);
+		}
+
+		// the exact importance in front of every fragment and the alpha values it gives
+		std::vector<float> exactG(g.size()), exactAlpha(g.size()), gall(numPixels);
+		for (int pixel = 0; pixel < numPixels; ++pixel)
+		{
+			size_t first = (size_t)pixel * fragmentsPerPixel;
+			for (int i = 0; i < fragmentsPerPixel; ++i)
+				gall[pixel] += g[first + i] * g[first + i];
+			for (int i = 0; i < fragmentsPerPixel; ++i)
+			{
+				double sum = 0;
+				for (int j = 0; j < fragmentsPerPixel; ++j)
+				{
+					float w = g[first + j] * g[first + j];
+					if (d[first + j] < d[first + i]) sum += w;
+					else if (d[first + j] == d[first + i]) sum += 0.5 * w;
+				}
+				exactG[first + i] = (float)sum;
+				exactAlpha[first + i] = Alpha(g[first + i], (float)sum, gall[pixel], q, r, lambda);
+			}
+		}
+
+		printf("Fourier kernel benchmark (%s): %i pixels x %i fragments\n", SimdName(), numPixels, fragmentsPerPixel);
+		printf("   K  reference ms  kernel ms  M fragments/s  kernel error   G error (mean / max)  alpha error (mean)\n");
+		bool ok = true;
+		ok &= BenchmarkHarmonics<2>(g, d, exactG, exactAlpha, gall, fragmentsPerPixel, q, r, lambda);
+		ok &= BenchmarkHarmonics<4>(g, d, exactG, exactAlpha, gall, fragmentsPerPixel, q, r, lambda);
+		ok &= BenchmarkHarmonics<8>(g, d, exactG, exactAlpha, gall, fragmentsPerPixel, q, r, lambda);
+		ok &= BenchmarkHarmonics<16>(g, d, exactG, exactAlpha, gall, fragmentsPerPixel, q, r, lambda);
+		return ok;
+	}
+
+	static const char* SimdName()
+	{
+#if defined(FOURIER_AVX512)
+		return "AVX-512";
+#elif defined(FOURIER_AVX)
+		return "AVX";
+#elif defined(FOURIER_SSE)
+		return "SSE2";
+#else
+		return "scalar";
+#endif
+	}
+
+private:
+
+	static inline float Saturate(float x) { return std::min(std::max(x, 0.0f), 1.0f); }
+
+	template <int K>
+	static bool BenchmarkHarmonics(const std::vector<float>& g, const std::vector<float>& d, const std::vector<float>& exactG, const std::vector<float>& exactAlpha,
+		const std::vector<float>& gall, int fragmentsPerPixel, float q, float r, float lambda)
+	{
+		int numPixels = (int)gall.size();
+		std::vector<float> coefs[2], G[2];
+		double seconds[2];
+		for (int v = 0; v < 2; ++v)
+		{
+			coefs[v].resize((size_t)numPixels * 2 * K);
+			G[v].resize(g.size());
+			std::chrono::high_resolution_clock::time_point timeStart = std::chrono::high_resolution_clock::now();
+			ParallelFor(0, numPixels, 64, [&](long long first, long long last) {
+				for (long long pixel = first; pixel < last; ++pixel)
+				{
+					size_t f = (size_t)pixel * fragmentsPerPixel;
+					float* a = &coefs[v][(size_t)pixel * 2 * K];
+					if (v == 0)
+					{
+						AccumulateReference<K>(&g[f], &d[f], fragmentsPerPixel, a, a + K);
+						EvaluateReference<K>(&d[f], fragmentsPerPixel, a, a + K, &G[v][f]);
+					}
+					else
+					{
+						Accumulate<K>(&g[f], &d[f], fragmentsPerPixel, a, a + K);
+						Evaluate<K>(&d[f], fragmentsPerPixel, a, a + K, &G[v][f]);
+					}
+				}
+			});
+			seconds[v] = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - timeStart).count();
+		}
+
+		float errorKernel = 0, errorG = 0;
+		double sumErrorG = 0, sumErrorAlpha = 0;
+		for (int pixel = 0; pixel < numPixels; ++pixel)
+		{
+			const float* ref = &coefs[0][(size_t)pixel * 2 * K];
+			const float* fast = &coefs[1][(size_t)pixel * 2 * K];
+			float scale = ref[0] > 0 ? 1.0f / ref[0] : 1.0f;
+			for (int k = 0; k < 2 * K; ++k)
+				errorKernel = std::max(errorKernel, fabsf(fast[k] - ref[k]) * scale);
+			for (int i = 0; i < fragmentsPerPixel; ++i)
+			{
+				size_t f = (size_t)pixel * fragmentsPerPixel + i;
+				errorKernel = std::max(errorKernel, fabsf(G[1][f] - G[0][f]) * scale);
+				float e = gall[pixel] > 0 ? fabsf(G[1][f] - exactG[f]) / gall[pixel] : 0.0f;
+				errorG = std::max(errorG, e);
+				sumErrorG += e;
+				sumErrorAlpha += fabsf(Alpha(g[f], G[1][f], gall[pixel], q, r, lambda) - exactAlpha[f]);
+			}
+		}
+
+		size_t numFragments = g.size();
+		printf("  %2i  %12.3f  %9.3f  %13.1f  %12.2e   %9.4f / %-9.4f  %18.4f\n", K, seconds[0] * 1000, seconds[1] * 1000,
+			seconds[1] > 0 ? numFragments / seconds[1] * 1e-6 : 0.0, errorKernel, numFragments ? sumErrorG / numFragments : 0.0, errorG,
+			numFragments ? sumErrorAlpha / numFragments : 0.0);
+		return errorKernel < 1e-4f;
+	}
+
+	// sin(2 pi d) and cos(2 pi d): with x = d - round(d) in [-1/2, 1/2], the Taylor polynomials of sin and cos of y = pi x
+	// (in [-pi/2, pi/2], the error is below 6e-8) and the double angle.
+	template <typename S>
+	static inline void SinCos2Pi(typename S::V d, typename S::V& s, typename S::V& c)
+	{
+		typedef typename S::V V;
+		V y = S::Mul(S::Sub(d, S::Round(d)), S::Set1(3.14159265f));
+		V y2 = S::Mul(y, y);
+		V sy = S::Set1(-1.0f / 39916800.0f);
+		sy = S::Add(S::Set1(1.0f / 362880.0f), S::Mul(y2, sy));
+		sy = S::Add(S::Set1(-1.0f / 5040.0f), S::Mul(y2, sy));
+		sy = S::Add(S::Set1(1.0f / 120.0f), S::Mul(y2, sy));
+		sy = S::Add(S::Set1(-1.0f / 6.0f), S::Mul(y2, sy));
+		sy = S::Add(y, S::Mul(S::Mul(y, y2), sy));
+		V cy = S::Set1(1.0f / 479001600.0f);
+		cy = S::Add(S::Set1(-1.0f / 3628800.0f), S::Mul(y2, cy));
+		cy = S::Add(S::Set1(1.0f / 40320.0f), S::Mul(y2, cy));
+		cy = S::Add(S::Set1(-1.0f / 720.0f), S::Mul(y2, cy));
+		cy = S::Add(S::Set1(1.0f / 24.0f), S::Mul(y2, cy));
+		cy = S::Add(S::Set1(-0.5f), S::Mul(y2, cy));
+		cy = S::Add(S::Set1(1.0f), S::Mul(y2, cy));
+		s = S::Mul(S::Set1(2.0f), S::Mul(sy, cy));
+		c = S::Sub(S::Mul(cy, cy), S::Mul(sy, sy));
+	}
+
+	// Adds the coefficients of the first n - n % S::N fragments to a and b and returns how many fragments were processed.
+	template <typename S, int K>
+	static int AccumulateBlocks(const float* g, const float* d, int n, float* a, float* b)
+	{
+		typedef typename S::V V;
+		if (n < S::N) return 0;
+		V A[K], B[K];
+		for (int k = 0; k < K; ++k)
+			A[k] = B[k] = S::Set1(0.0f);
+
+		int i = 0;
+		for (; i + S::N <= n; i += S::N)
+		{
+			V gi = S::Load(g + i);
+			V w = S::Mul(S::Set1(2.0f), S::Mul(gi, gi));
+			V s1, c1;
+			SinCos2Pi<S>(S::Load(d + i), s1, c1);
+			V s = s1, c = c1;
+			A[0] = S::Add(A[0], w);
+			for (int k = 1; k < K; ++k)
+			{
+				A[k] = S::Add(A[k], S::Mul(w, c));
+				B[k] = S::Add(B[k], S::Mul(w, s));
+				V cn = S::Sub(S::Mul(c, c1), S::Mul(s, s1));
+				s = S::Add(S::Mul(s, c1), S::Mul(c, s1));
+				c = cn;
+			}
+		}
+
+		float lanes[16];
+		for (int k = 0; k < K; ++k)
+		{
+			S::Store(lanes, A[k]);
+			for (int l = 0; l < S::N; ++l) a[k] += lanes[l];
+			S::Store(lanes, B[k]);
+			for (int l = 0; l < S::N; ++l) b[k] += lanes[l];
+		}
+		return i;
+	}
+
+	// Writes G of the first n - n % S::N depths and returns how many were processed.
+	template <typename S, int K>
+	static int EvaluateBlocks(const float* d, int n, const float* as, const float* bs, float* G)
+	{
+		typedef typename S::V V;
+		int i = 0;
+		for (; i + S::N <= n; i += S::N)
+		{
+			V di = S::Load(d + i);
+			V s1, c1;
+			SinCos2Pi<S>(di, s1, c1);
+			V s = s1, c = c1;
+			V one = S::Set1(1.0f);
+			V Gdi = S::Mul(S::Set1(as[0]), di);
+			for (int k = 1; k < K; ++k)
+			{
+				Gdi = S::Add(Gdi, S::Add(S::Mul(S::Set1(as[k]), s), S::Mul(S::Set1(bs[k]), S::Sub(one, c))));
+				V cn = S::Sub(S::Mul(c, c1), S::Mul(s, s1));
+				s = S::Add(S::Mul(s, c1), S::Mul(c, s1));
+				c = cn;
+			}
+			S::Store(G + i, Gdi);
+		}
+		return i;
+	}
+
+	struct Scalar
+	{
+		typedef float V;
+		static const int N = 1;
+		static inline V Set1(float x) { return x; }
+		static inline V Load(const float* p) { return *p; }
+		static inline void Store(float* p, V x) { *p = x; }
+		static inline V Add(V x, V y) { return x + y; }
+		static inline V Sub(V x, V y) { return x - y; }
+		static inline V Mul(V x, V y) { return x * y; }
+		static inline V Round(V x) { return floorf(x + 0.5f); }
+	};
+
+#ifdef FOURIER_SSE
+	struct Sse
+	{
+		typedef __m128 V;
+		static const int N = 4;
+		static inline V Set1(float x) { return _mm_set1_ps(x); }
+		static inline V Load(const float* p) { return _mm_loadu_ps(p); }
+		static inline void Store(float* p, V x) { _mm_storeu_ps(p, x); }
+		static inline V Add(V x, V y) { return _mm_add_ps(x, y); }
+		static inline V Sub(V x, V y) { return _mm_sub_ps(x, y); }
+		static inline V Mul(V x, V y) { return _mm_mul_ps(x, y); }
+		static inline V Round(V x) { return _mm_cvtepi32_ps(_mm_cvtps_epi32(x)); }	// to nearest, |x| < 2^31
+	};
+#endif
+
+#ifdef FOURIER_AVX
+	struct Avx
+	{
+		typedef __m256 V;
+		static const int N = 8;
+		static inline V Set1(float x) { return _mm256_set1_ps(x); }
+		static inline V Load(const float* p) { return _mm256_loadu_ps(p); }
+		static inline void Store(float* p, V x) { _mm256_storeu_ps(p, x); }
+		static inline V Add(V x, V y) { return _mm256_add_ps(x, y); }
+		static inline V Sub(V x, V y) { return _mm256_sub_ps(x, y); }
+		static inline V Mul(V x, V y) { return _mm256_mul_ps(x, y); }
+		static inline V Round(V x) { return _mm256_round_ps(x, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC); }
+	};
+#endif
+
+#ifdef FOURIER_AVX512
+	struct Avx512
+	{
+		typedef __m512 V;
+		static const int N = 16;
+		static inline V Set1(float x) { return _mm512_set1_ps(x); }
+		static inline V Load(const float* p) { return _mm512_loadu_ps(p); }
+		static inline void Store(float* p, V x) { _mm512_storeu_ps(p, x); }
+		static inline V Add(V x, V y) { return _mm512_add_ps(x, y); }
+		static inline V Sub(V x, V y) { return _mm512_sub_ps(x, y); }
+		static inline V Mul(V x, V y) { return _mm512_mul_ps(x, y); }
+		static inline V Round(V x) { return _mm512_maskz_cvtepi32_ps(0xFFFF, _mm512_maskz_cvtps_epi32(0xFFFF, x)); }	// to nearest, |x| < 2^31, like the SSE2 path (the unmasked forms warn in GCC)
+	};
+#endif
+};
@@ -0,0 +1,466 @@
+#pragma once
+
+#include "parallel.hpp"
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_IX86)
+#include <emmintrin.h>
+#define FRAGMENTSORT_SSE
+#endif
+
+// Sorts the fragments of every pixel front to back, on the CPU, for fragments stored contiguously per pixel
+// (as in LineRasterizer::FragmentArrays). The strategy depends on the length of the list:
+// - MIN_NETWORK to 16 fragments: Batcher's odd-even merge sorting network, applied to four pixels of the same size class at once
+//   (one pixel per SIMD lane, the padding sorts to the end)
+// - shorter lists and lists up to RADIX_THRESHOLD fragments: insertion sort, in place
+// - longer lists: LSD radix sort of the 32 bit depth keys with 11 bit digits, skipping passes whose digit is the same everywhere
+// The network and the radix sort reorder (key, index) pairs and then permute the payload once. The pixels are distributed over the thread pool.
+//
+// In the GLOBAL mode, all fragments are instead radix sorted as one array by (pixel, depth), in blocks of equal size per thread.
+// This balances the work no matter how the fragments are distributed over the pixels, at the cost of passes over all fragments
+// for the pixel bits as well. Both modes give the same sorted arrays.
+
+class FragmentSorter
+{
+public:
+
+	enum Mode
+	{
+		PER_PIXEL,
+		GLOBAL
+	};
+
+	enum Strategy
+	{
+		NETWORK,
+		INSERTION,
+		RADIX,
+		NUM_STRATEGIES
+	};
+
+	static const int MIN_NETWORK = 5;			// shorter lists are cheaper to sort by insertion than to gather into SIMD lanes
+	static const int MAX_NETWORK = 16;			// longest list that is sorted by a network
+	static const int RADIX_THRESHOLD = 64;		// shortest list that is radix sorted
+
+	struct Statistics
+	{
+		Statistics() : TotalFragments(0), NumPasses(0), Seconds(0)
+		{
+			for (int s = 0; s < NUM_STRATEGIES; ++s)
+				NumPixels[s] = NumFragments[s] = 0;
+		}
+
+		long long NumPixels[NUM_STRATEGIES];	// per-pixel mode
+		long long NumFragments[NUM_STRATEGIES];
+		long long TotalFragments;
+		int NumPasses;							// global mode: radix passes that were not skipped
+		double Seconds;
+
+		void Print() const
+		{
+			printf("Sorted %lld fragments in %.3f ms (%.1f M fragments/s)", TotalFragments, Seconds * 1000, Seconds > 0 ? TotalFragments / Seconds * 1e-6 : 0.0);
+			if (NumPasses > 0) printf(": global, %i radix passes\n", NumPasses);
+			else printf(": network %lld / insertion %lld / radix %lld pixels\n", NumPixels[NETWORK], NumPixels[INSERTION], NumPixels[RADIX]);
+		}
+	};
+
+	explicit FragmentSorter(Mode mode = PER_PIXEL) : _Mode(mode)
+	{
+		for (int n = 0; n < NUM_NETWORKS; ++n)
+			BuildNetwork(8 << n, _Networks[n]);
+	}
+
+	void SetMode(Mode mode) { _Mode = mode; }
+	Mode GetMode() const { return _Mode; }
+	const Statistics& GetStatistics() const { return _Statistics; }
+
+	// Sorts the fragments of every pixel by depth. The fragments of pixel p are fragments[offsets[p]] ... fragments[offsets[p + 1] - 1].
+	// Fragment is any struct with the bits of a float depth in an unsigned int 'Depth'.
+	template <typename Fragment>
+	void Sort(const unsigned int* offsets, size_t numPixels, Fragment* fragments)
+	{
+		std::chrono::high_resolution_clock::time_point timeStart = std::chrono::high_resolution_clock::now();
+		_Statistics = Statistics();
+		_Statistics.TotalFragments = offsets[numPixels] - offsets[0];
+		if (_Mode == GLOBAL)
+			SortGlobal(offsets, numPixels, fragments);
+		else SortPerPixel(offsets, numPixels, fragments);
+		_Statistics.Seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - timeStart).count();
+	}
+
+	// Prints the depth complexity histogram of the fragments and, per length class, the time of the per-pixel mode and of the
+	// insertion sort of shader_SortFragments_LowRes.hlsl (without its length limit), both multithreaded.
+	// Then both modes sort all fragments. The input is not changed.
+	// Returns whether the sorter agrees with the insertion sort and both modes give the same order.
+	template <typename Fragment>
+	bool Benchmark(const unsigned int* offsets, size_t numPixels, const Fragment* fragments)
+	{
+		static const unsigned int bounds[] = { 2, 5, 9, 17, 65, 257, 1025, 0xffffffff };
+		const int numClasses = sizeof(bounds) / sizeof(bounds[0]) - 1;
+		printf("Fragment sort benchmark: %zu pixels, %u fragments\n", numPixels, offsets[numPixels] - offsets[0]);
+		Mode mode = _Mode;
+		_Mode = PER_PIXEL;
+		bool ok = true;
+
+		for (int c = 0; c < numClasses; ++c)
+		{
+			// copy the lists of the class
+			std::vector<unsigned int> classOffsets(1, 0);
+			std::vector<Fragment> classFragments;
+			for (size_t pixel = 0; pixel < numPixels; ++pixel)
+			{
+				unsigned int count = offsets[pixel + 1] - offsets[pixel];
+				if (count < bounds[c] || count >= bounds[c + 1]) continue;
+				classFragments.insert(classFragments.end(), fragments + offsets[pixel], fragments + offsets[pixel + 1]);
+				classOffsets.push_back((unsigned int)classFragments.size());
+			}
+			size_t classPixels = classOffsets.size() - 1;
+			if (classPixels == 0) continue;
+
+			std::vector<Fragment> reference = classFragments;
+			std::chrono::high_resolution_clock::time_point timeStart = std::chrono::high_resolution_clock::now();
+			ParallelFor(0, (long long)classPixels, 1 << 12, [&](long long first, long long last) {
+				for (long long pixel = first; pixel < last; ++pixel)
+					InsertionSortFragments(reference.data() + classOffsets[pixel], classOffsets[pixel + 1] - classOffsets[pixel]);
+			});
+			double secondsInsertion = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - timeStart).count();
+
+			Sort(classOffsets.data(), classPixels, classFragments.data());
+			double secondsSort = _Statistics.Seconds;
+
+			size_t wrong = 0;
+			for (size_t i = 0; i < classFragments.size(); ++i)
+				if (classFragments[i].Depth != reference[i].Depth) wrong++;
+			ok &= wrong == 0;
+
+			if (bounds[c + 1] == 0xffffffff) printf("  %5u+       ", bounds[c]);
+			else printf("  %5u - %-5u", bounds[c], bounds[c + 1] - 1);
+			printf(": %8zu pixels, %9zu fragments, insertion %8.3f ms, sorter %8.3f ms (%.1fx)%s\n", classPixels, classFragments.size(),
+				secondsInsertion * 1000, secondsSort * 1000, secondsSort > 0 ? secondsInsertion / secondsSort : 0.0, wrong ? ", WRONG ORDER" : "");
+		}
+
+		std::vector<Fragment> perPixel(fragments + offsets[0], fragments + offsets[numPixels]);
+		std::vector<Fragment> global = perPixel;
+		Sort(offsets, numPixels, perPixel.data() - offsets[0]);
+		double secondsPerPixel = _Statistics.Seconds;
+		_Mode = GLOBAL;
+		Sort(offsets, numPixels, global.data() - offsets[0]);
+		double secondsGlobal = _Statistics.Seconds;
+		size_t wrong = 0;
+		for (size_t i = 0; i < global.size(); ++i)
+			if (global[i].Depth != perPixel[i].Depth) wrong++;
+		printf("  all          : per pixel %8.3f ms, global %8.3f ms (%i passes)%s\n", secondsPerPixel * 1000, secondsGlobal * 1000,
+			_Statistics.NumPasses, wrong ? ", DIFFERENT ORDER" : "");
+		_Mode = mode;
+		return ok && wrong == 0;
+	}
+
+private:
+
+	static const int LANES = 4;
+	static const int NUM_NETWORKS = 2;			// for 8 and 16 elements
+	static const int RADIX_BITS = 11;
+	static const int RADIX_SIZE = 1 << RADIX_BITS;
+	static const int MIN_BLOCK_SIZE = 1 << 16;	// fragments per block of the global sort
+
+	// Every pixel is sorted by one thread, with the strategy for its length.
+	template <typename Fragment>
+	void SortPerPixel(const unsigned int* offsets, size_t numPixels, Fragment* fragments)
+	{
+		ParallelFor(0, (long long)numPixels, 1 << 12, [&](long long first, long long last) {
+			Scratch<Fragment> scratch;
+
+			// pixels waiting for a network, per size class
+			unsigned int batch[NUM_NETWORKS][LANES];
+			int batchSize[NUM_NETWORKS] = { 0 };
+			for (long long pixel = first; pixel < last; ++pixel)
+			{
+				unsigned int begin = offsets[pixel], count = offsets[pixel + 1] - begin;
+				if (count < 2)
+					continue;
+				if (count >= MIN_NETWORK && count <= MAX_NETWORK)
+				{
+					int n = count <= 8 ? 0 : 1;
+					batch[n][batchSize[n]++] = (unsigned int)pixel;
+					if (batchSize[n] == LANES)
+					{
+						SortNetwork(n, batch[n], LANES, offsets, fragments);
+						batchSize[n] = 0;
+					}
+				}
+				else if (count < RADIX_THRESHOLD)
+					InsertionSortFragments(fragments + begin, count);
+				else SortRadix(fragments + begin, count, scratch);
+			}
+			for (int n = 0; n < NUM_NETWORKS; ++n)
+				if (batchSize[n] > 0)
+					SortNetwork(n, batch[n], batchSize[n], offsets, fragments);
+		});
+
+		for (size_t pixel = 0; pixel < numPixels; ++pixel)
+		{
+			unsigned int count = offsets[pixel + 1] - offsets[pixel];
+			if (count < 2) continue;
+			Strategy strategy = count >= MIN_NETWORK && count <= MAX_NETWORK ? NETWORK : count < RADIX_THRESHOLD ? INSERTION : RADIX;
+			_Statistics.NumPixels[strategy]++;
+			_Statistics.NumFragments[strategy] += count;
+		}
+	}
+
+	// One LSD radix sort of all fragments by (pixel, depth). Every pass counts the digits per block, turns the counts into
+	// the output offsets of every (digit, block) and scatters the blocks, which keeps the passes stable.
+	template <typename Fragment>
+	void SortGlobal(const unsigned int* offsets, size_t numPixels, Fragment* fragments)
+	{
+		size_t base = offsets[0], count = offsets[numPixels] - base;
+		if (count < 2) return;
+		ThreadPool& pool = ThreadPool::Global();
+
+		int numBlocks = (int)std::max<size_t>(1, std::min<size_t>(pool.GetNumThreads(), count / MIN_BLOCK_SIZE));
+
+		// the depths usually span a small range, which saves passes: the key is (pixel, depth - smallest depth)
+		std::vector<uint32_t> blockMin(numBlocks, 0xffffffffu), blockMax(numBlocks, 0);
+		pool.Run(numBlocks, [&](int block) {
+			for (size_t i = base + count * block / numBlocks; i < base + count * (block + 1) / numBlocks; ++i)
+			{
+				uint32_t key = SortKey(fragments[i].Depth);
+				blockMin[block] = std::min(blockMin[block], key);
+				blockMax[block] = std::max(blockMax[block], key);
+			}
+		});
+		uint32_t minKey = *std::min_element(blockMin.begin(), blockMin.end());
+		uint32_t maxKey = *std::max_element(blockMax.begin(), blockMax.end());
+		int depthBits = 0, pixelBits = 0;
+		while (depthBits < 32 && ((uint64_t)(maxKey - minKey) >> depthBits) != 0)
+			depthBits++;
+		while (pixelBits < 32 && ((uint64_t)1 << pixelBits) < numPixels)
+			pixelBits++;
+
+		_Keys.resize(count);
+		_TempKeys.resize(count);
+		_Indices.resize(count);
+		_TempIndices.resize(count);
+		ParallelFor(0, (long long)numPixels, 1 << 12, [&](long long first, long long last) {
+			for (long long pixel = first; pixel < last; ++pixel)
+				for (unsigned int i = offsets[pixel]; i < offsets[pixel + 1]; ++i)
+				{
+					_Keys[i - base] = ((uint64_t)pixel << depthBits) | (SortKey(fragments[i].Depth) - minKey);
+					_Indices[i - base] = (uint32_t)(i - base);
+				}
+		});
+
+		_BlockHistograms.resize((size_t)numBlocks * RADIX_SIZE);
+		for (int shift = 0; shift < depthBits + pixelBits; shift += RADIX_BITS)
+		{
+			pool.Run(numBlocks, [&](int block) {
+				unsigned int* histogram = _BlockHistograms.data() + (size_t)block * RADIX_SIZE;
+				memset(histogram, 0, RADIX_SIZE * sizeof(unsigned int));
+				for (size_t i = count * block / numBlocks; i < count * (block + 1) / numBlocks; ++i)
+					histogram[(_Keys[i] >> shift) & (RADIX_SIZE - 1)]++;
+			});
+
+			// skip the pass if all keys have the same digit
+			int firstDigit = (int)((_Keys[0] >> shift) & (RADIX_SIZE - 1));
+			size_t firstDigitCount = 0;
+			for (int block = 0; block < numBlocks; ++block)
+				firstDigitCount += _BlockHistograms[(size_t)block * RADIX_SIZE + firstDigit];
+			if (firstDigitCount == count)
+				continue;
+
+			unsigned int sum = 0;
+			for (int d = 0; d < RADIX_SIZE; ++d)
+				for (int block = 0; block < numBlocks; ++block)
+				{
+					unsigned int& h = _BlockHistograms[(size_t)block * RADIX_SIZE + d];
+					unsigned int c = h;
+					h = sum;
+					sum += c;
+				}
+
+			pool.Run(numBlocks, [&](int block) {
+				unsigned int* cursor = _BlockHistograms.data() + (size_t)block * RADIX_SIZE;
+				for (size_t i = count * block / numBlocks; i < count * (block + 1) / numBlocks; ++i)
+				{
+					unsigned int slot = cursor[(_Keys[i] >> shift) & (RADIX_SIZE - 1)]++;
+					_TempKeys[slot] = _Keys[i];
+					_TempIndices[slot] = _Indices[i];
+				}
+			});
+			_Keys.swap(_TempKeys);
+			_Indices.swap(_TempIndices);
+			_Statistics.NumPasses++;
+		}
+
+		// the pixel counts did not change, so the fragments only need to be permuted
+		std::vector<Fragment> sorted(count);
+		ParallelFor(0, (long long)count, 1 << 14, [&](long long first, long long last) {
+			for (long long i = first; i < last; ++i)
+				sorted[i] = fragments[base + _Indices[i]];
+		});
+		std::copy(sorted.begin(), sorted.end(), fragments + base);
+	}
+
+	template <typename Fragment>
+	struct Scratch
+	{
+		std::vector<uint32_t> Keys, TempKeys;
+		std::vector<uint32_t> Indices, TempIndices;
+		std::vector<Fragment> Permuted;
+		std::vector<unsigned int> Histogram;
+	};
+
+	// Maps the bits of a float to an unsigned int with the same order.
+	static inline uint32_t SortKey(uint32_t depthBits)
+	{
+		return depthBits ^ ((depthBits >> 31) ? 0xffffffffu : 0x80000000u);
+	}
+
+	// Compare-exchange pairs of Batcher's odd-even merge sort for a power of two.
+	static void BuildNetwork(int n, std::vector<std::pair<int, int> >& pairs)
+	{
+		pairs.clear();
+		for (int p = 1; p < n; p <<= 1)
+			for (int k = p; k >= 1; k >>= 1)
+				for (int j = k % p; j + k < n; j += 2 * k)
+					for (int i = 0; i < std::min(k, n - j - k); ++i)
+						if ((i + j) / (2 * p) == (i + j + k) / (2 * p))
+							pairs.push_back(std::make_pair(i + j, i + j + k));
+	}
+
+	// Sorts up to LANES pixels with network n. Row k of the key and index matrices holds element k of every pixel.
+	template <typename Fragment>
+	void SortNetwork(int n, const unsigned int* pixels, int numPixels, const unsigned int* offsets, Fragment* fragments) const
+	{
+		int size = 8 << n;
+		uint32_t keys[MAX_NETWORK][LANES], indices[MAX_NETWORK][LANES];
+		for (int lane = 0; lane < LANES; ++lane)
+		{
+			unsigned int begin = lane < numPixels ? offsets[pixels[lane]] : 0;
+			unsigned int count = lane < numPixels ? offsets[pixels[lane] + 1] - begin : 0;
+			for (int k = 0; k < size; ++k)
+			{
+				// signed order for the SIMD compare; the padding is the largest key
+				keys[k][lane] = (unsigned int)k < count ? SortKey(fragments[begin + k].Depth) ^ 0x80000000u : 0x7fffffffu;
+				indices[k][lane] = (uint32_t)k;
+			}
+		}
+
+		const std::vector<std::pair<int, int> >& network = _Networks[n];
+#ifdef FRAGMENTSORT_SSE
+		__m128i K[MAX_NETWORK], I[MAX_NETWORK];
+		for (int k = 0; k < size; ++k)
+		{
+			K[k] = _mm_loadu_si128((const __m128i*)keys[k]);
+			I[k] = _mm_loadu_si128((const __m128i*)indices[k]);
+		}
+		for (const std::pair<int, int>& pair : network)
+		{
+			__m128i ka = K[pair.first], kb = K[pair.second];
+			__m128i ia = I[pair.first], ib = I[pair.second];
+			__m128i swap = _mm_cmpgt_epi32(ka, kb);
+			K[pair.first] = _mm_or_si128(_mm_and_si128(swap, kb), _mm_andnot_si128(swap, ka));
+			K[pair.second] = _mm_or_si128(_mm_and_si128(swap, ka), _mm_andnot_si128(swap, kb));
+			I[pair.first] = _mm_or_si128(_mm_and_si128(swap, ib), _mm_andnot_si128(swap, ia));
+			I[pair.second] = _mm_or_si128(_mm_and_si128(swap, ia), _mm_andnot_si128(swap, ib));
+		}
+		for (int k = 0; k < size; ++k)
+			_mm_storeu_si128((__m128i*)indices[k], I[k]);
+#else
+		for (const std::pair<int, int>& pair : network)
+			for (int lane = 0; lane < LANES; ++lane)
+				if ((int32_t)keys[pair.first][lane] > (int32_t)keys[pair.second][lane])
+				{
+					std::swap(keys[pair.first][lane], keys[pair.second][lane]);
+					std::swap(indices[pair.first][lane], indices[pair.second][lane]);
+				}
+#endif
+
+		// the padding is sorted to the end, so the first 'count' indices belong to the pixel
+		Fragment sorted[MAX_NETWORK];
+		for (int lane = 0; lane < numPixels; ++lane)
+		{
+			unsigned int begin = offsets[pixels[lane]], count = offsets[pixels[lane] + 1] - begin;
+			for (unsigned int k = 0; k < count; ++k)
+				sorted[k] = fragments[begin + indices[k][lane]];
+			std::copy(sorted, sorted + count, fragments + begin);
+		}
+	}
+
+	template <typename Fragment>
+	static void SortRadix(Fragment* fragments, unsigned int count, Scratch<Fragment>& scratch)
+	{
+		scratch.Keys.resize(count);
+		scratch.Indices.resize(count);
+		scratch.TempKeys.resize(count);
+		scratch.TempIndices.resize(count);
+		scratch.Histogram.resize(RADIX_SIZE);
+		uint32_t* keys = scratch.Keys.data();
+		uint32_t* indices = scratch.Indices.data();
+		uint32_t* tempKeys = scratch.TempKeys.data();
+		uint32_t* tempIndices = scratch.TempIndices.data();
+		unsigned int* histogram = scratch.Histogram.data();
+		for (unsigned int i = 0; i < count; ++i)
+		{
+			keys[i] = SortKey(fragments[i].Depth);
+			indices[i] = i;
+		}
+
+		for (int shift = 0; shift < 32; shift += RADIX_BITS)
+		{
+			memset(histogram, 0, RADIX_SIZE * sizeof(unsigned int));
+			for (unsigned int i = 0; i < count; ++i)
+				histogram[(keys[i] >> shift) & (RADIX_SIZE - 1)]++;
+			if (histogram[(keys[0] >> shift) & (RADIX_SIZE - 1)] == count)
+				continue;
+
+			unsigned int sum = 0;
+			for (int d = 0; d < RADIX_SIZE; ++d)
+			{
+				unsigned int h = histogram[d];
+				histogram[d] = sum;
+				sum += h;
+			}
+			for (unsigned int i = 0; i < count; ++i)
+			{
+				unsigned int slot = histogram[(keys[i] >> shift) & (RADIX_SIZE - 1)]++;
+				tempKeys[slot] = keys[i];
+				tempIndices[slot] = indices[i];
+			}
+			std::swap(keys, tempKeys);
+			std::swap(indices, tempIndices);
+		}
+		scratch.Permuted.resize(count);
+		for (unsigned int i = 0; i < count; ++i)
+			scratch.Permuted[i] = fragments[indices[i]];
+		std::copy(scratch.Permuted.begin(), scratch.Permuted.end(), fragments);
+	}
+
+	// The loop of shader_SortFragments_LowRes.hlsl, also used for the medium lists.
+	template <typename Fragment>
+	static void InsertionSortFragments(Fragment* fragments, unsigned int count)
+	{
+		for (unsigned int i = 1; i < count; ++i)
+		{
+			Fragment fragment = fragments[i];
+			uint32_t key = SortKey(fragment.Depth);
+			unsigned int j = i;
+			for (; j > 0 && SortKey(fragments[j - 1].Depth) > key; --j)
+				fragments[j] = fragments[j - 1];
+			fragments[j] = fragment;
+		}
+	}
+
+	Mode _Mode;
+	std::vector<std::pair<int, int> > _Networks[NUM_NETWORKS];
+	Statistics _Statistics;
+
+	// global mode
+	std::vector<uint64_t> _Keys, _TempKeys;		// (pixel, depth)
+	std::vector<uint32_t> _Indices, _TempIndices;
+	std::vector<unsigned int> _BlockHistograms;
+};
@@ -0,0 +1,350 @@
+#pragma once
+
+#include "mappedfile.hpp"
+#include "parallel.hpp"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+// Binary cache of a preprocessed line set, stored next to the source file (<source>.linecache).
+// The file starts with a header, followed by one 64-byte aligned section per array (structure of arrays).
+// A cache is valid for a source file with the same content hash, the same number of control points and the same processing key
+// (which identifies load-time processing such as simplification and reordering).
+// To keep warm starts cheap, the hash is only recomputed if size or modification time of the source changed, or if the
+// modification time is ambiguous: file times have a resolution of a second (two on FAT), so a source that was modified
+// shortly before the cache was written could have been modified again afterwards without a change of its time.
+
+class LineCache
+{
+public:
+
+	enum Section
+	{
+		POSITIONS,					// Vec3f per vertex
+		ID,							// int per vertex
+		IMPORTANCE,					// float per vertex
+		ALPHA_WEIGHTS,				// float per vertex
+		LINE_OFFSETS,				// int per line (+1)
+		LINE_LENGTHS,				// float per line
+		NUM_CONTROL_POINTS_OF_LINE,	// int per line
+		CONTROL_POINT_LINE_INDICES,	// unsigned int per control point
+		LINE_ORDER,					// int per line: the original index of the line (empty if the lines were not reordered)
+		NUM_SECTIONS
+	};
+
+	static const uint32_t VERSION = 4;
+	static const uint64_t ALIGNMENT = 64;
+	static const int64_t AMBIGUOUS_SECONDS = 2;	// resolution of file modification times
+
+	struct SectionInfo
+	{
+		uint64_t Offset;		// in bytes from the beginning of the file
+		uint64_t Count;			// number of elements
+		uint32_t ElementSize;	// in bytes
+		uint32_t Padding;
+	};
+
+	struct Header
+	{
+		char Magic[8];
+		uint32_t Version;
+		int32_t TotalNumberOfControlPoints;
+		int32_t NumLines;
+		int32_t NumSections;
+		uint64_t SourceSize;
+		int64_t SourceModified;
+		int64_t CacheWritten;		// time when the source was hashed
+		uint64_t ContentHash;
+		uint64_t ProcessingKey;
+		SectionInfo Sections[NUM_SECTIONS];
+	};
+
+	static std::string GetPath(const std::string& sourcePath) { return sourcePath + ".linecache"; }
+
+	static uint32_t GetElementSize(Section section) { return section == POSITIONS ? 3 * sizeof(float) : 4; }
+
+	static bool GetFileInfo(const std::string& path, uint64_t& size, int64_t& modified)
+	{
+#ifdef _WIN32
+		struct _stat64 st;
+		if (_stat64(path.c_str(), &st) != 0) return false;
+#else
+		struct stat st;
+		if (stat(path.c_str(), &st) != 0) return false;
+#endif
+		size = (uint64_t)st.st_size;
+		modified = (int64_t)st.st_mtime;
+		return true;
+	}
+
+	// 64 bit hash of the file content. Blocks are hashed in parallel and combined in order,
+	// so the result does not depend on the number of threads.
+	static uint64_t ComputeContentHash(const std::string& path)
+	{
+		MappedFile file;
+		if (!file.Open(path)) return 0;
+
+		static const size_t BLOCK_SIZE = 16 << 20;
+		size_t size = file.GetSize();
+		int numBlocks = (int)((size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+		std::vector<uint64_t> blockHashes(numBlocks);
+		ThreadPool::Global().Run(numBlocks, [&](int b) {
+			size_t begin = (size_t)b * BLOCK_SIZE;
+			size_t blockSize = std::min(BLOCK_SIZE, size - begin);
+			blockHashes[b] = HashBytes(file.GetData() + begin, blockSize, (uint64_t)b);
+			file.Evict(file.GetData() + begin, blockSize);	// each block is read once
+		});
+
+		uint64_t hash = Mix(size ^ 0x243F6A8885A308D3ull);
+		for (uint64_t blockHash : blockHashes)
+			hash = Mix(hash ^ blockHash);
+		return hash;
+	}
+
+	// Writes the cache file section by section. Sections can be written in pieces (e.g., while streaming).
+	// The file is written to a temporary name and renamed on Finish(), so that a partial cache is never used.
+	class Writer
+	{
+	public:
+
+		Writer() : _File(NULL) {}
+		~Writer() { Abort(); }
+
+		// 'counts' holds the number of elements of the NUM_SECTIONS arrays.
+		bool Begin(const std::string& sourcePath, int totalNumCPs, uint64_t processingKey, int numLines, const uint64_t* counts)
+		{
+			Abort();
+			_SourcePath = sourcePath;
+			_TempPath = GetPath(sourcePath) + ".tmp";
+
+			memset(&_Header, 0, sizeof(Header));
+			memcpy(_Header.Magic, "FOOFSELC", 8);
+			_Header.Version = VERSION;
+			_Header.TotalNumberOfControlPoints = totalNumCPs;
+			_Header.ProcessingKey = processingKey;
+			_Header.NumLines = numLines;
+			_Header.NumSections = NUM_SECTIONS;
+
+			uint64_t offset = AlignUp(sizeof(Header));
+			for (int s = 0; s < NUM_SECTIONS; ++s)
+			{
+				_Header.Sections[s].Offset = offset;
+				_Header.Sections[s].Count = counts[s];
+				_Header.Sections[s].ElementSize = GetElementSize((Section)s);
+				offset = AlignUp(offset + counts[s] * _Header.Sections[s].ElementSize);
+			}
+			_FileSize = offset;
+
+#ifdef _WIN32
+			if (fopen_s(&_File, _TempPath.c_str(), "wb") != 0) _File = NULL;
+#else
+			_File = fopen(_TempPath.c_str(), "wb");
+#endif
+			if (!_File) return false;
+
+			// reserve the full size, so that sections can be written in any order
+			if (_FileSize > 0 && (Seek(_FileSize - 1) != 0 || fputc(0, _File) == EOF))
+			{
+				Abort();
+				return false;
+			}
+			return true;
+		}
+
+		// Writes 'count' elements of a section, starting at element 'first'.
+		bool WriteSection(Section section, uint64_t first, const void* data, uint64_t count)
+		{
+			if (!_File) return false;
+			const SectionInfo& info = _Header.Sections[section];
+			if (first + count > info.Count) return false;
+			if (count == 0) return true;
+			if (Seek(info.Offset + first * info.ElementSize) != 0) return false;
+			return fwrite(data, info.ElementSize, (size_t)count, _File) == count;
+		}
+
+		// Stores the header (with the key of the source file) and moves the cache into place.
+		bool Finish()
+		{
+			if (!_File) return false;
+			uint64_t size = 0;
+			int64_t modified = 0;
+			GetFileInfo(_SourcePath, size, modified);
+			_Header.SourceSize = size;
+			_Header.SourceModified = modified;
+			_Header.CacheWritten = (int64_t)time(NULL);
+			_Header.ContentHash = ComputeContentHash(_SourcePath);
+
+			bool ok = Seek(0) == 0 && fwrite(&_Header, sizeof(Header), 1, _File) == 1;
+			ok &= fclose(_File) == 0;
+			_File = NULL;
+
+			std::string path = GetPath(_SourcePath);
+			remove(path.c_str());
+			ok = ok && rename(_TempPath.c_str(), path.c_str()) == 0;
+			if (!ok) remove(_TempPath.c_str());
+			return ok;
+		}
+
+		void Abort()
+		{
+			if (!_File) return;
+			fclose(_File);
+			_File = NULL;
+			remove(_TempPath.c_str());
+		}
+
+	private:
+
+		int Seek(uint64_t offset)
+		{
+#ifdef _WIN32
+			return _fseeki64(_File, (long long)offset, SEEK_SET);
+#else
+			return fseeko(_File, (off_t)offset, SEEK_SET);
+#endif
+		}
+
+		FILE* _File;
+		Header _Header;
+		uint64_t _FileSize;
+		std::string _SourcePath;
+		std::string _TempPath;
+	};
+
+	// Maps the cache of 'sourcePath' if it exists and is valid for the given number of control points and processing.
+	static bool Open(const std::string& sourcePath, int totalNumCPs, uint64_t processingKey, MappedFile& cache)
+	{
+		if (!cache.Open(GetPath(sourcePath)))
+			return false;
+
+		const Header* header = GetHeader(cache);
+		uint64_t size = 0;
+		int64_t modified = 0;
+		bool valid = header && header->TotalNumberOfControlPoints == totalNumCPs && header->ProcessingKey == processingKey && GetFileInfo(sourcePath, size, modified);
+		bool ambiguous = header && modified + AMBIGUOUS_SECONDS >= header->CacheWritten;
+		if (valid && (header->SourceSize != size || header->SourceModified != modified || ambiguous))
+			valid = header->SourceSize == size && header->ContentHash == ComputeContentHash(sourcePath);
+
+		if (!valid) cache.Close();
+		return valid;
+	}
+
+	// Returns the header if the mapped file is a complete cache of the current version.
+	static const Header* GetHeader(const MappedFile& cache)
+	{
+		if (cache.GetSize() < sizeof(Header)) return NULL;
+		const Header* header = (const Header*)cache.GetData();
+		if (memcmp(header->Magic, "FOOFSELC", 8) != 0 || header->Version != VERSION || header->NumSections != NUM_SECTIONS) return NULL;
+		for (int s = 0; s < NUM_SECTIONS; ++s)
+		{
+			const SectionInfo& info = header->Sections[s];
+			// written without overflow: the check must hold for corrupt headers, too
+			if (info.Offset % ALIGNMENT != 0 || info.ElementSize == 0 || info.Offset > cache.GetSize() ||
+				info.Count > (cache.GetSize() - info.Offset) / info.ElementSize) return NULL;
+		}
+		return header;
+	}
+
+	template <typename T>
+	static const T* GetSection(const MappedFile& cache, Section section, size_t& count)
+	{
+		const SectionInfo& info = GetHeader(cache)->Sections[section];
+		count = info.ElementSize == sizeof(T) ? (size_t)info.Count : 0;
+		return (const T*)(cache.GetData() + info.Offset);
+	}
+
+	static uint64_t AlignUp(uint64_t offset) { return (offset + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT; }
+
+private:
+
+	static inline uint64_t Mix(uint64_t h)
+	{
+		h ^= h >> 33; h *= 0xFF51AFD7ED558CCDull;
+		h ^= h >> 33; h *= 0xC4CEB9FE1A85EC53ull;
+		h ^= h >> 33;
+		return h;
+	}
+
+	static uint64_t HashBytes(const char* data, size_t size, uint64_t seed)
+	{
+		// four independent lanes keep the multiplier pipeline busy
+		uint64_t lanes[4] = { seed + 0x9E3779B97F4A7C15ull, seed ^ 0xBF58476D1CE4E5B9ull, seed + 0x94D049BB133111EBull, ~seed };
+		size_t i = 0;
+		for (; i + 32 <= size; i += 32)
+		{
+			for (int l = 0; l < 4; ++l)
+			{
+				uint64_t word;
+				memcpy(&word, data + i + l * 8, 8);
+				lanes[l] = (lanes[l] ^ word) * 0x9E3779B97F4A7C15ull;
+				lanes[l] = (lanes[l] << 31) | (lanes[l] >> 33);
+			}
+		}
+		uint64_t tail[4] = { 0, 0, 0, 0 };
+		memcpy(tail, data + i, size - i);
+		uint64_t hash = size;
+		for (int l = 0; l < 4; ++l)
+			hash = Mix(hash ^ lanes[l] ^ Mix(tail[l] + l));
+		return hash;
+	}
+};
+
+// An array that either owns its elements or refers to a section of a mapped cache file (zero-copy).
+// Reading works the same in both cases. Edit() takes ownership by copying mapped elements first.
+
+template <typename T>
+class CachedArray
+{
+public:
+
+	CachedArray() : _Mapped(NULL), _MappedSize(0), _IsMapped(false) {}
+
+	size_t size() const { return _IsMapped ? _MappedSize : _Storage.size(); }
+	bool empty() const { return size() == 0; }
+	const T* data() const { return _IsMapped ? _Mapped : _Storage.data(); }
+	const T& operator[](size_t i) const { return data()[i]; }
+	const T* begin() const { return data(); }
+	const T* end() const { return data() + size(); }
+
+	// Refers to elements that are owned by someone else (e.g., a mapped file).
+	void Attach(const T* data, size_t size)
+	{
+		std::vector<T>().swap(_Storage);
+		_Mapped = data;
+		_MappedSize = size;
+		_IsMapped = true;
+	}
+
+	void clear()
+	{
+		std::vector<T>().swap(_Storage);
+		_Mapped = NULL;
+		_MappedSize = 0;
+		_IsMapped = false;
+	}
+
+	// Returns the owned elements for modification.
+	std::vector<T>& Edit()
+	{
+		if (_IsMapped)
+		{
+			_Storage.assign(_Mapped, _Mapped + _MappedSize);
+			_IsMapped = false;
+			_Mapped = NULL;
+			_MappedSize = 0;
+		}
+		return _Storage;
+	}
+
+private:
+
+	std::vector<T> _Storage;
+	const T* _Mapped;
+	size_t _MappedSize;
+	bool _IsMapped;
+};
@@ -0,0 +1,204 @@
+#pragma once
+
+#include "vec.hpp"
+#include "parallel.hpp"
+#include "parameterization.hpp"
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <float.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Optional load-time reordering of the lines along a space-filling curve, so that lines that are close in the vertex buffers
+// are also close in space (and on screen). The lines are sorted by the Morton or Hilbert code of the center of their bounding box,
+// quantized to 21 bits per axis in the bounding box of the line set. The Hilbert curve has no jumps between neighboring cells
+// and thus gives the better locality; the Morton order is cheaper to compute.
+// The vertices of a line keep their order. The permutation is returned, so that results can be mapped back to the original lines.
+
+class LineReorder
+{
+public:
+
+	enum Curve
+	{
+		NONE,
+		MORTON,
+		HILBERT
+	};
+
+	static const int BITS = 21;
+
+	// Interleaves the bits of x, y and z (x most significant).
+	static inline uint64_t MortonCode(uint32_t x, uint32_t y, uint32_t z)
+	{
+		return (SpreadBits(x) << 2) | (SpreadBits(y) << 1) | SpreadBits(z);
+	}
+
+	// Index along the Hilbert curve through the 2^BITS cells per axis (Skilling, "Programming the Hilbert curve", 2004).
+	static inline uint64_t HilbertCode(uint32_t x, uint32_t y, uint32_t z)
+	{
+		uint32_t X[3] = { x, y, z };
+		const uint32_t M = 1u << (BITS - 1);
+
+		// inverse undo of the rotations and reflections
+		for (uint32_t Q = M; Q > 1; Q >>= 1)
+		{
+			uint32_t P = Q - 1;
+			for (int i = 0; i < 3; ++i)
+			{
+				if (X[i] & Q)
+					X[0] ^= P;
+				else
+				{
+					uint32_t t = (X[0] ^ X[i]) & P;
+					X[0] ^= t;
+					X[i] ^= t;
+				}
+			}
+		}
+
+		// gray encode
+		X[1] ^= X[0];
+		X[2] ^= X[1];
+		uint32_t t = 0;
+		for (uint32_t Q = M; Q > 1; Q >>= 1)
+			if (X[2] & Q) t ^= Q - 1;
+		for (int i = 0; i < 3; ++i)
+			X[i] ^= t;
+
+		// the transposed index is read bit by bit across the axes
+		return MortonCode(X[0], X[1], X[2]);
+	}
+
+	// Sorts the lines along the curve. 'order' receives for every new line its original line index.
+	static void ComputeOrder(Curve curve, const Vec3f* positions, const int* lineOffsets, int numLines, std::vector<int>& order)
+	{
+		// the bounding box centers of the lines
+		std::vector<Vec3f> centers(numLines);
+		ParallelFor(0, numLines, 1 << 10, [&](long long first, long long last) {
+			for (int lineId = (int)first; lineId < (int)last; ++lineId)
+			{
+				Vec3f lo(FLT_MAX, FLT_MAX, FLT_MAX), hi(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+				for (int v = lineOffsets[lineId]; v < lineOffsets[lineId + 1]; ++v)
+				{
+					const Vec3f& p = positions[v];
+					lo.x = std::min(lo.x, p.x); lo.y = std::min(lo.y, p.y); lo.z = std::min(lo.z, p.z);
+					hi.x = std::max(hi.x, p.x); hi.y = std::max(hi.y, p.y); hi.z = std::max(hi.z, p.z);
+				}
+				centers[lineId] = lo.x <= hi.x ? Vec3f((lo.x + hi.x) * 0.5f, (lo.y + hi.y) * 0.5f, (lo.z + hi.z) * 0.5f) : Vec3f(0, 0, 0);
+			}
+		});
+
+		Vec3f lo(FLT_MAX, FLT_MAX, FLT_MAX), hi(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+		for (const Vec3f& c : centers)
+		{
+			lo.x = std::min(lo.x, c.x); lo.y = std::min(lo.y, c.y); lo.z = std::min(lo.z, c.z);
+			hi.x = std::max(hi.x, c.x); hi.y = std::max(hi.y, c.y); hi.z = std::max(hi.z, c.z);
+		}
+
+		// quantize in the bounding box of the centers and sort by code (equal codes keep the file order)
+		const float cells = (float)((1u << BITS) - 1);
+		Vec3f scale(hi.x > lo.x ? cells / (hi.x - lo.x) : 0.0f, hi.y > lo.y ? cells / (hi.y - lo.y) : 0.0f, hi.z > lo.z ? cells / (hi.z - lo.z) : 0.0f);
+		std::vector<std::pair<uint64_t, int> > keys(numLines);
+		ParallelFor(0, numLines, 1 << 12, [&](long long first, long long last) {
+			for (int lineId = (int)first; lineId < (int)last; ++lineId)
+			{
+				const Vec3f& c = centers[lineId];
+				uint32_t x = Quantize((c.x - lo.x) * scale.x), y = Quantize((c.y - lo.y) * scale.y), z = Quantize((c.z - lo.z) * scale.z);
+				keys[lineId] = std::make_pair(curve == HILBERT ? HilbertCode(x, y, z) : MortonCode(x, y, z), lineId);
+			}
+		});
+		std::sort(keys.begin(), keys.end());
+
+		order.resize(numLines);
+		for (int lineId = 0; lineId < numLines; ++lineId)
+			order[lineId] = keys[lineId].second;
+	}
+
+	// Moves the per-vertex data into the order of 'order' (new line -> original line).
+	// Arrays that don't have one value per vertex are left alone.
+	template <typename T>
+	static void PermuteVertices(const std::vector<int>& order, const std::vector<int>& oldOffsets, const std::vector<int>& newOffsets, std::vector<T>& values)
+	{
+		if (values.size() != (size_t)oldOffsets.back()) return;
+		std::vector<T> permuted(values.size());
+		ParallelFor(0, (long long)order.size(), 1 << 10, [&](long long first, long long last) {
+			for (int lineId = (int)first; lineId < (int)last; ++lineId)
+				std::copy(values.begin() + oldOffsets[order[lineId]], values.begin() + oldOffsets[order[lineId] + 1], permuted.begin() + newOffsets[lineId]);
+		});
+		values.swap(permuted);
+	}
+
+	template <typename T>
+	static void PermuteLines(const std::vector<int>& order, std::vector<T>& values)
+	{
+		if (values.size() != order.size()) return;
+		std::vector<T> permuted(values.size());
+		for (size_t lineId = 0; lineId < order.size(); ++lineId)
+			permuted[lineId] = values[order[lineId]];
+		values.swap(permuted);
+	}
+
+	// Reorders a parameterized line set: the vertices, their importance, the line offsets and control point counts, and the line index
+	// of every vertex and control point (which become the new line indices). The blending weights are recomputed for the new
+	// control point offsets; lengths and weights within a line are the same as before.
+	static void Apply(Curve curve, std::vector<Vec3f>& positions, std::vector<float>& importance, std::vector<float>& alphaWeights,
+		std::vector<int>& lineOffsets, std::vector<int>& ids, std::vector<float>& lineLengths, std::vector<int>& numberOfControlPointsOfLine,
+		std::vector<unsigned int>& controlPointLineIndices, std::vector<int>& order)
+	{
+		order.clear();
+		if (curve == NONE || lineOffsets.size() < 2) return;
+		std::chrono::high_resolution_clock::time_point timeStart = std::chrono::high_resolution_clock::now();
+
+		int numLines = (int)lineOffsets.size() - 1;
+		ComputeOrder(curve, positions.data(), lineOffsets.data(), numLines, order);
+
+		std::vector<int> newOffsets(numLines + 1);
+		newOffsets[0] = 0;
+		for (int lineId = 0; lineId < numLines; ++lineId)
+			newOffsets[lineId + 1] = newOffsets[lineId] + lineOffsets[order[lineId] + 1] - lineOffsets[order[lineId]];
+
+		PermuteVertices(order, lineOffsets, newOffsets, positions);
+		PermuteVertices(order, lineOffsets, newOffsets, importance);
+		PermuteLines(order, numberOfControlPointsOfLine);
+		lineOffsets.swap(newOffsets);
+
+		// the blending weights contain the index of the first control point of the line, which changed
+		lineLengths.resize(numLines);
+		alphaWeights.resize(positions.size());
+		LineParameterization::ComputeArcLengths(positions.data(), lineOffsets.data(), numLines, lineLengths.data(), alphaWeights.data());
+		LineParameterization::NormalizeArcLengths(lineOffsets.data(), numLines, lineLengths.data(), numberOfControlPointsOfLine.data(), alphaWeights.data());
+
+		ids.resize(lineOffsets[numLines]);
+		ParallelFor(0, numLines, 1 << 10, [&](long long first, long long last) {
+			for (int lineId = (int)first; lineId < (int)last; ++lineId)
+				std::fill(ids.begin() + lineOffsets[lineId], ids.begin() + lineOffsets[lineId + 1], lineId);
+		});
+
+		// the control points of a line are contiguous, in line order
+		LineParameterization::ComputeControlPointLineIndices(numberOfControlPointsOfLine.data(), numLines, controlPointLineIndices.data());
+
+		double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - timeStart).count();
+		printf("Reordered %i lines along the %s curve in %.3f s\n", numLines, curve == HILBERT ? "Hilbert" : "Morton", seconds);
+	}
+
+private:
+
+	static inline uint32_t Quantize(float v)
+	{
+		return (uint32_t)std::min(std::max(v, 0.0f), (float)((1u << BITS) - 1));
+	}
+
+	// Inserts two zero bits between the lower BITS bits.
+	static inline uint64_t SpreadBits(uint32_t v)
+	{
+		uint64_t x = v & ((1u << BITS) - 1);
+		x = (x | x << 32) & 0x001F00000000FFFFull;
+		x = (x | x << 16) & 0x001F0000FF0000FFull;
+		x = (x | x << 8) & 0x100F00F00F00F00Full;
+		x = (x | x << 4) & 0x10C30C30C30C30C3ull;
+		x = (x | x << 2) & 0x1249249249249249ull;
+		return x;
+	}
+};
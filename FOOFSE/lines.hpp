@@ -1,36 +1,56 @@
 #pragma once
 
 #include "math.hpp"
+#include "lineset.hpp"
+#include "lod.hpp"
+#include "segmentbvh.hpp"
 #include <d3d11.h>
 #include <vector>
-#include <map>
-#include <fstream>
-#include <sstream>
-#include <iostream>
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
 
 class Lines
 {
 public:
 
-	Lines(const std::string& path, int totalNumCPs) :
-		_NumLines(0),
+	// Loads the line set (see LineSet for the parameters). The device resources are created by Create().
+	Lines(const std::string& path, int totalNumCPs, size_t streamingBudget = 0, const LineSimplifier::Settings& simplification = LineSimplifier::Settings(),
+		LineReorder::Curve reordering = LineReorder::NONE) :
+		_LineSet(path, totalNumCPs, streamingBudget, simplification, reordering),
 		_VbPosition(NULL),
 		_VbID(NULL),
 		_VbImportance(NULL),
 		_VbAlphaWeights(NULL),
 		_VbCurrentAlpha(NULL),
+		_SrvPosition(NULL),
+		_SrvID(NULL),
+		_SrvImportance(NULL),
 		_SrvAlphaWeights(NULL),
 		_SrvCurrentAlpha(NULL),
 		_UavCurrentAlpha(NULL),
 		_LineID(NULL),
 		_SrvLineID(NULL),
-		_TotalNumberOfControlPoints(totalNumCPs)
+		_CullingEnabled(false),
+		_Culled(false),
+		_NumVisibleSegments(0),
+		_ViewScreenHeight(0),
+		_ViewValid(false),
+		_LodPixelThreshold(0),
+		_LodSelected(false),
+		_NumLodVertices(0),
+		_LodCapacity(0),
+		_LodIndexBuffer(NULL),
+		_SrvLodIndices(NULL)
 	{
 		_AlphaBuffer[0] = _AlphaBuffer[1] = NULL;
 		_SrvAlphaBuffer[0] = _SrvAlphaBuffer[1] = NULL;
 		_UavAlphaBuffer[0] = _UavAlphaBuffer[1] = NULL;
-
-		LoadLineSet(path);
+		for (int s = 0; s < NUM_LOD_STREAMS; ++s)
+		{
+			_VbLod[s] = NULL;
+			_UavLod[s] = NULL;
+		}
 	}
 
 	~Lines() {
@@ -39,44 +59,46 @@ public:
 
 	bool Create(ID3D11Device* Device)
 	{
-		// create the vertex buffers
+		// create the vertex buffers (readable by the level of detail gather)
 		D3D11_BUFFER_DESC bufferDesc;
 		ZeroMemory(&bufferDesc, sizeof(D3D11_BUFFER_DESC));
-		bufferDesc.BindFlags = D3D11_BIND_VERTEX_BUFFER;
-		bufferDesc.ByteWidth = (UINT)_Positions.size() * sizeof(XMFLOAT3);
+		bufferDesc.BindFlags = D3D11_BIND_VERTEX_BUFFER | D3D11_BIND_SHADER_RESOURCE;
+		bufferDesc.MiscFlags = D3D11_RESOURCE_MISC_BUFFER_ALLOW_RAW_VIEWS;
+		bufferDesc.ByteWidth = (UINT)_LineSet.GetPositions().size() * sizeof(XMFLOAT3);
 		bufferDesc.Usage = D3D11_USAGE_DEFAULT;
 		D3D11_SUBRESOURCE_DATA initData;
 		ZeroMemory(&initData, sizeof(D3D11_SUBRESOURCE_DATA));
-		initData.pSysMem = _Positions.data();
+		initData.pSysMem = _LineSet.GetPositions().data();
 		if (FAILED(Device->CreateBuffer(&bufferDesc, &initData, &_VbPosition))) return false;
+		if (!CreateRawSrv(Device, _VbPosition, (UINT)_LineSet.GetPositions().size() * 3, &_SrvPosition)) return false;
 
-		bufferDesc.ByteWidth = (UINT)_ID.size() * sizeof(int);
-		initData.pSysMem = _ID.data();
+		bufferDesc.ByteWidth = (UINT)_LineSet.GetID().size() * sizeof(int);
+		initData.pSysMem = _LineSet.GetID().data();
 		if (FAILED(Device->CreateBuffer(&bufferDesc, &initData, &_VbID))) return false;
+		if (!CreateRawSrv(Device, _VbID, (UINT)_LineSet.GetID().size(), &_SrvID)) return false;
 
-		initData.pSysMem = _Importance.data();
+		initData.pSysMem = _LineSet.GetImportance().data();
 		if (FAILED(Device->CreateBuffer(&bufferDesc, &initData, &_VbImportance))) return false;
+		if (!CreateRawSrv(Device, _VbImportance, (UINT)_LineSet.GetID().size(), &_SrvImportance)) return false;
 
 		// create buffer for the alpha weights
 		{
-			bufferDesc.MiscFlags = D3D11_RESOURCE_MISC_BUFFER_ALLOW_RAW_VIEWS;
-			bufferDesc.BindFlags = D3D11_BIND_VERTEX_BUFFER | D3D11_BIND_SHADER_RESOURCE;
-			bufferDesc.ByteWidth = (UINT)_Positions.size() * sizeof(float);
-			initData.pSysMem = &_AlphaWeights[0];
+			bufferDesc.ByteWidth = (UINT)_LineSet.GetPositions().size() * sizeof(float);
+			initData.pSysMem = _LineSet.GetAlphaWeights().data();
 			if (FAILED(Device->CreateBuffer(&bufferDesc, &initData, &_VbAlphaWeights))) return false;
 
 			D3D11_SHADER_RESOURCE_VIEW_DESC srv;
 			ZeroMemory(&srv, sizeof(D3D11_SHADER_RESOURCE_VIEW_DESC));
 			srv.ViewDimension = D3D11_SRV_DIMENSION_BUFFEREX;
 			srv.BufferEx.Flags = D3D11_BUFFEREX_SRV_FLAG_RAW;
-			srv.BufferEx.NumElements = (UINT)_Positions.size();
+			srv.BufferEx.NumElements = (UINT)_LineSet.GetPositions().size();
 			srv.Format = DXGI_FORMAT_R32_TYPELESS;
 			if (FAILED(Device->CreateShaderResourceView(_VbAlphaWeights, &srv, &_SrvAlphaWeights))) return false;
 		}
 
 		// create current alpha resources
 		{
-			unsigned int NUM_ELEMENTS = (unsigned int)_Positions.size();
+			unsigned int NUM_ELEMENTS = (unsigned int)_LineSet.GetPositions().size();
 			D3D11_BUFFER_DESC bufDesc;
 			ZeroMemory(&bufDesc, sizeof(D3D11_BUFFER_DESC));
 			bufDesc.BindFlags = D3D11_BIND_VERTEX_BUFFER | D3D11_BIND_UNORDERED_ACCESS | D3D11_BIND_SHADER_RESOURCE;
@@ -106,7 +128,7 @@ public:
 
 		for (int p = 0; p<2; ++p)
 		{
-			unsigned int NUM_ELEMENTS = _TotalNumberOfControlPoints;
+			unsigned int NUM_ELEMENTS = GetTotalNumberOfControlPoints();
 			D3D11_BUFFER_DESC bufDesc;
 			ZeroMemory(&bufDesc, sizeof(D3D11_BUFFER_DESC));
 			bufDesc.BindFlags = D3D11_BIND_UNORDERED_ACCESS | D3D11_BIND_SHADER_RESOURCE;
@@ -135,7 +157,7 @@ public:
 		}
 
 		{
-			unsigned int NUM_ELEMENTS = _TotalNumberOfControlPoints;
+			unsigned int NUM_ELEMENTS = GetTotalNumberOfControlPoints();
 			D3D11_BUFFER_DESC bufDesc;
 			ZeroMemory(&bufDesc, sizeof(D3D11_BUFFER_DESC));
 			bufDesc.BindFlags = D3D11_BIND_UNORDERED_ACCESS | D3D11_BIND_SHADER_RESOURCE;
@@ -147,7 +169,7 @@ public:
 
 			D3D11_SUBRESOURCE_DATA initData;
 			ZeroMemory(&initData, sizeof(D3D11_SUBRESOURCE_DATA));
-			initData.pSysMem = _ControlPointLineIndices.data();
+			initData.pSysMem = _LineSet.GetControlPointLineIndices().data();
 			if (FAILED(Device->CreateBuffer(&bufDesc, &initData, &_LineID))) return false;
 
 			D3D11_SHADER_RESOURCE_VIEW_DESC srv;
@@ -168,6 +190,9 @@ public:
 		if (_VbID)				_VbID->Release();				_VbID = NULL;
 		if (_VbImportance)		_VbImportance->Release();		_VbImportance = NULL;
 		if (_VbAlphaWeights)	_VbAlphaWeights->Release();		_VbAlphaWeights = NULL;
+		if (_SrvPosition)		_SrvPosition->Release();		_SrvPosition = NULL;
+		if (_SrvID)				_SrvID->Release();				_SrvID = NULL;
+		if (_SrvImportance)		_SrvImportance->Release();		_SrvImportance = NULL;
 		if (_SrvAlphaWeights)	_SrvAlphaWeights->Release();	_SrvAlphaWeights = NULL;
 		if (_VbCurrentAlpha)	_VbCurrentAlpha->Release();		_VbCurrentAlpha = NULL;
 		if (_SrvCurrentAlpha)	_SrvCurrentAlpha->Release();	_SrvCurrentAlpha = NULL;
@@ -179,281 +204,266 @@ public:
 		}
 		if (_LineID)			_LineID->Release();				_LineID = NULL;
 		if (_SrvLineID)			_SrvLineID->Release();			_SrvLineID = NULL;
+		ReleaseLevelOfDetail();
 	}
 
+	// Both draw the vertices of the selected level of detail if it is enabled, otherwise the visible segments (if culling is enabled).
 	void DrawHQ(ID3D11DeviceContext* ImmediateContext)
 	{
 		ImmediateContext->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_LINESTRIP);
 
-		ID3D11Buffer* vbs[] = { _VbPosition, _VbID, _VbCurrentAlpha };
+		bool lod = IsLevelOfDetailActive();
+		ID3D11Buffer* vbs[] = { lod ? _VbLod[LOD_POSITION] : _VbPosition, lod ? _VbLod[LOD_ID] : _VbID, lod ? _VbLod[LOD_CURRENT_ALPHA] : _VbCurrentAlpha };
 		UINT strides[] = { sizeof(float) * 3, sizeof(int), sizeof(float) };
 		UINT offsets[] = { 0, 0, 0 };
 		ImmediateContext->IASetVertexBuffers(0, 3, vbs, strides, offsets);
-		ImmediateContext->Draw(GetTotalNumberOfVertices() - 2, 0);
+		DrawStrips(ImmediateContext);
 	}
 
 	void DrawLowRes(ID3D11DeviceContext* ImmediateContext)
 	{
 		ImmediateContext->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_LINESTRIP);
 
-		ID3D11Buffer* vbs[] = { _VbPosition, _VbID, _VbImportance, _VbAlphaWeights };
+		bool lod = IsLevelOfDetailActive();
+		ID3D11Buffer* vbs[] = { lod ? _VbLod[LOD_POSITION] : _VbPosition, lod ? _VbLod[LOD_ID] : _VbID,
+			lod ? _VbLod[LOD_IMPORTANCE] : _VbImportance, lod ? _VbLod[LOD_ALPHA_WEIGHTS] : _VbAlphaWeights };
 		UINT strides[] = { sizeof(float) * 3, sizeof(int), sizeof(float), sizeof(float) };
 		UINT offsets[] = { 0, 0, 0, 0 };
 		ImmediateContext->IASetVertexBuffers(0, 4, vbs, strides, offsets);
-		ImmediateContext->Draw(GetTotalNumberOfVertices() - 2, 0);
+		DrawStrips(ImmediateContext);
 	}
 
-	ID3D11ShaderResourceView* GetSrvCurrentAlpha() { return _SrvCurrentAlpha; }
-	ID3D11UnorderedAccessView* GetUavCurrentAlpha() { return _UavCurrentAlpha; }
-	ID3D11ShaderResourceView** GetSrvAlpha() { return _SrvAlphaBuffer; }
-	ID3D11UnorderedAccessView** GetUavAlpha() { return _UavAlphaBuffer; }
-	ID3D11ShaderResourceView* GetSrvAlphaWeights() { return _SrvAlphaWeights; }
-	ID3D11ShaderResourceView* GetSrvLineID() { return _SrvLineID; }
-
-	int GetTotalNumberOfControlPoints() const { return _TotalNumberOfControlPoints; }
-	int GetTotalNumberOfVertices() const { return (int)_Positions.size(); }
-
-private:
-
-	void LoadLineSet(const std::string& path)
+	// Enables the level of detail: lines are drawn as coarse as possible, such that their error stays below 'pixelThreshold' pixels.
+	// The hierarchy is built on first use. 0 draws all vertices.
+	void SetLevelOfDetail(float pixelThreshold)
 	{
-		typedef std::vector<XMFLOAT3> Line;
-		static const int OBJ_ZERO_BASED_SHIFT = -1;
+		_LodPixelThreshold = pixelThreshold;
+		_ViewValid = false;
+		if (pixelThreshold > 0 && _LevelOfDetail.IsEmpty() && !_LineSet.GetLineOffsets().empty())
+			_LevelOfDetail.Build(_LineSet.GetPositions().data(), _LineSet.GetLineOffsets().data(), _LineSet.GetNumLines());
+	}
 
-		std::vector<Line> lines;
-		std::vector<float> objImportance;
+	// Enables culling of the segments outside of the view frustum. The segment BVH is built on first use.
+	void SetFrustumCulling(bool enabled)
+	{
+		_CullingEnabled = enabled;
+		_ViewValid = false;
+		if (enabled && _SegmentBvh.IsEmpty() && !_LineSet.GetPositions().empty())
+			_SegmentBvh.Build(_LineSet.GetPositions().data(), _LineSet.GetID().data(), GetTotalNumberOfVertices());
+	}
 
-		XMFLOAT3 last(0, 0, 0);
-		_NumLines = 0;
-		std::vector<XMFLOAT3> vertices;
-		std::ifstream myfile(path);
-		if (myfile.is_open())
+	// Culls the segments against the view frustum and selects the level of detail of the visible lines.
+	// The selected vertices are gathered into compact vertex buffers with 'gatherShader'. 'stripWidth' (in normalized device coordinates)
+	// widens the frustum, since segments just outside of it can reach into the view. Nothing is done if the view did not change.
+	void UpdateVisibility(ID3D11DeviceContext* ImmediateContext, const XMFLOAT4X4& view, const XMFLOAT4X4& projection, int screenHeight, float stripWidth,
+		ID3D11ComputeShader* gatherShader)
+	{
+		bool cull = _CullingEnabled && !_SegmentBvh.IsEmpty();
+		bool lod = _LodPixelThreshold > 0 && !_LevelOfDetail.IsEmpty();
+		if ((!cull && !lod) || !_VbPosition)
+			return;
+		if (_ViewValid && screenHeight == _ViewScreenHeight && memcmp(&view, &_View, sizeof(XMFLOAT4X4)) == 0 && memcmp(&projection, &_Projection, sizeof(XMFLOAT4X4)) == 0)
+			return;
+		_View = view;
+		_Projection = projection;
+		_ViewScreenHeight = screenHeight;
+		_ViewValid = false;
+		_Culled = false;
+		_LodSelected = false;
+
+		if (cull)
 		{
-			std::string line;
-			while (myfile.good())
-			{
-				std::getline(myfile, line);
-				if (line.size() < 2) continue;
-				if (line[0] == 'v' && line[1] == ' ')	// read in vertex
-				{
-					XMFLOAT3 vertex;
-					if (sscanf_s(line.c_str(), "v %f %f %f", &vertex.x, &vertex.y, &vertex.z) == 3)
-						vertices.push_back(vertex);
-				}
-				else if (line[0] == 'v' && line[1] == 't')	// read in tex coord (aka importance)
-				{
-					float imp;
-					if (sscanf_s(line.c_str(), "vt %f", &imp) == 1)
-					{
-						objImportance.push_back(imp);
-					}
-				}
-				else if (line[0] == 'l') // read in line indices
-				{
-					std::stringstream t(line);
-					std::string lead;
-					t >> lead;
-					int index;
-					Line vline;
-					float noise = 0; // 0.01f + rand() / (float)(RAND_MAX)* 0.2f;
-					while (t >> index)
-					{
-						XMVECTOR vNew = XMLoadFloat3(&vertices[index + OBJ_ZERO_BASED_SHIFT]);
-						XMVECTOR vLast = XMLoadFloat3(&last);
-						float dist;
-						XMVECTOR vDist = XMVector3LengthSq(vNew - vLast);
-						XMStoreFloat(&dist, vDist);
-						if (dist > 0.0001f)
-						{
-							last = vertices[index + OBJ_ZERO_BASED_SHIFT];
-							vline.push_back(vertices[index + OBJ_ZERO_BASED_SHIFT]);
-
-
-							if (index + OBJ_ZERO_BASED_SHIFT < objImportance.size())
-							{
-								float imp = objImportance[index + OBJ_ZERO_BASED_SHIFT];
-								_Importance.push_back(imp + noise);
-							}
-						}
-					}
-					lines.push_back(vline);
-					_NumLines++;
-				}
-			}
-			myfile.close();
+			_NumVisibleSegments = _SegmentBvh.Cull(view, projection, stripWidth, _VisibleRanges);
+			_Culled = true;
 		}
 
-		// compute the lengths of the lines
-		float lineLengthMin = FLT_MAX;
-		float lineLengthMax = -FLT_MAX;
+		if (lod)
 		{
-			int lineId = 0;
+			if (cull) _SegmentBvh.GetVisibleLines(_LineSet.GetLineOffsets().data(), _LineSet.GetNumLines(), _VisibleLines);
+			_NumLodVertices = _LevelOfDetail.Select(view, projection, screenHeight, _LodPixelThreshold, cull ? _VisibleLines.data() : NULL, _LodIndices);
+			if (_NumLodVertices > _LodCapacity)
 			{
-				_LineLengths.clear();
-				_LineLengths.resize(lines.size(), 0);
-				float totalLengths = 0;
-				for (auto itLine = lines.begin(); itLine != lines.end(); ++itLine, lineId++)
-				{
-					float length = 0;
-					for (int id = 0; id < (int)itLine->size() - 1; ++id)
-					{
-						XMVECTOR a = XMLoadFloat3(&itLine->at(id));
-						XMVECTOR b = XMLoadFloat3(&itLine->at(id + 1));
-						float l = 0;
-						XMStoreFloat(&l, XMVector3Length(a - b));
-
-						if (l < 999999999)
-							length += l;
-					}
-					_LineLengths[lineId] = length;
-
-					totalLengths += length;
-					lineLengthMin = std::min(lineLengthMin, length);
-					lineLengthMax = std::max(lineLengthMax, length);
-				}
+				ID3D11Device* device = NULL;
+				ImmediateContext->GetDevice(&device);
+				bool ok = CreateLevelOfDetail(device, std::min(_NumLodVertices + _NumLodVertices / 2, GetTotalNumberOfVertices()));
+				device->Release();
+				if (!ok) return;
 			}
-		}
-
-		float accumLineLength = 0;
-		int totalNumPoints = 0;
-		{
-			int lineId = 0;
-			// get total number of vertices
-			for (auto itLine = lines.begin(); itLine != lines.end(); ++itLine, lineId++)
+			if (_NumLodVertices > 0)
 			{
-				totalNumPoints += (int)itLine->size();
-				accumLineLength += _LineLengths[lineId];
+				D3D11_BOX box = { 0, 0, 0, (UINT)(_NumLodVertices * sizeof(unsigned int)), 1, 1 };
+				ImmediateContext->UpdateSubresource(_LodIndexBuffer, 0, &box, _LodIndices.data(), 0, 0);
 			}
+			Gather(ImmediateContext, gatherShader);
+			_LodSelected = true;
 		}
+		_ViewValid = true;
+	}
 
-		// store position data and IDs in linear memory
-		_Positions.resize(totalNumPoints);
-		_ID.resize(totalNumPoints);
+	// Gathers the current alpha of the selected vertices (after it has been faded) with 'gatherShader'.
+	void GatherCurrentAlpha(ID3D11DeviceContext* ImmediateContext, ID3D11ComputeShader* gatherShader)
+	{
+		if (IsLevelOfDetailActive())
+			Gather(ImmediateContext, gatherShader);
+	}
 
-		int offset = 0;
-		int lineID = 0;
-		for (auto itLine = lines.begin(); itLine != lines.end(); ++itLine)
-		{
-			memcpy_s(&(_Positions)[offset], (totalNumPoints - offset) * sizeof(XMFLOAT3), &((*itLine)[0]), itLine->size() * sizeof(XMFLOAT3));
-			for (unsigned int i = 0; i<itLine->size(); ++i)
-				_ID[i + offset] = lineID;
-			offset += (int)itLine->size();
-			lineID++;
-		}
+	bool IsLevelOfDetailActive() const { return _LodPixelThreshold > 0 && _LodSelected; }
+	bool IsCullingActive() const { return _CullingEnabled && _Culled; }
 
-		// ==============================================================
-		// Distribute polyline segments (here sometimes called control points) among the lines so that they are roughly equally-sized.
-		// ==============================================================
-		assert(_TotalNumberOfControlPoints * 2 > (int)_NumLines);
+	// Number of segments in the view frustum after the last UpdateVisibility() (all segments if culling is disabled).
+	int GetNumberOfVisibleSegments() const { return IsCullingActive() ? _NumVisibleSegments : _SegmentBvh.GetNumSegments(); }
+	int GetNumberOfSegments() const { return _SegmentBvh.GetNumSegments(); }
 
-		_NumberOfControlPointsOfLine.resize(_NumLines);
-		{
-			// calculate the average length of a polyline segment
-			float lengthPerPatch = accumLineLength / _TotalNumberOfControlPoints;
+	ID3D11ShaderResourceView* GetSrvCurrentAlpha() { return _SrvCurrentAlpha; }
+	ID3D11UnorderedAccessView* GetUavCurrentAlpha() { return _UavCurrentAlpha; }
+	ID3D11ShaderResourceView** GetSrvAlpha() { return _SrvAlphaBuffer; }
+	ID3D11UnorderedAccessView** GetUavAlpha() { return _UavAlphaBuffer; }
+	ID3D11ShaderResourceView* GetSrvAlphaWeights() { return _SrvAlphaWeights; }
+	ID3D11ShaderResourceView* GetSrvLineID() { return _SrvLineID; }
 
-			// we first make sure that lines shorter than this length receive two polyline segments
-			int remPatches = _TotalNumberOfControlPoints;
-			float remLength = accumLineLength;
-			for (int lineId = 0; lineId < lines.size(); ++lineId)
-			{
-				float length = _LineLengths[lineId];
-				if (length <= lengthPerPatch)
-				{
-					_NumberOfControlPointsOfLine[lineId] = 2;
-					remPatches -= 2;
-					remLength -= length;
-				}
-			}
+	// Distributes a new number of control points among the lines, without reloading the line set.
+	// The device resources are recreated if a device is given. The cache on disk keeps the number of control points it was loaded with.
+	bool SetTotalNumberOfControlPoints(int totalNumCPs, ID3D11Device* Device)
+	{
+		_LineSet.SetTotalNumberOfControlPoints(totalNumCPs);
+		if (!Device) return true;
+		Release();
+		return Create(Device);
+	}
 
-			// the remaining polyline segments are distributed among the other lines
-			std::map<float, int> remainder;
-			int assignedPatches = 0;
-			for (int lineId = 0; lineId < lines.size(); ++lineId)
-			{
-				float length = _LineLengths[lineId];
-				if (length > lengthPerPatch)
-				{
-					float numPatches = length / remLength * remPatches;
-					_NumberOfControlPointsOfLine[lineId] = (int)numPatches;
-					assignedPatches += (int)numPatches;
-					remainder.insert(std::pair<float, int>(numPatches - (int)numPatches, lineId));
-				}
-			}
+	int GetTotalNumberOfControlPoints() const { return _LineSet.GetTotalNumberOfControlPoints(); }
+	int GetTotalNumberOfVertices() const { return _LineSet.GetNumVertices(); }
+	int GetOriginalLineID(int lineId) const { return _LineSet.GetOriginalLineID(lineId); }
+	const LineSet& GetLineSet() const { return _LineSet; }
 
-			// due to rounding a few segments are not yet assigned. do so now.
-			assert(assignedPatches <= remPatches);
-			while (assignedPatches < remPatches)
-			{
-				// get the patch with the largest remainder
-				auto itBiggest = --remainder.end();
-				int biggestRemLineId = itBiggest->second;
-				remainder.erase(itBiggest);
-				_NumberOfControlPointsOfLine[biggestRemLineId] += 1;
-				assignedPatches += 1;
-			}
-		}
+private:
 
-		// ==============================================================
-		// Compute the blending weight parameterization
-		// ==============================================================
+	enum LodStream
+	{
+		LOD_POSITION,
+		LOD_ID,
+		LOD_IMPORTANCE,
+		LOD_ALPHA_WEIGHTS,
+		LOD_CURRENT_ALPHA,
+		NUM_LOD_STREAMS
+	};
+
+	static bool CreateRawSrv(ID3D11Device* Device, ID3D11Buffer* buffer, UINT numElements, ID3D11ShaderResourceView** srv)
+	{
+		D3D11_SHADER_RESOURCE_VIEW_DESC desc;
+		ZeroMemory(&desc, sizeof(D3D11_SHADER_RESOURCE_VIEW_DESC));
+		desc.ViewDimension = D3D11_SRV_DIMENSION_BUFFEREX;
+		desc.BufferEx.Flags = D3D11_BUFFEREX_SRV_FLAG_RAW;
+		desc.BufferEx.NumElements = numElements;
+		desc.Format = DXGI_FORMAT_R32_TYPELESS;
+		return SUCCEEDED(Device->CreateShaderResourceView(buffer, &desc, srv));
+	}
 
-		// compute the (alpha) control weights
-		_AlphaWeights.resize(totalNumPoints);
+	// Creates the index buffer and the compact vertex buffers of the level of detail for 'capacity' vertices.
+	bool CreateLevelOfDetail(ID3D11Device* Device, int capacity)
+	{
+		ReleaseLevelOfDetail();
+
+		D3D11_BUFFER_DESC bufDesc;
+		ZeroMemory(&bufDesc, sizeof(D3D11_BUFFER_DESC));
+		bufDesc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+		bufDesc.ByteWidth = capacity * sizeof(unsigned int);
+		bufDesc.MiscFlags = D3D11_RESOURCE_MISC_BUFFER_ALLOW_RAW_VIEWS;
+		bufDesc.Usage = D3D11_USAGE_DEFAULT;
+		if (FAILED(Device->CreateBuffer(&bufDesc, NULL, &_LodIndexBuffer))) return false;
+		if (!CreateRawSrv(Device, _LodIndexBuffer, capacity, &_SrvLodIndices)) return false;
+
+		bufDesc.BindFlags = D3D11_BIND_VERTEX_BUFFER | D3D11_BIND_UNORDERED_ACCESS;
+		for (int s = 0; s < NUM_LOD_STREAMS; ++s)
 		{
-			int offset = 0;
-			int lineId = 0;
-			int cpOffset = 0;
-			for (auto itLine = lines.begin(); itLine != lines.end(); ++itLine, lineId++)
-			{
-				float currLength = 0;
-				float lineLength = _LineLengths[lineId];
-				_AlphaWeights[offset] = (float)cpOffset; //_NumControlPointsPerLine * lineId;
-				offset++;
-
-				int numCp = _NumberOfControlPointsOfLine[lineId];
-				for (unsigned int id = 0; id < itLine->size() - 1; ++id)
-				{
-					XMVECTOR a = XMLoadFloat3(&itLine->at(id));
-					XMVECTOR b = XMLoadFloat3(&itLine->at(id + 1));
-					float l = 0;
-					XMStoreFloat(&l, XMVector3Length(a - b));
-					currLength += l;
-
-					_AlphaWeights[offset] = std::min(currLength / lineLength * (numCp - 1), numCp - 1 - 0.0001f);
-					_AlphaWeights[offset] += cpOffset;
-
-					offset++;
-				}
-				cpOffset += numCp;
-			}
-			if (offset != totalNumPoints)
-				throw new std::exception("Offset mismatch.");
+			UINT numElements = s == LOD_POSITION ? capacity * 3 : capacity;
+			bufDesc.ByteWidth = numElements * sizeof(float);
+			if (FAILED(Device->CreateBuffer(&bufDesc, NULL, &_VbLod[s]))) return false;
+
+			D3D11_UNORDERED_ACCESS_VIEW_DESC uav;
+			ZeroMemory(&uav, sizeof(D3D11_UNORDERED_ACCESS_VIEW_DESC));
+			uav.ViewDimension = D3D11_UAV_DIMENSION_BUFFER;
+			uav.Buffer.Flags = D3D11_BUFFER_UAV_FLAG_RAW;
+			uav.Buffer.NumElements = numElements;
+			uav.Format = DXGI_FORMAT_R32_TYPELESS;
+			if (FAILED(Device->CreateUnorderedAccessView(_VbLod[s], &uav, &_UavLod[s]))) return false;
 		}
+		_LodCapacity = capacity;
+		return true;
+	}
+
+	void ReleaseLevelOfDetail()
+	{
+		if (_LodIndexBuffer)	_LodIndexBuffer->Release();		_LodIndexBuffer = NULL;
+		if (_SrvLodIndices)		_SrvLodIndices->Release();		_SrvLodIndices = NULL;
+		for (int s = 0; s < NUM_LOD_STREAMS; ++s) {
+			if (_VbLod[s])		_VbLod[s]->Release();			_VbLod[s] = NULL;
+			if (_UavLod[s])		_UavLod[s]->Release();			_UavLod[s] = NULL;
+		}
+		_LodCapacity = 0;
+		_LodSelected = false;
+		_ViewValid = false;
+	}
 
+	// Draws the line strips of the bound vertex buffers. The line shaders draw the segment between the vertices j + 1 and j + 2
+	// (with j and j + 3 as neighbors) for the primitive of the vertices j and j + 1. Thus segments [a, b) need the vertices a - 1 ... b - 1.
+	void DrawStrips(ID3D11DeviceContext* ImmediateContext)
+	{
+		if (IsLevelOfDetailActive())
 		{
-			_ControlPointLineIndices.resize(_TotalNumberOfControlPoints);
-			int lineID = 0;
-			int cpID = 0;
-			for (int numCP : _NumberOfControlPointsOfLine)
-			{
-				for (int i = 0; i < numCP; ++i)
-					_ControlPointLineIndices[cpID++] = lineID;
+			if (_NumLodVertices > 2)
+				ImmediateContext->Draw(_NumLodVertices - 2, 0);
+			return;
+		}
 
-				lineID++;
-			}
+		int numVertices = GetTotalNumberOfVertices();
+		if (!IsCullingActive())
+		{
+			if (numVertices > 2)
+				ImmediateContext->Draw(numVertices - 2, 0);
+			return;
+		}
+		for (const SegmentBvh::Range& range : _VisibleRanges)
+		{
+			int first = std::max(range.First - 1, 0);
+			int last = std::min(range.First + range.Count - 1, numVertices - 3);
+			if (last > first)
+				ImmediateContext->Draw(last - first + 1, first);
 		}
 	}
-	
-	int _TotalNumberOfControlPoints;
-	
-	int _NumLines;
-	
+
+	// Copies the attributes of the selected vertices into the compact vertex buffers.
+	void Gather(ID3D11DeviceContext* ImmediateContext, ID3D11ComputeShader* gatherShader)
+	{
+		if (_NumLodVertices <= 0 || !gatherShader) return;
+		ImmediateContext->CSSetShader(gatherShader, NULL, 0);
+
+		ID3D11ShaderResourceView* srvs[] = { _SrvLodIndices, _SrvPosition, _SrvID, _SrvImportance, _SrvAlphaWeights, _SrvCurrentAlpha };
+		ImmediateContext->CSSetShaderResources(0, 6, srvs);
+		UINT initialCounts[] = { 0,0,0,0,0 };
+		ImmediateContext->CSSetUnorderedAccessViews(0, NUM_LOD_STREAMS, _UavLod, initialCounts);
+
+		UINT groupsX = (_NumLodVertices + 511) / 512;
+		ImmediateContext->Dispatch(groupsX, 1, 1);
+
+		// clean up
+		ID3D11ShaderResourceView* noSrvs[] = { NULL, NULL, NULL, NULL, NULL, NULL };
+		ImmediateContext->CSSetShaderResources(0, 6, noSrvs);
+		ID3D11UnorderedAccessView* noUavs[] = { NULL, NULL, NULL, NULL, NULL };
+		ImmediateContext->CSSetUnorderedAccessViews(0, NUM_LOD_STREAMS, noUavs, initialCounts);
+	}
+
+	LineSet _LineSet;
+
 	ID3D11Buffer* _VbPosition;
 	ID3D11Buffer* _VbID;
 	ID3D11Buffer* _VbImportance;
 	ID3D11Buffer* _VbAlphaWeights;	// blending weights (basically the position between control points)
 	ID3D11Buffer* _VbCurrentAlpha;	// alpha stored with the vertex buffer
 
+	ID3D11ShaderResourceView* _SrvPosition;
+	ID3D11ShaderResourceView* _SrvID;
+	ID3D11ShaderResourceView* _SrvImportance;
 	ID3D11ShaderResourceView* _SrvAlphaWeights;
 	ID3D11ShaderResourceView* _SrvCurrentAlpha;
 	ID3D11UnorderedAccessView* _UavCurrentAlpha;
@@ -465,13 +475,27 @@ private:
 	ID3D11Buffer* _LineID;		// stores for every control point the lineID (used for smoothing)
 	ID3D11ShaderResourceView* _SrvLineID;
 
-	std::vector<Vec3f> _Positions;
-	std::vector<int> _ID;
-	std::vector<float> _Importance;
-	std::vector<float> _AlphaWeights;	// Blending weight parameterization
-
-	std::vector<float> _LineLengths;
-	std::vector<int> _NumberOfControlPointsOfLine;
-	std::vector<unsigned int> _ControlPointLineIndices;
+	SegmentBvh _SegmentBvh;
+	bool _CullingEnabled;
+	bool _Culled;
+	std::vector<SegmentBvh::Range> _VisibleRanges;
+	std::vector<unsigned char> _VisibleLines;
+	int _NumVisibleSegments;
+
+	XMFLOAT4X4 _View;					// view of the current culling and level of detail
+	XMFLOAT4X4 _Projection;
+	int _ViewScreenHeight;
+	bool _ViewValid;
+
+	LineLevelOfDetail _LevelOfDetail;
+	float _LodPixelThreshold;			// maximal projected error in pixels (0 = all vertices are drawn)
+	bool _LodSelected;
+	std::vector<unsigned int> _LodIndices;
+	int _NumLodVertices;
+	int _LodCapacity;
+	ID3D11Buffer* _LodIndexBuffer;		// indices of the selected vertices
+	ID3D11ShaderResourceView* _SrvLodIndices;
+	ID3D11Buffer* _VbLod[NUM_LOD_STREAMS];	// attributes of the selected vertices
+	ID3D11UnorderedAccessView* _UavLod[NUM_LOD_STREAMS];
 
 };
\ No newline at end of file
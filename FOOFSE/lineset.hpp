@@ -0,0 +1,228 @@
+#pragma once
+
+#include "vec.hpp"
+#include "objreader.hpp"
+#include "linecache.hpp"
+#include "linestream.hpp"
+#include "parameterization.hpp"
+#include "controlpoints.hpp"
+#include "simplify.hpp"
+#include "lineorder.hpp"
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+// The CPU side of a line set: the vertices with their line index and importance, the distribution of the control points
+// and the blending weight parameterization. Loading, preprocessing and caching don't depend on the graphics API or the platform,
+// so that line sets can be converted and benchmarked on headless machines. Lines uploads the arrays to the GPU.
+
+class LineSet
+{
+public:
+
+	// If 'streamingBudget' (in bytes) is not zero, a line set without a valid cache is converted with bounded memory (see LineSetStreamer).
+	// 'simplification' optionally reduces oversampled lines while loading (see LineSimplifier).
+	// 'reordering' optionally sorts the lines along a space-filling curve (see LineReorder); GetOriginalLineID() maps them back.
+	LineSet(const std::string& path, int totalNumCPs, size_t streamingBudget = 0, const LineSimplifier::Settings& simplification = LineSimplifier::Settings(),
+		LineReorder::Curve reordering = LineReorder::NONE) :
+		_TotalNumberOfControlPoints(totalNumCPs),
+		_Simplification(simplification),
+		_Reordering(reordering),
+		_NumLines(0)
+	{
+		if (streamingBudget > 0 && _Reordering != LineReorder::NONE)
+		{
+			printf("Streamed line sets are not reordered.\n");
+			_Reordering = LineReorder::NONE;
+		}
+		LoadLineSet(path, streamingBudget);
+	}
+
+	// Distributes a new number of control points among the lines, without reloading the line set.
+	// The cache on disk keeps the number of control points it was loaded with.
+	void SetTotalNumberOfControlPoints(int totalNumCPs)
+	{
+		_TotalNumberOfControlPoints = totalNumCPs;
+		ComputeParameterization();
+	}
+
+	int GetTotalNumberOfControlPoints() const { return _TotalNumberOfControlPoints; }
+	int GetNumLines() const { return _NumLines; }
+	int GetNumVertices() const { return (int)_Positions.size(); }
+	// The line set was loaded from its cache (or streamed into it) instead of parsed.
+	bool IsCached() const { return _CacheFile.GetData() != NULL; }
+
+	// Index of a line in the source file (differs from the line index if the lines were reordered).
+	int GetOriginalLineID(int lineId) const { return _LineOrder.empty() ? lineId : _LineOrder[lineId]; }
+
+	const CachedArray<Vec3f>& GetPositions() const { return _Positions; }
+	const CachedArray<int>& GetID() const { return _ID; }
+	const CachedArray<float>& GetImportance() const { return _Importance; }
+	const CachedArray<float>& GetAlphaWeights() const { return _AlphaWeights; }
+	const CachedArray<int>& GetLineOffsets() const { return _LineOffsets; }
+	const CachedArray<float>& GetLineLengths() const { return _LineLengths; }
+	const CachedArray<int>& GetNumberOfControlPointsOfLine() const { return _NumberOfControlPointsOfLine; }
+	const CachedArray<unsigned int>& GetControlPointLineIndices() const { return _ControlPointLineIndices; }
+
+private:
+
+	void LoadLineSet(const std::string& path, size_t streamingBudget)
+	{
+		// the preprocessed arrays of a previous run are used in place
+		if (LoadCache(path))
+			return;
+
+		// data sets that are larger than the memory are streamed into the cache, which is then mapped
+		if (streamingBudget > 0)
+		{
+			if (!LineSetStreamer::WriteCache(path, _TotalNumberOfControlPoints, streamingBudget, _Simplification) || !LoadCache(path))
+				printf("Couldn't stream the line set: %s\n", path.c_str());
+			return;
+		}
+
+		ObjLineReader::LineData lineData;
+		if (!ObjLineReader::Read(path, lineData))
+			return;
+		_NumLines = lineData.NumLines;
+		_Positions.Edit().swap(lineData.Positions);
+		_ID.Edit().swap(lineData.ID);
+		_Importance.Edit().swap(lineData.Importance);
+		_LineOffsets.Edit().swap(lineData.LineOffsets);
+
+		// optionally reduce oversampled lines
+		LineSimplifier::Apply(_Simplification, _Positions.Edit(), _Importance.Edit(), _LineOffsets.Edit(), _ID.Edit());
+
+		ComputeParameterization();
+
+		// optionally sort the lines along a space-filling curve
+		LineReorder::Apply(_Reordering, _Positions.Edit(), _Importance.Edit(), _AlphaWeights.Edit(), _LineOffsets.Edit(), _ID.Edit(),
+			_LineLengths.Edit(), _NumberOfControlPointsOfLine.Edit(), _ControlPointLineIndices.Edit(), _LineOrder.Edit());
+
+		WriteCache(path);
+	}
+
+	// Distributes the control points among the lines and computes the blending weight parameterization.
+	void ComputeParameterization()
+	{
+		if (_LineOffsets.empty()) return;
+
+		std::vector<float>& lineLengths = _LineLengths.Edit();
+		std::vector<int>& numberOfControlPointsOfLine = _NumberOfControlPointsOfLine.Edit();
+		std::vector<float>& alphaWeights = _AlphaWeights.Edit();
+		std::vector<unsigned int>& controlPointLineIndices = _ControlPointLineIndices.Edit();
+
+		// compute the arc length at every vertex (stored in the alpha weights) and the lengths of the lines
+		lineLengths.resize(_NumLines);
+		alphaWeights.resize(_Positions.size());
+		LineParameterization::ComputeArcLengths(_Positions.data(), _LineOffsets.data(), _NumLines, lineLengths.data(), alphaWeights.data());
+
+		// distribute the control points among the lines
+		numberOfControlPointsOfLine.resize(_NumLines);
+		ControlPointAllocator::Allocate(lineLengths.data(), _NumLines, _TotalNumberOfControlPoints, numberOfControlPointsOfLine.data());
+
+		// turn the arc lengths into the (alpha) control weights
+		LineParameterization::NormalizeArcLengths(_LineOffsets.data(), _NumLines, lineLengths.data(), numberOfControlPointsOfLine.data(), alphaWeights.data());
+
+		controlPointLineIndices.resize(_TotalNumberOfControlPoints);
+		LineParameterization::ComputeControlPointLineIndices(numberOfControlPointsOfLine.data(), _NumLines, controlPointLineIndices.data());
+	}
+
+	// Maps the cache of the line set and refers to its sections without copying. Returns false if there is no valid cache.
+	bool LoadCache(const std::string& path)
+	{
+		if (!LineCache::Open(path, _TotalNumberOfControlPoints, GetProcessingKey(), _CacheFile))
+			return false;
+
+		_NumLines = LineCache::GetHeader(_CacheFile)->NumLines;
+		AttachSection(_Positions, LineCache::POSITIONS);
+		AttachSection(_ID, LineCache::ID);
+		AttachSection(_Importance, LineCache::IMPORTANCE);
+		AttachSection(_AlphaWeights, LineCache::ALPHA_WEIGHTS);
+		AttachSection(_LineOffsets, LineCache::LINE_OFFSETS);
+		AttachSection(_LineLengths, LineCache::LINE_LENGTHS);
+		AttachSection(_NumberOfControlPointsOfLine, LineCache::NUM_CONTROL_POINTS_OF_LINE);
+		AttachSection(_ControlPointLineIndices, LineCache::CONTROL_POINT_LINE_INDICES);
+		AttachSection(_LineOrder, LineCache::LINE_ORDER);
+
+		// the importance comes from the 'vt' records, which may be missing for some or all vertices
+		size_t numVertices = _Positions.size();
+		bool consistent = _ID.size() == numVertices && _Importance.size() <= numVertices && _AlphaWeights.size() == numVertices
+			&& _LineOffsets.size() == (size_t)_NumLines + 1 && _LineLengths.size() == (size_t)_NumLines && _NumberOfControlPointsOfLine.size() == (size_t)_NumLines
+			&& _ControlPointLineIndices.size() == (size_t)_TotalNumberOfControlPoints && (_LineOrder.empty() || _LineOrder.size() == (size_t)_NumLines);
+		if (!consistent)
+		{
+			_NumLines = 0;
+			_Positions.clear(); _ID.clear(); _Importance.clear(); _AlphaWeights.clear();
+			_LineOffsets.clear(); _LineLengths.clear(); _NumberOfControlPointsOfLine.clear(); _ControlPointLineIndices.clear(); _LineOrder.clear();
+			_CacheFile.Close();
+			return false;
+		}
+
+		printf("Loaded %s: %i lines, %i vertices (cached)\n", LineCache::GetPath(path).c_str(), _NumLines, (int)numVertices);
+		return true;
+	}
+
+	template <typename T>
+	void AttachSection(CachedArray<T>& array, LineCache::Section section)
+	{
+		size_t count = 0;
+		const T* data = LineCache::GetSection<T>(_CacheFile, section, count);
+		array.Attach(data, count);
+	}
+
+	// Stores the preprocessed line set, so that the next run can skip parsing and parameterization.
+	void WriteCache(const std::string& path)
+	{
+		_CacheFile.Close();
+
+		uint64_t counts[LineCache::NUM_SECTIONS];
+		counts[LineCache::POSITIONS] = _Positions.size();
+		counts[LineCache::ID] = _ID.size();
+		counts[LineCache::IMPORTANCE] = _Importance.size();
+		counts[LineCache::ALPHA_WEIGHTS] = _AlphaWeights.size();
+		counts[LineCache::LINE_OFFSETS] = _LineOffsets.size();
+		counts[LineCache::LINE_LENGTHS] = _LineLengths.size();
+		counts[LineCache::NUM_CONTROL_POINTS_OF_LINE] = _NumberOfControlPointsOfLine.size();
+		counts[LineCache::CONTROL_POINT_LINE_INDICES] = _ControlPointLineIndices.size();
+		counts[LineCache::LINE_ORDER] = _LineOrder.size();
+
+		LineCache::Writer writer;
+		bool ok = writer.Begin(path, _TotalNumberOfControlPoints, GetProcessingKey(), _NumLines, counts)
+			&& writer.WriteSection(LineCache::POSITIONS, 0, _Positions.data(), _Positions.size())
+			&& writer.WriteSection(LineCache::ID, 0, _ID.data(), _ID.size())
+			&& writer.WriteSection(LineCache::IMPORTANCE, 0, _Importance.data(), _Importance.size())
+			&& writer.WriteSection(LineCache::ALPHA_WEIGHTS, 0, _AlphaWeights.data(), _AlphaWeights.size())
+			&& writer.WriteSection(LineCache::LINE_OFFSETS, 0, _LineOffsets.data(), _LineOffsets.size())
+			&& writer.WriteSection(LineCache::LINE_LENGTHS, 0, _LineLengths.data(), _LineLengths.size())
+			&& writer.WriteSection(LineCache::NUM_CONTROL_POINTS_OF_LINE, 0, _NumberOfControlPointsOfLine.data(), _NumberOfControlPointsOfLine.size())
+			&& writer.WriteSection(LineCache::CONTROL_POINT_LINE_INDICES, 0, _ControlPointLineIndices.data(), _ControlPointLineIndices.size())
+			&& writer.WriteSection(LineCache::LINE_ORDER, 0, _LineOrder.data(), _LineOrder.size())
+			&& writer.Finish();
+		if (!ok)
+			printf("Could not write the line cache %s\n", LineCache::GetPath(path).c_str());
+	}
+	
+
+	// Identifies the load-time processing in the cache.
+	uint64_t GetProcessingKey() const { return _Simplification.GetKey() | ((uint64_t)_Reordering << 48); }
+
+	int _TotalNumberOfControlPoints;
+	LineSimplifier::Settings _Simplification;
+	LineReorder::Curve _Reordering;
+
+	int _NumLines;
+
+	MappedFile _CacheFile;				// the arrays below either own their data or refer to this file
+
+	CachedArray<Vec3f> _Positions;
+	CachedArray<int> _ID;
+	CachedArray<float> _Importance;
+	CachedArray<float> _AlphaWeights;	// Blending weight parameterization
+	CachedArray<int> _LineOffsets;		// index of the first vertex of every line (plus the total number of vertices at the end)
+
+	CachedArray<float> _LineLengths;
+	CachedArray<int> _NumberOfControlPointsOfLine;
+	CachedArray<unsigned int> _ControlPointLineIndices;
+	CachedArray<int> _LineOrder;		// original index of every line (empty if not reordered)
+};
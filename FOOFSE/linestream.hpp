@@ -0,0 +1,209 @@
+#pragma once
+
+#include "objreader.hpp"
+#include "parameterization.hpp"
+#include "controlpoints.hpp"
+#include "linecache.hpp"
+#include "simplify.hpp"
+#include <vector>
+#include <string>
+#include <algorithm>
+
+// Loads a line set with bounded memory, for data sets that do not fit into the main memory.
+// The OBJ file is parsed once into scratch files (see ObjLineStream). Then the lines are resolved twice:
+//  1. The first pass computes the line lengths and distributes the control points.
+//  2. The second pass computes the blending weights and emits positions, IDs, importance and alpha weights in fixed-size blocks.
+// Per-vertex data is only held in the current block; per-line and per-control-point data is kept in memory.
+// The lines are simplified in both passes (see LineSimplifier), the importance only if every line has one value per vertex.
+// The results are identical to those of Lines::LoadLineSet.
+
+class LineSetStreamer
+{
+public:
+
+	// Per-line results of the first pass.
+	struct Layout
+	{
+		int NumLines;
+		int NumVertices;
+		int NumImportance;
+		std::vector<int> LineOffsets;		// first vertex of every line, plus the total number of vertices at the end
+		std::vector<float> LineLengths;
+		std::vector<int> NumberOfControlPointsOfLine;
+		std::vector<unsigned int> ControlPointLineIndices;
+	};
+
+	// The vertices [FirstVertex, FirstVertex + NumVertices) and importance values [FirstImportance, FirstImportance + NumImportance).
+	struct Block
+	{
+		int FirstVertex;
+		int NumVertices;
+		const Vec3f* Positions;
+		const int* ID;
+		const float* AlphaWeights;
+		int FirstImportance;
+		int NumImportance;
+		const float* Importance;
+	};
+
+	// Calls onLayout(const Layout&) after the first pass and onBlock(const Block&) for all blocks in order.
+	// Both return false to cancel. 'memoryBudget' (in bytes) bounds the text window while parsing and the block size.
+	template <typename LayoutFunc, typename BlockFunc>
+	static bool Stream(const std::string& path, int totalNumCPs, size_t memoryBudget, const LineSimplifier::Settings& simplification,
+		const LayoutFunc& onLayout, const BlockFunc& onBlock)
+	{
+		ObjLineStream stream;
+		if (!stream.Open(path, memoryBudget / 2))
+			return false;
+
+		// first pass: line lengths and control point distribution
+		Layout layout;
+		layout.NumLines = stream.GetNumLines();
+		layout.NumImportance = 0;
+		layout.LineOffsets.reserve(layout.NumLines + 1);
+		layout.LineOffsets.push_back(0);
+		layout.LineLengths.reserve(layout.NumLines);
+		const bool simplify = simplification.IsActive();
+		bool importancePerVertex = true;
+		std::vector<float> arcLength;
+		std::vector<Vec3f> simplePositions;
+		std::vector<float> simpleImportance;
+		stream.ForEachLine([&](int /*lineId*/, const Vec3f* positions, int numPositions, const float*, int numImportance) {
+			if (simplify)
+			{
+				simplePositions.clear();
+				LineSimplifier::SimplifyLine(simplification, positions, NULL, numPositions, simplePositions, simpleImportance);
+				importancePerVertex &= numImportance == numPositions;
+				positions = simplePositions.data();
+				numPositions = (int)simplePositions.size();
+			}
+			arcLength.resize(numPositions);
+			layout.LineLengths.push_back(LineParameterization::ComputeArcLength(positions, numPositions, arcLength.data()));
+			layout.LineOffsets.push_back(layout.LineOffsets.back() + numPositions);
+			layout.NumImportance += numImportance;
+			return true;
+		});
+		layout.NumVertices = layout.LineOffsets.back();
+		if (simplify)
+		{
+			if (!importancePerVertex && layout.NumImportance > 0)
+				printf("The importance does not have one value per vertex and is dropped by the simplification.\n");
+			layout.NumImportance = importancePerVertex && layout.NumImportance > 0 ? layout.NumVertices : 0;
+		}
+		const bool keepImportance = !simplify || layout.NumImportance > 0;
+
+		layout.NumberOfControlPointsOfLine.resize(layout.NumLines);
+		ControlPointAllocator::Allocate(layout.LineLengths.data(), layout.NumLines, totalNumCPs, layout.NumberOfControlPointsOfLine.data());
+		layout.ControlPointLineIndices.resize(totalNumCPs);
+		LineParameterization::ComputeControlPointLineIndices(layout.NumberOfControlPointsOfLine.data(), layout.NumLines, layout.ControlPointLineIndices.data());
+
+		if (!onLayout(layout))
+			return false;
+
+		// second pass: blending weights, emitted in blocks
+		const size_t bytesPerVertex = sizeof(Vec3f) + sizeof(int) + 2 * sizeof(float);
+		const int blockSize = (int)std::max((size_t)MIN_BLOCK_SIZE, std::min(memoryBudget / 4 / bytesPerVertex, (size_t)MAX_BLOCK_SIZE));
+		std::vector<Vec3f> positions(blockSize);
+		std::vector<int> ids(blockSize);
+		std::vector<float> alphaWeights(blockSize);
+		std::vector<float> importance(blockSize);
+		std::vector<float> lineAlphaWeights;
+
+		Block block;
+		block.FirstVertex = 0;
+		block.NumVertices = 0;
+		block.FirstImportance = 0;
+		block.NumImportance = 0;
+		block.Positions = positions.data();
+		block.ID = ids.data();
+		block.AlphaWeights = alphaWeights.data();
+		block.Importance = importance.data();
+
+		auto flush = [&]() {
+			if (block.NumVertices == 0 && block.NumImportance == 0) return true;
+			if (!onBlock((const Block&)block)) return false;
+			block.FirstVertex += block.NumVertices;
+			block.FirstImportance += block.NumImportance;
+			block.NumVertices = 0;
+			block.NumImportance = 0;
+			return true;
+		};
+
+		int cpOffset = 0;
+		bool ok = stream.ForEachLine([&](int lineId, const Vec3f* linePositions, int numPositions, const float* lineImportance, int numImportance) {
+			if (simplify)
+			{
+				simplePositions.clear();
+				simpleImportance.clear();
+				LineSimplifier::SimplifyLine(simplification, linePositions, keepImportance ? lineImportance : NULL, numPositions, simplePositions, simpleImportance);
+				linePositions = simplePositions.data();
+				numPositions = (int)simplePositions.size();
+				lineImportance = simpleImportance.data();
+				numImportance = (int)simpleImportance.size();
+			}
+			int numCp = layout.NumberOfControlPointsOfLine[lineId];
+			lineAlphaWeights.resize(numPositions);
+			if (numPositions > 0)
+				LineParameterization::ComputeAlphaWeights(linePositions, numPositions, layout.LineLengths[lineId], numCp, cpOffset, lineAlphaWeights.data());
+			cpOffset += numCp;
+
+			// a line can span several blocks
+			int v = 0, i = 0;
+			while (v < numPositions || i < numImportance)
+			{
+				if ((block.NumVertices == blockSize || block.NumImportance == blockSize) && !flush())
+					return false;
+
+				int count = std::min(numPositions - v, blockSize - block.NumVertices);
+				std::copy(linePositions + v, linePositions + v + count, positions.begin() + block.NumVertices);
+				std::copy(lineAlphaWeights.begin() + v, lineAlphaWeights.begin() + v + count, alphaWeights.begin() + block.NumVertices);
+				std::fill(ids.begin() + block.NumVertices, ids.begin() + block.NumVertices + count, lineId);
+				block.NumVertices += count;
+				v += count;
+
+				count = std::min(numImportance - i, blockSize - block.NumImportance);
+				std::copy(lineImportance + i, lineImportance + i + count, importance.begin() + block.NumImportance);
+				block.NumImportance += count;
+				i += count;
+			}
+			return true;
+		});
+		return ok && flush();
+	}
+
+	// Converts the line set into the cache file of Lines (see LineCache), without holding it in memory.
+	static bool WriteCache(const std::string& path, int totalNumCPs, size_t memoryBudget, const LineSimplifier::Settings& simplification = LineSimplifier::Settings())
+	{
+		LineCache::Writer writer;
+		bool ok = Stream(path, totalNumCPs, memoryBudget, simplification,
+			[&](const Layout& layout) {
+				uint64_t counts[LineCache::NUM_SECTIONS];
+				counts[LineCache::POSITIONS] = layout.NumVertices;
+				counts[LineCache::ID] = layout.NumVertices;
+				counts[LineCache::IMPORTANCE] = layout.NumImportance;
+				counts[LineCache::ALPHA_WEIGHTS] = layout.NumVertices;
+				counts[LineCache::LINE_OFFSETS] = layout.LineOffsets.size();
+				counts[LineCache::LINE_LENGTHS] = layout.LineLengths.size();
+				counts[LineCache::NUM_CONTROL_POINTS_OF_LINE] = layout.NumberOfControlPointsOfLine.size();
+				counts[LineCache::CONTROL_POINT_LINE_INDICES] = layout.ControlPointLineIndices.size();
+				counts[LineCache::LINE_ORDER] = 0;
+				return writer.Begin(path, totalNumCPs, simplification.GetKey(), layout.NumLines, counts)
+					&& writer.WriteSection(LineCache::LINE_OFFSETS, 0, layout.LineOffsets.data(), layout.LineOffsets.size())
+					&& writer.WriteSection(LineCache::LINE_LENGTHS, 0, layout.LineLengths.data(), layout.LineLengths.size())
+					&& writer.WriteSection(LineCache::NUM_CONTROL_POINTS_OF_LINE, 0, layout.NumberOfControlPointsOfLine.data(), layout.NumberOfControlPointsOfLine.size())
+					&& writer.WriteSection(LineCache::CONTROL_POINT_LINE_INDICES, 0, layout.ControlPointLineIndices.data(), layout.ControlPointLineIndices.size());
+			},
+			[&](const Block& block) {
+				return writer.WriteSection(LineCache::POSITIONS, block.FirstVertex, block.Positions, block.NumVertices)
+					&& writer.WriteSection(LineCache::ID, block.FirstVertex, block.ID, block.NumVertices)
+					&& writer.WriteSection(LineCache::ALPHA_WEIGHTS, block.FirstVertex, block.AlphaWeights, block.NumVertices)
+					&& writer.WriteSection(LineCache::IMPORTANCE, block.FirstImportance, block.Importance, block.NumImportance);
+			});
+		return ok && writer.Finish();
+	}
+
+private:
+
+	static const int MIN_BLOCK_SIZE = 1 << 12;
+	static const int MAX_BLOCK_SIZE = 1 << 24;
+};
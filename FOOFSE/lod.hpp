@@ -0,0 +1,255 @@
+#pragma once
+
+#include "math.hpp"
+#include "parallel.hpp"
+#include "simplify.hpp"
+#include <vector>
+#include <queue>
+#include <algorithm>
+#include <chrono>
+#include <stdio.h>
+#include <math.h>
+
+// Hierarchical level of detail of a line set, built once after loading.
+// The interior vertices of every line are ranked in Douglas-Peucker order (the farthest vertex of the coarsest range first).
+// Level k of a line keeps the first (n - 4) >> k of them, so that every level has about half the vertices of the previous one.
+// The first two and the last two vertices are always kept, since the line shaders only use them as neighbors of the inner segments.
+// Every level stores its exact world space error: the largest distance of a removed vertex to the simplified line.
+// Level 0 is the full line and is not stored.
+//
+// Per view, Select() picks for every line the coarsest level whose error, projected at the nearest point of the bounding sphere
+// of the line, stays below a pixel threshold. The result is a list of vertex indices, in line order.
+
+class LineLevelOfDetail
+{
+public:
+
+	struct Level
+	{
+		int FirstIndex;		// in the index array
+		int NumIndices;
+		float Error;		// in world space
+	};
+
+	LineLevelOfDetail() : _NumLines(0) {}
+
+	void Build(const Vec3f* positions, const int* lineOffsets, int numLines)
+	{
+		std::chrono::high_resolution_clock::time_point timeStart = std::chrono::high_resolution_clock::now();
+
+		// the size of every level only depends on the number of vertices of the line
+		_NumLines = numLines;
+		_LineOffsets.assign(lineOffsets, lineOffsets + numLines + 1);
+		_LineLevels.resize(numLines + 1);
+		_Levels.clear();
+		int numIndices = 0;
+		for (int lineId = 0; lineId < numLines; ++lineId)
+		{
+			_LineLevels[lineId] = (int)_Levels.size();
+			for (int removable = lineOffsets[lineId + 1] - lineOffsets[lineId] - 4; removable > 0; )
+			{
+				removable >>= 1;
+				Level level;
+				level.FirstIndex = numIndices;
+				level.NumIndices = 4 + removable;
+				level.Error = 0;
+				_Levels.push_back(level);
+				numIndices += level.NumIndices;
+			}
+		}
+		_LineLevels[numLines] = (int)_Levels.size();
+		_Indices.resize(numIndices);
+		_Bounds.resize(numLines);
+
+		// rank the vertices and fill the levels in parallel
+		ParallelFor(0, numLines, 256, [&](long long first, long long last) {
+			std::vector<int> rank;
+			for (int lineId = (int)first; lineId < (int)last; ++lineId)
+				BuildLine(positions, lineId, rank);
+		});
+
+		double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - timeStart).count();
+		printf("Built the level of detail of %i lines: %i levels, %i indices in %.3f s\n", numLines, (int)_Levels.size(), numIndices, seconds);
+	}
+
+	bool IsEmpty() const { return _LineLevels.empty(); }
+
+	// Writes the indices of the vertices to draw and returns their number.
+	// 'view' and 'projection' are the (row-major) camera matrices; a line is refined until its error projects to at most 'pixelThreshold' pixels.
+	// Lines with visible[lineId] == 0 are skipped (if 'visible' is not NULL).
+	int Select(const XMFLOAT4X4& view, const XMFLOAT4X4& projection, int screenHeight, float pixelThreshold, const unsigned char* visible, std::vector<unsigned int>& indices)
+	{
+		XMVECTOR determinant;
+		XMFLOAT4X4 viewInverse;
+		XMStoreFloat4x4(&viewInverse, XMMatrixInverse(&determinant, XMLoadFloat4x4(&view)));
+		Vec3f eye(viewInverse._41, viewInverse._42, viewInverse._43);
+
+		// world space error that projects to one pixel at distance 1
+		float errorPerPixel = 2.0f / (projection._22 * (float)screenHeight);
+		float errorThreshold = pixelThreshold * errorPerPixel;
+
+		// choose the levels and count the indices
+		_Selection.resize(_NumLines);
+		_SelectionOffsets.resize(_NumLines + 1);
+		ParallelFor(0, _NumLines, 1 << 12, [&](long long first, long long last) {
+			for (int lineId = (int)first; lineId < (int)last; ++lineId)
+			{
+				if (visible && !visible[lineId])
+				{
+					_Selection[lineId] = HIDDEN;
+					_SelectionOffsets[lineId + 1] = 0;
+					continue;
+				}
+				const Bounds& bounds = _Bounds[lineId];
+				float dx = bounds.Center.x - eye.x, dy = bounds.Center.y - eye.y, dz = bounds.Center.z - eye.z;
+				float distance = sqrtf(dx * dx + dy * dy + dz * dz) - bounds.Radius;
+
+				int selected = -1;	// full line
+				if (distance > 0)
+				{
+					float maxError = errorThreshold * distance;
+					for (int l = _LineLevels[lineId + 1] - 1; l >= _LineLevels[lineId]; --l)
+					{
+						if (_Levels[l].Error <= maxError)
+						{
+							selected = l;
+							break;
+						}
+					}
+				}
+				_Selection[lineId] = selected;
+				_SelectionOffsets[lineId + 1] = selected < 0 ? _LineOffsets[lineId + 1] - _LineOffsets[lineId] : _Levels[selected].NumIndices;
+			}
+		});
+		_SelectionOffsets[0] = 0;
+		for (int lineId = 0; lineId < _NumLines; ++lineId)
+			_SelectionOffsets[lineId + 1] += _SelectionOffsets[lineId];
+
+		// write the indices
+		int numSelected = _SelectionOffsets[_NumLines];
+		indices.resize(numSelected);
+		ParallelFor(0, _NumLines, 1 << 12, [&](long long first, long long last) {
+			for (int lineId = (int)first; lineId < (int)last; ++lineId)
+			{
+				unsigned int* out = indices.data() + _SelectionOffsets[lineId];
+				int selected = _Selection[lineId];
+				if (selected == HIDDEN)
+					continue;
+				if (selected < 0)
+				{
+					for (int v = _LineOffsets[lineId]; v < _LineOffsets[lineId + 1]; ++v)
+						*out++ = (unsigned int)v;
+				}
+				else std::copy(_Indices.begin() + _Levels[selected].FirstIndex, _Indices.begin() + _Levels[selected].FirstIndex + _Levels[selected].NumIndices, out);
+			}
+		});
+		return numSelected;
+	}
+
+private:
+
+	static const int HIDDEN = -2;
+
+	struct Bounds
+	{
+		Vec3f Center;
+		float Radius;
+	};
+
+	struct Range
+	{
+		Range(float distanceSq, int first, int last, int farthest) : DistanceSq(distanceSq), First(first), Last(last), Farthest(farthest) {}
+		float DistanceSq;
+		int First, Last, Farthest;
+
+		// the farthest vertex first, ties along the line
+		bool operator<(const Range& other) const { return DistanceSq < other.DistanceSq || (DistanceSq == other.DistanceSq && First > other.First); }
+	};
+
+	static Range MakeRange(const Vec3f* p, int first, int last)
+	{
+		Range range(-1, first, last, -1);
+		for (int i = first + 1; i < last; ++i)
+		{
+			float distanceSq = LineSimplifier::DistanceToSegmentSq(p[i], p[first], p[last]);
+			if (distanceSq > range.DistanceSq)
+			{
+				range.DistanceSq = distanceSq;
+				range.Farthest = i;
+			}
+		}
+		return range;
+	}
+
+	void BuildLine(const Vec3f* positions, int lineId, std::vector<int>& rank)
+	{
+		int lineBegin = _LineOffsets[lineId];
+		int n = _LineOffsets[lineId + 1] - lineBegin;
+		const Vec3f* p = positions + lineBegin;
+
+		// bounding sphere
+		Bounds& bounds = _Bounds[lineId];
+		if (n > 0)
+		{
+			Vec3f lo = p[0], hi = p[0];
+			for (int i = 1; i < n; ++i)
+			{
+				lo.x = std::min(lo.x, p[i].x); lo.y = std::min(lo.y, p[i].y); lo.z = std::min(lo.z, p[i].z);
+				hi.x = std::max(hi.x, p[i].x); hi.y = std::max(hi.y, p[i].y); hi.z = std::max(hi.z, p[i].z);
+			}
+			bounds.Center = Vec3f((lo.x + hi.x) * 0.5f, (lo.y + hi.y) * 0.5f, (lo.z + hi.z) * 0.5f);
+			bounds.Radius = 0.5f * sqrtf((hi.x - lo.x) * (hi.x - lo.x) + (hi.y - lo.y) * (hi.y - lo.y) + (hi.z - lo.z) * (hi.z - lo.z));
+		}
+		else bounds.Radius = 0;
+
+		if (_LineLevels[lineId] == _LineLevels[lineId + 1])
+			return;
+
+		// rank the vertices 2 ... n-3 by refining the range 1 ... n-2 in Douglas-Peucker order
+		rank.assign(n, 0);
+		std::priority_queue<Range> ranges;
+		ranges.push(MakeRange(p, 1, n - 2));
+		int nextRank = 0;
+		while (!ranges.empty())
+		{
+			Range range = ranges.top();
+			ranges.pop();
+			rank[range.Farthest] = nextRank++;
+			if (range.Farthest - range.First > 1) ranges.push(MakeRange(p, range.First, range.Farthest));
+			if (range.Last - range.Farthest > 1) ranges.push(MakeRange(p, range.Farthest, range.Last));
+		}
+
+		for (int l = _LineLevels[lineId]; l < _LineLevels[lineId + 1]; ++l)
+		{
+			Level& level = _Levels[l];
+			int keep = level.NumIndices - 4;
+			unsigned int* out = _Indices.data() + level.FirstIndex;
+			*out++ = lineBegin;
+			*out++ = lineBegin + 1;
+
+			// the largest distance of a removed vertex to the segment between its kept neighbors
+			float maxDistanceSq = 0;
+			int previous = 1;
+			for (int i = 2; i <= n - 2; ++i)
+			{
+				if (i < n - 2 && rank[i] >= keep) continue;
+				for (int r = previous + 1; r < i; ++r)
+					maxDistanceSq = std::max(maxDistanceSq, LineSimplifier::DistanceToSegmentSq(p[r], p[previous], p[i]));
+				*out++ = lineBegin + i;
+				previous = i;
+			}
+			*out++ = lineBegin + n - 1;
+			level.Error = sqrtf(maxDistanceSq);
+		}
+	}
+
+	int _NumLines;
+	std::vector<int> _LineOffsets;		// first vertex of every line (plus the total number of vertices)
+	std::vector<int> _LineLevels;		// first level of every line (plus the total number of levels)
+	std::vector<Level> _Levels;			// levels 1, 2, ... of every line, from fine to coarse
+	std::vector<unsigned int> _Indices;	// vertex indices of the levels
+	std::vector<Bounds> _Bounds;
+
+	std::vector<int> _Selection;			// selected level per line (-1 = full line, HIDDEN = not drawn)
+	std::vector<int> _SelectionOffsets;
+};
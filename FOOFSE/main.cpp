@@ -98,6 +98,12 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
 	Vec2i resolution(700, 700);
 	float q, r, lambda, stripWidth;
 	int totalNumCPs, smoothingIterations;
+	float lodPixelThreshold = 0.5f;		// maximal projected error of the simplified lines in pixels (0 = draw all vertices)
+	bool frustumCulling = true;			// skip the segments outside of the view frustum
+	LineReorder::Curve lineOrder = LineReorder::HILBERT;	// store spatially close lines close together in memory
+	Renderer::Estimator opacityEstimator = Renderer::ESTIMATOR_FOURIER;	// RAW is exact (sorted lists), FOURIER and FOM approximate
+	bool legacyShaders = false;			// shader_CreateLists_LowRes and shader_MinGather_LowRes instead of the FOM versions
+	Renderer::SmoothingMethod smoothingMethod = Renderer::SMOOTHING_JACOBI;	// DIRECT for one implicit step (a different kernel)
 	switch (datasetIndex)
 	{
 	default:
@@ -146,8 +152,13 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
 	// Initialize the objects
 	g_D3D = new D3D(hWnd);
 	g_Camera = new Camera(eye, lookAt, (float)resolution.x / (float)resolution.y, hWnd);
-	g_Lines = new Lines(path, totalNumCPs);
+	g_Lines = new Lines(path, totalNumCPs, 0, LineSimplifier::Settings(), lineOrder);
+	g_Lines->SetLevelOfDetail(lodPixelThreshold);
+	g_Lines->SetFrustumCulling(frustumCulling);
 	g_Renderer = new Renderer(q, r, lambda, stripWidth, smoothingIterations);
+	g_Renderer->SetOpacityEstimator(opacityEstimator);
+	g_Renderer->SetLegacyShaders(legacyShaders);
+	g_Renderer->SetSmoothingMethod(smoothingMethod);
 
 	// Create D3D resources
 	ID3D11Device* device = g_D3D->GetDevice();
@@ -184,10 +195,13 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
 
 		// update the camera
 		g_Camera->Update(elapsedS);
-		// render the scene
-		Render();
+		// render the scene, unless the view did not change and the alphas converged: the last image stays on screen
+		if (g_Renderer->IsIdle(g_D3D, g_Lines, g_Camera))
+			MsgWaitForMultipleObjects(0, NULL, FALSE, 15, QS_ALLINPUT);	// wake up on input, the camera polls the keys
+		else Render();
 
-		printf("\rfps: %i      ", (int)(1.0 / elapsedS));
+		printf("\rfps: %i, visible segments: %i / %i, long lists: %i / %i      ", (int)(1.0 / elapsedS), g_Lines->GetNumberOfVisibleSegments(), g_Lines->GetNumberOfSegments(),
+			g_Renderer->GetNumberOfLongListPixelsLowRes(), g_Renderer->GetNumberOfLongListPixels());
 		std::string newWindowTitleTemp = windowTitle + "      fps: " + std::to_string((int)(1.0 / elapsedS));
 		LPCSTR newWindowTitle = newWindowTitleTemp.c_str();
 		SetWindowText(hWnd, newWindowTitle);
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <string>
+#include <stddef.h>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// This class maps a file read-only into the address space of the process.
+// The pages are loaded on demand by the operating system, so no copy of the file content is made.
+
+class MappedFile
+{
+public:
+
+	MappedFile() : _Data(NULL), _Size(0)
+#ifdef _WIN32
+		, _File(INVALID_HANDLE_VALUE), _Mapping(NULL)
+#endif
+	{}
+
+	explicit MappedFile(const std::string& path) : MappedFile() { Open(path); }
+
+	~MappedFile() { Close(); }
+
+	// Maps the file. Returns false if the file does not exist or cannot be mapped.
+	bool Open(const std::string& path)
+	{
+		Close();
+#ifdef _WIN32
+		_File = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+		if (_File == INVALID_HANDLE_VALUE) return false;
+
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(_File, &size)) { Close(); return false; }
+		_Size = (size_t)size.QuadPart;
+		if (_Size == 0) return true;	// empty files can't be mapped, but they are valid.
+
+		_Mapping = CreateFileMappingA(_File, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (!_Mapping) { Close(); return false; }
+		_Data = (const char*)MapViewOfFile(_Mapping, FILE_MAP_READ, 0, 0, 0);
+		if (!_Data) { Close(); return false; }
+#else
+		int fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0) return false;
+
+		struct stat st;
+		if (fstat(fd, &st) != 0) { close(fd); return false; }
+		_Size = (size_t)st.st_size;
+		if (_Size == 0) { close(fd); return true; }
+
+		void* data = mmap(NULL, _Size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);	// the mapping keeps its own reference to the file
+		if (data == MAP_FAILED) { _Size = 0; return false; }
+		madvise(data, _Size, MADV_SEQUENTIAL);
+		_Data = (const char*)data;
+#endif
+		return true;
+	}
+
+	void Close()
+	{
+#ifdef _WIN32
+		if (_Data) UnmapViewOfFile(_Data);
+		if (_Mapping) CloseHandle(_Mapping);
+		if (_File != INVALID_HANDLE_VALUE) CloseHandle(_File);
+		_Mapping = NULL;
+		_File = INVALID_HANDLE_VALUE;
+#else
+		if (_Data) munmap((void*)_Data, _Size);
+#endif
+		_Data = NULL;
+		_Size = 0;
+	}
+
+	// Hints that [begin, begin + size) is not needed anymore. Its pages are removed from the working set
+	// and loaded from the file again if accessed. Only pages that lie completely inside the range are affected.
+	void Evict(const char* begin, size_t size) const
+	{
+#ifdef _WIN32
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		size_t pageSize = info.dwPageSize;
+#else
+		size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+#endif
+		size_t first = ((size_t)begin + pageSize - 1) / pageSize * pageSize;
+		size_t last = ((size_t)begin + size) / pageSize * pageSize;
+		if (last <= first) return;
+#ifdef _WIN32
+		VirtualUnlock((LPVOID)first, last - first);	// unlocking pages that are not locked removes them from the working set
+#else
+		madvise((void*)first, last - first, MADV_DONTNEED);
+#endif
+	}
+
+	const char* GetData() const { return _Data; }
+	size_t GetSize() const { return _Size; }
+
+private:
+
+	MappedFile(const MappedFile&);
+	MappedFile& operator=(const MappedFile&);
+
+	const char* _Data;
+	size_t _Size;
+
+#ifdef _WIN32
+	HANDLE _File;
+	HANDLE _Mapping;
+#endif
+};
@@ -0,0 +1,343 @@
+#pragma once
+
+#include "parallel.hpp"
+#include <vector>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <assert.h>
+#include <chrono>
+#include <algorithm>
+#include <string.h>
+#include <stdio.h>
+
+// Minimum of the alpha values per control point over all fragments, gathered from the tasks of the thread pool
+// (the CPU version of InterlockedMin on AlphaBufferUAV in the min gather). There are two strategies:
+// - ATOMIC: compare-and-swap on the float bits in a shared array (the bits of non-negative floats order like the floats).
+//   Cheap when the updates are spread over many control points, but threads that hit the same control point retry.
+// - LOCAL: every thread keeps the minima of the control points it touched in its own hash map, without any shared writes.
+//   End() merges the maps pairwise in a parallel tree (log2 of the number of threads rounds) and writes the result.
+// AUTO picks the strategy of the next gather from the statistics of the last one: LOCAL when the compare-and-swap had to retry
+// often and the maps stay small compared to the number of updates (few popular control points), ATOMIC otherwise (and always
+// with a single thread). LOCAL goes back to ATOMIC when the maps get too large to pay off.
+// Add() is called from tasks of ThreadPool::Global() or from the thread that calls Begin() and End(), one gather at a time:
+// all threads outside the pool share the last per-thread map, so other outside threads must not add (asserted).
+
+class MinGather
+{
+public:
+
+	enum Strategy
+	{
+		AUTO,
+		ATOMIC,
+		LOCAL
+	};
+
+	// AUTO switches to LOCAL if more than one in this many atomic updates had to retry ...
+	static const int LOCAL_RETRY_RATIO = 100;
+	// ... and every map entry takes this many updates (back to ATOMIC below half of it)
+	static const int LOCAL_UPDATES_PER_ENTRY = 16;
+
+	struct Statistics
+	{
+		Statistics() : NumUpdates(0), NumRetries(0), NumEntries(0), NumTouched(0), Used(ATOMIC), NumThreads(1), Seconds(0) {}
+
+		long long NumUpdates;		// calls of Add
+		long long NumRetries;		// failed compare-and-swap (ATOMIC)
+		long long NumEntries;		// entries of the thread-local maps before the merge (LOCAL)
+		int NumTouched;				// control points with at least one update
+		Strategy Used;
+		int NumThreads;
+		double Seconds;				// merge in End
+
+		double GetUpdatesPerPoint() const { return NumTouched > 0 ? (double)NumUpdates / NumTouched : 0.0; }
+
+		void Print() const
+		{
+			printf("Min gather (%s, %i threads): %lld updates of %i control points (%.1f each), %lld retries, merge %.3f ms\n",
+				Used == LOCAL ? "local" : "atomic", NumThreads, NumUpdates, NumTouched, GetUpdatesPerPoint(), NumRetries, Seconds * 1000);
+		}
+	};
+
+	explicit MinGather(Strategy strategy = AUTO) : _Strategy(strategy), _Current(strategy == LOCAL ? LOCAL : ATOMIC), _NumControlPoints(0) {}
+
+	void SetStrategy(Strategy strategy)
+	{
+		_Strategy = strategy;
+		if (strategy != AUTO) _Current = strategy;
+	}
+	Strategy GetStrategy() const { return _Strategy; }
+	// the strategy of the next gather
+	Strategy GetCurrentStrategy() const { return _Current; }
+	const Statistics& GetStatistics() const { return _Statistics; }
+	int GetNumberOfControlPoints() const { return _NumControlPoints; }
+
+	// Starts a gather: all control points are untouched.
+	void Begin(int numControlPoints)
+	{
+		if (numControlPoints != _NumControlPoints)
+		{
+			_Alphas.reset(new std::atomic<unsigned int>[numControlPoints]);
+			_NumControlPoints = numControlPoints;
+		}
+		ParallelFor(0, numControlPoints, 1 << 14, [&](long long first, long long last) {
+			for (long long cp = first; cp < last; ++cp)
+				_Alphas[cp].store(UNTOUCHED, std::memory_order_relaxed);
+		});
+
+		int numThreads = ThreadPool::Global().GetNumThreads();
+		if ((int)_Locals.size() != numThreads)
+			_Locals.resize(numThreads);
+		ThreadPool::Global().Run(numThreads, [&](int t) { _Locals[t].Clear(); });
+		_Owner = std::this_thread::get_id();
+	}
+
+	// Lowers the alpha of the control point (in [0, numControlPoints)) to 'alpha' >= 0.
+	inline void Add(int controlPoint, float alpha)
+	{
+		unsigned int bits;
+		memcpy(&bits, &alpha, sizeof(float));
+		int thread = ThreadPool::Global().GetThreadIndex();
+		assert(thread + 1 < (int)_Locals.size() || std::this_thread::get_id() == _Owner);
+		Local& local = _Locals[thread];
+		local.NumUpdates++;
+		if (_Current == LOCAL)
+		{
+			local.Map.Min(controlPoint, bits);
+			return;
+		}
+		std::atomic<unsigned int>& target = _Alphas[controlPoint];
+		unsigned int current = target.load(std::memory_order_relaxed);
+		while (bits < current && !target.compare_exchange_weak(current, bits, std::memory_order_relaxed))
+			local.NumRetries++;
+	}
+
+	// Finishes the gather: merges the thread-local maps (LOCAL), updates the statistics and, with AUTO, picks the next strategy.
+	void End()
+	{
+		std::chrono::high_resolution_clock::time_point timeStart = std::chrono::high_resolution_clock::now();
+		ThreadPool& pool = ThreadPool::Global();
+		int numThreads = (int)_Locals.size();
+
+		Statistics statistics;
+		statistics.Used = _Current;
+		statistics.NumThreads = numThreads;
+		for (const Local& local : _Locals)
+		{
+			statistics.NumUpdates += local.NumUpdates;
+			statistics.NumRetries += local.NumRetries;
+			statistics.NumEntries += local.Map.GetSize();
+		}
+
+		if (_Current == LOCAL)
+		{
+			// tree reduction: in every round, map i takes the minima of map i + step
+			for (int step = 1; step < numThreads; step *= 2)
+			{
+				pool.Run((numThreads + 2 * step - 1) / (2 * step), [&](int task) {
+					int i = task * 2 * step;
+					if (i + step < numThreads)
+						_Locals[i].Map.Merge(_Locals[i + step].Map);
+				});
+			}
+
+			// every control point is in the merged map once
+			const LocalMap& map = _Locals[0].Map;
+			ParallelFor(0, map.GetCapacity(), 1 << 12, [&](long long first, long long last) {
+				for (long long slot = first; slot < last; ++slot)
+				{
+					int cp = map.GetKey(slot);
+					if (cp != LocalMap::EMPTY)
+						_Alphas[cp].store(map.GetValue(slot), std::memory_order_relaxed);
+				}
+			});
+			statistics.NumTouched = map.GetSize();
+		}
+		else
+		{
+			std::atomic<int> numTouched(0);
+			ParallelFor(0, _NumControlPoints, 1 << 14, [&](long long first, long long last) {
+				int count = 0;
+				for (long long cp = first; cp < last; ++cp)
+					if (_Alphas[cp].load(std::memory_order_relaxed) != UNTOUCHED) count++;
+				numTouched += count;
+			});
+			statistics.NumTouched = numTouched;
+		}
+
+		statistics.Seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - timeStart).count();
+		_Statistics = statistics;
+
+		if (_Strategy == AUTO)
+		{
+			if (numThreads == 1)
+				_Current = ATOMIC;
+			else if (_Current == ATOMIC)
+			{
+				// at most every thread touches every control point
+				long long numEntries = (long long)numThreads * statistics.NumTouched;
+				if (statistics.NumRetries * LOCAL_RETRY_RATIO > statistics.NumUpdates && numEntries * LOCAL_UPDATES_PER_ENTRY <= statistics.NumUpdates)
+					_Current = LOCAL;
+			}
+			else if (statistics.NumEntries * LOCAL_UPDATES_PER_ENTRY > 2 * statistics.NumUpdates)
+				_Current = ATOMIC;
+		}
+	}
+
+	// The alpha values of the control points after End(). Control points without updates get 1.
+	void GetAlphas(std::vector<float>& alphas) const
+	{
+		alphas.resize(_NumControlPoints);
+		for (int cp = 0; cp < _NumControlPoints; ++cp)
+		{
+			unsigned int bits = _Alphas[cp].load(std::memory_order_relaxed);
+			if (bits == UNTOUCHED) alphas[cp] = 1;
+			else memcpy(&alphas[cp], &bits, sizeof(float));
+		}
+	}
+
+	// Gathers numUpdates random alpha values into numControlPoints control points with both strategies and prints the times.
+	// A fraction 'hotFraction' of the updates goes to the first 16 control points, to provoke contention.
+	// Returns whether both strategies give the same alphas.
+	static bool Benchmark(int numControlPoints, long long numUpdates, float hotFraction, int numFrames = 3)
+	{
+		ThreadPool& pool = ThreadPool::Global();
+		int numTasks = pool.GetNumThreads() * 4;
+		std::vector<float> alphas[2];
+		printf("Min gather benchmark: %lld updates of %i control points (%.0f%% on 16 of them), %i threads\n", numUpdates, numControlPoints,
+			hotFraction * 100, pool.GetNumThreads());
+		for (int s = 0; s < 2; ++s)
+		{
+			MinGather gather(s == 0 ? ATOMIC : LOCAL);
+			double seconds = 0;
+			for (int frame = 0; frame < numFrames; ++frame)
+			{
+				std::chrono::high_resolution_clock::time_point timeStart = std::chrono::high_resolution_clock::now();
+				gather.Begin(numControlPoints);
+				pool.Run(numTasks, [&](int task) {
+					unsigned int state = 2463534242u + task * 7919u;
+					long long first = numUpdates * task / numTasks, last = numUpdates * (task + 1) / numTasks;
+					for (long long u = first; u < last; ++u)
+					{
+						state ^= state << 13; state ^= state >> 17; state ^= state << 5;	// xorshift
+						bool hot = (state & 0xffff) < hotFraction * 65536;
+						int cp = (int)((state >> 8) % (unsigned int)(hot ? std::min(16, numControlPoints) : numControlPoints));
+						gather.Add(cp, (float)(state >> 9) / (float)(1u << 23));
+					}
+				});
+				gather.End();
+				seconds += std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - timeStart).count();
+			}
+			gather.GetAlphas(alphas[s]);
+			printf("  %-6s: %8.3f ms / frame, %lld retries, merge %.3f ms\n", s == 0 ? "atomic" : "local", seconds * 1000 / std::max(numFrames, 1),
+				gather.GetStatistics().NumRetries, gather.GetStatistics().Seconds * 1000);
+		}
+		printf("  results %s\n", alphas[0] == alphas[1] ? "match" : "differ");
+		return alphas[0] == alphas[1];
+	}
+
+private:
+
+	static const unsigned int UNTOUCHED = 0xffffffff;
+
+	// Open addressing hash map from control point to the bits of its minimal alpha, with linear probing.
+	class LocalMap
+	{
+	public:
+		static const int EMPTY = -1;
+
+		LocalMap() : _Size(0), _Shift(32) {}
+
+		int GetSize() const { return _Size; }
+		long long GetCapacity() const { return (long long)_Keys.size(); }
+		int GetKey(long long slot) const { return _Keys[slot]; }
+		unsigned int GetValue(long long slot) const { return _Values[slot]; }
+
+		// keeps the memory for the next gather
+		void Clear()
+		{
+			if (_Size > 0) std::fill(_Keys.begin(), _Keys.end(), (int)EMPTY);
+			_Size = 0;
+		}
+
+		inline void Min(int key, unsigned int value)
+		{
+			if (2 * (_Size + 1) > (int)_Keys.size()) Grow();
+			size_t mask = _Keys.size() - 1;
+			for (size_t slot = Hash(key); ; slot = (slot + 1) & mask)
+			{
+				if (_Keys[slot] == key)
+				{
+					_Values[slot] = std::min(_Values[slot], value);
+					return;
+				}
+				if (_Keys[slot] == EMPTY)
+				{
+					_Keys[slot] = key;
+					_Values[slot] = value;
+					_Size++;
+					return;
+				}
+			}
+		}
+
+		void Merge(const LocalMap& other)
+		{
+			for (size_t slot = 0; slot < other._Keys.size(); ++slot)
+				if (other._Keys[slot] != EMPTY)
+					Min(other._Keys[slot], other._Values[slot]);
+		}
+
+	private:
+
+		// Fibonacci hashing: the upper bits of the product index the table
+		inline size_t Hash(int key) const { return _Shift >= 32 ? 0 : (size_t)(((unsigned int)key * 2654435769u) >> _Shift); }
+
+		void Grow()
+		{
+			std::vector<int> keys;
+			std::vector<unsigned int> values;
+			keys.swap(_Keys);
+			values.swap(_Values);
+			size_t capacity = std::max((size_t)1024, keys.size() * 2);
+			_Keys.assign(capacity, (int)EMPTY);
+			_Values.resize(capacity);
+			_Shift = 32;
+			for (size_t c = capacity; c > 1; c >>= 1) _Shift--;
+			_Size = 0;
+			for (size_t slot = 0; slot < keys.size(); ++slot)
+				if (keys[slot] != EMPTY)
+					Min(keys[slot], values[slot]);
+		}
+
+		std::vector<int> _Keys;
+		std::vector<unsigned int> _Values;
+		int _Size;
+		int _Shift;
+	};
+
+	struct Local
+	{
+		Local() : NumUpdates(0), NumRetries(0) {}
+
+		void Clear()
+		{
+			Map.Clear();
+			NumUpdates = NumRetries = 0;
+		}
+
+		LocalMap Map;
+		long long NumUpdates;
+		long long NumRetries;
+		char Padding[64];		// keeps the counters of neighboring threads on different cache lines
+	};
+
+	Strategy _Strategy;
+	Strategy _Current;
+	Statistics _Statistics;
+	std::unique_ptr<std::atomic<unsigned int>[]> _Alphas;	// bits of the float alpha per control point
+	int _NumControlPoints;
+	std::thread::id _Owner;		// the thread of Begin, the only outside thread that adds
+	std::vector<Local> _Locals;								// per thread of the pool
+};
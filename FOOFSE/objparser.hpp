@@ -0,0 +1,188 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <string>
+
+// Allocation-free tokenizer for the records of a Wavefront OBJ line set ('v', 'vt' and 'l').
+// The functions operate on a [cur, end) character range (e.g., a memory-mapped file) and advance 'cur'.
+// The semantics follow the previous std::getline/sscanf_s/std::stringstream based reader:
+//  - ParseFloat reads what "%f" reads and rounds correctly, i.e., it returns the same value as strtof.
+//  - ParseInt reads what "stream >> int" reads and fails on overflow.
+
+class ObjParser
+{
+public:
+
+	static inline bool IsSpace(char c) { return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\v' || c == '\f'; }
+	static inline bool IsDigit(char c) { return (unsigned char)(c - '0') < 10; }
+
+	// Returns the end of the line starting at 'cur' (points to '\n' or to 'end').
+	static inline const char* FindLineEnd(const char* cur, const char* end)
+	{
+		const char* nl = (const char*)memchr(cur, '\n', end - cur);
+		return nl ? nl : end;
+	}
+
+	// Removes a trailing carriage return, as reading the file in text mode did.
+	static inline const char* TrimLineEnd(const char* begin, const char* lineEnd)
+	{
+		return (lineEnd > begin && lineEnd[-1] == '\r') ? lineEnd - 1 : lineEnd;
+	}
+
+	static bool ParseFloat(const char*& cur, const char* end, float& value)
+	{
+		const char* p = cur;
+		while (p < end && IsSpace(*p)) ++p;
+		const char* start = p;
+
+		bool negative = false;
+		if (p < end && (*p == '+' || *p == '-')) { negative = *p == '-'; ++p; }
+
+		uint64_t mantissa = 0;
+		int numDigits = 0;			// significant digits stored in the mantissa
+		int exponent = 0;
+		bool anyDigit = false;
+		bool truncated = false;
+
+		const char* digitsBegin = p;
+		while (p < end && IsDigit(*p))
+		{
+			if (numDigits < 19) { mantissa = mantissa * 10 + (*p - '0'); if (mantissa != 0) numDigits++; }
+			else { exponent++; truncated |= *p != '0'; }
+			anyDigit = true;
+			++p;
+		}
+		// hexadecimal floats are left to the C runtime
+		if (p < end && (*p == 'x' || *p == 'X') && p - digitsBegin == 1 && *digitsBegin == '0')
+			return ParseFloatFallback(cur, start, end, value);
+
+		if (p < end && *p == '.')
+		{
+			++p;
+			while (p < end && IsDigit(*p))
+			{
+				if (numDigits < 19) { mantissa = mantissa * 10 + (*p - '0'); exponent--; if (mantissa != 0) numDigits++; }
+				else truncated |= *p != '0';
+				anyDigit = true;
+				++p;
+			}
+		}
+
+		// "inf", "nan" and the like
+		if (!anyDigit)
+			return ParseFloatFallback(cur, start, end, value);
+
+		if (p < end && (*p == 'e' || *p == 'E'))
+		{
+			const char* e = p + 1;
+			bool expNegative = false;
+			if (e < end && (*e == '+' || *e == '-')) { expNegative = *e == '-'; ++e; }
+			if (e < end && IsDigit(*e))
+			{
+				int expValue = 0;
+				while (e < end && IsDigit(*e))
+				{
+					if (expValue < 100000) expValue = expValue * 10 + (*e - '0');
+					++e;
+				}
+				exponent += expNegative ? -expValue : expValue;
+				p = e;
+			}
+			// otherwise the 'e' is not part of the number
+		}
+
+		// fast path: mantissa and power of ten are exact doubles, so the division/multiplication is correctly rounded.
+		static const double pow10[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+			1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+		if (!truncated && mantissa <= (1ull << 53) && exponent >= -22 && exponent <= 22)
+		{
+			double d = (double)mantissa;
+			d = exponent < 0 ? d / pow10[-exponent] : d * pow10[exponent];
+
+			if (d == 0)
+			{
+				value = negative ? -0.0f : 0.0f;
+				cur = p;
+				return true;
+			}
+
+			// the conversion to float rounds a second time. This is only wrong if the double lies exactly
+			// halfway between two floats, and the float must not be denormalized or overflow.
+			uint64_t bits;
+			memcpy(&bits, &d, sizeof(bits));
+			bool halfway = (bits & 0x1FFFFFFFull) == 0x10000000ull;
+			if (!halfway && d >= FLT_MIN && d <= FLT_MAX)
+			{
+				value = negative ? -(float)d : (float)d;
+				cur = p;
+				return true;
+			}
+		}
+		return ParseFloatFallback(cur, start, end, value);
+	}
+
+	static bool ParseInt(const char*& cur, const char* end, int& value)
+	{
+		const char* p = cur;
+		while (p < end && IsSpace(*p)) ++p;
+
+		bool negative = false;
+		if (p < end && (*p == '+' || *p == '-')) { negative = *p == '-'; ++p; }
+		if (p >= end || !IsDigit(*p)) return false;
+
+		int64_t v = 0;
+		while (p < end && IsDigit(*p))
+		{
+			v = v * 10 + (*p - '0');
+			if (v > (int64_t)INT32_MAX + 1) return false;
+			++p;
+		}
+		if (negative) v = -v;
+		if (v > INT32_MAX || v < INT32_MIN) return false;
+
+		value = (int)v;
+		cur = p;
+		return true;
+	}
+
+	// Skips leading white space and the following word.
+	static inline void SkipWord(const char*& cur, const char* end)
+	{
+		while (cur < end && IsSpace(*cur)) ++cur;
+		while (cur < end && !IsSpace(*cur)) ++cur;
+	}
+
+private:
+
+	// Rare cases (hex floats, inf/nan, more than 19 significant digits, extreme exponents) go through strtof.
+	static bool ParseFloatFallback(const char*& cur, const char* start, const char* end, float& value)
+	{
+		// a number never contains white space, so the token ends there at the latest.
+		const char* tokenEnd = start;
+		while (tokenEnd < end && !IsSpace(*tokenEnd)) ++tokenEnd;
+
+		char buffer[128];
+		size_t length = (size_t)(tokenEnd - start);
+		if (length < sizeof(buffer))
+		{
+			memcpy(buffer, start, length);
+			buffer[length] = 0;
+			return StrToFloat(cur, start, buffer, value);
+		}
+		std::string token(start, tokenEnd);
+		return StrToFloat(cur, start, token.c_str(), value);
+	}
+
+	static bool StrToFloat(const char*& cur, const char* start, const char* token, float& value)
+	{
+		char* tokenEnd = NULL;
+		float v = strtof(token, &tokenEnd);
+		if (tokenEnd == token) return false;
+		value = v;
+		cur = start + (tokenEnd - token);
+		return true;
+	}
+};
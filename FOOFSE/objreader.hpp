@@ -0,0 +1,524 @@
+#pragma once
+
+#include "vec.hpp"
+#include "mappedfile.hpp"
+#include "objparser.hpp"
+#include "parallel.hpp"
+#include <vector>
+#include <string>
+#include <chrono>
+#include <stdio.h>
+
+// Reads the polylines of a Wavefront OBJ file ('v', 'vt' and 'l' records) into flat arrays.
+// The file is memory-mapped and split into newline-aligned chunks that are parsed in parallel.
+// The chunks are then merged with prefix sums, so that the result is identical to a sequential read:
+//  - 'l' records only see the 'v' and 'vt' records that precede them in the file.
+//  - OBJ indices are 1-based.
+//  - A point is dropped if it is closer than 0.0001 (squared distance) to the previously stored point,
+//    which carries over from one line to the next.
+
+class ObjLineReader
+{
+public:
+
+	struct LineData
+	{
+		std::vector<Vec3f> Positions;
+		std::vector<int> ID;				// line index per vertex
+		std::vector<float> Importance;		// importance per vertex (only if the OBJ has enough 'vt' records)
+		std::vector<int> LineOffsets;		// first vertex of every line, plus the total number of vertices at the end
+		int NumLines;
+	};
+
+	// Reads the file. Returns false if it can't be opened.
+	static bool Read(const std::string& path, LineData& out)
+	{
+		std::chrono::high_resolution_clock::time_point timeStart = std::chrono::high_resolution_clock::now();
+
+		out.Positions.clear();
+		out.ID.clear();
+		out.Importance.clear();
+		out.LineOffsets.assign(1, 0);
+		out.NumLines = 0;
+
+		MappedFile file;
+		if (!file.Open(path))
+		{
+			printf("Couldn't open the line set: %s\n", path.c_str());
+			return false;
+		}
+
+		// split the file into chunks that start at the beginning of a line
+		ThreadPool& pool = ThreadPool::Global();
+		const char* data = file.GetData();
+		size_t size = file.GetSize();
+		size_t numChunks = std::max((size_t)1, std::min(size / MIN_CHUNK_SIZE, (size_t)pool.GetNumThreads() * 8));
+		std::vector<const char*> chunkBegin = SplitIntoChunks(data, data + size, numChunks);
+
+		// parse the chunks in parallel
+		std::vector<Chunk> chunks(numChunks);
+		pool.Run((int)numChunks, [&](int c) { ParseChunk(chunkBegin[c], chunkBegin[c + 1], chunks[c]); });
+
+		// merge the OBJ vertices and tex coords
+		std::vector<Vec3f> vertices;
+		std::vector<float> objImportance;
+		{
+			int numVertices = 0, numImportance = 0, numLines = 0;
+			for (Chunk& chunk : chunks)
+			{
+				chunk.VertexBase = numVertices;			numVertices += (int)chunk.Vertices.size();
+				chunk.ImportanceBase = numImportance;	numImportance += (int)chunk.Importance.size();
+				chunk.LineBase = numLines;				numLines += chunk.NumLines();
+			}
+			vertices.resize(numVertices);
+			objImportance.resize(numImportance);
+			out.NumLines = numLines;
+
+			pool.Run((int)numChunks, [&](int c) {
+				Chunk& chunk = chunks[c];
+				std::copy(chunk.Vertices.begin(), chunk.Vertices.end(), vertices.begin() + chunk.VertexBase);
+				std::copy(chunk.Importance.begin(), chunk.Importance.end(), objImportance.begin() + chunk.ImportanceBase);
+				std::vector<Vec3f>().swap(chunk.Vertices);
+				std::vector<float>().swap(chunk.Importance);
+			});
+		}
+
+		// resolve the line indices. The point deduplication depends on the last point of the previous chunk,
+		// which is not known yet. We speculate that it is the last referenced vertex and repair afterwards.
+		for (size_t c = 0; c < numChunks; ++c)
+			chunks[c].LastIn = c == 0 ? Vec3f(0, 0, 0) : GuessLastPoint(chunks, c, vertices);
+
+		pool.Run((int)numChunks, [&](int c) {
+			Chunk& chunk = chunks[c];
+			Vec3f last = chunk.LastIn;
+			for (int l = 0; l < chunk.NumLines(); ++l)
+				ResolveLine(chunk, l, vertices, objImportance, last, chunk.Positions, chunk.OutImportance, chunk.LineSizes, chunk.LineImportanceSizes);
+			chunk.LastOut = last;
+		});
+
+		for (size_t c = 1; c < numChunks; ++c)
+			RepairChunk(chunks[c], chunks[c - 1].LastOut, vertices, objImportance);
+
+		// concatenate the chunk results
+		{
+			int numPositions = 0, numImportance = 0;
+			for (Chunk& chunk : chunks)
+			{
+				chunk.PositionBase = numPositions;			numPositions += (int)chunk.Positions.size();
+				chunk.OutImportanceBase = numImportance;	numImportance += (int)chunk.OutImportance.size();
+			}
+			out.Positions.resize(numPositions);
+			out.ID.resize(numPositions);
+			out.Importance.resize(numImportance);
+			out.LineOffsets.resize(out.NumLines + 1);
+			out.LineOffsets[out.NumLines] = numPositions;
+
+			pool.Run((int)numChunks, [&](int c) {
+				Chunk& chunk = chunks[c];
+				std::copy(chunk.Positions.begin(), chunk.Positions.end(), out.Positions.begin() + chunk.PositionBase);
+				std::copy(chunk.OutImportance.begin(), chunk.OutImportance.end(), out.Importance.begin() + chunk.OutImportanceBase);
+				int offset = chunk.PositionBase;
+				for (int l = 0; l < chunk.NumLines(); ++l)
+				{
+					int lineId = chunk.LineBase + l;
+					out.LineOffsets[lineId] = offset;
+					std::fill(out.ID.begin() + offset, out.ID.begin() + offset + chunk.LineSizes[l], lineId);
+					offset += chunk.LineSizes[l];
+				}
+			});
+		}
+
+		double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - timeStart).count();
+		double sizeMB = size / (1024.0 * 1024.0);
+		printf("Parsed %s: %i lines, %i vertices, %.1f MB in %.3f s (%.1f MB/s, %i chunks)\n", path.c_str(), out.NumLines, (int)out.Positions.size(),
+			sizeMB, seconds, seconds > 0 ? sizeMB / seconds : 0.0, (int)numChunks);
+		return true;
+	}
+
+private:
+
+	friend class ObjLineStream;
+
+	static const size_t MIN_CHUNK_SIZE = 1 << 20;
+	static const int OBJ_ZERO_BASED_SHIFT = -1;
+
+	struct Chunk
+	{
+		Chunk() : VertexBase(0), ImportanceBase(0), LineBase(0), PositionBase(0), OutImportanceBase(0) {}
+
+		int NumLines() const { return (int)LineIndexOffsets.size() - 1; }
+
+		// parsed records
+		std::vector<Vec3f> Vertices;
+		std::vector<float> Importance;
+		std::vector<int> Indices;				// OBJ indices of all 'l' records
+		std::vector<int> LineIndexOffsets;		// first entry in Indices per 'l' record (plus the end)
+		std::vector<int> LineNumVertices;		// number of 'v' records in this chunk before the 'l' record
+		std::vector<int> LineNumImportance;		// number of 'vt' records in this chunk before the 'l' record
+
+		// resolved lines
+		std::vector<Vec3f> Positions;
+		std::vector<float> OutImportance;
+		std::vector<int> LineSizes;
+		std::vector<int> LineImportanceSizes;
+		Vec3f LastIn, LastOut;
+
+		int VertexBase, ImportanceBase, LineBase, PositionBase, OutImportanceBase;
+	};
+
+	// Returns numChunks + 1 boundaries of chunks of [begin, end) that start at the beginning of a line.
+	static std::vector<const char*> SplitIntoChunks(const char* begin, const char* end, size_t numChunks)
+	{
+		size_t size = end - begin;
+		std::vector<const char*> chunkBegin(numChunks + 1, end);
+		chunkBegin[0] = begin;
+		for (size_t c = 1; c < numChunks; ++c)
+		{
+			const char* guess = std::max(chunkBegin[c - 1], begin + size / numChunks * c);
+			const char* lineEnd = ObjParser::FindLineEnd(guess, end);
+			chunkBegin[c] = lineEnd < end ? lineEnd + 1 : end;
+		}
+		return chunkBegin;
+	}
+
+	static void ParseChunk(const char* cur, const char* end, Chunk& chunk)
+	{
+		chunk.LineIndexOffsets.assign(1, 0);
+		while (cur < end)
+		{
+			const char* lineEnd = ObjParser::FindLineEnd(cur, end);
+			const char* line = cur;
+			const char* lineStop = ObjParser::TrimLineEnd(line, lineEnd);
+			cur = lineEnd < end ? lineEnd + 1 : end;
+
+			if (lineStop - line < 2) continue;
+			if (line[0] == 'v' && line[1] == ' ')	// read in vertex
+			{
+				Vec3f vertex;
+				const char* p = line + 1;
+				if (ObjParser::ParseFloat(p, lineStop, vertex.x) &&
+					ObjParser::ParseFloat(p, lineStop, vertex.y) &&
+					ObjParser::ParseFloat(p, lineStop, vertex.z))
+					chunk.Vertices.push_back(vertex);
+			}
+			else if (line[0] == 'v' && line[1] == 't')	// read in tex coord (aka importance)
+			{
+				float imp;
+				const char* p = line + 2;
+				if (ObjParser::ParseFloat(p, lineStop, imp))
+					chunk.Importance.push_back(imp);
+			}
+			else if (line[0] == 'l') // read in line indices
+			{
+				const char* p = line;
+				ObjParser::SkipWord(p, lineStop);
+				int index;
+				while (ObjParser::ParseInt(p, lineStop, index))
+					chunk.Indices.push_back(index);
+				chunk.LineIndexOffsets.push_back((int)chunk.Indices.size());
+				chunk.LineNumVertices.push_back((int)chunk.Vertices.size());
+				chunk.LineNumImportance.push_back((int)chunk.Importance.size());
+			}
+		}
+	}
+
+	// squared distance, in the same operation order as XMVector3LengthSq
+	static inline float DistanceSq(const Vec3f& a, const Vec3f& b)
+	{
+		float dx = a.x - b.x, dy = a.y - b.y, dz = a.z - b.z;
+		return (dx * dx + dy * dy) + dz * dz;
+	}
+
+	static inline bool IsSame(const Vec3f& a, const Vec3f& b)
+	{
+		return memcmp(&a, &b, sizeof(Vec3f)) == 0;
+	}
+
+	static void ResolveLine(const Chunk& chunk, int l, const std::vector<Vec3f>& vertices, const std::vector<float>& objImportance, Vec3f& last,
+		std::vector<Vec3f>& positions, std::vector<float>& importance, std::vector<int>& lineSizes, std::vector<int>& lineImportanceSizes)
+	{
+		// only the records before this line are visible
+		int numVertices = chunk.VertexBase + chunk.LineNumVertices[l];
+		int numImportance = chunk.ImportanceBase + chunk.LineNumImportance[l];
+		size_t numPositionsBefore = positions.size();
+		size_t numImportanceBefore = importance.size();
+		int first = chunk.LineIndexOffsets[l];
+		ResolveIndices(chunk.Indices.data() + first, chunk.LineIndexOffsets[l + 1] - first, numVertices, numImportance, vertices.data(), objImportance.data(), last, positions, importance);
+		lineSizes.push_back((int)(positions.size() - numPositionsBefore));
+		lineImportanceSizes.push_back((int)(importance.size() - numImportanceBefore));
+	}
+
+	// Appends the points of an 'l' record, of which only the first numVertices 'v' and numImportance 'vt' records are visible.
+	static void ResolveIndices(const int* indices, int numIndices, int numVertices, int numImportance, const Vec3f* vertices, const float* objImportance, Vec3f& last,
+		std::vector<Vec3f>& positions, std::vector<float>& importance)
+	{
+		for (int i = 0; i < numIndices; ++i)
+		{
+			int vertexId = indices[i] + OBJ_ZERO_BASED_SHIFT;
+			if (vertexId < 0 || vertexId >= numVertices) continue;
+			if (DistanceSq(vertices[vertexId], last) > 0.0001f)
+			{
+				last = vertices[vertexId];
+				positions.push_back(last);
+				if (vertexId < numImportance)
+					importance.push_back(objImportance[vertexId]);
+			}
+		}
+	}
+
+	// The last referenced vertex before chunk c. This is the last stored point, unless it was a duplicate.
+	static Vec3f GuessLastPoint(const std::vector<Chunk>& chunks, size_t c, const std::vector<Vec3f>& vertices)
+	{
+		while (c-- > 0)
+		{
+			const Chunk& chunk = chunks[c];
+			for (int l = chunk.NumLines() - 1; l >= 0; --l)
+			{
+				int numVertices = chunk.VertexBase + chunk.LineNumVertices[l];
+				for (int i = chunk.LineIndexOffsets[l + 1] - 1; i >= chunk.LineIndexOffsets[l]; --i)
+				{
+					int vertexId = chunk.Indices[i] + OBJ_ZERO_BASED_SHIFT;
+					if (vertexId >= 0 && vertexId < numVertices)
+						return vertices[vertexId];
+				}
+			}
+		}
+		return Vec3f(0, 0, 0);
+	}
+
+	// Resolves the lines of the chunk again if the speculated start point was wrong.
+	// Stops as soon as a line produces the same points as before, since everything after it is unaffected.
+	static void RepairChunk(Chunk& chunk, const Vec3f& lastIn, const std::vector<Vec3f>& vertices, const std::vector<float>& objImportance)
+	{
+		if (IsSame(chunk.LastIn, lastIn)) return;
+
+		std::vector<Vec3f> positions;
+		std::vector<float> importance;
+		std::vector<int> lineSizes, lineImportanceSizes;
+		Vec3f last = lastIn;
+		size_t specPosition = 0, specImportance = 0;
+		for (int l = 0; l < chunk.NumLines(); ++l)
+		{
+			size_t p0 = positions.size(), i0 = importance.size();
+			ResolveLine(chunk, l, vertices, objImportance, last, positions, importance, lineSizes, lineImportanceSizes);
+
+			int n = lineSizes[l], ni = lineImportanceSizes[l];
+			bool converged = n > 0 && n == chunk.LineSizes[l] && ni == chunk.LineImportanceSizes[l] &&
+				memcmp(&positions[p0], &chunk.Positions[specPosition], n * sizeof(Vec3f)) == 0 &&
+				(ni == 0 || memcmp(&importance[i0], &chunk.OutImportance[specImportance], ni * sizeof(float)) == 0);
+			specPosition += chunk.LineSizes[l];
+			specImportance += chunk.LineImportanceSizes[l];
+
+			if (converged)
+			{
+				positions.insert(positions.end(), chunk.Positions.begin() + specPosition, chunk.Positions.end());
+				importance.insert(importance.end(), chunk.OutImportance.begin() + specImportance, chunk.OutImportance.end());
+				lineSizes.insert(lineSizes.end(), chunk.LineSizes.begin() + l + 1, chunk.LineSizes.end());
+				lineImportanceSizes.insert(lineImportanceSizes.end(), chunk.LineImportanceSizes.begin() + l + 1, chunk.LineImportanceSizes.end());
+				last = chunk.LastOut;
+				break;
+			}
+		}
+
+		chunk.Positions.swap(positions);
+		chunk.OutImportance.swap(importance);
+		chunk.LineSizes.swap(lineSizes);
+		chunk.LineImportanceSizes.swap(lineImportanceSizes);
+		chunk.LastIn = lastIn;
+		chunk.LastOut = last;
+	}
+};
+
+// Reads the polylines of an OBJ file that can be larger than the main memory, with the same semantics as ObjLineReader.
+// Open() parses the file once, in windows of bounded size, and spills the 'v', 'vt' and 'l' records into binary scratch files
+// next to the source. ForEachLine() then resolves the lines in file order from the mapped scratch files and can be called repeatedly.
+
+class ObjLineStream
+{
+public:
+
+	ObjLineStream() : _NumLines(0) {}
+	~ObjLineStream() { Close(); }
+
+	// 'memoryBudget' bounds the text window (and thus the parsed records) that is held in memory at a time.
+	bool Open(const std::string& path, size_t memoryBudget)
+	{
+		Close();
+		std::chrono::high_resolution_clock::time_point timeStart = std::chrono::high_resolution_clock::now();
+
+		MappedFile file;
+		if (!file.Open(path))
+		{
+			printf("Couldn't open the line set: %s\n", path.c_str());
+			return false;
+		}
+
+		_ScratchPath = path + ".scratch";
+		Spill vertexSpill, importanceSpill, lineSpill;
+		if (!vertexSpill.Open(_ScratchPath + ".v") || !importanceSpill.Open(_ScratchPath + ".vt") || !lineSpill.Open(_ScratchPath + ".l"))
+		{
+			printf("Couldn't create the scratch files: %s.*\n", _ScratchPath.c_str());
+			Close();
+			return false;
+		}
+
+		// parse the file window by window. Each window is split into chunks that are parsed in parallel.
+		ThreadPool& pool = ThreadPool::Global();
+		const char* data = file.GetData();
+		const char* end = data + file.GetSize();
+		size_t windowSize = std::max((size_t)ObjLineReader::MIN_CHUNK_SIZE, memoryBudget / 4);	// the parsed records take up to about three times the text
+		int numVertices = 0, numImportance = 0;
+		bool ok = true;
+		for (const char* window = data; window < end && ok; )
+		{
+			const char* windowEnd = end;
+			if ((size_t)(end - window) > windowSize)
+			{
+				const char* lineEnd = ObjParser::FindLineEnd(window + windowSize, end);
+				windowEnd = lineEnd < end ? lineEnd + 1 : end;
+			}
+
+			size_t numChunks = std::max((size_t)1, std::min((size_t)(windowEnd - window) / ObjLineReader::MIN_CHUNK_SIZE, (size_t)pool.GetNumThreads() * 2));
+			std::vector<const char*> chunkBegin = ObjLineReader::SplitIntoChunks(window, windowEnd, numChunks);
+			std::vector<ObjLineReader::Chunk> chunks(numChunks);
+			pool.Run((int)numChunks, [&](int c) { ObjLineReader::ParseChunk(chunkBegin[c], chunkBegin[c + 1], chunks[c]); });
+
+			// append the records in file order. A line record stores the number of indices and the number of visible 'v' and 'vt' records.
+			for (const ObjLineReader::Chunk& chunk : chunks)
+			{
+				ok &= vertexSpill.Write(chunk.Vertices.data(), chunk.Vertices.size() * sizeof(Vec3f));
+				ok &= importanceSpill.Write(chunk.Importance.data(), chunk.Importance.size() * sizeof(float));
+				for (int l = 0; l < chunk.NumLines(); ++l)
+				{
+					int first = chunk.LineIndexOffsets[l];
+					int header[3] = { chunk.LineIndexOffsets[l + 1] - first, numVertices + chunk.LineNumVertices[l], numImportance + chunk.LineNumImportance[l] };
+					ok &= lineSpill.Write(header, sizeof(header));
+					ok &= lineSpill.Write(chunk.Indices.data() + first, header[0] * sizeof(int));
+				}
+				numVertices += (int)chunk.Vertices.size();
+				numImportance += (int)chunk.Importance.size();
+				_NumLines += chunk.NumLines();
+			}
+
+			file.Evict(window, windowEnd - window);
+			window = windowEnd;
+		}
+
+		ok &= vertexSpill.Close() && importanceSpill.Close() && lineSpill.Close();
+		ok = ok && _Vertices.Open(_ScratchPath + ".v") && _Importance.Open(_ScratchPath + ".vt") && _LineRecords.Open(_ScratchPath + ".l");
+		if (!ok)
+		{
+			printf("Couldn't write the scratch files: %s.*\n", _ScratchPath.c_str());
+			Close();
+			return false;
+		}
+
+		double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - timeStart).count();
+		double sizeMB = file.GetSize() / (1024.0 * 1024.0);
+		printf("Scanned %s: %i lines, %i OBJ vertices, %.1f MB in %.3f s (%.1f MB/s)\n", path.c_str(), _NumLines, numVertices,
+			sizeMB, seconds, seconds > 0 ? sizeMB / seconds : 0.0);
+		return true;
+	}
+
+	// Unmaps and deletes the scratch files.
+	void Close()
+	{
+		_Vertices.Close();
+		_Importance.Close();
+		_LineRecords.Close();
+		if (!_ScratchPath.empty())
+		{
+			remove((_ScratchPath + ".v").c_str());
+			remove((_ScratchPath + ".vt").c_str());
+			remove((_ScratchPath + ".l").c_str());
+			_ScratchPath.clear();
+		}
+		_NumLines = 0;
+	}
+
+	int GetNumLines() const { return _NumLines; }
+
+	// Calls func(lineId, positions, numPositions, importance, numImportance) for all lines in file order.
+	// The arrays are only valid during the call. func returns false to stop; ForEachLine then returns false as well.
+	template <typename Func>
+	bool ForEachLine(const Func& func) const
+	{
+		static const size_t EVICT_SIZE = 16 << 20;
+
+		const Vec3f* vertices = (const Vec3f*)_Vertices.GetData();
+		const float* objImportance = (const float*)_Importance.GetData();
+		const int* records = (const int*)_LineRecords.GetData();
+		const int* recordsEnd = records + _LineRecords.GetSize() / sizeof(int);
+		const char* evicted = _LineRecords.GetData();
+
+		std::vector<Vec3f> positions;
+		std::vector<float> importance;
+		Vec3f last(0, 0, 0);
+		for (int lineId = 0; records < recordsEnd; ++lineId)
+		{
+			int numIndices = records[0];
+			positions.clear();
+			importance.clear();
+			ObjLineReader::ResolveIndices(records + 3, numIndices, records[1], records[2], vertices, objImportance, last, positions, importance);
+			if (!func(lineId, positions.data(), (int)positions.size(), importance.data(), (int)importance.size()))
+				return false;
+			records += 3 + numIndices;
+
+			// the line records are read once per pass, so they don't need to stay in memory
+			if ((const char*)records - evicted > (ptrdiff_t)EVICT_SIZE)
+			{
+				_LineRecords.Evict(evicted, (const char*)records - evicted);
+				evicted = (const char*)records;
+			}
+		}
+		return true;
+	}
+
+private:
+
+	// Buffered appending to a scratch file.
+	class Spill
+	{
+	public:
+
+		Spill() : _File(NULL) {}
+		~Spill() { Close(); }
+
+		bool Open(const std::string& path)
+		{
+#ifdef _WIN32
+			if (fopen_s(&_File, path.c_str(), "wb") != 0) _File = NULL;
+#else
+			_File = fopen(path.c_str(), "wb");
+#endif
+			if (!_File) return false;
+			setvbuf(_File, NULL, _IOFBF, 1 << 20);
+			return true;
+		}
+
+		bool Write(const void* data, size_t size)
+		{
+			return size == 0 || fwrite(data, 1, size, _File) == size;
+		}
+
+		bool Close()
+		{
+			if (!_File) return true;
+			FILE* file = _File;
+			_File = NULL;
+			return fclose(file) == 0;
+		}
+
+	private:
+		FILE* _File;
+	};
+
+	ObjLineStream(const ObjLineStream&);
+	ObjLineStream& operator=(const ObjLineStream&);
+
+	std::string _ScratchPath;
+	MappedFile _Vertices;		// Vec3f per 'v' record
+	MappedFile _Importance;		// float per 'vt' record
+	MappedFile _LineRecords;	// per 'l' record: number of indices, number of visible 'v' and 'vt' records, indices
+	int _NumLines;
+};
@@ -0,0 +1,308 @@
+#pragma once
+
+#include "rasterizer.hpp"
+#include "fragmentsort.hpp"
+#include "fourier.hpp"
+#include "mingather.hpp"
+#include <vector>
+#include <chrono>
+#include <type_traits>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+
+// CPU version of the low-res opacity estimation: the per-control-point minimum of the alpha estimate over all fragments.
+// The estimators correspond to the pixel shaders of the min gather (OPACITY_ESTIMATOR_* in shader_Common.hlsli):
+// - RAW: as on the GPU, the fragments are stored per pixel (LineRasterizer::FragmentArrays) and sorted front to back. The sums of
+//   the squared importance in front of and behind every fragment are exact (PS_RAW). This is the reference for the others.
+// - FOURIER: the coefficients are sums over the fragments, so no lists are needed. The strips are rasterized twice: the first pass
+//   only accumulates (a_k, b_k) per pixel (a_0 / 2 is gall), the second pass evaluates G and the alpha of every fragment from the
+//   coefficients of its pixel. The memory is 2 K floats per pixel instead of a record per fragment, and there is no sort.
+// - FOM: the fragments are stored per pixel but not sorted, and the coefficients of every pixel are computed from its list
+//   and evaluated for each of its fragments (PS_FOM).
+// The estimator is chosen at runtime (SetEstimator) or at compile time (Optimize<RAW>(...)). The list based ones are policies
+// for OptimizeLists, which only differ in whether the lists are sorted and how the alpha values of a pixel are computed.
+// The alpha of a fragment goes to its control point through a MinGather, like InterlockedMin on the float bits in the shader.
+// The position along the series is the depth of the fragment (the shaders use the importance there, the depth is commented out).
+
+template <int K>
+class OpacityOptimizer
+{
+public:
+
+	enum Estimator
+	{
+		RAW,
+		FOURIER,
+		FOM
+	};
+
+	static const char* GetName(Estimator estimator)
+	{
+		return estimator == RAW ? "raw" : estimator == FOURIER ? "fourier" : "fom";
+	}
+
+	struct Settings
+	{
+		Settings() : Q(80), R(40), Lambda(1.5f), Gather(MinGather::AUTO) {}
+
+		LineRasterizer::Settings Raster;
+		float Q;			// as in the renderer parameters
+		float R;
+		float Lambda;
+		MinGather::Strategy Gather;	// reduction of the alpha values into the control points
+	};
+
+	struct Statistics
+	{
+		Statistics() : NumFragments(0), MemoryBytes(0), RasterSeconds(0), Seconds(0) {}
+
+		long long NumFragments;		// per rasterization pass
+		size_t MemoryBytes;			// fragment lists or coefficients
+		double RasterSeconds;		// all rasterization passes
+		double Seconds;
+
+		void Print() const
+		{
+			printf("Opacity estimation of %lld fragments in %.3f ms (rasterization %.3f ms), %.1f MB\n", NumFragments, Seconds * 1000,
+				RasterSeconds * 1000, MemoryBytes / (1024.0 * 1024.0));
+		}
+	};
+
+	// exact sums over the fragments sorted front to back
+	struct RawPolicy
+	{
+		static const bool SORTED = true;
+
+		static void ComputeAlphas(const float* g, const float* /*d*/, int n, const Settings& settings, float* alpha)
+		{
+			float gall = 0;
+			for (int i = 0; i < n; ++i)
+				gall += g[i] * g[i];
+			float gf = 0;
+			for (int i = 0; i < n; ++i)
+			{
+				float gb = gall - gf - g[i] * g[i];
+				float a = 1 / (1 + powf(std::max(1 - g[i], 0.0f), 2 * settings.Lambda) * (settings.R * gf + settings.Q * gb));
+				alpha[i] = std::min(std::max(a, 0.0f), 1.0f);
+				gf += g[i] * g[i];
+			}
+		}
+	};
+
+	// Fourier series of the pixel, computed from its list in any order
+	struct FomPolicy
+	{
+		static const bool SORTED = false;
+
+		static void ComputeAlphas(const float* g, const float* d, int n, const Settings& settings, float* alpha)
+		{
+			FourierOpacity::ComputeAlphas<K>(g, d, n, settings.Q, settings.R, settings.Lambda, alpha);
+		}
+	};
+
+	explicit OpacityOptimizer(const Settings& settings, Estimator estimator = FOURIER) :
+		_Settings(settings), _Estimator(estimator), _Rasterizer(settings.Raster), _Gather(settings.Gather) {}
+
+	void SetEstimator(Estimator estimator) { _Estimator = estimator; }
+	Estimator GetEstimator() const { return _Estimator; }
+	const Settings& GetSettings() const { return _Settings; }
+	const Statistics& GetStatistics() const { return _Statistics; }
+	const MinGather::Statistics& GetGatherStatistics() const { return _Gather.GetStatistics(); }
+
+	// Estimates the alpha of every control point from the line strips of the vertex arrays (as in LineRasterizer::Rasterize),
+	// with the estimator that was set.
+	void Optimize(const Vec3f* positions, const int* ids, const float* importance, const float* alphaWeights, int numVertices, int numControlPoints,
+		const Mat4f& view, const Mat4f& projection, const float* depthBuffer)
+	{
+		switch (_Estimator)
+		{
+		case RAW: Optimize<RAW>(positions, ids, importance, alphaWeights, numVertices, numControlPoints, view, projection, depthBuffer); break;
+		case FOM: Optimize<FOM>(positions, ids, importance, alphaWeights, numVertices, numControlPoints, view, projection, depthBuffer); break;
+		default: Optimize<FOURIER>(positions, ids, importance, alphaWeights, numVertices, numControlPoints, view, projection, depthBuffer); break;
+		}
+	}
+
+	// Same with the estimator fixed at compile time.
+	template <Estimator E>
+	void Optimize(const Vec3f* positions, const int* ids, const float* importance, const float* alphaWeights, int numVertices, int numControlPoints,
+		const Mat4f& view, const Mat4f& projection, const float* depthBuffer)
+	{
+		std::chrono::high_resolution_clock::time_point timeStart = std::chrono::high_resolution_clock::now();
+		_Statistics = Statistics();
+
+		_Gather.Begin(numControlPoints);
+		Estimate(std::integral_constant<Estimator, E>(), positions, ids, importance, alphaWeights, numVertices, view, projection, depthBuffer);
+		_Gather.End();
+
+		_Statistics.Seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - timeStart).count();
+	}
+
+	// The alpha values of the control points. Control points without fragments get 1.
+	void GetAlphas(std::vector<float>& alphas) const { _Gather.GetAlphas(alphas); }
+
+	// Runs every estimator numFrames times on the same input and prints the time per frame, the memory, and the mean and
+	// largest error of the alpha values against the exact RAW solution.
+	// Returns whether FOURIER and FOM, which evaluate the same series, agree to 1e-3 (only the order of the sums differs).
+	bool Benchmark(const Vec3f* positions, const int* ids, const float* importance, const float* alphaWeights, int numVertices, int numControlPoints,
+		const Mat4f& view, const Mat4f& projection, const float* depthBuffer, int numFrames = 3)
+	{
+		Estimator estimator = _Estimator;
+		std::vector<float> alphas[3];
+		Statistics statistics[3];
+		for (int e = RAW; e <= FOM; ++e)
+		{
+			_Estimator = (Estimator)e;
+			double seconds = 0, rasterSeconds = 0;
+			for (int frame = 0; frame < std::max(numFrames, 1); ++frame)
+			{
+				Optimize(positions, ids, importance, alphaWeights, numVertices, numControlPoints, view, projection, depthBuffer);
+				seconds += _Statistics.Seconds;
+				rasterSeconds += _Statistics.RasterSeconds;
+			}
+			statistics[e] = _Statistics;
+			statistics[e].Seconds = seconds / std::max(numFrames, 1);
+			statistics[e].RasterSeconds = rasterSeconds / std::max(numFrames, 1);
+			GetAlphas(alphas[e]);
+		}
+		_Estimator = estimator;
+
+		printf("Opacity estimation benchmark (K = %i): %lld fragments, %i control points, %i frames\n", K, statistics[RAW].NumFragments, numControlPoints, numFrames);
+		for (int e = RAW; e <= FOM; ++e)
+		{
+			double sumError = 0;
+			float maxError = 0;
+			for (int cp = 0; cp < numControlPoints; ++cp)
+			{
+				float error = fabsf(alphas[e][cp] - alphas[RAW][cp]);
+				sumError += error;
+				maxError = std::max(maxError, error);
+			}
+			printf("  %-7s: %8.3f ms / frame (rasterization %8.3f ms), %8.1f MB, alpha error mean %.2e max %.2e\n", GetName((Estimator)e),
+				statistics[e].Seconds * 1000, statistics[e].RasterSeconds * 1000, statistics[e].MemoryBytes / (1024.0 * 1024.0),
+				numControlPoints > 0 ? sumError / numControlPoints : 0.0, maxError);
+		}
+		float maxDifference = 0;
+		for (int cp = 0; cp < numControlPoints; ++cp)
+			maxDifference = std::max(maxDifference, fabsf(alphas[FOURIER][cp] - alphas[FOM][cp]));
+		printf("  fourier and fom differ by %.2e\n", maxDifference);
+		return maxDifference <= 1e-3f;
+	}
+
+private:
+
+	static inline float Clamp(float x) { return std::min(std::max(x, 0.001f), 0.999f); }
+
+	static inline float GetDepth(const LineRasterizer::FragmentData& fragment)
+	{
+		float depth;
+		memcpy(&depth, &fragment.Depth, sizeof(float));
+		return Clamp(depth);
+	}
+
+	// Lowers the alpha of the control point of the fragment (all half left and right belongs to the control point).
+	inline void MinAlpha(float alphaWeight, float alpha)
+	{
+		int controlPoint = (int)floorf(alphaWeight + 0.5f);
+		if (controlPoint < 0 || controlPoint >= _Gather.GetNumberOfControlPoints()) return;
+		_Gather.Add(controlPoint, alpha);
+	}
+
+	void Estimate(std::integral_constant<Estimator, RAW>, const Vec3f* positions, const int* ids, const float* importance, const float* alphaWeights,
+		int numVertices, const Mat4f& view, const Mat4f& projection, const float* depthBuffer)
+	{
+		OptimizeLists<RawPolicy>(positions, ids, importance, alphaWeights, numVertices, view, projection, depthBuffer);
+	}
+
+	void Estimate(std::integral_constant<Estimator, FOM>, const Vec3f* positions, const int* ids, const float* importance, const float* alphaWeights,
+		int numVertices, const Mat4f& view, const Mat4f& projection, const float* depthBuffer)
+	{
+		OptimizeLists<FomPolicy>(positions, ids, importance, alphaWeights, numVertices, view, projection, depthBuffer);
+	}
+
+	void Estimate(std::integral_constant<Estimator, FOURIER>, const Vec3f* positions, const int* ids, const float* importance, const float* alphaWeights,
+		int numVertices, const Mat4f& view, const Mat4f& projection, const float* depthBuffer)
+	{
+		OptimizeTwoPass(positions, ids, importance, alphaWeights, numVertices, view, projection, depthBuffer);
+	}
+
+	template <typename Policy>
+	void OptimizeLists(const Vec3f* positions, const int* ids, const float* importance, const float* alphaWeights, int numVertices,
+		const Mat4f& view, const Mat4f& projection, const float* depthBuffer)
+	{
+		_Rasterizer.Rasterize(positions, ids, importance, alphaWeights, numVertices, view, projection, depthBuffer, _Arrays);
+		_Statistics.RasterSeconds = _Rasterizer.GetStatistics().Seconds;
+		_Statistics.NumFragments = _Rasterizer.GetStatistics().NumFragments;
+		_Statistics.MemoryBytes = _Arrays.Offsets.size() * sizeof(unsigned int) + _Arrays.Fragments.size() * sizeof(LineRasterizer::FragmentData);
+
+		size_t numPixels = (size_t)_Arrays.Width * _Arrays.Height;
+		if (Policy::SORTED)
+			_Sorter.Sort(_Arrays.Offsets.data(), numPixels, _Arrays.Fragments.data());
+
+		ParallelFor(0, (long long)numPixels, 1 << 10, [&](long long first, long long last) {
+			std::vector<float> g, d, alpha;
+			for (long long pixel = first; pixel < last; ++pixel)
+			{
+				unsigned int begin = _Arrays.Offsets[pixel], count = _Arrays.Offsets[pixel + 1] - begin;
+				if (count == 0) continue;
+				g.resize(count);
+				d.resize(count);
+				alpha.resize(count);
+				const LineRasterizer::FragmentData* fragments = &_Arrays.Fragments[begin];
+				for (unsigned int i = 0; i < count; ++i)
+				{
+					g[i] = Clamp(fragments[i].Importance);
+					d[i] = GetDepth(fragments[i]);
+				}
+				Policy::ComputeAlphas(g.data(), d.data(), (int)count, _Settings, alpha.data());
+				for (unsigned int i = 0; i < count; ++i)
+					MinAlpha(fragments[i].AlphaWeight, alpha[i]);
+			}
+		});
+	}
+
+	void OptimizeTwoPass(const Vec3f* positions, const int* ids, const float* importance, const float* alphaWeights, int numVertices,
+		const Mat4f& view, const Mat4f& projection, const float* depthBuffer)
+	{
+		size_t numPixels = (size_t)_Settings.Raster.Width * _Settings.Raster.Height;
+		_Coefficients.assign(numPixels * 2 * K, 0.0f);
+		_Statistics.MemoryBytes = _Coefficients.size() * sizeof(float);
+		float* coefficients = _Coefficients.data();
+
+		// pass 1: the coefficients of the pixels
+		_Rasterizer.RasterizeStream(positions, ids, importance, alphaWeights, numVertices, view, projection, depthBuffer,
+			[&](unsigned int pixel, const LineRasterizer::FragmentData& fragment) {
+				float* a = coefficients + (size_t)pixel * 2 * K;
+				FourierOpacity::AccumulateFragment<K>(Clamp(fragment.Importance), GetDepth(fragment), a, a + K);
+			});
+		_Statistics.RasterSeconds = _Rasterizer.GetStatistics().Seconds;
+		_Statistics.NumFragments = _Rasterizer.GetStatistics().NumFragments;
+
+		ParallelFor(0, (long long)numPixels, 1 << 12, [&](long long first, long long last) {
+			for (long long pixel = first; pixel < last; ++pixel)
+			{
+				float* a = coefficients + (size_t)pixel * 2 * K;
+				FourierOpacity::ScaleCoefficients<K>(a, a + K, a, a + K);
+			}
+		});
+
+		// pass 2: the alpha of every fragment
+		_Rasterizer.RasterizeStream(positions, ids, importance, alphaWeights, numVertices, view, projection, depthBuffer,
+			[&](unsigned int pixel, const LineRasterizer::FragmentData& fragment) {
+				const float* as = coefficients + (size_t)pixel * 2 * K;
+				float gi = Clamp(fragment.Importance);
+				float G = FourierOpacity::EvaluateFragment<K>(GetDepth(fragment), as, as + K);
+				MinAlpha(fragment.AlphaWeight, FourierOpacity::Alpha(gi, G, as[0], _Settings.Q, _Settings.R, _Settings.Lambda));
+			});
+		_Statistics.RasterSeconds += _Rasterizer.GetStatistics().Seconds;
+	}
+
+	Settings _Settings;
+	Estimator _Estimator;
+	Statistics _Statistics;
+	LineRasterizer _Rasterizer;
+	FragmentSorter _Sorter;
+	LineRasterizer::FragmentArrays _Arrays;					// RAW and FOM: lists
+	std::vector<float> _Coefficients;						// FOURIER: a_0 ... a_K-1, b_0 ... b_K-1 per pixel
+	MinGather _Gather;
+};
@@ -0,0 +1,197 @@
+#pragma once
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <vector>
+#include <algorithm>
+
+// A fixed set of worker threads that executes indexed tasks.
+// Run() blocks until all tasks are done; the calling thread helps with the work.
+// Calls from inside a task run serially on the calling worker, so nesting is safe.
+
+class ThreadPool
+{
+public:
+
+	explicit ThreadPool(int numThreads = 0) : _Current(NULL), _Generation(0), _Stop(false)
+	{
+		if (numThreads <= 0)
+			numThreads = std::max(1, (int)std::thread::hardware_concurrency());
+		for (int i = 0; i < numThreads - 1; ++i)	// the calling thread is the last worker
+			_Workers.push_back(std::thread(&ThreadPool::WorkerLoop, this, i));
+	}
+
+	~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(_Mutex);
+			_Stop = true;
+		}
+		_WakeUp.notify_all();
+		for (auto& worker : _Workers)
+			worker.join();
+	}
+
+	// Process-wide pool using all hardware threads.
+	static ThreadPool& Global()
+	{
+		static ThreadPool pool;
+		return pool;
+	}
+
+	int GetNumThreads() const { return (int)_Workers.size() + 1; }
+
+	// Index of the calling thread in [0, GetNumThreads()): the workers of this pool have 0 ... n - 2, any other thread
+	// has n - 1 (the thread that calls Run works as the last worker). Used to address per-thread data from inside tasks:
+	// Run lets only one outside thread at a time execute tasks, also on the serial path, so n - 1 is never shared.
+	int GetThreadIndex() const
+	{
+		const WorkerId& id = CurrentWorker();
+		return id.Pool == this ? id.Index : (int)_Workers.size();
+	}
+
+	// Calls func(task) for all tasks in [0, numTasks).
+	template <typename Func>
+	void Run(int numTasks, const Func& func)
+	{
+		if (numTasks <= 0) return;
+		if (IsInsideTask())
+		{
+			for (int task = 0; task < numTasks; ++task)
+				func(task);
+			return;
+		}
+
+		std::lock_guard<std::mutex> runLock(_RunMutex);	// one job (and one outside thread in the tasks) at a time
+
+		if (numTasks == 1 || _Workers.empty())
+		{
+			bool& insideTask = IsInsideTask();
+			insideTask = true;
+			for (int task = 0; task < numTasks; ++task)
+				func(task);
+			insideTask = false;
+			return;
+		}
+
+		std::function<void(int)> function = func;
+		Job job(function, numTasks);
+		{
+			std::lock_guard<std::mutex> lock(_Mutex);
+			_Current = &job;
+			_Generation++;
+		}
+		_WakeUp.notify_all();
+
+		Work(job);
+
+		// wait until all tasks are done and no worker is still looking at the job.
+		std::unique_lock<std::mutex> lock(_Mutex);
+		_Current = NULL;
+		_Done.wait(lock, [&job]() { return job.Remaining == 0 && job.Users == 0; });
+	}
+
+private:
+
+	struct Job
+	{
+		Job(const std::function<void(int)>& function, int numTasks) : Function(function), NumTasks(numTasks), Next(0), Remaining(numTasks), Users(0) {}
+		const std::function<void(int)>& Function;
+		const int NumTasks;
+		std::atomic<int> Next;
+		std::atomic<int> Remaining;
+		int Users;	// guarded by _Mutex
+	};
+
+	struct WorkerId
+	{
+		const ThreadPool* Pool;
+		int Index;
+	};
+
+	static WorkerId& CurrentWorker()
+	{
+		static thread_local WorkerId id = { NULL, 0 };
+		return id;
+	}
+
+	static bool& IsInsideTask()
+	{
+		static thread_local bool insideTask = false;
+		return insideTask;
+	}
+
+	void Work(Job& job)
+	{
+		bool& insideTask = IsInsideTask();
+		insideTask = true;
+		for (;;)
+		{
+			int task = job.Next.fetch_add(1);
+			if (task >= job.NumTasks) break;
+			job.Function(task);
+			job.Remaining.fetch_sub(1);
+		}
+		insideTask = false;
+	}
+
+	void WorkerLoop(int index)
+	{
+		CurrentWorker().Pool = this;
+		CurrentWorker().Index = index;
+		unsigned long long seenGeneration = 0;
+		for (;;)
+		{
+			Job* job = NULL;
+			{
+				std::unique_lock<std::mutex> lock(_Mutex);
+				_WakeUp.wait(lock, [&]() { return _Stop || _Generation != seenGeneration; });
+				if (_Stop) return;
+				seenGeneration = _Generation;
+				job = _Current;
+				if (!job) continue;
+				job->Users++;
+			}
+
+			Work(*job);
+
+			{
+				std::lock_guard<std::mutex> lock(_Mutex);
+				job->Users--;
+			}
+			_Done.notify_all();
+		}
+	}
+
+	ThreadPool(const ThreadPool&);
+	ThreadPool& operator=(const ThreadPool&);
+
+	std::vector<std::thread> _Workers;
+	std::mutex _RunMutex;
+	std::mutex _Mutex;
+	std::condition_variable _WakeUp;
+	std::condition_variable _Done;
+	Job* _Current;
+	unsigned long long _Generation;
+	bool _Stop;
+};
+
+// Splits [begin, end) into contiguous ranges and calls func(rangeBegin, rangeEnd) for each of them in parallel.
+// 'grainSize' is the minimal number of elements per range.
+template <typename Func>
+void ParallelFor(long long begin, long long end, long long grainSize, const Func& func)
+{
+	long long count = end - begin;
+	if (count <= 0) return;
+	ThreadPool& pool = ThreadPool::Global();
+	long long maxTasks = (long long)pool.GetNumThreads() * 4;	// a few tasks per thread for load balancing
+	long long numTasks = std::max(1ll, std::min(maxTasks, count / std::max(1ll, grainSize)));
+	pool.Run((int)numTasks, [&](int task) {
+		long long rangeBegin = begin + count * task / numTasks;
+		long long rangeEnd = begin + count * (task + 1) / numTasks;
+		func(rangeBegin, rangeEnd);
+	});
+}
@@ -0,0 +1,201 @@
+#pragma once
+
+#include "vec.hpp"
+#include "parallel.hpp"
+#include <vector>
+#include <algorithm>
+#include <math.h>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
+#if defined(__AVX__) || defined(__SSE2__) || defined(_M_X64) || defined(_M_IX86)
+#include <emmintrin.h>
+#define PARAMETERIZATION_SSE
+#endif
+
+// The steps of the blending weight parameterization.
+// They are shared by the in-memory loader (Lines) and the streaming loader (LineSetStreamer).
+// Every segment length is computed once: the arc length at every vertex is stored in the alpha weight array,
+// which is normalized in place after the control points have been distributed.
+
+class LineParameterization
+{
+public:
+
+	// Length of the segment a-b, in the operation order of XMVector3Length (SSE2 path): sqrt((x*x + z*z) + y*y).
+	static inline float SegmentLength(const Vec3f& a, const Vec3f& b)
+	{
+		float dx = a.x - b.x, dy = a.y - b.y, dz = a.z - b.z;
+		return sqrtf((dx * dx + dz * dz) + dy * dy);
+	}
+
+	// Writes the arc length at every vertex of a line (starting with 0) and returns the length of the line.
+	// Segments with an invalid length are skipped in the line length.
+	static float ComputeArcLength(const Vec3f* positions, int numPositions, float* arcLength)
+	{
+		if (numPositions <= 0) return 0;
+
+		float currLength = 0;
+		float length = 0;
+		arcLength[0] = 0;
+		int id = 0;
+#ifdef PARAMETERIZATION_SSE
+		// segment lengths in SIMD registers, the prefix sum in order (so that the rounding matches the scalar sum)
+		float segments[8];
+#if defined(__AVX__)
+		for (; id + 8 < numPositions; id += 8)
+		{
+			_mm256_storeu_ps(segments, SegmentLengths8(positions + id));
+			for (int k = 0; k < 8; ++k)
+				Accumulate(segments[k], currLength, length, arcLength[id + k + 1]);
+		}
+#endif
+		for (; id + 4 < numPositions; id += 4)
+		{
+			_mm_storeu_ps(segments, SegmentLengths4(positions + id));
+			for (int k = 0; k < 4; ++k)
+				Accumulate(segments[k], currLength, length, arcLength[id + k + 1]);
+		}
+#endif
+		for (; id < numPositions - 1; ++id)
+			Accumulate(SegmentLength(positions[id], positions[id + 1]), currLength, length, arcLength[id + 1]);
+		return length;
+	}
+
+	// Turns the arc lengths of a non-empty line into blending weights: the position between the control points cpOffset ... cpOffset + numCp - 1.
+	static void NormalizeArcLength(float* weights, int numPositions, float lineLength, int numCp, int cpOffset)
+	{
+		float scale = (float)(numCp - 1);
+		float maxWeight = numCp - 1 - 0.0001f;
+		float offset = (float)cpOffset;
+		weights[0] = offset;
+		int id = 1;
+#ifdef PARAMETERIZATION_SSE
+		__m128 vLength = _mm_set1_ps(lineLength);
+		__m128 vScale = _mm_set1_ps(scale);
+		__m128 vMaxWeight = _mm_set1_ps(maxWeight);
+		__m128 vOffset = _mm_set1_ps(offset);
+		for (; id + 4 <= numPositions; id += 4)
+		{
+			__m128 w = _mm_mul_ps(_mm_div_ps(_mm_loadu_ps(weights + id), vLength), vScale);
+			w = _mm_min_ps(vMaxWeight, w);	// same as std::min(w, maxWeight), also for NaN
+			_mm_storeu_ps(weights + id, _mm_add_ps(w, vOffset));
+		}
+#endif
+		for (; id < numPositions; ++id)
+			weights[id] = std::min(weights[id] / lineLength * scale, maxWeight) + offset;
+	}
+
+	// Blending weights of the vertices of a non-empty line.
+	static void ComputeAlphaWeights(const Vec3f* positions, int numPositions, float lineLength, int numCp, int cpOffset, float* alphaWeights)
+	{
+		ComputeArcLength(positions, numPositions, alphaWeights);
+		NormalizeArcLength(alphaWeights, numPositions, lineLength, numCp, cpOffset);
+	}
+
+	// Computes the lengths of all lines and the arc length at every vertex in parallel.
+	static void ComputeArcLengths(const Vec3f* positions, const int* lineOffsets, int numLines, float* lineLengths, float* arcLengths)
+	{
+		ForEachLine(lineOffsets, numLines, [&](int lineId) {
+			int lineBegin = lineOffsets[lineId];
+			lineLengths[lineId] = ComputeArcLength(positions + lineBegin, lineOffsets[lineId + 1] - lineBegin, arcLengths + lineBegin);
+		});
+	}
+
+	// Turns the arc lengths of all lines into blending weights in parallel.
+	static void NormalizeArcLengths(const int* lineOffsets, int numLines, const float* lineLengths, const int* numberOfControlPointsOfLine, float* weights)
+	{
+		std::vector<int> cpOffsets(numLines);
+		int cpOffset = 0;
+		for (int lineId = 0; lineId < numLines; ++lineId)
+		{
+			cpOffsets[lineId] = cpOffset;
+			cpOffset += numberOfControlPointsOfLine[lineId];
+		}
+
+		ForEachLine(lineOffsets, numLines, [&](int lineId) {
+			int lineBegin = lineOffsets[lineId];
+			int lineEnd = lineOffsets[lineId + 1];
+			if (lineBegin < lineEnd)
+				NormalizeArcLength(weights + lineBegin, lineEnd - lineBegin, lineLengths[lineId], numberOfControlPointsOfLine[lineId], cpOffsets[lineId]);
+		});
+	}
+
+	// Stores for every control point the index of its line.
+	static void ComputeControlPointLineIndices(const int* numberOfControlPointsOfLine, int numLines, unsigned int* controlPointLineIndices)
+	{
+		int cpID = 0;
+		for (int lineID = 0; lineID < numLines; ++lineID)
+		{
+			for (int i = 0; i < numberOfControlPointsOfLine[lineID]; ++i)
+				controlPointLineIndices[cpID++] = lineID;
+		}
+	}
+
+private:
+
+	static inline void Accumulate(float l, float& currLength, float& length, float& arcLength)
+	{
+		currLength += l;
+		arcLength = currLength;
+		if (l < 999999999)
+			length += l;
+	}
+
+	// Calls func(lineId) for all lines in parallel. Every task gets the lines that start in an equally-sized range of vertices.
+	template <typename Func>
+	static void ForEachLine(const int* lineOffsets, int numLines, const Func& func)
+	{
+		int numVertices = lineOffsets[numLines];
+		if (numVertices == 0)
+		{
+			for (int lineId = 0; lineId < numLines; ++lineId)
+				func(lineId);
+			return;
+		}
+		ParallelFor(0, numVertices, 1 << 16, [&](long long begin, long long end) {
+			int first = (int)(std::lower_bound(lineOffsets, lineOffsets + numLines, begin) - lineOffsets);
+			int last = end == numVertices ? numLines : (int)(std::lower_bound(lineOffsets, lineOffsets + numLines, end) - lineOffsets);
+			for (int lineId = first; lineId < last; ++lineId)
+				func(lineId);
+		});
+	}
+
+#ifdef PARAMETERIZATION_SSE
+	// Differences p[k] - p[k + 1] of the four segments starting at p[0] ... p[3] as structure of arrays (reads p[0] ... p[4]).
+	static inline void SegmentDifferences4(const Vec3f* p, __m128& x, __m128& y, __m128& z)
+	{
+		const float* f = (const float*)p;
+		__m128 d0 = _mm_sub_ps(_mm_loadu_ps(f + 0), _mm_loadu_ps(f + 3));	// x0 y0 z0 x1
+		__m128 d1 = _mm_sub_ps(_mm_loadu_ps(f + 4), _mm_loadu_ps(f + 7));	// y1 z1 x2 y2
+		__m128 d2 = _mm_sub_ps(_mm_loadu_ps(f + 8), _mm_loadu_ps(f + 11));	// z2 x3 y3 z3
+
+		x = _mm_shuffle_ps(d0, _mm_shuffle_ps(d1, d2, _MM_SHUFFLE(1, 0, 2, 2)), _MM_SHUFFLE(3, 0, 3, 0));
+		y = _mm_shuffle_ps(_mm_shuffle_ps(d0, d1, _MM_SHUFFLE(0, 0, 1, 1)), _mm_shuffle_ps(d1, d2, _MM_SHUFFLE(2, 2, 3, 3)), _MM_SHUFFLE(2, 0, 2, 0));
+		z = _mm_shuffle_ps(_mm_shuffle_ps(d0, d1, _MM_SHUFFLE(1, 1, 2, 2)), d2, _MM_SHUFFLE(3, 0, 2, 0));
+	}
+
+	// Lengths of the four segments starting at p[0] ... p[3].
+	static inline __m128 SegmentLengths4(const Vec3f* p)
+	{
+		__m128 x, y, z;
+		SegmentDifferences4(p, x, y, z);
+		return _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(z, z)), _mm_mul_ps(y, y)));
+	}
+
+#if defined(__AVX__)
+	// Lengths of the eight segments starting at p[0] ... p[7] (reads p[0] ... p[8]).
+	static inline __m256 SegmentLengths8(const Vec3f* p)
+	{
+		__m128 x0, y0, z0, x1, y1, z1;
+		SegmentDifferences4(p, x0, y0, z0);
+		SegmentDifferences4(p + 4, x1, y1, z1);
+		__m256 x = _mm256_insertf128_ps(_mm256_castps128_ps256(x0), x1, 1);
+		__m256 y = _mm256_insertf128_ps(_mm256_castps128_ps256(y0), y1, 1);
+		__m256 z = _mm256_insertf128_ps(_mm256_castps128_ps256(z0), z1, 1);
+		return _mm256_sqrt_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(x, x), _mm256_mul_ps(z, z)), _mm256_mul_ps(y, y)));
+	}
+#endif
+#endif
+};
@@ -0,0 +1,664 @@
+#pragma once
+
+#include "vec.hpp"
+#include "parallel.hpp"
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+
+// CPU version of the low-res fragment list pass (shader_CreateLists_LowRes_FOM.hlsl), for machines without a GPU.
+// Every segment is expanded into the same view-aligned strip quad as the geometry shader (offset by StripWidth in view space,
+// rejected unless the line IDs of all four vertices of the primitive match) and rasterized with the depth of the pixel shader.
+// The result are either per-pixel fragment lists in the layout of the GPU buffers, or compressed sparse rows (CSR) that store
+// the fragments of every pixel contiguously in exactly sized arrays. Or the fragments are not stored at all, but handed to a visitor.
+//
+// The screen is split into tiles. First, chunks of segments are binned in parallel into the tiles that their quads overlap.
+// Then every tile is rasterized by one thread, so that its pixels need no synchronization. The stored outputs rasterize the tiles
+// twice: the first pass only counts the fragments, so that the second one writes them straight into exactly sized arrays.
+// Vertices are snapped to 1/256 pixel like on the GPU, and the pixel centers are tested exactly with integer edge functions
+// and the top-left rule, so that the two triangles of a quad never both cover a pixel.
+
+class LineRasterizer
+{
+public:
+
+	struct Settings
+	{
+		Settings() : Width(0), Height(0), StripWidth(0.00015f), HaloPortion(0.7f), TileSize(32) {}
+
+		int Width;			// in pixels
+		int Height;
+		float StripWidth;	// as in the renderer parameters
+		float HaloPortion;
+		int TileSize;		// in pixels
+	};
+
+	// Same layout as Renderer::FragmentDataLowRes.
+	struct FragmentData
+	{
+		unsigned int Depth;		// bits of the (positive) float depth
+		float AlphaWeight;
+		float Importance;
+	};
+
+	// Same layout as Renderer::FragmentLinkLowRes.
+	struct FragmentLink
+	{
+		FragmentData Data;
+		unsigned int Next;		// next fragment of the pixel, END for the last one
+	};
+
+	static const unsigned int END = 0xffffffff;
+
+	// StartOffset[y * Width + x] is the first fragment of the pixel, like the start offset buffer.
+	struct FragmentLists
+	{
+		FragmentLists() : Width(0), Height(0) {}
+
+		int Width;
+		int Height;
+		std::vector<unsigned int> StartOffset;
+		std::vector<FragmentLink> Fragments;
+	};
+
+	// The fragments of pixel p = y * Width + x are Fragments[Offsets[p]] ... Fragments[Offsets[p + 1] - 1], in drawing order.
+	// The fragments are counted per pixel before they are stored, so nothing is dropped and there is no buffer besides the offsets.
+	struct FragmentArrays
+	{
+		FragmentArrays() : Width(0), Height(0) {}
+
+		int Width;
+		int Height;
+		std::vector<unsigned int> Offsets;
+		std::vector<FragmentData> Fragments;
+	};
+
+	struct Statistics
+	{
+		Statistics() : NumSegments(0), NumFragments(0), Seconds(0) {}
+
+		int NumSegments;		// segments that passed the line ID test
+		long long NumFragments;
+		double Seconds;
+
+		void Print() const
+		{
+			printf("Rasterized %i segments into %lld fragments in %.3f ms (%.1f M fragments/s)\n", NumSegments, NumFragments, Seconds * 1000,
+				Seconds > 0 ? NumFragments / Seconds * 1e-6 : 0.0);
+		}
+	};
+
+	explicit LineRasterizer(const Settings& settings) : _Settings(settings) {}
+
+	const Settings& GetSettings() const { return _Settings; }
+	const Statistics& GetStatistics() const { return _Statistics; }
+
+	// Rasterizes the line strips of the vertex arrays (drawn as in Lines::DrawLowRes) with the (row-major) camera matrices.
+	// A fragment is kept if it is in front of the depth buffer (one float per pixel, or NULL for a cleared buffer).
+	// Like on the GPU, new fragments are inserted at the front of the lists.
+	void Rasterize(const Vec3f* positions, const int* ids, const float* importance, const float* alphaWeights, int numVertices,
+		const Mat4f& view, const Mat4f& projection, const float* depthBuffer, FragmentLists& lists)
+	{
+		std::chrono::high_resolution_clock::time_point timeStart = std::chrono::high_resolution_clock::now();
+		Input input = { positions, ids, importance, alphaWeights, &view, &projection, depthBuffer };
+		int numSegments = CountFragments(input, numVertices, NULL);
+
+		// every tile links its fragments from its first index on, the tiles own disjoint pixels
+		lists.Width = _Settings.Width;
+		lists.Height = _Settings.Height;
+		lists.StartOffset.assign((size_t)lists.Width * lists.Height, (unsigned int)END);
+		lists.Fragments.resize(_TileOffsets.back());
+		ThreadPool::Global().Run(_TilesX * _TilesY, [&](int t) {
+			unsigned int index = (unsigned int)_TileOffsets[t];
+			RasterizeTile(input, t, [&](unsigned int pixel, const FragmentData& data) {
+				FragmentLink& link = lists.Fragments[index];
+				link.Data = data;
+				link.Next = lists.StartOffset[pixel];
+				lists.StartOffset[pixel] = index++;
+			});
+		});
+
+		UpdateStatistics(numSegments, (long long)_TileOffsets.back(), timeStart);
+	}
+
+	// Same as above, but stores the fragments contiguously per pixel: a first pass only counts the fragments of every pixel,
+	// the counts are summed up to the offsets of the pixels, and a second pass writes every fragment to its final place.
+	void Rasterize(const Vec3f* positions, const int* ids, const float* importance, const float* alphaWeights, int numVertices,
+		const Mat4f& view, const Mat4f& projection, const float* depthBuffer, FragmentArrays& arrays)
+	{
+		std::chrono::high_resolution_clock::time_point timeStart = std::chrono::high_resolution_clock::now();
+		Input input = { positions, ids, importance, alphaWeights, &view, &projection, depthBuffer };
+		arrays.Width = _Settings.Width;
+		arrays.Height = _Settings.Height;
+		size_t numPixels = (size_t)arrays.Width * arrays.Height;
+		arrays.Offsets.assign(numPixels + 1, 0);
+		int numSegments = CountFragments(input, numVertices, arrays.Offsets.data());
+		for (size_t pixel = 0; pixel < numPixels; ++pixel)
+			arrays.Offsets[pixel + 1] += arrays.Offsets[pixel];
+
+		// the second pass emits the fragments of a tile in the same (drawing) order
+		arrays.Fragments.resize(arrays.Offsets[numPixels]);
+		_Cursors.assign(arrays.Offsets.begin(), arrays.Offsets.end() - 1);
+		ThreadPool::Global().Run(_TilesX * _TilesY, [&](int t) {
+			RasterizeTile(input, t, [&](unsigned int pixel, const FragmentData& data) {
+				arrays.Fragments[_Cursors[pixel]++] = data;
+			});
+		});
+
+		UpdateStatistics(numSegments, (long long)_TileOffsets.back(), timeStart);
+	}
+
+	// Same as above, but without storing the fragments: visitor(pixel, fragment) is called for every fragment, per pixel in drawing order.
+	// The tiles are processed in parallel and own disjoint pixels, so the visitor may update per-pixel data without synchronization.
+	template <typename Visitor>
+	void RasterizeStream(const Vec3f* positions, const int* ids, const float* importance, const float* alphaWeights, int numVertices,
+		const Mat4f& view, const Mat4f& projection, const float* depthBuffer, const Visitor& visitor)
+	{
+		std::chrono::high_resolution_clock::time_point timeStart = std::chrono::high_resolution_clock::now();
+		Input input = { positions, ids, importance, alphaWeights, &view, &projection, depthBuffer };
+		int numSegments = BinSegments(input, numVertices);
+
+		int numTiles = _TilesX * _TilesY;
+		std::vector<long long> tileFragments(numTiles, 0);
+		ThreadPool::Global().Run(numTiles, [&](int t) {
+			long long count = 0;
+			RasterizeTile(input, t, [&](unsigned int pixel, const FragmentData& data) {
+				visitor(pixel, data);
+				count++;
+			});
+			tileFragments[t] = count;
+		});
+
+		long long numFragments = 0;
+		for (int t = 0; t < numTiles; ++t)
+			numFragments += tileFragments[t];
+		UpdateStatistics(numSegments, numFragments, timeStart);
+	}
+
+	// Rasterizes into lists, into arrays and as a stream and prints the times. Returns whether all three give the same fragments:
+	// the lists in reverse drawing order, the arrays in drawing order, and the stream the same number and depths per pixel.
+	bool Benchmark(const Vec3f* positions, const int* ids, const float* importance, const float* alphaWeights, int numVertices,
+		const Mat4f& view, const Mat4f& projection, const float* depthBuffer)
+	{
+		FragmentLists lists;
+		FragmentArrays arrays;
+		Rasterize(positions, ids, importance, alphaWeights, numVertices, view, projection, depthBuffer, lists);
+		Statistics statisticsLists = _Statistics;
+		Rasterize(positions, ids, importance, alphaWeights, numVertices, view, projection, depthBuffer, arrays);
+		Statistics statisticsArrays = _Statistics;
+		size_t numPixels = (size_t)_Settings.Width * _Settings.Height;
+		std::vector<unsigned int> streamCounts(numPixels, 0);
+		std::vector<unsigned long long> streamDepths(numPixels, 0);
+		RasterizeStream(positions, ids, importance, alphaWeights, numVertices, view, projection, depthBuffer, [&](unsigned int pixel, const FragmentData& data) {
+			streamCounts[pixel]++;
+			streamDepths[pixel] += data.Depth;
+		});
+		Statistics statisticsStream = _Statistics;
+
+		size_t wrong = 0;
+		for (size_t pixel = 0; pixel < numPixels; ++pixel)
+		{
+			unsigned int begin = arrays.Offsets[pixel], end = arrays.Offsets[pixel + 1];
+			bool same = streamCounts[pixel] == end - begin;
+			unsigned long long depths = 0;
+			unsigned int index = lists.StartOffset[pixel];
+			for (unsigned int i = end; i > begin && same; --i)
+			{
+				same = index != END && memcmp(&lists.Fragments[index].Data, &arrays.Fragments[i - 1], sizeof(FragmentData)) == 0;
+				if (same) index = lists.Fragments[index].Next;
+				depths += arrays.Fragments[i - 1].Depth;
+			}
+			if (!same || index != END || depths != streamDepths[pixel]) wrong++;
+		}
+
+		printf("Rasterizer benchmark: %i x %i pixels, %i segments, %lld fragments\n", _Settings.Width, _Settings.Height,
+			statisticsArrays.NumSegments, statisticsArrays.NumFragments);
+		printf("  lists : %8.3f ms\n  arrays: %8.3f ms\n  stream: %8.3f ms\n  %zu pixels differ\n", statisticsLists.Seconds * 1000,
+			statisticsArrays.Seconds * 1000, statisticsStream.Seconds * 1000, wrong);
+		return wrong == 0 && statisticsLists.NumFragments == statisticsArrays.NumFragments && statisticsStream.NumFragments == statisticsArrays.NumFragments;
+	}
+
+private:
+
+	static const int CHUNK_SIZE = 1 << 12;		// primitives per binning task
+	static const int SUBPIXEL_BITS = 8;
+	static const int SUBPIXELS = 1 << SUBPIXEL_BITS;
+	static const int GUARD_BAND = 8;			// triangles are clipped at GUARD_BAND times the viewport, which keeps the fixed-point coordinates small
+	static const int MAX_POLYGON = 9;			// a triangle clipped at 6 planes
+
+	struct Input
+	{
+		const Vec3f* Positions;
+		const int* IDs;
+		const float* Importance;
+		const float* AlphaWeights;
+		const Mat4f* View;
+		const Mat4f* Projection;
+		const float* DepthBuffer;
+	};
+
+	// Attributes of a strip vertex, interpolated linearly in clip space while clipping.
+	enum Attribute
+	{
+		CLIP_X, CLIP_Y, CLIP_Z, CLIP_W,
+		VIEW_X, VIEW_Y, VIEW_Z,
+		ALPHA_WEIGHT,
+		IMPORTANCE,
+		TEXCOORD,
+		NUM_ATTRIBUTES
+	};
+
+	struct Vertex
+	{
+		float a[NUM_ATTRIBUTES];
+	};
+
+	// Tiles of one chunk of primitives: the segments of tile t are Items[Offsets[t]] ... Items[Offsets[t + 1] - 1].
+	struct Bins
+	{
+		std::vector<int> Offsets;
+		std::vector<int> Items;
+		std::vector<std::pair<int, int> > Pairs;	// (tile, primitive) before sorting
+	};
+
+	static void Transform(const Mat4f& m, float x, float y, float z, float out[4])
+	{
+		for (int c = 0; c < 4; ++c)
+			out[c] = x * m.m[0][c] + y * m.m[1][c] + z * m.m[2][c] + m.m[3][c];
+	}
+
+	// The strip quad of primitive j (the segment between the vertices j + 1 and j + 2), as emitted by the geometry shader.
+	bool BuildQuad(const Input& input, int j, Vertex quad[4]) const
+	{
+		const int* id = input.IDs + j;
+		if (id[0] != id[2] || id[2] != id[1] || id[1] != id[3])
+			return false;
+
+		float a0[4], p0[4], p1[4], a1[4];
+		const Vec3f* p = input.Positions + j;
+		Transform(*input.View, p[0].x, p[0].y, p[0].z, a0);
+		Transform(*input.View, p[1].x, p[1].y, p[1].z, p0);
+		Transform(*input.View, p[2].x, p[2].y, p[2].z, p1);
+		Transform(*input.View, p[3].x, p[3].y, p[3].z, a1);
+		for (int k = 0; k < 3; ++k)
+		{
+			a0[k] /= a0[3]; p0[k] /= p0[3]; p1[k] /= p1[3]; a1[k] /= a1[3];
+		}
+
+		// normalize() of a zero vector gives NaN on the GPU, which drops the quad
+		float d0x = p1[0] - a0[0], d0y = p1[1] - a0[1];
+		float d1x = a1[0] - p0[0], d1y = a1[1] - p0[1];
+		float l0 = sqrtf(d0x * d0x + d0y * d0y), l1 = sqrtf(d1x * d1x + d1y * d1y);
+		if (!(l0 > 0) || !(l1 > 0))
+			return false;
+		float s0 = _Settings.StripWidth / l0, s1 = _Settings.StripWidth / l1;
+		float off0x = -d0y * s0, off0y = d0x * s0;
+		float off1x = -d1y * s1, off1y = d1x * s1;
+
+		const float* center[4] = { p0, p0, p1, p1 };
+		const float offX[4] = { off0x, -off0x, off1x, -off1x };
+		const float offY[4] = { off0y, -off0y, off1y, -off1y };
+		for (int v = 0; v < 4; ++v)
+		{
+			Vertex& vertex = quad[v];
+			vertex.a[VIEW_X] = center[v][0] + offX[v];
+			vertex.a[VIEW_Y] = center[v][1] + offY[v];
+			vertex.a[VIEW_Z] = center[v][2];
+			Transform(*input.Projection, vertex.a[VIEW_X], vertex.a[VIEW_Y], vertex.a[VIEW_Z], vertex.a + CLIP_X);
+			int source = j + 1 + v / 2;
+			vertex.a[ALPHA_WEIGHT] = input.AlphaWeights[source];
+			vertex.a[IMPORTANCE] = input.Importance[source];
+			vertex.a[TEXCOORD] = (float)(v & 1);
+		}
+		return true;
+	}
+
+	// Distance to the clip plane k (inside if >= 0): near, far and the guard band.
+	static float PlaneDistance(const Vertex& v, int k)
+	{
+		const float* c = v.a;
+		switch (k)
+		{
+		case 0: return c[CLIP_Z];
+		case 1: return c[CLIP_W] - c[CLIP_Z];
+		case 2: return GUARD_BAND * c[CLIP_W] + c[CLIP_X];
+		case 3: return GUARD_BAND * c[CLIP_W] - c[CLIP_X];
+		case 4: return GUARD_BAND * c[CLIP_W] + c[CLIP_Y];
+		default: return GUARD_BAND * c[CLIP_W] - c[CLIP_Y];
+		}
+	}
+
+	// Clips a triangle (Sutherland-Hodgman) and returns the number of vertices of the convex polygon.
+	static int ClipTriangle(const Vertex& v0, const Vertex& v1, const Vertex& v2, Vertex polygon[MAX_POLYGON])
+	{
+		polygon[0] = v0; polygon[1] = v1; polygon[2] = v2;
+
+		// most triangles are entirely inside (or outside) of the planes
+		int outside0 = 0, outside1 = 0, outside2 = 0;
+		for (int k = 0; k < 6; ++k)
+		{
+			outside0 |= (PlaneDistance(v0, k) < 0) << k;
+			outside1 |= (PlaneDistance(v1, k) < 0) << k;
+			outside2 |= (PlaneDistance(v2, k) < 0) << k;
+		}
+		if ((outside0 | outside1 | outside2) == 0) return 3;
+		if ((outside0 & outside1 & outside2) != 0) return 0;
+
+		Vertex buffer[MAX_POLYGON];
+		Vertex* in = polygon;
+		Vertex* out = buffer;
+		int count = 3;
+		for (int k = 0; k < 6 && count > 0; ++k)
+		{
+			if ((((outside0 | outside1 | outside2) >> k) & 1) == 0) continue;
+			int outCount = 0;
+			for (int i = 0; i < count; ++i)
+			{
+				const Vertex& a = in[i];
+				const Vertex& b = in[(i + 1) % count];
+				float da = PlaneDistance(a, k), db = PlaneDistance(b, k);
+				if (da >= 0)
+					out[outCount++] = a;
+				if ((da >= 0) != (db >= 0))
+				{
+					// interpolate from the inside vertex, so that neighboring triangles get the same point
+					const Vertex& inside = da >= 0 ? a : b;
+					const Vertex& outside = da >= 0 ? b : a;
+					float di = da >= 0 ? da : db, dout = da >= 0 ? db : da;
+					float t = di / (di - dout);
+					Vertex& v = out[outCount++];
+					for (int n = 0; n < NUM_ATTRIBUTES; ++n)
+						v.a[n] = inside.a[n] + (outside.a[n] - inside.a[n]) * t;
+				}
+			}
+			std::swap(in, out);
+			count = outCount;
+		}
+		if (in != polygon)
+			std::copy(in, in + count, polygon);
+		return count;
+	}
+
+	// Viewport transformation to fixed-point pixel coordinates (y down).
+	void ToScreen(const Vertex& v, int64_t& x, int64_t& y) const
+	{
+		float invW = 1.0f / v.a[CLIP_W];
+		float sx = (v.a[CLIP_X] * invW * 0.5f + 0.5f) * _Settings.Width;
+		float sy = (0.5f - v.a[CLIP_Y] * invW * 0.5f) * _Settings.Height;
+		x = (int64_t)floorf(sx * SUBPIXELS + 0.5f);
+		y = (int64_t)floorf(sy * SUBPIXELS + 0.5f);
+	}
+
+	void GetTileRect(int tile, int& x0, int& y0, int& x1, int& y1) const
+	{
+		int tileSize = std::max(1, _Settings.TileSize);
+		x0 = (tile % _TilesX) * tileSize;
+		y0 = (tile / _TilesX) * tileSize;
+		x1 = std::min(x0 + tileSize, _Settings.Width);
+		y1 = std::min(y0 + tileSize, _Settings.Height);
+	}
+
+	// Bins the segments into the tiles and rasterizes the tiles without storing anything: counts the fragments of every tile
+	// (the first fragment of every tile goes to _TileOffsets) and, if pixelCounts is not NULL, adds the fragments of pixel p
+	// to pixelCounts[p + 1]. Returns the number of valid segments.
+	int CountFragments(const Input& input, int numVertices, unsigned int* pixelCounts)
+	{
+		int numSegments = BinSegments(input, numVertices);
+
+		int numTiles = _TilesX * _TilesY;
+		_TileOffsets.assign(numTiles + 1, 0);
+		ThreadPool::Global().Run(numTiles, [&](int t) {
+			size_t count = 0;
+			RasterizeTile(input, t, [&](unsigned int pixel, const FragmentData&) {
+				if (pixelCounts) pixelCounts[pixel + 1]++;
+				count++;
+			});
+			_TileOffsets[t + 1] = count;
+		});
+		for (int t = 0; t < numTiles; ++t)
+			_TileOffsets[t + 1] += _TileOffsets[t];
+		return numSegments;
+	}
+
+	// Bins the segments into the tiles, in chunks of consecutive primitives. Returns the number of valid segments.
+	int BinSegments(const Input& input, int numVertices)
+	{
+		int tileSize = std::max(1, _Settings.TileSize);
+		_TilesX = (_Settings.Width + tileSize - 1) / tileSize;
+		_TilesY = (_Settings.Height + tileSize - 1) / tileSize;
+		int numTiles = _TilesX * _TilesY;
+
+		int numPrimitives = std::max(0, numVertices - 3);
+		int numChunks = (numPrimitives + CHUNK_SIZE - 1) / CHUNK_SIZE;
+		_Chunks.resize(numChunks);
+		std::vector<int> chunkSegments(numChunks, 0);
+		ThreadPool& pool = ThreadPool::Global();
+		pool.Run(numChunks, [&](int c) {
+			chunkSegments[c] = BinChunk(input, c, numPrimitives, numTiles, _Chunks[c]);
+		});
+
+		int numSegments = 0;
+		for (int c = 0; c < numChunks; ++c)
+			numSegments += chunkSegments[c];
+		return numSegments;
+	}
+
+	void UpdateStatistics(int numSegments, long long numFragments, std::chrono::high_resolution_clock::time_point timeStart)
+	{
+		_Statistics.NumSegments = numSegments;
+		_Statistics.NumFragments = numFragments;
+		_Statistics.Seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - timeStart).count();
+	}
+
+	// Sorts the primitives of a chunk into the tiles that their clipped quads overlap. Returns the number of valid segments.
+	int BinChunk(const Input& input, int chunk, int numPrimitives, int numTiles, Bins& bins) const
+	{
+		int first = chunk * CHUNK_SIZE;
+		int last = std::min(first + CHUNK_SIZE, numPrimitives);
+		int tileSize = std::max(1, _Settings.TileSize);
+		bins.Pairs.clear();
+		int numSegments = 0;
+		Vertex quad[4], polygon[MAX_POLYGON];
+		for (int j = first; j < last; ++j)
+		{
+			if (!BuildQuad(input, j, quad))
+				continue;
+			numSegments++;
+
+			int64_t minX = INT64_MAX, minY = INT64_MAX, maxX = INT64_MIN, maxY = INT64_MIN;
+			for (int tri = 0; tri < 2; ++tri)
+			{
+				int count = tri == 0 ? ClipTriangle(quad[0], quad[1], quad[2], polygon) : ClipTriangle(quad[1], quad[3], quad[2], polygon);
+				for (int i = 0; i < count; ++i)
+				{
+					int64_t x, y;
+					ToScreen(polygon[i], x, y);
+					minX = std::min(minX, x); maxX = std::max(maxX, x);
+					minY = std::min(minY, y); maxY = std::max(maxY, y);
+				}
+			}
+			if (minX > maxX) continue;
+
+			// pixels whose centers can be covered
+			int px0, py0, px1, py1;
+			if (!GetPixelRange(minX, minY, maxX, maxY, 0, 0, _Settings.Width, _Settings.Height, px0, py0, px1, py1))
+				continue;
+			for (int ty = py0 / tileSize; ty <= (py1 - 1) / tileSize; ++ty)
+				for (int tx = px0 / tileSize; tx <= (px1 - 1) / tileSize; ++tx)
+					bins.Pairs.push_back(std::make_pair(ty * _TilesX + tx, j));
+		}
+
+		// counting sort by tile, primitives stay in order
+		bins.Offsets.assign(numTiles + 1, 0);
+		for (const std::pair<int, int>& pair : bins.Pairs)
+			bins.Offsets[pair.first + 1]++;
+		for (int t = 0; t < numTiles; ++t)
+			bins.Offsets[t + 1] += bins.Offsets[t];
+		bins.Items.resize(bins.Pairs.size());
+		std::vector<int> cursor(bins.Offsets.begin(), bins.Offsets.end() - 1);
+		for (const std::pair<int, int>& pair : bins.Pairs)
+			bins.Items[cursor[pair.first]++] = pair.second;
+		return numSegments;
+	}
+
+	// Range [px0, px1) x [py0, py1) of the pixels in the rectangle whose centers lie in the fixed-point bounding box. False if empty.
+	static bool GetPixelRange(int64_t minX, int64_t minY, int64_t maxX, int64_t maxY, int rx0, int ry0, int rx1, int ry1, int& px0, int& py0, int& px1, int& py1)
+	{
+		// pixel p has its center at p * SUBPIXELS + SUBPIXELS / 2
+		const int64_t half = SUBPIXELS / 2;
+		px0 = (int)std::max<int64_t>(rx0, FloorDiv(minX - half + SUBPIXELS - 1, SUBPIXELS));
+		py0 = (int)std::max<int64_t>(ry0, FloorDiv(minY - half + SUBPIXELS - 1, SUBPIXELS));
+		px1 = (int)std::min<int64_t>(rx1, FloorDiv(maxX - half, SUBPIXELS) + 1);
+		py1 = (int)std::min<int64_t>(ry1, FloorDiv(maxY - half, SUBPIXELS) + 1);
+		return px0 < px1 && py0 < py1;
+	}
+
+	static int64_t FloorDiv(int64_t a, int64_t b)
+	{
+		return a >= 0 ? a / b : -((-a + b - 1) / b);
+	}
+
+	// Rasterizes the binned segments of a tile and calls emit(pixel, fragment) for the fragments in front of the depth buffer.
+	template <typename Emit>
+	void RasterizeTile(const Input& input, int tile, const Emit& emit) const
+	{
+		int x0, y0, x1, y1;
+		GetTileRect(tile, x0, y0, x1, y1);
+
+		Vertex quad[4], polygon[MAX_POLYGON];
+		for (size_t c = 0; c < _Chunks.size(); ++c)
+		{
+			const Bins& bins = _Chunks[c];
+			for (int i = bins.Offsets[tile]; i < bins.Offsets[tile + 1]; ++i)
+			{
+				BuildQuad(input, bins.Items[i], quad);
+
+				// the triangle strip (0, 1, 2), (1, 3, 2)
+				for (int tri = 0; tri < 2; ++tri)
+				{
+					int count = tri == 0 ? ClipTriangle(quad[0], quad[1], quad[2], polygon) : ClipTriangle(quad[1], quad[3], quad[2], polygon);
+					for (int k = 1; k + 1 < count; ++k)
+						RasterizeTriangle(input, polygon[0], polygon[k], polygon[k + 1], x0, y0, x1, y1, emit);
+				}
+			}
+		}
+	}
+
+	template <typename Emit>
+	void RasterizeTriangle(const Input& input, const Vertex& v0, const Vertex& v1, const Vertex& v2, int rx0, int ry0, int rx1, int ry1,
+		const Emit& emit) const
+	{
+		const Vertex* v[3] = { &v0, &v1, &v2 };
+		int64_t X[3], Y[3];
+		for (int i = 0; i < 3; ++i)
+			ToScreen(*v[i], X[i], Y[i]);
+
+		// orient the triangle so that the edge functions are positive inside
+		int64_t area = (X[1] - X[0]) * (Y[2] - Y[0]) - (Y[1] - Y[0]) * (X[2] - X[0]);
+		if (area == 0) return;
+		if (area < 0)
+		{
+			std::swap(v[1], v[2]);
+			std::swap(X[1], X[2]);
+			std::swap(Y[1], Y[2]);
+			area = -area;
+		}
+
+		int px0, py0, px1, py1;
+		if (!GetPixelRange(std::min(X[0], std::min(X[1], X[2])), std::min(Y[0], std::min(Y[1], Y[2])),
+			std::max(X[0], std::max(X[1], X[2])), std::max(Y[0], std::max(Y[1], Y[2])), rx0, ry0, rx1, ry1, px0, py0, px1, py1))
+			return;
+
+		// edge i is opposite of vertex i; pixels exactly on an edge belong to the triangle if the edge is a top or left edge
+		int64_t stepX[3], stepY[3], row[3], bias[3];
+		int64_t sampleX = (int64_t)px0 * SUBPIXELS + SUBPIXELS / 2, sampleY = (int64_t)py0 * SUBPIXELS + SUBPIXELS / 2;
+		for (int i = 0; i < 3; ++i)
+		{
+			int a = (i + 1) % 3, b = (i + 2) % 3;
+			int64_t dx = X[b] - X[a], dy = Y[b] - Y[a];
+			bool topLeft = (dy == 0 && dx > 0) || dy < 0;
+			bias[i] = topLeft ? 0 : -1;
+			row[i] = dx * (sampleY - Y[a]) - dy * (sampleX - X[a]) + bias[i];
+			stepX[i] = -dy * SUBPIXELS;
+			stepY[i] = dx * SUBPIXELS;
+		}
+
+		// perspective-correct interpolation of the view space position, the alpha weight, the importance and the strip coordinate
+		float invW[3], attr[3][6];
+		for (int i = 0; i < 3; ++i)
+		{
+			invW[i] = 1.0f / v[i]->a[CLIP_W];
+			for (int n = 0; n < 6; ++n)
+				attr[i][n] = v[i]->a[VIEW_X + n] * invW[i];
+		}
+		float invArea = 1.0f / (float)area;
+		const Mat4f& proj = *input.Projection;
+		int width = _Settings.Width;
+
+		for (int y = py0; y < py1; ++y)
+		{
+			// the strips are thin, so only the span of the row inside of all three edges is visited
+			int64_t spanBegin = px0, spanEnd = px1;
+			for (int i = 0; i < 3; ++i)
+			{
+				if (stepX[i] > 0)
+					spanBegin = std::max(spanBegin, px0 + FloorDiv(-row[i] + stepX[i] - 1, stepX[i]));
+				else if (stepX[i] < 0)
+					spanEnd = std::min(spanEnd, px0 + FloorDiv(row[i], -stepX[i]) + 1);
+				else if (row[i] < 0)
+					spanEnd = spanBegin;
+			}
+			int64_t e[3];
+			for (int i = 0; i < 3; ++i)
+				e[i] = row[i] + (spanBegin - px0) * stepX[i];
+			for (int x = (int)spanBegin; x < (int)spanEnd; ++x)
+			{
+				// undo the top-left bias for the weights
+				float b[3];
+				for (int i = 0; i < 3; ++i)
+					b[i] = (float)(e[i] - bias[i]) * invArea;
+				float w = 1.0f / (b[0] * invW[0] + b[1] * invW[1] + b[2] * invW[2]);
+				float value[6];
+				for (int n = 0; n < 6; ++n)
+					value[n] = (b[0] * attr[0][n] + b[1] * attr[1][n] + b[2] * attr[2][n]) * w;
+
+				// depth of the pixel shader: the halo is pushed back
+				float viewZ = value[VIEW_Z - VIEW_X];
+				float halfDistCenter = fabsf(value[TEXCOORD - VIEW_X] - 0.5f);
+				if (halfDistCenter * 2 > _Settings.HaloPortion)
+					viewZ += halfDistCenter * 2 * _Settings.StripWidth;
+				float vx = value[0], vy = value[1];
+				float clipZ = vx * proj.m[0][2] + vy * proj.m[1][2] + viewZ * proj.m[2][2] + proj.m[3][2];
+				float clipW = vx * proj.m[0][3] + vy * proj.m[1][3] + viewZ * proj.m[2][3] + proj.m[3][3];
+				float depth = clipZ / clipW;
+
+				size_t pixel = (size_t)y * width + x;
+				float refDepth = input.DepthBuffer ? input.DepthBuffer[pixel] : 1.0f;
+				if (depth < refDepth)
+				{
+					FragmentData data;
+					memcpy(&data.Depth, &depth, sizeof(float));
+					data.AlphaWeight = value[ALPHA_WEIGHT - VIEW_X];
+					data.Importance = std::min(std::max(value[IMPORTANCE - VIEW_X], 0.0f), 1.0f);
+					emit((unsigned int)pixel, data);
+				}
+				for (int i = 0; i < 3; ++i)
+					e[i] += stepX[i];
+			}
+			for (int i = 0; i < 3; ++i)
+				row[i] += stepY[i];
+		}
+	}
+
+	Settings _Settings;
+	Statistics _Statistics;
+	int _TilesX;
+	int _TilesY;
+	std::vector<Bins> _Chunks;
+	std::vector<size_t> _TileOffsets;						// first fragment of every tile in the output
+	std::vector<unsigned int> _Cursors;						// next free fragment of every pixel while writing
+};
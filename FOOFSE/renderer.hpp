@@ -1,10 +1,14 @@
 #pragma once
 
 #include <d3d11.h>
+#include <cfloat>
+#include <cmath>
+#include <cstring>
 #include "d3d.hpp"
 #include "camera.hpp"
 #include "lines.hpp"
 #include "cbuffer.hpp"
+#include "smoothing.hpp"
 
 class Renderer
 {
@@ -15,6 +19,10 @@ class Renderer
 		// an expected average overdraw rate.
 		static const int EXPECTED_OVERDRAW_IN_LINKED_LISTS = 8;
 
+		// The statistics of a frame are copied into one of this many read back buffers in turn. The CPU runs up to three
+		// frames ahead of the GPU (no vsync), a single buffer would always be busy with the copy of the last frame.
+		static const int NUM_STATS_COPIES = 4;
+
 		struct FragmentData	{
 			unsigned int Color;		// Pixel color
 			unsigned int Depth;		// Depth
@@ -44,9 +52,13 @@ class Renderer
 
 		struct CbFadeToAlpha
 		{
-			CbFadeToAlpha() : FadeToAlpha(0.1f), LaplaceWeight(0.1f) {}
+			CbFadeToAlpha() : FadeToAlpha(0.1f), LaplaceWeight(0.1f), Diffusion(0), NumControlPoints(0), Halo(1) {}
 			float FadeToAlpha;
 			float LaplaceWeight;
+			float Diffusion;			// smoothing strength: _SmoothingIterations Jacobi steps of LaplaceWeight (AlphaSmoother::GetDiffusion)
+			int NumControlPoints;
+			int Halo;					// control points on both sides of a chunk in the smoothing (AlphaSmoother::GetHalo)
+			int Padding[3];
 		};
 
 		struct CbRenderer
@@ -56,7 +68,8 @@ class Renderer
 				HaloColor(0, 0, 0, 1),
 				StripWidth(0.00015f),
 				HaloPortion(0.7f),
-				ScreenWidth(100), ScreenHeight(100) {}
+				ScreenWidth(100), ScreenHeight(100),
+				OpacityEstimator(OPACITY_ESTIMATOR_FOURIER) {}
 			float Q;
 			float R;
 			float Lambda;
@@ -67,13 +80,42 @@ class Renderer
 			float HaloPortion;
 			int ScreenWidth;
 			int ScreenHeight;
+			int OpacityEstimator;
+			int Padding[3];
+		};
+
+		// estimator of the alpha values in the min gather (OPACITY_ESTIMATOR_* in shader_Common.hlsli)
+		enum Estimator
+		{
+			ESTIMATOR_RAW = OPACITY_ESTIMATOR_RAW,			// exact, needs the sorted lists
+			ESTIMATOR_FOURIER = OPACITY_ESTIMATOR_FOURIER,
+			ESTIMATOR_FOM = OPACITY_ESTIMATOR_FOM
+		};
+
+		// smoothing of the alphas along the lines
+		enum SmoothingMethod
+		{
+			SMOOTHING_DIRECT,		// one implicit step, solved directly (shader_SmoothAlpha, AlphaSmoother::Smooth), a different kernel (see smoothing.hpp)
+			SMOOTHING_JACOBI		// _SmoothingIterations Jacobi steps (the default)
 		};
 
+		// everything the optimized alphas depend on: the view and the parameters of the renderer (compared bytewise)
+		struct ViewState
+		{
+			Camera::CbParam View;
+			CbRenderer Parameters;
+			CbFadeToAlpha Fade;
+			int SmoothingIterations;
+			int Smoothing;
+			int LegacyShaders;
+		};
+
+		// FOURIER_HARMONICS (shader_Common.hlsli) coefficients a_k and b_k
 		struct FourierCoef
 		{
-			XMFLOAT4 fFourierA;
-			XMFLOAT4 fFourierB;
-			static int GetSizeInBytes() { return sizeof(XMFLOAT4) * 2; };
+			float fFourierA[FOURIER_HARMONICS];
+			float fFourierB[FOURIER_HARMONICS];
+			static int GetSizeInBytes() { return sizeof(float) * 2 * FOURIER_HARMONICS; };
 		};
 
 		Renderer(float q, float r, float lambda, float stripWidth, int smoothingIterations) : 
@@ -88,6 +130,8 @@ class Renderer
 			_UavStartOffsetBufferLowRes(NULL),
 			_UavFragmentLinkBufferLowRes(NULL),
 			_UavFourierCoef(NULL),
+			_FrameStatsBuffer(NULL),
+			_UavFrameStats(NULL),
 			_VsLineShader_HQ(NULL),
 			_VsLineShader_LowRes(NULL),
 			_VsSortFragments(NULL),
@@ -107,14 +151,32 @@ class Renderer
 			_InputLayout_ViewportQuad(NULL),
 			_CsFadeAlpha(NULL),
 			_CsSmoothAlpha(NULL),
+			_CsSmoothAlphaJacobi(NULL),
+			_CsGatherLod(NULL),
+			_CsGatherLodAlpha(NULL),
 			_VsLineShaderFOM(NULL),
 			_PsLineShaderFOM(NULL),
 			_GsLineShaderFOM(NULL),
 			_VsMinGatherFOM(NULL),
 			_PsMinGatherFOM(NULL),
 			_ResolutionDownScale(1),
-			_SmoothingIterations(smoothingIterations)
+			_SmoothingIterations(smoothingIterations),
+			_LegacyShaders(false),
+			_Smoothing(SMOOTHING_JACOBI),
+			_ConvergenceEpsilon(1e-4f)
 		{
+			_NumLongListPixels[0] = _NumLongListPixels[1] = 0;
+			_MaxAlphaDelta = FLT_MAX;
+			_FrameIndex = 0;
+			_InvalidationFrame = 0;
+			_NumOptimizedFrames = 0;
+			for (int c = 0; c < NUM_STATS_COPIES; ++c)
+			{
+				_FrameStatsStaging[c] = NULL;
+				_StatsCopyFrame[c] = -1;
+				_StatsCopyOptimized[c] = false;
+			}
+			memset(&_LastViewState, 0, sizeof(ViewState));
 			_CbRenderer.Data.Q = q;
 			_CbRenderer.Data.R = r;
 			_CbRenderer.Data.Lambda = lambda;
@@ -149,6 +211,9 @@ class Renderer
 
 			if (!D3D::LoadComputeShaderFromFile("shader_FadeToAlphaPerVertex.cso", Device, &_CsFadeAlpha)) return false;
 			if (!D3D::LoadComputeShaderFromFile("shader_SmoothAlpha.cso", Device, &_CsSmoothAlpha)) return false;
+			if (!D3D::LoadComputeShaderFromFile("shader_SmoothAlpha_Jacobi.cso", Device, &_CsSmoothAlphaJacobi)) return false;
+			if (!D3D::LoadComputeShaderFromFile("shader_GatherLod.cso", Device, &_CsGatherLod)) return false;
+			if (!D3D::LoadComputeShaderFromFile("shader_GatherLodAlpha.cso", Device, &_CsGatherLodAlpha)) return false;
 			
 			// FOM shader
 			if (!D3D::LoadVertexShaderFromFile("shader_CreateLists_LowRes_FOM.vso", Device, &_VsLineShaderFOM, &blobLineShaderFOM, &sizeLineShaderFOM)) return false;
@@ -186,22 +251,7 @@ class Renderer
 					{ "ALPHAWEIGHTA",  0, DXGI_FORMAT_R32_FLOAT, 3, 0,  D3D11_INPUT_PER_VERTEX_DATA, 0 },
 					{ "ALPHAWEIGHTB",  0, DXGI_FORMAT_R32_FLOAT, 3, sizeof(float) * 2,  D3D11_INPUT_PER_VERTEX_DATA, 0 },
 				};
-				HRESULT hr = Device->CreateInputLayout(layout, 8, blobLineShader_LowRes, sizeLineShader_LowRes, &_InputLayout_Line_LowRes);
-				if (FAILED(hr))	return false;
-			}
-
-			{
-				const D3D11_INPUT_ELEMENT_DESC layout[] =
-				{
-					{ "POSITIONA",  0, DXGI_FORMAT_R32G32B32_FLOAT, 0, 0,  D3D11_INPUT_PER_VERTEX_DATA, 0 },
-					{ "POSITIONB",  0, DXGI_FORMAT_R32G32B32_FLOAT, 0, sizeof(XMFLOAT3) * 2,  D3D11_INPUT_PER_VERTEX_DATA, 0 },
-					{ "IDA",  0, DXGI_FORMAT_R32_SINT, 1, 0,  D3D11_INPUT_PER_VERTEX_DATA, 0 },
-					{ "IDB",  0, DXGI_FORMAT_R32_SINT, 1, sizeof(int) * 2,  D3D11_INPUT_PER_VERTEX_DATA, 0 },
-					{ "IMPORTANCEA",  0, DXGI_FORMAT_R32_FLOAT, 2, 0,  D3D11_INPUT_PER_VERTEX_DATA, 0 },
-					{ "IMPORTANCEB",  0, DXGI_FORMAT_R32_FLOAT, 2, sizeof(float) * 2,  D3D11_INPUT_PER_VERTEX_DATA, 0 },
-					{ "ALPHAWEIGHTA",  0, DXGI_FORMAT_R32_FLOAT, 3, 0,  D3D11_INPUT_PER_VERTEX_DATA, 0 },
-					{ "ALPHAWEIGHTB",  0, DXGI_FORMAT_R32_FLOAT, 3, sizeof(float) * 2,  D3D11_INPUT_PER_VERTEX_DATA, 0 },
-				};
+				// the legacy and the FOM list shaders have the same input signature
 				HRESULT hr = Device->CreateInputLayout(layout, 8, blobLineShaderFOM, sizeLineShaderFOM, &_InputLayout_Line_LowRes);
 				if (FAILED(hr))	return false;
 			}
@@ -240,6 +290,38 @@ class Renderer
 				if (FAILED(Device->CreateBuffer(&bufDesc, &initData, &_VbViewportQuad))) return false;
 			}
 
+			// --- create the statistics of a frame and their read back buffer: the long list counters ([0] = low res lists,
+			// [1] = full res lists) and the largest change of a vertex alpha in the fade ([2], float bits)
+			{
+				D3D11_BUFFER_DESC bufDesc;
+				ZeroMemory(&bufDesc, sizeof(D3D11_BUFFER_DESC));
+				bufDesc.BindFlags = D3D11_BIND_UNORDERED_ACCESS;
+				bufDesc.ByteWidth = 3 * sizeof(unsigned int);
+				bufDesc.CPUAccessFlags = 0;
+				bufDesc.MiscFlags = D3D11_RESOURCE_MISC_BUFFER_ALLOW_RAW_VIEWS;
+				bufDesc.Usage = D3D11_USAGE_DEFAULT;
+				if (FAILED(Device->CreateBuffer(&bufDesc, NULL, &_FrameStatsBuffer))) return false;
+
+				bufDesc.BindFlags = 0;
+				bufDesc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
+				bufDesc.MiscFlags = 0;
+				bufDesc.Usage = D3D11_USAGE_STAGING;
+				for (int c = 0; c < NUM_STATS_COPIES; ++c)
+				{
+					if (FAILED(Device->CreateBuffer(&bufDesc, NULL, &_FrameStatsStaging[c]))) return false;
+					_StatsCopyFrame[c] = -1;
+				}
+
+				D3D11_UNORDERED_ACCESS_VIEW_DESC uavDesc;
+				ZeroMemory(&uavDesc, sizeof(D3D11_UNORDERED_ACCESS_VIEW_DESC));
+				uavDesc.Buffer.FirstElement = 0;
+				uavDesc.Buffer.Flags = D3D11_BUFFER_UAV_FLAG_RAW;
+				uavDesc.Buffer.NumElements = 3;
+				uavDesc.Format = DXGI_FORMAT_R32_TYPELESS;
+				uavDesc.ViewDimension = D3D11_UAV_DIMENSION_BUFFER;
+				if (FAILED(Device->CreateUnorderedAccessView(_FrameStatsBuffer, &uavDesc, &_UavFrameStats))) return false;
+			}
+
 			if (!_CbFadeToAlpha.Create(Device)) return false;
 			if (!_CbRenderer.Create(Device)) return false;
 
@@ -400,7 +482,16 @@ class Renderer
 			if (_PsMinGather_LowRes)		_PsMinGather_LowRes->Release();			_PsMinGather_LowRes = NULL;
 			if (_CsFadeAlpha)				_CsFadeAlpha->Release();				_CsFadeAlpha = NULL;
 			if (_CsSmoothAlpha)				_CsSmoothAlpha->Release();				_CsSmoothAlpha = NULL;
+			if (_CsSmoothAlphaJacobi)		_CsSmoothAlphaJacobi->Release();		_CsSmoothAlphaJacobi = NULL;
+			if (_CsGatherLod)				_CsGatherLod->Release();				_CsGatherLod = NULL;
+			if (_CsGatherLodAlpha)			_CsGatherLodAlpha->Release();			_CsGatherLodAlpha = NULL;
 			if (_VbViewportQuad)			_VbViewportQuad->Release();				_VbViewportQuad = NULL;
+			if (_FrameStatsBuffer)			_FrameStatsBuffer->Release();			_FrameStatsBuffer = NULL;
+			for (int c = 0; c < NUM_STATS_COPIES; ++c)
+			{
+				if (_FrameStatsStaging[c])		_FrameStatsStaging[c]->Release();		_FrameStatsStaging[c] = NULL;
+			}
+			if (_UavFrameStats)				_UavFrameStats->Release();				_UavFrameStats = NULL;
 			
 			// FOM
 			if (_VsLineShaderFOM)			_VsLineShaderFOM->Release();			_VsLineShaderFOM = NULL;
@@ -428,10 +519,74 @@ class Renderer
 			if (_UavFourierCoef)				_UavFourierCoef->Release();					_UavFourierCoef = NULL;
 		}
 
+		// Number of pixels whose fragment list was longer than the fast path handles (low res / full res), read back with a delay of a few frames.
+		int GetNumberOfLongListPixelsLowRes() const { return _NumLongListPixels[0]; }
+		int GetNumberOfLongListPixels() const { return _NumLongListPixels[1]; }
+
+		// Largest change of a vertex alpha in the fade, read back with a delay of a few frames (FLT_MAX after InvalidateConvergence).
+		// Only frames drawn after the last invalidation count.
+		float GetMaxAlphaDelta() const { return _MaxAlphaDelta; }
+		// The alpha values stopped changing: the fade, and the optimization as long as nothing else changes, can be skipped.
+		// Without a read back (e.g. the staging copies are always busy) this happens after GetMaxOptimizedFrames frames.
+		bool IsConverged() const { return _MaxAlphaDelta <= _ConvergenceEpsilon || _NumOptimizedFrames >= GetMaxOptimizedFrames(); }
+		// Until the next read back, the alpha values count as changing (e.g. after the view or the parameters changed).
+		void InvalidateConvergence() { _MaxAlphaDelta = FLT_MAX; _InvalidationFrame = _FrameIndex; _NumOptimizedFrames = 0; }
+		// Optimized frames after an invalidation until the alphas count as converged anyway: twice the frames the fade needs
+		// to get from a change of 1 below the epsilon for a fixed target, plus the latency of the read back.
+		int GetMaxOptimizedFrames() const
+		{
+			float fade = _CbFadeToAlpha.Data.FadeToAlpha;
+			float epsilon = _ConvergenceEpsilon > 1e-7f ? _ConvergenceEpsilon : 1e-7f;
+			if (fade <= 0 || fade >= 1 || epsilon >= 1) return NUM_STATS_COPIES + 1;
+			return NUM_STATS_COPIES + 1 + 2 * (int)ceilf(logf(epsilon) / logf(1 - fade));
+		}
+		void SetConvergenceEpsilon(float epsilon) { _ConvergenceEpsilon = epsilon; }
+		float GetConvergenceEpsilon() const { return _ConvergenceEpsilon; }
+
+		// The view or the parameters differ from those of the last optimized frame.
+		bool HasViewChanged(D3D* D3D, Lines* Geometry, Camera* Camera) const
+		{
+			ViewState state = GetViewState(D3D, Geometry, Camera);
+			return memcmp(&state, &_LastViewState, sizeof(ViewState)) != 0;
+		}
+		// Nothing changed and the alphas converged: the image of the last frame is still valid and the frame can be skipped.
+		// Changes the renderer cannot see (e.g. the level of detail of the lines) need an InvalidateConvergence.
+		bool IsIdle(D3D* D3D, Lines* Geometry, Camera* Camera) const { return IsConverged() && !HasViewChanged(D3D, Geometry, Camera); }
+
+		// Estimator of the alpha values. RAW also sorts the low res lists. The legacy shaders only have RAW and FOM (FOURIER gives FOM).
+		void SetOpacityEstimator(Estimator estimator) { _CbRenderer.Data.OpacityEstimator = estimator; }
+		Estimator GetOpacityEstimator() const { return (Estimator)_CbRenderer.Data.OpacityEstimator; }
+
+		// Uses shader_CreateLists_LowRes and shader_MinGather_LowRes instead of the FOM versions (no long list counter).
+		void SetLegacyShaders(bool legacy) { _LegacyShaders = legacy; }
+		bool GetLegacyShaders() const { return _LegacyShaders; }
+
+		// The direct solve is not a drop-in replacement of the Jacobi steps: the alphas differ by a few 1e-2 on average.
+		void SetSmoothingMethod(SmoothingMethod method)
+		{
+			_Smoothing = method;
+			if (_Smoothing == SMOOTHING_DIRECT && GetDiffusion() < AlphaSmoother::GetDiffusion(_SmoothingIterations, _CbFadeToAlpha.Data.LaplaceWeight))
+				printf("The direct smoothing of %i iterations is clamped to the diffusion time %.1f (the halo of at most %i control points).\n",
+					_SmoothingIterations, GetDiffusion(), AlphaSmoother::MAX_HALO);
+		}
+		SmoothingMethod GetSmoothingMethod() const { return _Smoothing; }
+		// diffusion time of the direct solve, clamped to the largest halo like on the CPU
+		float GetDiffusion() const
+		{
+			return std::min(AlphaSmoother::GetDiffusion(_SmoothingIterations, _CbFadeToAlpha.Data.LaplaceWeight), AlphaSmoother::GetMaxDiffusion());
+		}
+
 		void Draw(ID3D11DeviceContext* ImmediateContext, D3D* D3D, Lines* Geometry, Camera* Camera)
 		{
 			static int ping = 0;
 
+			ReadFrameStatistics(ImmediateContext);
+			UINT clearCounters[4] = { 0, 0, 0, 0 };
+			ImmediateContext->ClearUnorderedAccessViewUint(_UavFrameStats, clearCounters);
+
+			_CbFadeToAlpha.Data.Diffusion = GetDiffusion();
+			_CbFadeToAlpha.Data.NumControlPoints = Geometry->GetTotalNumberOfControlPoints();
+			_CbFadeToAlpha.Data.Halo = AlphaSmoother::GetHalo(_CbFadeToAlpha.Data.Diffusion);
 			_CbFadeToAlpha.UpdateBuffer(ImmediateContext);
 
 			Camera->GetParams().UpdateBuffer(ImmediateContext);
@@ -441,6 +596,19 @@ class Renderer
 			_CbRenderer.Data.ScreenHeight = (int)D3D->GetBackBufferSurfaceDesc().Height;
 			_CbRenderer.UpdateBuffer(ImmediateContext);
 
+			// the alphas are only optimized until they converged for this view and these parameters
+			ViewState viewState = GetViewState(D3D, Geometry, Camera);
+			if (memcmp(&viewState, &_LastViewState, sizeof(ViewState)) != 0)
+			{
+				_LastViewState = viewState;
+				InvalidateConvergence();
+			}
+			bool optimize = !IsConverged();
+
+			// cull the segments and select the level of detail for this view (if enabled)
+			if (optimize)
+				Geometry->UpdateVisibility(ImmediateContext, Camera->GetParams().Data.mView, Camera->GetParams().Data.mProj, _CbRenderer.Data.ScreenHeight, _CbRenderer.Data.StripWidth, _CsGatherLod);
+
 			ID3D11Buffer* cbs[] = { Camera->GetParams().GetBuffer(), _CbRenderer.GetBuffer() };
 			ImmediateContext->VSSetConstantBuffers(0, 2, cbs);
 			ImmediateContext->GSSetConstantBuffers(0, 2, cbs);
@@ -459,6 +627,7 @@ class Renderer
 
 			// -------------------------------------------
 #pragma region Create fragment linked lists - low res
+			if (optimize)
 			{
 				// Clear the start offset buffer by magic value.
 				unsigned int clearStartOffset[4] = { 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff };
@@ -473,13 +642,9 @@ class Renderer
 				ImmediateContext->OMSetDepthStencilState(D3D->GetDsTestWriteOff(), 0);
 				ImmediateContext->RSSetState(D3D->GetRsCullNone());
 
-				//ImmediateContext->VSSetShader(_VsLineShader_LowRes, NULL, 0);
-				//ImmediateContext->GSSetShader(_GsLineShader_LowRes, NULL, 0);
-				//ImmediateContext->PSSetShader(_PsLineShader_LowRes, NULL, 0);
-
-				ImmediateContext->VSSetShader(_VsLineShaderFOM, NULL, 0);
-				ImmediateContext->GSSetShader(_GsLineShaderFOM, NULL, 0);
-				ImmediateContext->PSSetShader(_PsLineShaderFOM, NULL, 0);
+				ImmediateContext->VSSetShader(_LegacyShaders ? _VsLineShader_LowRes : _VsLineShaderFOM, NULL, 0);
+				ImmediateContext->GSSetShader(_LegacyShaders ? _GsLineShader_LowRes : _GsLineShaderFOM, NULL, 0);
+				ImmediateContext->PSSetShader(_LegacyShaders ? _PsLineShader_LowRes : _PsLineShaderFOM, NULL, 0);
 
 				ID3D11ShaderResourceView* srvs[] = { D3D->GetSrvDepthbuffer() };
 				ImmediateContext->PSSetShaderResources(0, 1, srvs);
@@ -501,6 +666,8 @@ class Renderer
 
 			// -------------------------------------------
 #pragma region Sort the fragments - low res
+			// only the RAW estimator needs the lists in order
+			if (optimize && _CbRenderer.Data.OpacityEstimator == ESTIMATOR_RAW)
 			{
 				ImmediateContext->IASetInputLayout(_InputLayout_ViewportQuad);
 				ImmediateContext->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
@@ -527,34 +694,39 @@ class Renderer
 			// -------------------------------------------
 #pragma region Min gather of alpha values
 			// -------------------------------------------
+			if (optimize)
 			{
 				ImmediateContext->OMSetBlendState(D3D->GetBsBlendBackToFront(), blendFactor, 0xffffffff);
 
 				UINT maxValues[] = { 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff };
 				ImmediateContext->ClearUnorderedAccessViewUint(Geometry->GetUavAlpha()[ping], maxValues);
 
-				/*ImmediateContext->VSSetShader(_VsMinGather_LowRes, NULL, 0);
-				ImmediateContext->GSSetShader(NULL, NULL, 0);
-				ImmediateContext->PSSetShader(_PsMinGather_LowRes, NULL, 0);*/
-
-				ImmediateContext->VSSetShader(_VsMinGatherFOM, NULL, 0);
+				ImmediateContext->VSSetShader(_LegacyShaders ? _VsMinGather_LowRes : _VsMinGatherFOM, NULL, 0);
 				ImmediateContext->GSSetShader(NULL, NULL, 0);
-				ImmediateContext->PSSetShader(_PsMinGatherFOM, NULL, 0);
+				ImmediateContext->PSSetShader(_LegacyShaders ? _PsMinGather_LowRes : _PsMinGatherFOM, NULL, 0);
 
+				if (_LegacyShaders)
 				{
-					ID3D11UnorderedAccessView* uavs[] = { _UavStartOffsetBufferLowRes, _UavFragmentLinkBufferLowRes, _UavFourierCoef, Geometry->GetUavAlpha()[ping] };
-					UINT initialCount[] = { 0,0,0,0 };
+					ID3D11UnorderedAccessView* uavs[] = { _UavStartOffsetBufferLowRes, _UavFragmentLinkBufferLowRes, Geometry->GetUavAlpha()[ping] };
+					UINT initialCount[] = { 0,0,0 };
 					ID3D11RenderTargetView* rtvsNo[] = { NULL };
-					ImmediateContext->OMSetRenderTargetsAndUnorderedAccessViews(1, rtvsNo, NULL, 1, 4, uavs, initialCount);
+					ImmediateContext->OMSetRenderTargetsAndUnorderedAccessViews(1, rtvsNo, NULL, 1, 3, uavs, initialCount);
+				}
+				else
+				{
+					ID3D11UnorderedAccessView* uavs[] = { _UavStartOffsetBufferLowRes, _UavFragmentLinkBufferLowRes, _UavFourierCoef, Geometry->GetUavAlpha()[ping], _UavFrameStats };
+					UINT initialCount[] = { 0,0,0,0,0 };
+					ID3D11RenderTargetView* rtvsNo[] = { NULL };
+					ImmediateContext->OMSetRenderTargetsAndUnorderedAccessViews(1, rtvsNo, NULL, 1, 5, uavs, initialCount);
 				}
 
 				ImmediateContext->Draw(6, 0);
 
 				{
-					ID3D11UnorderedAccessView* uavs[] = { NULL, NULL, NULL, NULL };
-					UINT initialCount[] = { 0,0,0,0 };
+					ID3D11UnorderedAccessView* uavs[] = { NULL, NULL, NULL, NULL, NULL };
+					UINT initialCount[] = { 0,0,0,0,0 };
 					ID3D11RenderTargetView* rtvsNo[] = { NULL };
-					ImmediateContext->OMSetRenderTargetsAndUnorderedAccessViews(1, rtvsNo, NULL, 1, 4, uavs, initialCount);
+					ImmediateContext->OMSetRenderTargetsAndUnorderedAccessViews(1, rtvsNo, NULL, 1, 5, uavs, initialCount);
 				}
 			}
 #pragma endregion
@@ -562,49 +734,73 @@ class Renderer
 
 			// -------------------------------------------
 #pragma region Smoothing
+			// one implicit step along the lines (as strong as _SmoothingIterations Jacobi steps), solved directly in chunks of
+			// AlphaSmoother::CHUNK_SIZE control points, 32 chunks per group
+			if (optimize && _SmoothingIterations > 0 && _Smoothing == SMOOTHING_DIRECT)
 			{
 				ImmediateContext->CSSetShader(_CsSmoothAlpha, NULL, 0);
 
 				ID3D11Buffer* cbs[] = { _CbFadeToAlpha.GetBuffer() };
 				ImmediateContext->CSSetConstantBuffers(0, 1, cbs);
 
-				for (int s = 0; s< _SmoothingIterations; ++s)
-				{
-					float laplaceWeight = _CbFadeToAlpha.Data.LaplaceWeight;
+				ID3D11ShaderResourceView* srvs[] = { Geometry->GetSrvLineID(), Geometry->GetSrvAlpha()[ping] };
+				ImmediateContext->CSSetShaderResources(0, 2, srvs);
+
+				ID3D11UnorderedAccessView* uavs[] = { Geometry->GetUavAlpha()[1 - ping] };
+				UINT initialCounts[] = { 0, 0, 0, 0 };
+				ImmediateContext->CSSetUnorderedAccessViews(0, 1, uavs, initialCounts);
+
+				UINT numChunks = (Geometry->GetTotalNumberOfControlPoints() + AlphaSmoother::CHUNK_SIZE - 1) / AlphaSmoother::CHUNK_SIZE;
+				UINT groupsX = numChunks;
+				if (groupsX % (32) == 0)
+					groupsX = groupsX / (32);
+				else groupsX = groupsX / (32) + 1;
+				ImmediateContext->Dispatch(groupsX, 1, 1);
+
+				// clean up
+				ID3D11ShaderResourceView* noSrvs[] = { NULL, NULL };
+				ImmediateContext->CSSetShaderResources(0, 2, noSrvs);
+
+				ID3D11UnorderedAccessView* noUavs[] = { NULL };
+				ImmediateContext->CSSetUnorderedAccessViews(0, 1, noUavs, initialCounts);
+
+				ID3D11Buffer* noCbs[] = { NULL };
+				ImmediateContext->CSSetConstantBuffers(0, 1, noCbs);
+
+				ping = 1 - ping;	// ping pong!
+			}
 
-					for (int ta = 0; ta < 2; ++ta)
-					{
-						if (ta == 0)
-							_CbFadeToAlpha.Data.LaplaceWeight = laplaceWeight;
-						else
-							_CbFadeToAlpha.Data.LaplaceWeight = -laplaceWeight*1.01f;
-						_CbFadeToAlpha.UpdateBuffer(ImmediateContext);
+			// _SmoothingIterations Jacobi steps, one dispatch each
+			if (optimize && _SmoothingIterations > 0 && _Smoothing == SMOOTHING_JACOBI)
+			{
+				ImmediateContext->CSSetShader(_CsSmoothAlphaJacobi, NULL, 0);
 
-						if (ta == 1) continue;	// skip the shrinking..
+				ID3D11Buffer* cbs[] = { _CbFadeToAlpha.GetBuffer() };
+				ImmediateContext->CSSetConstantBuffers(0, 1, cbs);
 
-						ID3D11ShaderResourceView* srvs[] = { Geometry->GetSrvAlpha()[ping], Geometry->GetSrvLineID() };
-						ImmediateContext->CSSetShaderResources(0, 2, srvs);
+				for (int s = 0; s < _SmoothingIterations; ++s)
+				{
+					ID3D11ShaderResourceView* srvs[] = { Geometry->GetSrvAlpha()[ping], Geometry->GetSrvLineID() };
+					ImmediateContext->CSSetShaderResources(0, 2, srvs);
 
-						ID3D11UnorderedAccessView* uavs[] = { Geometry->GetUavAlpha()[1 - ping] };
-						UINT initialCounts[] = { 0, 0, 0, 0 };
-						ImmediateContext->CSSetUnorderedAccessViews(0, 1, uavs, initialCounts);
+					ID3D11UnorderedAccessView* uavs[] = { Geometry->GetUavAlpha()[1 - ping] };
+					UINT initialCounts[] = { 0, 0, 0, 0 };
+					ImmediateContext->CSSetUnorderedAccessViews(0, 1, uavs, initialCounts);
 
-						UINT groupsX = Geometry->GetTotalNumberOfControlPoints();
-						if (groupsX % (512) == 0)
-							groupsX = groupsX / (512);
-						else groupsX = groupsX / (512) + 1;
-						ImmediateContext->Dispatch(groupsX, 1, 1);
+					UINT groupsX = Geometry->GetTotalNumberOfControlPoints();
+					if (groupsX % (512) == 0)
+						groupsX = groupsX / (512);
+					else groupsX = groupsX / (512) + 1;
+					ImmediateContext->Dispatch(groupsX, 1, 1);
 
-						// clean up
-						ID3D11ShaderResourceView* noSrvs[] = { NULL, NULL };
-						ImmediateContext->CSSetShaderResources(0, 2, noSrvs);
+					// clean up
+					ID3D11ShaderResourceView* noSrvs[] = { NULL, NULL };
+					ImmediateContext->CSSetShaderResources(0, 2, noSrvs);
 
-						ID3D11UnorderedAccessView* noUavs[] = { NULL };
-						ImmediateContext->CSSetUnorderedAccessViews(0, 1, noUavs, initialCounts);
+					ID3D11UnorderedAccessView* noUavs[] = { NULL };
+					ImmediateContext->CSSetUnorderedAccessViews(0, 1, noUavs, initialCounts);
 
-						ping = 1 - ping;	// ping pong!
-					}
-					_CbFadeToAlpha.Data.LaplaceWeight = laplaceWeight;
+					ping = 1 - ping;	// ping pong!
 				}
 
 				ID3D11Buffer* noCbs[] = { NULL };
@@ -615,15 +811,16 @@ class Renderer
 
 			// -------------------------------------------
 #pragma region Fade the current alpha solution per vertex
+			if (optimize)
 			{
 				ImmediateContext->CSSetShader(_CsFadeAlpha, NULL, 0);
 
 				ID3D11ShaderResourceView* srvs[] = { Geometry->GetSrvAlpha()[ping], Geometry->GetSrvAlphaWeights() };
 				ImmediateContext->CSSetShaderResources(0, 2, srvs);
 
-				ID3D11UnorderedAccessView* uavs[] = { Geometry->GetUavCurrentAlpha() };
+				ID3D11UnorderedAccessView* uavs[] = { Geometry->GetUavCurrentAlpha(), _UavFrameStats };
 				UINT initialCounts[] = { 0,0,0,0 };
-				ImmediateContext->CSSetUnorderedAccessViews(0, 1, uavs, initialCounts);
+				ImmediateContext->CSSetUnorderedAccessViews(0, 2, uavs, initialCounts);
 
 				ID3D11Buffer* cbs[] = { _CbFadeToAlpha.GetBuffer() };
 				ImmediateContext->CSSetConstantBuffers(0, 1, cbs);
@@ -638,11 +835,14 @@ class Renderer
 				ID3D11ShaderResourceView* noSrvs[] = { NULL, NULL };
 				ImmediateContext->CSSetShaderResources(0, 2, noSrvs);
 
-				ID3D11UnorderedAccessView* noUavs[] = { NULL };
-				ImmediateContext->CSSetUnorderedAccessViews(0, 1, noUavs, initialCounts);
+				ID3D11UnorderedAccessView* noUavs[] = { NULL, NULL };
+				ImmediateContext->CSSetUnorderedAccessViews(0, 2, noUavs, initialCounts);
 
 				ID3D11Buffer* noCbs[] = { NULL };
 				ImmediateContext->CSSetConstantBuffers(0, 1, noCbs);
+
+				// the selected vertices need the faded alpha, too
+				Geometry->GatherCurrentAlpha(ImmediateContext, _CsGatherLodAlpha);
 			}
 #pragma endregion
 			// -------------------------------------------
@@ -708,9 +908,9 @@ class Renderer
 				ImmediateContext->PSSetShader(_PsSortFragments, NULL, 0);
 
 				{
-					ID3D11UnorderedAccessView* uavs[] = { _UavStartOffsetBuffer, _UavFragmentLinkBuffer };
-					UINT initialCount[] = { 0,0 };
-					ImmediateContext->OMSetRenderTargetsAndUnorderedAccessViews(1, rtvs, D3D->GetDsvBackbuffer(), 1, 2, uavs, initialCount);
+					ID3D11UnorderedAccessView* uavs[] = { _UavStartOffsetBuffer, _UavFragmentLinkBuffer, _UavFrameStats };
+					UINT initialCount[] = { 0,0,0 };
+					ImmediateContext->OMSetRenderTargetsAndUnorderedAccessViews(1, rtvs, D3D->GetDsvBackbuffer(), 1, 3, uavs, initialCount);
 				}
 
 				ImmediateContext->Draw(6, 0);
@@ -740,10 +940,61 @@ class Renderer
 			}
 #pragma endregion
 			// -------------------------------------------
+
+			// copy the statistics for the read back in one of the next frames
+			int copy = (int)(_FrameIndex % NUM_STATS_COPIES);
+			ImmediateContext->CopyResource(_FrameStatsStaging[copy], _FrameStatsBuffer);
+			_StatsCopyFrame[copy] = _FrameIndex;
+			_StatsCopyOptimized[copy] = optimize;
+			if (optimize) _NumOptimizedFrames++;
+			_FrameIndex++;
 		}
 
 	private:
 
+		// Reads the copies of the statistics that are done, from the oldest to the newest frame (if none is done yet, the old
+		// values are kept). The copies of later frames are not done either once one is busy.
+		void ReadFrameStatistics(ID3D11DeviceContext* ImmediateContext)
+		{
+			for (int n = 0; n < NUM_STATS_COPIES; ++n)
+			{
+				int copy = (int)((_FrameIndex + n) % NUM_STATS_COPIES);	// the oldest first
+				if (_StatsCopyFrame[copy] < 0) continue;
+				D3D11_MAPPED_SUBRESOURCE mappedCounters;
+				if (ImmediateContext->Map(_FrameStatsStaging[copy], 0, D3D11_MAP_READ, D3D11_MAP_FLAG_DO_NOT_WAIT, &mappedCounters) != S_OK)
+					break;
+				// a frame without optimization has no low res lists and no fade, the copy of a frame before the invalidation does not count
+				if (_StatsCopyOptimized[copy])
+					_NumLongListPixels[0] = (int)((const unsigned int*)mappedCounters.pData)[0];
+				_NumLongListPixels[1] = (int)((const unsigned int*)mappedCounters.pData)[1];
+				if (_StatsCopyOptimized[copy] && _StatsCopyFrame[copy] >= _InvalidationFrame)
+					memcpy(&_MaxAlphaDelta, (const unsigned int*)mappedCounters.pData + 2, sizeof(float));
+				ImmediateContext->Unmap(_FrameStatsStaging[copy], 0);
+				_StatsCopyFrame[copy] = -1;
+			}
+		}
+
+		ViewState GetViewState(D3D* D3D, Lines* Geometry, Camera* Camera) const
+		{
+			ViewState state;
+			memset(&state, 0, sizeof(ViewState));
+			state.View = Camera->GetParams().Data;
+			state.Parameters = _CbRenderer.Data;
+			state.Parameters.TotalNumberOfControlPoints = Geometry->GetTotalNumberOfControlPoints();
+			state.Parameters.ScreenWidth = (int)D3D->GetBackBufferSurfaceDesc().Width;
+			state.Parameters.ScreenHeight = (int)D3D->GetBackBufferSurfaceDesc().Height;
+			memset(state.Parameters.Padding, 0, sizeof(state.Parameters.Padding));
+			state.Fade = _CbFadeToAlpha.Data;
+			state.Fade.Diffusion = GetDiffusion();
+			state.Fade.NumControlPoints = Geometry->GetTotalNumberOfControlPoints();
+			state.Fade.Halo = AlphaSmoother::GetHalo(state.Fade.Diffusion);
+			memset(state.Fade.Padding, 0, sizeof(state.Fade.Padding));
+			state.SmoothingIterations = _SmoothingIterations;
+			state.Smoothing = _Smoothing;
+			state.LegacyShaders = _LegacyShaders ? 1 : 0;
+			return state;
+		}
+
 		ID3D11Buffer* _StartOffsetBuffer;
 		ID3D11Buffer* _FragmentLinkBuffer;
 		ID3D11Buffer* _VbViewportQuad;
@@ -757,6 +1008,18 @@ class Renderer
 		ID3D11UnorderedAccessView* _UavFragmentLinkBufferLowRes;
 		ID3D11UnorderedAccessView* _UavFourierCoef;
 
+		ID3D11Buffer* _FrameStatsBuffer;
+		ID3D11Buffer* _FrameStatsStaging[NUM_STATS_COPIES];
+		ID3D11UnorderedAccessView* _UavFrameStats;
+		int _NumLongListPixels[2];
+		float _MaxAlphaDelta;
+		long long _FrameIndex;							// of the next frame
+		long long _InvalidationFrame;					// first frame after the last InvalidateConvergence
+		int _NumOptimizedFrames;						// since the last InvalidateConvergence
+		long long _StatsCopyFrame[NUM_STATS_COPIES];	// frame of the copy that was not read yet, or -1
+		bool _StatsCopyOptimized[NUM_STATS_COPIES];		// the frame of the copy ran the optimization
+		ViewState _LastViewState;		// of the last optimized frame
+
 		ID3D11VertexShader* _VsLineShader_HQ;
 		ID3D11VertexShader* _VsLineShader_LowRes;
 		ID3D11VertexShader* _VsSortFragments;
@@ -780,6 +1043,9 @@ class Renderer
 
 		ID3D11ComputeShader* _CsFadeAlpha;
 		ID3D11ComputeShader* _CsSmoothAlpha;
+		ID3D11ComputeShader* _CsSmoothAlphaJacobi;
+		ID3D11ComputeShader* _CsGatherLod;
+		ID3D11ComputeShader* _CsGatherLodAlpha;
 		ConstantBuffer<CbFadeToAlpha> _CbFadeToAlpha;
 		ConstantBuffer<CbRenderer> _CbRenderer;
 
@@ -793,4 +1059,7 @@ class Renderer
 
 		int _ResolutionDownScale;
 		int _SmoothingIterations;
+		bool _LegacyShaders;
+		SmoothingMethod _Smoothing;
+		float _ConvergenceEpsilon;
 };
\ No newline at end of file
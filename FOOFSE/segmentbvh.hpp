@@ -0,0 +1,379 @@
+#pragma once
+
+#include "math.hpp"
+#include "parallel.hpp"
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <float.h>
+#include <stdio.h>
+
+// Bounding volume hierarchy over the line segments, for view frustum culling.
+// Segment i connects the vertices i and i + 1 (if both belong to the same line). The leaves are runs of SEGMENTS_PER_LEAF consecutive
+// segments, so the visible segments are found as a few contiguous ranges that can be drawn directly from the vertex buffers.
+// The tree is split at the median of the leaf centers along the largest axis. Nodes are stored depth-first with the left child
+// following its parent, so that every subtree occupies a fixed range of nodes and the subtrees can be built in parallel.
+
+class SegmentBvh
+{
+public:
+
+	static const int SEGMENTS_PER_LEAF = 64;
+
+	// Segments [First, First + Count).
+	struct Range
+	{
+		int First;
+		int Count;
+	};
+
+	SegmentBvh() : _NumSegments(0), _NumVertices(0) {}
+
+	void Build(const Vec3f* positions, const int* ids, int numVertices)
+	{
+		std::chrono::high_resolution_clock::time_point timeStart = std::chrono::high_resolution_clock::now();
+
+		_NumVertices = numVertices;
+		int numSlots = std::max(0, numVertices - 1);
+		int numLeaves = (numSlots + SEGMENTS_PER_LEAF - 1) / SEGMENTS_PER_LEAF;
+		_LeafBounds.resize(numLeaves);
+		_LeafSegments.resize(numLeaves);
+		_Visible.assign(numLeaves, 0);
+
+		// bounds of the leaves
+		ParallelFor(0, numLeaves, 256, [&](long long first, long long last) {
+			for (int leaf = (int)first; leaf < (int)last; ++leaf)
+			{
+				Bounds& bounds = _LeafBounds[leaf];
+				bounds.Reset();
+				int numSegments = 0;
+				int end = std::min((leaf + 1) * SEGMENTS_PER_LEAF, numSlots);
+				for (int s = leaf * SEGMENTS_PER_LEAF; s < end; ++s)
+				{
+					if (ids[s] != ids[s + 1]) continue;
+					bounds.Extend(positions[s]);
+					bounds.Extend(positions[s + 1]);
+					numSegments++;
+				}
+				_LeafSegments[leaf] = numSegments;
+			}
+		});
+
+		// only leaves with segments go into the tree
+		_Order.clear();
+		_NumSegments = 0;
+		for (int leaf = 0; leaf < numLeaves; ++leaf)
+		{
+			_NumSegments += _LeafSegments[leaf];
+			if (_LeafSegments[leaf] > 0)
+				_Order.push_back(leaf);
+		}
+		int numTreeLeaves = (int)_Order.size();
+		_Nodes.resize(numTreeLeaves > 0 ? 2 * numTreeLeaves - 1 : 0);
+
+		// split the top of the tree serially, then build the subtrees in parallel and finish the top bottom-up
+		if (numTreeLeaves > 0)
+		{
+			std::vector<Subtree> top, subtrees;
+			Subtree root = { 0, 0, numTreeLeaves };
+			subtrees.push_back(root);
+			int numSubtrees = ThreadPool::Global().GetNumThreads() * 4;
+			while ((int)subtrees.size() < numSubtrees)
+			{
+				std::vector<Subtree> next;
+				for (const Subtree& subtree : subtrees)
+				{
+					if (subtree.End - subtree.Begin <= SPLIT_SERIAL_MIN_LEAVES)
+					{
+						next.push_back(subtree);
+						continue;
+					}
+					top.push_back(subtree);
+					int mid = Split(subtree.Begin, subtree.End);
+					Subtree left = { subtree.Node + 1, subtree.Begin, mid };
+					Subtree right = { subtree.Node + 2 * (mid - subtree.Begin), mid, subtree.End };
+					_Nodes[subtree.Node].Right = right.Node;
+					_Nodes[subtree.Node].Leaf = -1;
+					next.push_back(left);
+					next.push_back(right);
+				}
+				if (next.size() == subtrees.size()) break;
+				subtrees.swap(next);
+			}
+			ThreadPool::Global().Run((int)subtrees.size(), [&](int t) {
+				BuildSubtree(subtrees[t].Node, subtrees[t].Begin, subtrees[t].End);
+			});
+			for (int i = (int)top.size() - 1; i >= 0; --i)
+			{
+				Node& node = _Nodes[top[i].Node];
+				node.Box = _Nodes[top[i].Node + 1].Box;
+				node.Box.Extend(_Nodes[node.Right].Box);
+			}
+		}
+
+		double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - timeStart).count();
+		printf("Built the segment BVH: %i segments, %i leaves, %i nodes in %.3f s\n", _NumSegments, numTreeLeaves, (int)_Nodes.size(), seconds);
+	}
+
+	bool IsEmpty() const { return _LeafBounds.empty(); }
+	int GetNumSegments() const { return _NumSegments; }
+
+	// Finds the segments inside the view frustum of the (row-major) camera matrices and returns their number.
+	// 'margin' widens the frustum in normalized device coordinates (e.g., by the width of the line strips).
+	// At most MAX_RANGES ranges are written; ranges separated by small gaps are merged if there are more.
+	int Cull(const XMFLOAT4X4& view, const XMFLOAT4X4& projection, float margin, std::vector<Range>& ranges)
+	{
+		ranges.clear();
+		if (_Nodes.empty()) return 0;
+
+		// frustum planes of the row-vector convention: clip = (x, y, z, 1) * viewProjection
+		XMFLOAT4X4 m;
+		XMStoreFloat4x4(&m, XMMatrixMultiply(XMLoadFloat4x4(&view), XMLoadFloat4x4(&projection)));
+		float col[4][4];
+		for (int c = 0; c < 4; ++c)
+			for (int r = 0; r < 4; ++r)
+				col[c][r] = m.m[r][c];
+		for (int k = 0; k < 4; ++k)
+		{
+			float w = col[3][k] * (1 + margin);
+			_Planes[0][k] = w + col[0][k];		// left
+			_Planes[1][k] = w - col[0][k];		// right
+			_Planes[2][k] = w + col[1][k];		// bottom
+			_Planes[3][k] = w - col[1][k];		// top
+			_Planes[4][k] = col[2][k];			// near
+			_Planes[5][k] = col[3][k] - col[2][k];	// far
+		}
+
+		// traverse the top of the tree serially and the subtrees in parallel
+		std::fill(_Visible.begin(), _Visible.end(), 0);
+		std::vector<std::pair<int, int> > subtrees;	// node, plane mask
+		std::vector<std::pair<int, int> > stack(1, std::make_pair(0, (int)ALL_PLANES));
+		int numSubtrees = ThreadPool::Global().GetNumThreads() * 4;
+		while (!stack.empty() && (int)(stack.size() + subtrees.size()) < numSubtrees)
+		{
+			std::pair<int, int> entry = stack.back();
+			stack.pop_back();
+			int mask = Classify(_Nodes[entry.first].Box, entry.second);
+			if (mask < 0) continue;
+			const Node& node = _Nodes[entry.first];
+			if (node.Leaf >= 0 || mask == 0)
+			{
+				subtrees.push_back(std::make_pair(entry.first, mask));
+				continue;
+			}
+			stack.push_back(std::make_pair(node.Right, mask));
+			stack.push_back(std::make_pair(entry.first + 1, mask));
+		}
+		subtrees.insert(subtrees.end(), stack.begin(), stack.end());
+		ThreadPool::Global().Run((int)subtrees.size(), [&](int t) {
+			CullSubtree(subtrees[t].first, subtrees[t].second);
+		});
+
+		// visible leaves in vertex order
+		int numVisible = 0;
+		int numSlots = std::max(0, _NumVertices - 1);
+		for (int leaf = 0; leaf < (int)_Visible.size(); ++leaf)
+		{
+			if (!_Visible[leaf]) continue;
+			numVisible += _LeafSegments[leaf];
+			int first = leaf * SEGMENTS_PER_LEAF;
+			int end = std::min(first + SEGMENTS_PER_LEAF, numSlots);
+			if (!ranges.empty() && ranges.back().First + ranges.back().Count == first)
+				ranges.back().Count = end - ranges.back().First;
+			else
+			{
+				Range range = { first, end - first };
+				ranges.push_back(range);
+			}
+		}
+		if ((int)ranges.size() > MAX_RANGES)
+			MergeRanges(ranges);
+		return numVisible;
+	}
+
+	// Sets visible[lineId] to 1 if any segment of the line was visible in the last Cull().
+	void GetVisibleLines(const int* lineOffsets, int numLines, std::vector<unsigned char>& visible) const
+	{
+		visible.resize(numLines);
+		ParallelFor(0, numLines, 1 << 12, [&](long long first, long long last) {
+			for (int lineId = (int)first; lineId < (int)last; ++lineId)
+			{
+				unsigned char v = 0;
+				if (lineOffsets[lineId + 1] - lineOffsets[lineId] >= 2)
+				{
+					int lastLeaf = (lineOffsets[lineId + 1] - 2) / SEGMENTS_PER_LEAF;
+					for (int leaf = lineOffsets[lineId] / SEGMENTS_PER_LEAF; leaf <= lastLeaf && !v; ++leaf)
+						v = _Visible[leaf];
+				}
+				visible[lineId] = v;
+			}
+		});
+	}
+
+private:
+
+	static const int MAX_RANGES = 256;
+	static const int SPLIT_SERIAL_MIN_LEAVES = 64;
+	static const int ALL_PLANES = (1 << 6) - 1;
+
+	struct Bounds
+	{
+		float Min[3];
+		float Max[3];
+
+		void Reset()
+		{
+			Min[0] = Min[1] = Min[2] = FLT_MAX;
+			Max[0] = Max[1] = Max[2] = -FLT_MAX;
+		}
+		void Extend(const Vec3f& p)
+		{
+			Min[0] = std::min(Min[0], p.x); Min[1] = std::min(Min[1], p.y); Min[2] = std::min(Min[2], p.z);
+			Max[0] = std::max(Max[0], p.x); Max[1] = std::max(Max[1], p.y); Max[2] = std::max(Max[2], p.z);
+		}
+		void Extend(const Bounds& b)
+		{
+			for (int k = 0; k < 3; ++k)
+			{
+				Min[k] = std::min(Min[k], b.Min[k]);
+				Max[k] = std::max(Max[k], b.Max[k]);
+			}
+		}
+	};
+
+	struct Node
+	{
+		Bounds Box;
+		int Right;	// index of the right child (the left child follows the node)
+		int Leaf;	// index of the leaf, or -1 for inner nodes
+	};
+
+	struct Subtree
+	{
+		int Node;
+		int Begin, End;	// range in _Order
+	};
+
+	// Partitions _Order[begin, end) at the median along the largest axis of the leaf centers. Returns the middle.
+	int Split(int begin, int end)
+	{
+		float lo[3] = { FLT_MAX, FLT_MAX, FLT_MAX }, hi[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+		for (int i = begin; i < end; ++i)
+		{
+			const Bounds& b = _LeafBounds[_Order[i]];
+			for (int k = 0; k < 3; ++k)
+			{
+				float c = b.Min[k] + b.Max[k];
+				lo[k] = std::min(lo[k], c);
+				hi[k] = std::max(hi[k], c);
+			}
+		}
+		int axis = 0;
+		if (hi[1] - lo[1] > hi[axis] - lo[axis]) axis = 1;
+		if (hi[2] - lo[2] > hi[axis] - lo[axis]) axis = 2;
+
+		int mid = begin + (end - begin) / 2;
+		std::nth_element(_Order.begin() + begin, _Order.begin() + mid, _Order.begin() + end, [&](int a, int b) {
+			float ca = _LeafBounds[a].Min[axis] + _LeafBounds[a].Max[axis];
+			float cb = _LeafBounds[b].Min[axis] + _LeafBounds[b].Max[axis];
+			return ca < cb || (ca == cb && a < b);
+		});
+		return mid;
+	}
+
+	void BuildSubtree(int nodeIndex, int begin, int end)
+	{
+		Node& node = _Nodes[nodeIndex];
+		if (end - begin == 1)
+		{
+			node.Box = _LeafBounds[_Order[begin]];
+			node.Right = -1;
+			node.Leaf = _Order[begin];
+			return;
+		}
+		int mid = Split(begin, end);
+		node.Right = nodeIndex + 2 * (mid - begin);
+		node.Leaf = -1;
+		BuildSubtree(nodeIndex + 1, begin, mid);
+		BuildSubtree(node.Right, mid, end);
+		node.Box = _Nodes[nodeIndex + 1].Box;
+		node.Box.Extend(_Nodes[node.Right].Box);
+	}
+
+	// Returns -1 if the box is outside of a plane, otherwise the mask of the planes that still intersect it.
+	int Classify(const Bounds& box, int mask) const
+	{
+		for (int p = 0; p < 6; ++p)
+		{
+			if (!(mask & (1 << p))) continue;
+			const float* plane = _Planes[p];
+			float nearest = plane[3], farthest = plane[3];
+			for (int k = 0; k < 3; ++k)
+			{
+				float a = plane[k] * box.Min[k], b = plane[k] * box.Max[k];
+				nearest += std::min(a, b);
+				farthest += std::max(a, b);
+			}
+			if (farthest < 0) return -1;
+			if (nearest >= 0) mask &= ~(1 << p);
+		}
+		return mask;
+	}
+
+	void CullSubtree(int root, int rootMask)
+	{
+		std::vector<std::pair<int, int> > stack(1, std::make_pair(root, rootMask));
+		while (!stack.empty())
+		{
+			std::pair<int, int> entry = stack.back();
+			stack.pop_back();
+			const Node& node = _Nodes[entry.first];
+			int mask = entry.second == 0 ? 0 : Classify(node.Box, entry.second);
+			if (mask < 0) continue;
+			if (node.Leaf >= 0)
+			{
+				_Visible[node.Leaf] = 1;
+				continue;
+			}
+			stack.push_back(std::make_pair(node.Right, mask));
+			stack.push_back(std::make_pair(entry.first + 1, mask));
+		}
+	}
+
+	// Merges the ranges across the smallest gaps until at most MAX_RANGES remain.
+	static void MergeRanges(std::vector<Range>& ranges)
+	{
+		std::vector<int> gaps(ranges.size() - 1);
+		for (size_t i = 0; i + 1 < ranges.size(); ++i)
+			gaps[i] = ranges[i + 1].First - (ranges[i].First + ranges[i].Count);
+		int numMerges = (int)ranges.size() - MAX_RANGES;
+		std::nth_element(gaps.begin(), gaps.begin() + numMerges - 1, gaps.end());
+		int maxGap = gaps[numMerges - 1];
+
+		// gaps below the threshold are always merged, equal ones until enough ranges are left
+		int numBelow = 0;
+		for (size_t i = 0; i + 1 < ranges.size(); ++i)
+			numBelow += ranges[i + 1].First - (ranges[i].First + ranges[i].Count) < maxGap;
+		int numEqual = numMerges - numBelow;
+
+		size_t out = 0;
+		for (size_t i = 1; i < ranges.size(); ++i)
+		{
+			int gap = ranges[i].First - (ranges[out].First + ranges[out].Count);
+			bool merge = gap < maxGap || (gap == maxGap && numEqual-- > 0);
+			if (merge)
+				ranges[out].Count = ranges[i].First + ranges[i].Count - ranges[out].First;
+			else ranges[++out] = ranges[i];
+		}
+		ranges.resize(out + 1);
+	}
+
+	int _NumSegments;
+	int _NumVertices;
+	std::vector<Bounds> _LeafBounds;
+	std::vector<int> _LeafSegments;			// number of segments per leaf
+	std::vector<int> _Order;				// leaves with segments, in tree order
+	std::vector<Node> _Nodes;
+	std::vector<unsigned char> _Visible;	// per leaf, result of the last Cull()
+	float _Planes[6][4];
+};
@@ -4,6 +4,16 @@
 #define MSAA_SAMPLES 2
 #endif
 
+#ifndef FOURIER_HARMONICS
+// number of Fourier coefficients of the opacity estimate (2, 4, 8 or 16), also sets the layout of the coefficient buffer
+#define FOURIER_HARMONICS 4
+#endif
+
+// opacity estimators of the min gather (RendererParameters.OpacityEstimator, Renderer::SetOpacityEstimator)
+#define OPACITY_ESTIMATOR_RAW 0			// exact sums over the sorted fragment lists
+#define OPACITY_ESTIMATOR_FOURIER 1		// Fourier series of the importance over the depth
+#define OPACITY_ESTIMATOR_FOM 2			// Fourier series of the importance over the fragment order
+
 #ifndef _WIN32
 #ifdef MSAA_SAMPLES
 
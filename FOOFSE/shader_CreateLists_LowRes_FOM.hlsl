@@ -22,6 +22,7 @@ cbuffer RendererParameters : register(b1)
 	float HaloPortion;
 	int ScreenWidth;
 	int ScreenHeight;
+	int OpacityEstimator;		// OPACITY_ESTIMATOR_* (shader_Common.hlsli)
 }
 
 struct FragmentData
@@ -39,8 +40,8 @@ struct FragmentLink
 
 struct FourierCoef
 {
-    float4 fFourierA;
-    float4 fFourierB;
+    float fFourierA[FOURIER_HARMONICS];
+    float fFourierB[FOURIER_HARMONICS];
 };
 
 // Fragment And Link Buffer
@@ -194,15 +195,12 @@ void PS( PS_INPUT10 input)
     float depth = 0;
     
     // Fourier
-    int FourierLength = 4;
-    FourierCoefs[0].fFourierA[0] = 0.0f;
-    FourierCoefs[0].fFourierA[1] = 0.0f;
-    FourierCoefs[0].fFourierA[2] = 0.0f;
-    FourierCoefs[0].fFourierA[3] = 0.0f;
-    FourierCoefs[0].fFourierB[0] = 0.0f;
-    FourierCoefs[0].fFourierB[1] = 0.0f;
-    FourierCoefs[0].fFourierB[2] = 0.0f;
-    FourierCoefs[0].fFourierB[3] = 0.0f;
+    [unroll]
+    for (int c = 0; c < FOURIER_HARMONICS; c++)
+    {
+        FourierCoefs[0].fFourierA[c] = 0.0f;
+        FourierCoefs[0].fFourierB[c] = 0.0f;
+    }
 
 	int isHalo;
 	float halfDistCenter = abs(input.TexCoord.x - 0.5);
@@ -238,8 +236,8 @@ void PS( PS_INPUT10 input)
 		element.fragmentData.fAlphaWeight = input.AlphaWeight;
 		element.fragmentData.fImportance = saturate(input.Importance);
         
-        [allow_uav_condition]
-        for (int k = 0; k < FourierLength; k++)
+        [unroll]
+        for (int k = 0; k < FOURIER_HARMONICS; k++)
         {
             FourierCoefs[0].fFourierA[k] += 2 * element.fragmentData.fImportance * element.fragmentData.fImportance * cos(2 * Pi * element.fragmentData.uDepth * k);
             FourierCoefs[0].fFourierB[k] += 2 * element.fragmentData.fImportance * element.fragmentData.fImportance * sin(2 * Pi * element.fragmentData.uDepth * k);
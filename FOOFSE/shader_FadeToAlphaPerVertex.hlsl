@@ -3,12 +3,15 @@
 ByteAddressBuffer AlphaBuffer : register( t0 );  // alphas per control point (to fade to)
 ByteAddressBuffer AlphaWeight : register( t1 );  // blending weights used for fetching from the control point alphas
 RWByteAddressBuffer CurrentBuffer : register( u0 ); // alphas per vertex (current state)
+RWByteAddressBuffer FrameStats : register( u1 );	// statistics of the frame, [2] = largest change of an alpha (float bits)
 
 cbuffer FadeToAlphaBuffer : register(b0)
 {
     float FadeToAlpha;
 }
 
+groupshared uint MaxDelta;
+
 float GetCpBlendedValue(ByteAddressBuffer buffer, float weight)
 {
 	int firstField = 0;
@@ -20,15 +23,29 @@ float GetCpBlendedValue(ByteAddressBuffer buffer, float weight)
 }
 
 [numthreads(NUM_THREADS, 1, 1)]
-void CS( uint DTid : SV_DispatchThreadID )
+void CS( uint DTid : SV_DispatchThreadID, uint GI : SV_GroupIndex )
 {
+	if (GI == 0) MaxDelta = 0;
+	GroupMemoryBarrierWithGroupSync();
+
+	uint size;
+	CurrentBuffer.GetDimensions(size);
 	uint addr = DTid * 4;
+	if (addr < size)
+	{
+		float current = asfloat(CurrentBuffer.Load(addr));	// loads the current value
+		float alphaWeight = asfloat(AlphaWeight.Load(addr)); // get alpha weight -> tells us from control points to interpolate
+
+		float target = GetCpBlendedValue(AlphaBuffer, alphaWeight); // interpolate the alpha value at this position
+
+		float newAlpha = current + (target - current) * FadeToAlpha; // fade to the new alpha
+		CurrentBuffer.Store(addr, asuint(newAlpha)); // store it
 
-	float current = asfloat(CurrentBuffer.Load(addr));	// loads the current value
-	float alphaWeight = asfloat(AlphaWeight.Load(addr)); // get alpha weight -> tells us from control points to interpolate
+		// positive floats compare like their bits
+		InterlockedMax(MaxDelta, asuint(abs(newAlpha - current)));
+	}
 
-	float target = GetCpBlendedValue(AlphaBuffer, alphaWeight); // interpolate the alpha value at this position
-	
-	float newAlpha = current + (target - current) * FadeToAlpha; // fade to the new alpha
-	CurrentBuffer.Store(addr, asuint(newAlpha)); // store it
+	// one atomic per group for the convergence test on the CPU
+	GroupMemoryBarrierWithGroupSync();
+	if (GI == 0) FrameStats.InterlockedMax(8, MaxDelta);
 }
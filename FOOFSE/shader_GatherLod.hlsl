@@ -0,0 +1,22 @@
+#define NUM_THREADS 512
+
+ByteAddressBuffer Indices : register( t0 );			// selected vertices (level of detail)
+ByteAddressBuffer Position : register( t1 );
+ByteAddressBuffer ID : register( t2 );
+ByteAddressBuffer Importance : register( t3 );
+ByteAddressBuffer AlphaWeight : register( t4 );
+RWByteAddressBuffer LodPosition : register( u0 );	// attributes of the selected vertices
+RWByteAddressBuffer LodID : register( u1 );
+RWByteAddressBuffer LodImportance : register( u2 );
+RWByteAddressBuffer LodAlphaWeight : register( u3 );
+
+[numthreads(NUM_THREADS, 1, 1)]
+void CS( uint DTid : SV_DispatchThreadID )
+{
+	uint index = Indices.Load(DTid * 4);
+
+	LodPosition.Store3(DTid * 12, Position.Load3(index * 12));
+	LodID.Store(DTid * 4, ID.Load(index * 4));
+	LodImportance.Store(DTid * 4, Importance.Load(index * 4));
+	LodAlphaWeight.Store(DTid * 4, AlphaWeight.Load(index * 4));
+}
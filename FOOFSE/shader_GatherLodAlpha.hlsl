@@ -0,0 +1,12 @@
+#define NUM_THREADS 512
+
+ByteAddressBuffer Indices : register( t0 );				// selected vertices (level of detail)
+ByteAddressBuffer CurrentAlpha : register( t5 );		// alphas per vertex (current state)
+RWByteAddressBuffer LodCurrentAlpha : register( u4 );	// alphas of the selected vertices
+
+[numthreads(NUM_THREADS, 1, 1)]
+void CS( uint DTid : SV_DispatchThreadID )
+{
+	uint index = Indices.Load(DTid * 4);
+	LodCurrentAlpha.Store(DTid * 4, CurrentAlpha.Load(index * 4));
+}
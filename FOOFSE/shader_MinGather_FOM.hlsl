@@ -15,8 +15,8 @@ struct FragmentLink
 
 struct FourierCoef
 {
-    float4 fFourierA;
-    float4 fFourierB;
+    float fFourierA[FOURIER_HARMONICS];
+    float fFourierB[FOURIER_HARMONICS];
 };
 
 
@@ -38,12 +38,14 @@ cbuffer RendererParameters : register(b1)
 	float HaloPortion;
 	int ScreenWidth;
 	int ScreenHeight;
+	int OpacityEstimator;		// OPACITY_ESTIMATOR_* (shader_Common.hlsli)
 }
 
 RWByteAddressBuffer StartOffsetSRV					: register( u1 );
 RWStructuredBuffer< FragmentLink >  FragmentLinkSRV	: register( u2 );
 RWStructuredBuffer< FourierCoef > FourierCoefs      : register( u3 );
 RWByteAddressBuffer AlphaBufferUAV					: register( u4 );
+RWByteAddressBuffer LongListCounter					: register( u5 );	// [0] = number of pixels with a long list
 
 
 
@@ -69,7 +71,7 @@ struct QuadPS_Input
     float4 pos                : SV_POSITION; 
 };
 
-// Max hardcoded.
+// Lists longer than this are counted as long lists (they used to be truncated here).
 #define TEMPORARY_BUFFER_MAX        256
 #define Pi                          3.1415926
 
@@ -113,16 +115,20 @@ void PS_FOM(QuadPS_Input input)
     }
 
     float gall = 0;
-    float ak[5] = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
-    float bk[5] = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
-    int length = 5;
+    uint numFragments = 0;
+    float ak[FOURIER_HARMONICS];
+    float bk[FOURIER_HARMONICS];
+    [unroll]
+    for (int c = 0; c < FOURIER_HARMONICS; c++)
+    {
+        ak[c] = 0.0f;
+        bk[c] = 0.0f;
+    }
     
-	// First pass - iterate and sum up the squared importance
+	// First pass - iterate and sum up the squared importance (running sums, so lists of any length are streamed)
 	[allow_uav_condition]
-    for (int iii = 0; iii < TEMPORARY_BUFFER_MAX; iii++)
+    while (nNext != 0xFFFFFFFF)
     {
-        if (nNext == 0xFFFFFFFF)
-            break;
         FragmentLink element = FragmentLinkSRV[nNext];
         
         float gi = clamp(element.fragmentData.fImportance, 0.001, 0.999);
@@ -131,25 +137,27 @@ void PS_FOM(QuadPS_Input input)
 
         gall = gall + gi * gi;
         
-        [allow_uav_condition]
-        for (int k = 0; k < length; k++)
+        [unroll]
+        for (int k = 0; k < FOURIER_HARMONICS; k++)
         {
             ak[k] += Gak(k, gi, di);
             bk[k] += Gbk(k, gi, di);
         }
         
+        numFragments++;
         nNext = element.nNext;
     }
 
+    if (numFragments > TEMPORARY_BUFFER_MAX)
+        LongListCounter.InterlockedAdd(0, 1);
+
     nNext = StartOffsetSRV.Load(nIndex * 4);
     float gf = 0;
 
     // second pass - compute the alpha values and write to file!
 	[allow_uav_condition]
-    for (int ii = 0; ii < TEMPORARY_BUFFER_MAX; ii++)
+    while (nNext != 0xFFFFFFFF)
     {
-        if (nNext == 0xFFFFFFFF)
-            break;
         FragmentLink element = FragmentLinkSRV[nNext];
         
         float gi = clamp(element.fragmentData.fImportance, 0.001, 0.999);
@@ -158,8 +166,8 @@ void PS_FOM(QuadPS_Input input)
         float gb = gall - gf - gi * gi;
         float Gdi = ak[0] * di / 2;
 
-        [allow_uav_condition]
-        for (int k = 1; k < length; k++)
+        [unroll]
+        for (int k = 1; k < FOURIER_HARMONICS; k++)
         {
             Gdi += Gd(di, ak[k], bk[k], k);
         }
@@ -202,13 +210,12 @@ void PS_RAW(QuadPS_Input input)
 
 
     float gall = 0;
+    uint numFragments = 0;
 	
-	// First pass - iterate and sum up the squared importance
+	// First pass - iterate and sum up the squared importance (running sums, so lists of any length are streamed)
 	[allow_uav_condition]
-    for (int iii = 0; iii < TEMPORARY_BUFFER_MAX; iii++)
+    while (nNext != 0xFFFFFFFF)
     {
-        if (nNext == 0xFFFFFFFF)
-            break;
         FragmentLink element = FragmentLinkSRV[nNext];
         
         //float gi = clamp(((element.fragmentData.uDepthImportance >> 8) & 0xFFFFFF) / 16777216.0f, 0.001, 0.999);
@@ -216,19 +223,21 @@ void PS_RAW(QuadPS_Input input)
         float gi = clamp(element.fragmentData.fImportance, 0.001, 0.999);
         gall = gall + gi * gi;
 
+        numFragments++;
         nNext = element.nNext;
     }
 
+    if (numFragments > TEMPORARY_BUFFER_MAX)
+        LongListCounter.InterlockedAdd(0, 1);
+
     nNext = StartOffsetSRV.Load(nIndex * 4);
     float gf = 0;
 
 
     // second pass - compute the alpha values and write to file!
 	[allow_uav_condition]
-    for (int ii = 0; ii < TEMPORARY_BUFFER_MAX; ii++)
+    while (nNext != 0xFFFFFFFF)
     {
-        if (nNext == 0xFFFFFFFF)
-            break;
         FragmentLink element = FragmentLinkSRV[nNext];
         
         //float gi = clamp(((element.fragmentData.uDepthImportance) & 0xFF) / 255.0f, 0.001, 0.999);
@@ -269,14 +278,12 @@ void PS_FOURIER(QuadPS_Input input)
     }
 
     float gall = 0;
-    int length = 4;
+    uint numFragments = 0;
     
-	// First pass - iterate and sum up the squared importance
+	// First pass - iterate and sum up the squared importance (running sums, so lists of any length are streamed)
 	[allow_uav_condition]
-    for (int iii = 0; iii < TEMPORARY_BUFFER_MAX; iii++)
+    while (nNext != 0xFFFFFFFF)
     {
-        if (nNext == 0xFFFFFFFF)
-            break;
         FragmentLink element = FragmentLinkSRV[nNext];
         
         float gi = clamp(element.fragmentData.fImportance, 0.001, 0.999);
@@ -285,18 +292,20 @@ void PS_FOURIER(QuadPS_Input input)
 
         gall = gall + gi * gi;
         
+        numFragments++;
         nNext = element.nNext;
     }
 
+    if (numFragments > TEMPORARY_BUFFER_MAX)
+        LongListCounter.InterlockedAdd(0, 1);
+
     nNext = StartOffsetSRV.Load(nIndex * 4);
     float gf = 0;
 
     // second pass - compute the alpha values and write to file!
 	[allow_uav_condition]
-    for (int ii = 0; ii < TEMPORARY_BUFFER_MAX; ii++)
+    while (nNext != 0xFFFFFFFF)
     {
-        if (nNext == 0xFFFFFFFF)
-            break;
         FragmentLink element = FragmentLinkSRV[nNext];
         
         float gi = clamp(element.fragmentData.fImportance, 0.001, 0.999);
@@ -305,8 +314,8 @@ void PS_FOURIER(QuadPS_Input input)
         float gb = gall - gf - gi * gi;
         float Gdi = FourierCoefs[0].fFourierA[0] * di / 2;
         
-        [allow_uav_condition]
-        for (int k = 1; k < length; k++)
+        [unroll]
+        for (int k = 1; k < FOURIER_HARMONICS; k++)
         {
             Gdi += Gd(di, FourierCoefs[0].fFourierA[k], FourierCoefs[0].fFourierB[k], k);
         }
@@ -336,7 +345,10 @@ void PS_FOURIER(QuadPS_Input input)
 
 void PS(QuadPS_Input input)
 {
-    //PS_RAW(input);
-    PS_FOURIER(input);
-
+    if (OpacityEstimator == OPACITY_ESTIMATOR_RAW)
+        PS_RAW(input);
+    else if (OpacityEstimator == OPACITY_ESTIMATOR_FOM)
+        PS_FOM(input);
+    else
+        PS_FOURIER(input);
 }
\ No newline at end of file
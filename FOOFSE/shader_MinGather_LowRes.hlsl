@@ -31,6 +31,7 @@ cbuffer RendererParameters : register(b1)
 	float HaloPortion;
 	int ScreenWidth;
 	int ScreenHeight;
+	int OpacityEstimator;		// OPACITY_ESTIMATOR_* (shader_Common.hlsli)
 }
 
 RWByteAddressBuffer StartOffsetSRV					: register( u1 );
@@ -59,8 +60,6 @@ struct QuadPS_Input
     float4 pos                : SV_POSITION; 
 };
 
-// Max hardcoded.
-#define TEMPORARY_BUFFER_MAX        256
 #define Pi                          3.1415926
 
 float Gd(float di, float ak, float bk, int k)
@@ -103,16 +102,19 @@ void PS_FOM(QuadPS_Input input)
     }
 
     float gall = 0;
-    float ak[5] = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
-    float bk[5] = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
-    int length = 5;
+    float ak[FOURIER_HARMONICS];
+    float bk[FOURIER_HARMONICS];
+    [unroll]
+    for (int c = 0; c < FOURIER_HARMONICS; c++)
+    {
+        ak[c] = 0.0f;
+        bk[c] = 0.0f;
+    }
     
 	// First pass - iterate and sum up the squared importance
 	[allow_uav_condition]
-    for (int iii = 0; iii < TEMPORARY_BUFFER_MAX; iii++)
+    while (nNext != 0xFFFFFFFF)
     {
-        if (nNext == 0xFFFFFFFF)
-            break;
         FragmentLink element = FragmentLinkSRV[nNext];
         
         float gi = clamp(element.fragmentData.fImportance, 0.001, 0.999);
@@ -121,8 +123,8 @@ void PS_FOM(QuadPS_Input input)
 
         gall = gall + gi * gi;
         
-        [allow_uav_condition]
-        for (int k = 0; k < length; k++)
+        [unroll]
+        for (int k = 0; k < FOURIER_HARMONICS; k++)
         {
             ak[k] += Gak(k, gi, di);
             bk[k] += Gbk(k, gi, di);
@@ -136,10 +138,8 @@ void PS_FOM(QuadPS_Input input)
 
     // second pass - compute the alpha values and write to file!
 	[allow_uav_condition]
-    for (int ii = 0; ii < TEMPORARY_BUFFER_MAX; ii++)
+    while (nNext != 0xFFFFFFFF)
     {
-        if (nNext == 0xFFFFFFFF)
-            break;
         FragmentLink element = FragmentLinkSRV[nNext];
         
         float gi = clamp(element.fragmentData.fImportance, 0.001, 0.999);
@@ -148,8 +148,8 @@ void PS_FOM(QuadPS_Input input)
         float gb = gall - gf - gi * gi;
         float Gdi = ak[0] * di / 2;
 
-        [allow_uav_condition]
-        for (int k = 1; k < length; k++)
+        [unroll]
+        for (int k = 1; k < FOURIER_HARMONICS; k++)
         {
             Gdi += Gd(di, ak[k], bk[k], k);
         }
@@ -262,10 +262,8 @@ void PS_RAW(QuadPS_Input input)
 	
 	// First pass - iterate and sum up the squared importance
 	[allow_uav_condition]
-    for (int iii = 0; iii < TEMPORARY_BUFFER_MAX; iii++)
+    while (nNext != 0xFFFFFFFF)
     {
-        if (nNext == 0xFFFFFFFF)
-            break;
         FragmentLink element = FragmentLinkSRV[nNext];
         
         //float gi = clamp(((element.fragmentData.uDepthImportance >> 8) & 0xFFFFFF) / 16777216.0f, 0.001, 0.999);
@@ -282,10 +280,8 @@ void PS_RAW(QuadPS_Input input)
 
     // second pass - compute the alpha values and write to file!
 	[allow_uav_condition]
-    for (int ii = 0; ii < TEMPORARY_BUFFER_MAX; ii++)
+    while (nNext != 0xFFFFFFFF)
     {
-        if (nNext == 0xFFFFFFFF)
-            break;
         FragmentLink element = FragmentLinkSRV[nNext];
         
         //float gi = clamp(((element.fragmentData.uDepthImportance) & 0xFF) / 255.0f, 0.001, 0.999);
@@ -314,7 +310,9 @@ void PS_RAW(QuadPS_Input input)
 
 void PS(QuadPS_Input input)
 {
-    //PS_RAW(input);
-    PS_FOM(input);
-
+    // there is no Fourier buffer here, so FOURIER falls back to FOM
+    if (OpacityEstimator == OPACITY_ESTIMATOR_RAW)
+        PS_RAW(input);
+    else
+        PS_FOM(input);
 }
\ No newline at end of file
@@ -31,6 +31,7 @@ cbuffer RendererParameters : register(b1)
 	float HaloPortion;
 	int ScreenWidth;
 	int ScreenHeight;
+	int OpacityEstimator;		// OPACITY_ESTIMATOR_* (shader_Common.hlsli)
 }
 
 RWByteAddressBuffer StartOffsetSRV					: register( u1 );
@@ -58,9 +59,6 @@ struct QuadPS_Input
     float4 pos                : SV_POSITION; 
 };
 
-// Max hardcoded.
-#define TEMPORARY_BUFFER_MAX        256
-
 float4 GetColor(uint nColor)
 {
     float4 color;        
@@ -100,10 +98,8 @@ float4 PS( QuadPS_Input input ) : SV_Target0
 
     // Iterate the list and blend 
 	[allow_uav_condition]
-	for (int ii = 0; ii < TEMPORARY_BUFFER_MAX; ii++)
+	while (nNext != 0xFFFFFFFF)
 	{
-		if ( nNext == 0xFFFFFFFF )
-			break;
         FragmentLink element = FragmentLinkSRV[nNext];
         
 #ifdef MSAA_SAMPLES
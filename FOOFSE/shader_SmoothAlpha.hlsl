@@ -1,39 +1,116 @@
-#define NUM_THREADS 512
+#define NUM_THREADS 32
+#define CHUNK_SIZE 64		// AlphaSmoother::CHUNK_SIZE
 
-ByteAddressBuffer AlphaPing : register( t0 );  // alphas per control point (to fade to)
-ByteAddressBuffer LineID : register( t1 );		// line indices per control point
-RWByteAddressBuffer AlphaPong : register( u0 ); // alphas per vertex (current state)
+// One implicit smoothing step along every line, solved directly (see smoothing.hpp):
+//     u - Diffusion * (avg(neighbors) - u) = u_0,   u = 1 - alpha
+// Every thread solves a chunk of CHUNK_SIZE control points in a window with Halo control points on both sides, so that long
+// lines are spread over many threads. The forward sweep from the left end of the window and the backward sweep from the
+// right end meet in every control point of the chunk (twisted factorization). Line changes and untouched control points (NaN)
+// split the system.
+
+ByteAddressBuffer LineID : register( t0 );		// line indices per control point
+ByteAddressBuffer AlphaPing : register( t1 );	// alphas per control point (input)
+RWByteAddressBuffer AlphaPong : register( u0 ); // smoothed alphas per control point
 
 cbuffer FadeToAlphaBuffer : register(b0)
 {
     float FadeToAlpha;
 	float LaplaceWeight;
+	float Diffusion;			// SmoothingIterations * LaplaceWeight
+	uint NumControlPoints;
+	uint Halo;					// AlphaSmoother::GetHalo(Diffusion)
 }
 
-[numthreads(NUM_THREADS, 1, 1)]
-void CS( uint DTid : SV_DispatchThreadID )
-{
-	uint addr = DTid * 4;
+groupshared float2 Forward[NUM_THREADS * CHUNK_SIZE];	// factors (c, d) of the forward sweep:  x_i = d_i - c_i x_(i+1)
 
-	float3 values = 1 - asfloat(AlphaPing.Load3(addr - 4));	// loads three values (left, current, right)
-	uint3 indices = LineID.Load3(addr - 4);					// loads the indices
+float LoadAlpha(uint i) { return asfloat(AlphaPing.Load(i * 4)); }
 
-	float weight = 0;
-	float target = 0;
-	if (indices.x == indices.y && values.x == values.x) { 
-		target += values.x;
-		weight += 1;
-	}
-	if (indices.z == indices.y && values.z == values.z) {
-		target += values.z;
-		weight += 1;
-	}
+// the control points i and i + 1 are valid neighbors on the same line
+bool IsConnected(uint i)
+{
+	float a = LoadAlpha(i), b = LoadAlpha(i + 1);
+	if (a != a || b != b) return false;
+	return LineID.Load(i * 4) == LineID.Load((i + 1) * 4);
+}
 
-	if (weight > 0) target /= weight;
+[numthreads(NUM_THREADS, 1, 1)]
+void CS( uint DTid : SV_DispatchThreadID, uint GI : SV_GroupIndex )
+{
+	uint first = DTid * CHUNK_SIZE;
+	if (first >= NumControlPoints) return;
+	uint last = min(NumControlPoints, first + CHUNK_SIZE);
+	uint begin = first > Halo ? first - Halo : 0;
+	uint end = min(NumControlPoints, last + Halo);
+	uint slot = GI * CHUNK_SIZE;
+	float b = 1 + Diffusion;
 
-	float newAlpha = 0;
-	if (weight > 0)
-		newAlpha = values.y + (target - values.y) * LaplaceWeight; // fade to the new alpha
+	// forward sweep up to the control point before the last one of the chunk
+	float c = 0, d = 0;
+	uint i;
+	[allow_uav_condition]
+	for (i = begin; i + 1 < last; ++i)
+	{
+		float alpha = LoadAlpha(i);
+		if (alpha == alpha)
+		{
+			bool left = false, right = false;
+			if (i > begin) left = IsConnected(i - 1);
+			if (i + 1 < end) right = IsConnected(i);
+			float lower = left ? (right ? -0.5f * Diffusion : -Diffusion) : 0;
+			float upper = right ? (left ? -0.5f * Diffusion : -Diffusion) : 0;
+			float m = 1 / (b - lower * c);
+			c = upper * m;
+			d = ((1 - alpha) - lower * d) * m;
+		}
+		if (i + 1 >= first) Forward[slot + i + 1 - first] = float2(c, d);
+	}
 
-	AlphaPong.Store(addr, asuint(1 - newAlpha));
+	// backward sweep down to the chunk:  x_i = e_i - f_i x_(i-1)
+	float f = 0, e = 0;
+	[allow_uav_condition]
+	for (i = end; i > first; --i)
+	{
+		uint k = i - 1;
+		float alpha = LoadAlpha(k);
+		bool left = false, right = false;
+		if (k > begin) left = IsConnected(k - 1);
+		if (k + 1 < end) right = IsConnected(k);
+		if (alpha != alpha)
+		{
+			// untouched control points stay untouched next to valid ones, else 1
+			if (k < last)
+			{
+				uint line = LineID.Load(k * 4);
+				bool hasNeighbor = false;
+				if (k > 0)
+				{
+					float l = LoadAlpha(k - 1);
+					hasNeighbor = l == l && LineID.Load((k - 1) * 4) == line;
+				}
+				if (k + 1 < NumControlPoints)
+				{
+					float r = LoadAlpha(k + 1);
+					hasNeighbor = hasNeighbor || (r == r && LineID.Load((k + 1) * 4) == line);
+				}
+				AlphaPong.Store(k * 4, hasNeighbor ? asuint(alpha) : asuint(1.0f));
+			}
+			continue;
+		}
+		float lower = left ? (right ? -0.5f * Diffusion : -Diffusion) : 0;
+		float upper = right ? (left ? -0.5f * Diffusion : -Diffusion) : 0;
+		float u = 1 - alpha;
+		if (k < last)
+		{
+			float x = 0;	// a single control point has no neighbors: alpha 1
+			if (left || right)
+			{
+				float2 cd = left ? Forward[slot + k - first] : float2(0, 0);
+				x = (u - lower * cd.y - upper * e) / (b - lower * cd.x - upper * f);
+			}
+			AlphaPong.Store(k * 4, asuint(1 - x));
+		}
+		float m = 1 / (b - upper * f);
+		f = lower * m;
+		e = (u - upper * e) * m;
+	}
 }
@@ -31,10 +31,12 @@ cbuffer RendererParameters : register(b1)
 	float HaloPortion;
 	int ScreenWidth;
 	int ScreenHeight;
+	int OpacityEstimator;		// OPACITY_ESTIMATOR_* (shader_Common.hlsli)
 }
 
 RWByteAddressBuffer StartOffsetSRV					: register( u1 );
 RWStructuredBuffer< FragmentLink >  FragmentLinkSRV	: register( u2 );
+RWByteAddressBuffer LongListCounter					: register( u3 );	// [1] = number of pixels that took the long-list path
 
 struct QuadVSinput
 {
@@ -58,10 +60,72 @@ struct QuadPS_Input
 	float4 pos                : SV_POSITION;
 };
 
-// Max hardcoded.
-// We're in trouble if the fragment linked list is larger than this...
+// Lists up to this length are sorted in the temporary buffer.
+// Longer lists are sorted in chunks of this length, which are then merged by updating the Next-Links.
 #define TEMPORARY_BUFFER_MAX        256
 
+// Bottom-up merge sort of a list that consists of sorted runs of nWidth fragments. Returns the new head of the list.
+uint MergeSortedRuns(uint nHead, uint nNumFragment, uint nWidth)
+{
+	[allow_uav_condition]
+	for (; nWidth < nNumFragment; nWidth *= 2)
+	{
+		uint nNewHead = 0xFFFFFFFF;
+		uint nTail = 0xFFFFFFFF;
+		uint nRest = nHead;
+
+		[allow_uav_condition]
+		while (nRest != 0xFFFFFFFF)
+		{
+			// split off the next two runs
+			uint nA = nRest;
+			uint nNumA = 0;
+			[allow_uav_condition]
+			while (nNumA < nWidth && nRest != 0xFFFFFFFF)
+			{
+				nRest = FragmentLinkSRV[nRest].nNext;
+				nNumA++;
+			}
+			uint nB = nRest;
+			uint nNumB = 0;
+			[allow_uav_condition]
+			while (nNumB < nWidth && nRest != 0xFFFFFFFF)
+			{
+				nRest = FragmentLinkSRV[nRest].nNext;
+				nNumB++;
+			}
+
+			// merge them (the link of a fragment is read before it is overwritten as the tail)
+			[allow_uav_condition]
+			while (nNumA + nNumB > 0)
+			{
+				bool bTakeA = nNumB == 0;
+				if (nNumA > 0 && nNumB > 0)
+					bTakeA = FragmentLinkSRV[nA].fragmentData.nDepth <= FragmentLinkSRV[nB].fragmentData.nDepth;
+
+				uint nTake;
+				if (bTakeA) {
+					nTake = nA;
+					nA = FragmentLinkSRV[nA].nNext;
+					nNumA--;
+				} else {
+					nTake = nB;
+					nB = FragmentLinkSRV[nB].nNext;
+					nNumB--;
+				}
+
+				if (nTail == 0xFFFFFFFF)
+					nNewHead = nTake;
+				else FragmentLinkSRV[nTail].nNext = nTake;
+				nTail = nTake;
+			}
+		}
+		FragmentLinkSRV[nTail].nNext = 0xFFFFFFFF;
+		nHead = nNewHead;
+	}
+	return nHead;
+}
+
 void PS( QuadPS_Input input )
 {   
 	// index to current pixel.
@@ -69,49 +133,66 @@ void PS( QuadPS_Input input )
 
 	FragmentData aData[ TEMPORARY_BUFFER_MAX ];            // temporary buffer
 	uint nNumFragment = 0;                                // number of fragments in current pixel's linked list.
-	uint nNext = StartOffsetSRV.Load(nIndex * 4);                // get first fragment from the start offset buffer.
-	uint nFirst = nNext;
+	uint nFirst = StartOffsetSRV.Load(nIndex * 4);       // get first fragment from the start offset buffer.
+	uint nChunk = nFirst;
 
 	// early exit if no fragments in the linked list.
-	if( nNext == 0xFFFFFFFF ) {
+	if( nFirst == 0xFFFFFFFF ) {
 		return;
 	}
 
-	// Read and store linked list data to the temporary buffer.    
+	// Sort the list in chunks of TEMPORARY_BUFFER_MAX fragments. Short lists are a single chunk.
 	[allow_uav_condition]
-	for (int ii = 0; ii < TEMPORARY_BUFFER_MAX; ii++)
+	while (nChunk != 0xFFFFFFFF)
 	{
-		if ( nNext == 0xFFFFFFFF )
-			break;
-		FragmentLink element = FragmentLinkSRV[nNext];
-		aData[ nNumFragment ] = element.fragmentData;
-		
-		nNumFragment++;
-		nNext = element.nNext;
-	}
-	
-	// insertion sort
-	[allow_uav_condition]
-	for (uint jj = 1; jj < nNumFragment; jj++)
-	{
-		FragmentData valueToInsert = aData[jj];
-		uint holePos;
+		// Read and store linked list data to the temporary buffer.    
+		uint nNumChunk = 0;
+		uint nNext = nChunk;
+		[allow_uav_condition]
+		for (int ii = 0; ii < TEMPORARY_BUFFER_MAX; ii++)
+		{
+			if ( nNext == 0xFFFFFFFF )
+				break;
+			FragmentLink element = FragmentLinkSRV[nNext];
+			aData[ nNumChunk ] = element.fragmentData;
+			
+			nNumChunk++;
+			nNext = element.nNext;
+		}
 		
+		// insertion sort
 		[allow_uav_condition]
-		for (holePos=jj; holePos>0; holePos--)
+		for (uint jj = 1; jj < nNumChunk; jj++)
 		{
-			if (valueToInsert.nDepth > aData[holePos - 1].nDepth) break;
-			aData[holePos] = aData[holePos - 1];
+			FragmentData valueToInsert = aData[jj];
+			uint holePos;
+			
+			[allow_uav_condition]
+			for (holePos=jj; holePos>0; holePos--)
+			{
+				if (valueToInsert.nDepth > aData[holePos - 1].nDepth) break;
+				aData[holePos] = aData[holePos - 1];
+			}
+			aData[holePos] = valueToInsert;
 		}
-		aData[holePos] = valueToInsert;
+
+		// Store the sorted chunk.
+		nNext = nChunk;
+		[allow_uav_condition]
+		for( uint x = 0; x < nNumChunk; ++x )
+		{
+			FragmentLinkSRV[nNext].fragmentData = aData[ x ];		// front to back
+			nNext = FragmentLinkSRV[nNext].nNext;
+		}
+
+		nNumFragment += nNumChunk;
+		nChunk = nNext;
 	}
 
-	// Store the sorted list. This is not efficient! Its better to update the Next-Links instead.
-	nNext = nFirst;
-	[allow_uav_condition]
-	for( uint x = 0; x < nNumFragment; ++x )
+	// Long list: merge the sorted chunks.
+	if (nNumFragment > TEMPORARY_BUFFER_MAX)
 	{
-		FragmentLinkSRV[nNext].fragmentData = aData[ x ];		// front to back
-		nNext = FragmentLinkSRV[nNext].nNext;
+		LongListCounter.InterlockedAdd(4, 1);
+		StartOffsetSRV.Store(nIndex * 4, MergeSortedRuns(nFirst, nNumFragment, TEMPORARY_BUFFER_MAX));
 	}
 }
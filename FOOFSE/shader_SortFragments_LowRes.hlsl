@@ -31,6 +31,7 @@ cbuffer RendererParameters : register(b1)
 	float HaloPortion;
 	int ScreenWidth;
 	int ScreenHeight;
+	int OpacityEstimator;		// OPACITY_ESTIMATOR_* (shader_Common.hlsli)
 }
 
 RWByteAddressBuffer StartOffsetSRV					: register( u1 );
@@ -58,9 +59,76 @@ struct QuadPS_Input
     float4 pos                : SV_POSITION;
 };
 
-// Max hardcoded.
+// Lists up to this length are sorted in the temporary buffer.
+// Longer lists are sorted in chunks of this length, which are then merged by updating the Next-Links.
 #define TEMPORARY_BUFFER_MAX        256
 
+// Bottom-up merge sort of a list that consists of sorted runs of nWidth fragments. Returns the new head of the list.
+uint MergeSortedRuns(uint nHead, uint nNumFragment, uint nWidth)
+{
+	[allow_uav_condition]
+    for (; nWidth < nNumFragment; nWidth *= 2)
+    {
+        uint nNewHead = 0xFFFFFFFF;
+        uint nTail = 0xFFFFFFFF;
+        uint nRest = nHead;
+
+		[allow_uav_condition]
+        while (nRest != 0xFFFFFFFF)
+        {
+            // split off the next two runs
+            uint nA = nRest;
+            uint nNumA = 0;
+			[allow_uav_condition]
+            while (nNumA < nWidth && nRest != 0xFFFFFFFF)
+            {
+                nRest = FragmentLinkSRV[nRest].nNext;
+                nNumA++;
+            }
+            uint nB = nRest;
+            uint nNumB = 0;
+			[allow_uav_condition]
+            while (nNumB < nWidth && nRest != 0xFFFFFFFF)
+            {
+                nRest = FragmentLinkSRV[nRest].nNext;
+                nNumB++;
+            }
+
+            // merge them (the link of a fragment is read before it is overwritten as the tail)
+			[allow_uav_condition]
+            while (nNumA + nNumB > 0)
+            {
+                bool bTakeA = nNumB == 0;
+                if (nNumA > 0 && nNumB > 0)
+                    bTakeA = FragmentLinkSRV[nA].fragmentData.uDepthImportance <= FragmentLinkSRV[nB].fragmentData.uDepthImportance;
+
+                uint nTake;
+                if (bTakeA)
+                {
+                    nTake = nA;
+                    nA = FragmentLinkSRV[nA].nNext;
+                    nNumA--;
+                }
+                else
+                {
+                    nTake = nB;
+                    nB = FragmentLinkSRV[nB].nNext;
+                    nNumB--;
+                }
+
+                if (nTail == 0xFFFFFFFF)
+                    nNewHead = nTake;
+                else
+                    FragmentLinkSRV[nTail].nNext = nTake;
+                nTail = nTake;
+            }
+        }
+        FragmentLinkSRV[nTail].nNext = 0xFFFFFFFF;
+        nHead = nNewHead;
+    }
+    return nHead;
+}
+
 void PS_RAW( QuadPS_Input input )
 {   
     // index to current pixel.
@@ -68,89 +136,73 @@ void PS_RAW( QuadPS_Input input )
 
     FragmentData aData[ TEMPORARY_BUFFER_MAX ];            // temporary buffer
     uint nNumFragment = 0;                                 // number of fragments in current pixel's linked list.
-    uint nNext = StartOffsetSRV.Load(nIndex * 4);          // get first fragment from the start offset buffer.
-    uint nFirst = nNext;
-	float allAlpha = 1;
+    uint nFirst = StartOffsetSRV.Load(nIndex * 4);         // get first fragment from the start offset buffer.
+    uint nChunk = nFirst;
 
     // early exit if no fragments in the linked list.
-    if ( nNext == 0xFFFFFFFF ) {
+    if ( nFirst == 0xFFFFFFFF ) {
 		return;
     }
 
-    // Read and store linked list data to the temporary buffer.    
+    // Sort the list in chunks of TEMPORARY_BUFFER_MAX fragments. Short lists are a single chunk.
 	[allow_uav_condition]
-	for (int ii = 0; ii < TEMPORARY_BUFFER_MAX; ii++)
-	{
-		if ( nNext == 0xFFFFFFFF )
-			break;
-        
-        FragmentLink element = FragmentLinkSRV[nNext];
-        aData[ nNumFragment ] = element.fragmentData;
-
-        nNumFragment++;                   
-        nNext = element.nNext;
-    }
-	
-	// insertion sort
-	[allow_uav_condition]
-    for (uint jj = 1; jj < nNumFragment; jj++)
+    while (nChunk != 0xFFFFFFFF)
     {
-        FragmentData valueToInsert = aData[jj];
-        uint holePos;
-		
+        // Read and store linked list data to the temporary buffer.    
+        uint nNumChunk = 0;
+        uint nNext = nChunk;
 		[allow_uav_condition]
-        for (holePos = jj; holePos > 0; holePos--)
+        for (int ii = 0; ii < TEMPORARY_BUFFER_MAX; ii++)
         {
-            if (valueToInsert.uDepthImportance > aData[holePos - 1].uDepthImportance)
+            if ( nNext == 0xFFFFFFFF )
                 break;
-            aData[holePos] = aData[holePos - 1];
+            
+            FragmentLink element = FragmentLinkSRV[nNext];
+            aData[ nNumChunk ] = element.fragmentData;
+
+            nNumChunk++;                   
+            nNext = element.nNext;
         }
-        aData[holePos] = valueToInsert;
-    }
 	
-	// Store the sorted list. This is not efficient! Its better to update the Next-Links instead.
-    nNext = nFirst;
-	[allow_uav_condition]
-    for (uint x = 0; x < nNumFragment; ++x)
-    {
-        FragmentLinkSRV[nNext].fragmentData = aData[x]; // front to back
-        nNext = FragmentLinkSRV[nNext].nNext;
-    }
-}
-
-void PS_FOM( QuadPS_Input input )
-{
-    // index to current pixel.
-    uint nIndex = (uint) input.pos.y * ScreenWidth + (uint) input.pos.x;
-
-    FragmentData aData[TEMPORARY_BUFFER_MAX]; // temporary buffer
-    uint nNumFragment = 0; // number of fragments in current pixel's linked list.
-    uint nNext = StartOffsetSRV.Load(nIndex * 4); // get first fragment from the start offset buffer.
-    uint nFirst = nNext;
-    float allAlpha = 1;
+        // insertion sort
+		[allow_uav_condition]
+        for (uint jj = 1; jj < nNumChunk; jj++)
+        {
+            FragmentData valueToInsert = aData[jj];
+            uint holePos;
+		
+			[allow_uav_condition]
+            for (holePos = jj; holePos > 0; holePos--)
+            {
+                if (valueToInsert.uDepthImportance > aData[holePos - 1].uDepthImportance)
+                    break;
+                aData[holePos] = aData[holePos - 1];
+            }
+            aData[holePos] = valueToInsert;
+        }
+	
+        // Store the sorted chunk.
+        nNext = nChunk;
+		[allow_uav_condition]
+        for (uint x = 0; x < nNumChunk; ++x)
+        {
+            FragmentLinkSRV[nNext].fragmentData = aData[x]; // front to back
+            nNext = FragmentLinkSRV[nNext].nNext;
+        }
 
-    // early exit if no fragments in the linked list.
-    if (nNext == 0xFFFFFFFF)
-    {
-        return;
+        nNumFragment += nNumChunk;
+        nChunk = nNext;
     }
 
-    // Read and store linked list data to the temporary buffer.    
-	[allow_uav_condition]
-    for (int ii = 0; ii < TEMPORARY_BUFFER_MAX; ii++)
+    // Long list: merge the sorted chunks.
+    if (nNumFragment > TEMPORARY_BUFFER_MAX)
     {
-        if (nNext == 0xFFFFFFFF)
-            break;
-        
-        FragmentLink element = FragmentLinkSRV[nNext];
-        aData[nNumFragment] = element.fragmentData;
-
-        nNumFragment++;
-        nNext = element.nNext;
+        StartOffsetSRV.Store(nIndex * 4, MergeSortedRuns(nFirst, nNumFragment, TEMPORARY_BUFFER_MAX));
     }
 }
 
+// only drawn for the RAW estimator, the others don't need the order
 void PS( QuadPS_Input input )
 {
-    PS_FOM(input);
+    PS_RAW(input);
 }
@@ -0,0 +1,217 @@
+#pragma once
+
+#include "vec.hpp"
+#include "parallel.hpp"
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+
+// Optional load-time reduction of oversampled polylines. Both methods keep the end points of every line.
+//  - DOUGLAS_PEUCKER keeps a subset of the vertices, such that no removed vertex is farther than 'Tolerance' (world space) from the simplified line.
+//  - RESAMPLE places the vertices at uniform arc length, about 'SegmentLength' apart, and interpolates the importance linearly.
+// The importance is carried along if there is one value per vertex. Otherwise it can't be associated with the vertices and is dropped.
+
+class LineSimplifier
+{
+public:
+
+	enum Method
+	{
+		NONE,
+		DOUGLAS_PEUCKER,
+		RESAMPLE
+	};
+
+	struct Settings
+	{
+		Settings() : Type(NONE), Tolerance(0), SegmentLength(0) {}
+
+		Method Type;
+		float Tolerance;		// maximal distance of a removed vertex (DOUGLAS_PEUCKER)
+		float SegmentLength;	// target distance of the vertices (RESAMPLE)
+
+		bool IsActive() const { return (Type == DOUGLAS_PEUCKER && Tolerance >= 0) || (Type == RESAMPLE && SegmentLength > 0); }
+
+		// Identifies the settings, e.g., in the key of a cache. 0 if nothing is simplified.
+		uint64_t GetKey() const
+		{
+			if (!IsActive()) return 0;
+			float parameter = Type == DOUGLAS_PEUCKER ? Tolerance : SegmentLength;
+			uint32_t bits;
+			memcpy(&bits, &parameter, sizeof(bits));
+			return ((uint64_t)Type << 32) | bits;
+		}
+	};
+
+	// Appends the simplified line. 'importance' is NULL or has one value per vertex.
+	static void SimplifyLine(const Settings& settings, const Vec3f* positions, const float* importance, int numPositions,
+		std::vector<Vec3f>& outPositions, std::vector<float>& outImportance)
+	{
+		if (numPositions <= 2 || !settings.IsActive())
+		{
+			outPositions.insert(outPositions.end(), positions, positions + numPositions);
+			if (importance) outImportance.insert(outImportance.end(), importance, importance + numPositions);
+			return;
+		}
+		if (settings.Type == DOUGLAS_PEUCKER)
+			DouglasPeucker(positions, importance, numPositions, settings.Tolerance, outPositions, outImportance);
+		else Resample(positions, importance, numPositions, settings.SegmentLength, outPositions, outImportance);
+	}
+
+	// Simplifies all lines in parallel and rebuilds the line offsets and the line index per vertex.
+	static void Apply(const Settings& settings, std::vector<Vec3f>& positions, std::vector<float>& importance, std::vector<int>& lineOffsets, std::vector<int>& ids)
+	{
+		if (!settings.IsActive() || lineOffsets.size() < 2) return;
+		std::chrono::high_resolution_clock::time_point timeStart = std::chrono::high_resolution_clock::now();
+
+		int numLines = (int)lineOffsets.size() - 1;
+		int numVertices = lineOffsets[numLines];
+		bool withImportance = !importance.empty() && importance.size() == positions.size();
+		if (!withImportance && !importance.empty())
+			printf("The importance does not have one value per vertex and is dropped by the simplification.\n");
+
+		// every task simplifies the lines that start in an equally-sized range of vertices
+		ThreadPool& pool = ThreadPool::Global();
+		int numTasks = std::max(1, std::min(numLines, pool.GetNumThreads() * 4));
+		std::vector<int> taskFirstLine(numTasks + 1, numLines);
+		for (int t = 0; t < numTasks; ++t)
+			taskFirstLine[t] = (int)(std::lower_bound(lineOffsets.begin(), lineOffsets.end() - 1, (int)((long long)numVertices * t / numTasks)) - lineOffsets.begin());
+		taskFirstLine[0] = 0;
+
+		std::vector<std::vector<Vec3f> > taskPositions(numTasks);
+		std::vector<std::vector<float> > taskImportance(numTasks);
+		std::vector<int> lineSizes(numLines);
+		pool.Run(numTasks, [&](int t) {
+			for (int lineId = taskFirstLine[t]; lineId < taskFirstLine[t + 1]; ++lineId)
+			{
+				int lineBegin = lineOffsets[lineId];
+				size_t sizeBefore = taskPositions[t].size();
+				SimplifyLine(settings, positions.data() + lineBegin, withImportance ? importance.data() + lineBegin : NULL, lineOffsets[lineId + 1] - lineBegin,
+					taskPositions[t], taskImportance[t]);
+				lineSizes[lineId] = (int)(taskPositions[t].size() - sizeBefore);
+			}
+		});
+
+		// concatenate the results
+		for (int lineId = 0; lineId < numLines; ++lineId)
+			lineOffsets[lineId + 1] = lineOffsets[lineId] + lineSizes[lineId];
+		int numSimplified = lineOffsets[numLines];
+		positions.resize(numSimplified);
+		importance.resize(withImportance ? numSimplified : 0);
+		ids.resize(numSimplified);
+		pool.Run(numTasks, [&](int t) {
+			int first = lineOffsets[taskFirstLine[t]];
+			std::copy(taskPositions[t].begin(), taskPositions[t].end(), positions.begin() + first);
+			std::copy(taskImportance[t].begin(), taskImportance[t].end(), importance.begin() + first);
+			for (int lineId = taskFirstLine[t]; lineId < taskFirstLine[t + 1]; ++lineId)
+				std::fill(ids.begin() + lineOffsets[lineId], ids.begin() + lineOffsets[lineId + 1], lineId);
+		});
+		std::vector<Vec3f>(positions).swap(positions);	// release the memory of the removed vertices
+		std::vector<float>(importance).swap(importance);
+		std::vector<int>(ids).swap(ids);
+
+		double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - timeStart).count();
+		printf("Simplified %i lines: %i -> %i vertices (%.1f%%, reduction %.2fx) in %.3f s\n", numLines, numVertices, numSimplified,
+			numVertices > 0 ? 100.0 * numSimplified / numVertices : 100.0, numSimplified > 0 ? (double)numVertices / numSimplified : 1.0, seconds);
+	}
+
+	// Squared distance of p to the segment a-b.
+	static inline float DistanceToSegmentSq(const Vec3f& p, const Vec3f& a, const Vec3f& b)
+	{
+		float abx = b.x - a.x, aby = b.y - a.y, abz = b.z - a.z;
+		float apx = p.x - a.x, apy = p.y - a.y, apz = p.z - a.z;
+		float lengthSq = abx * abx + aby * aby + abz * abz;
+		float t = lengthSq > 0 ? std::min(1.0f, std::max(0.0f, (apx * abx + apy * aby + apz * abz) / lengthSq)) : 0.0f;
+		float dx = apx - t * abx, dy = apy - t * aby, dz = apz - t * abz;
+		return dx * dx + dy * dy + dz * dz;
+	}
+
+private:
+
+	static void DouglasPeucker(const Vec3f* positions, const float* importance, int numPositions, float tolerance,
+		std::vector<Vec3f>& outPositions, std::vector<float>& outImportance)
+	{
+		std::vector<char> keep(numPositions, 0);
+		keep[0] = keep[numPositions - 1] = 1;
+
+		// split the range at the farthest vertex, until all vertices are within the tolerance
+		float toleranceSq = tolerance * tolerance;
+		std::vector<std::pair<int, int> > stack(1, std::make_pair(0, numPositions - 1));
+		while (!stack.empty())
+		{
+			int first = stack.back().first;
+			int last = stack.back().second;
+			stack.pop_back();
+
+			float maxDistanceSq = -1;
+			int farthest = -1;
+			for (int i = first + 1; i < last; ++i)
+			{
+				float distanceSq = DistanceToSegmentSq(positions[i], positions[first], positions[last]);
+				if (distanceSq > maxDistanceSq)
+				{
+					maxDistanceSq = distanceSq;
+					farthest = i;
+				}
+			}
+			if (farthest >= 0 && maxDistanceSq > toleranceSq)
+			{
+				keep[farthest] = 1;
+				stack.push_back(std::make_pair(first, farthest));
+				stack.push_back(std::make_pair(farthest, last));
+			}
+		}
+
+		for (int i = 0; i < numPositions; ++i)
+		{
+			if (!keep[i]) continue;
+			outPositions.push_back(positions[i]);
+			if (importance) outImportance.push_back(importance[i]);
+		}
+	}
+
+	static void Resample(const Vec3f* positions, const float* importance, int numPositions, float segmentLength,
+		std::vector<Vec3f>& outPositions, std::vector<float>& outImportance)
+	{
+		// arc length at every vertex
+		std::vector<double> arcLength(numPositions);
+		arcLength[0] = 0;
+		for (int i = 1; i < numPositions; ++i)
+		{
+			double dx = positions[i].x - positions[i - 1].x, dy = positions[i].y - positions[i - 1].y, dz = positions[i].z - positions[i - 1].z;
+			arcLength[i] = arcLength[i - 1] + sqrt(dx * dx + dy * dy + dz * dz);
+		}
+		double length = arcLength[numPositions - 1];
+		if (!(length > 0))
+		{
+			outPositions.insert(outPositions.end(), positions, positions + numPositions);
+			if (importance) outImportance.insert(outImportance.end(), importance, importance + numPositions);
+			return;
+		}
+
+		int numSegments = std::max(1, (int)(length / segmentLength + 0.5));
+		double step = length / numSegments;
+		outPositions.push_back(positions[0]);
+		if (importance) outImportance.push_back(importance[0]);
+
+		int segment = 0;
+		for (int k = 1; k < numSegments; ++k)
+		{
+			double s = step * k;
+			while (segment < numPositions - 2 && arcLength[segment + 1] < s) ++segment;
+			double segmentArc = arcLength[segment + 1] - arcLength[segment];
+			float t = segmentArc > 0 ? (float)((s - arcLength[segment]) / segmentArc) : 0.0f;
+			const Vec3f& a = positions[segment];
+			const Vec3f& b = positions[segment + 1];
+			outPositions.push_back(Vec3f(a.x + (b.x - a.x) * t, a.y + (b.y - a.y) * t, a.z + (b.z - a.z) * t));
+			if (importance) outImportance.push_back(importance[segment] + (importance[segment + 1] - importance[segment]) * t);
+		}
+
+		outPositions.push_back(positions[numPositions - 1]);
+		if (importance) outImportance.push_back(importance[numPositions - 1]);
+	}
+};
@@ -0,0 +1,413 @@
+#pragma once
+
+#include "parallel.hpp"
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <math.h>
+#include <stdio.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_IX86)
+#include <emmintrin.h>
+#define SMOOTHING_SSE
+#endif
+
+// Smoothing of the alpha values along the control points of every line (the CPU version of shader_SmoothAlpha).
+// The renderer used to run a number of Jacobi steps  u <- u + w (avg(neighbors) - u)  on u = 1 - alpha, which only spread
+// a few control points per frame. Instead, the implicit step of the same operator
+//     u - t (avg(neighbors) - u) = u_0,   t = iterations * w
+// is solved exactly. Its smoothing kernel has the variance t, like iterations Jacobi steps of the weight w, but it reaches
+// along the whole line. The system of a line is tridiagonal and diagonally dominant, so it is solved with the Thomas
+// algorithm without pivoting, in one pass per line. The lines are solved in parallel.
+// The implicit step is not the same as the Jacobi steps: its kernel decays exponentially instead of like a Gaussian. In the
+// benchmark driver (bench/bench.cpp) the alphas differ by 2.2e-3 on average and up to 0.12 from those of 10 Jacobi steps of 0.1
+// (t = 1), and by 1.6e-3 and up to 0.09 from 100 steps (t = 10). Until a mapping reproduces the Jacobi steps, they stay the
+// default of the renderer (Renderer::SMOOTHING_JACOBI).
+//
+// A single thread per line serializes long lines on the GPU, so shader_SmoothAlpha solves chunks of CHUNK_SIZE control
+// points instead (SmoothChunked is its CPU version). Every chunk is solved with a halo on both sides: the influence of a
+// control point decays like r^distance, r = ((1 + t) - sqrt(1 + 2t)) / t, so a halo of GetHalo(t) control points keeps the
+// error of the cut off system below 1e-7. The halo is at most MAX_HALO, so t is clamped to GetMaxDiffusion. Within the window, the chunk is solved with a twisted factorization: a forward
+// sweep from the left end of the window up to the chunk, a backward sweep from the right end, and both meet in every
+// control point of the chunk. Only the factors of the forward sweep in the chunk are stored.
+// Untouched control points (NaN, no fragment in the min gather) are not smoothed and split the line, as in the Jacobi step;
+// control points without a valid neighbor get alpha 1, as in the shader.
+//
+// For the explicit smoothing, JacobiFused runs several Jacobi steps per block of BLOCK_SIZE control points while the block
+// is in the cache, instead of one sweep over all control points per step. Every block is loaded with a halo of one control
+// point per step on both sides (overlapped tiling): the values in the halo get wrong from its outer end, one control point
+// per step, and never reach the block. The halo ends at the line boundaries, where nothing leaks in anyway. The step itself
+// compares the line indices of the neighbors like shader_SmoothAlpha and is vectorized with SSE2; the result is that of single
+// steps (Jacobi) up to rounding, since the fused steps stay in u = 1 - alpha.
+
+class AlphaSmoother
+{
+public:
+
+	// control points per block of JacobiFused (without the halos)
+	static const int BLOCK_SIZE = 2048;
+	// control points per chunk of SmoothChunked (CHUNK_SIZE in shader_SmoothAlpha) and the largest halo
+	static const int CHUNK_SIZE = 64;
+	static const int MAX_HALO = 256;
+
+	// the diffusion time t with the variance of 'iterations' Jacobi steps of the weight 'laplaceWeight' (not the same kernel, see above)
+	static float GetDiffusion(int iterations, float laplaceWeight) { return iterations * laplaceWeight; }
+
+	// the largest t whose halo fits into MAX_HALO (about 500 for the error 1e-7): r^MAX_HALO = epsilon, t = 2 r / (1 - r)^2
+	static float GetMaxDiffusion(float epsilon = 1e-7f)
+	{
+		double r = pow((double)epsilon, 1.0 / MAX_HALO);
+		return (float)(2 * r / ((1 - r) * (1 - r)));
+	}
+
+	// control points on both sides of a chunk for an error below 'epsilon' (at most MAX_HALO, i.e. t up to GetMaxDiffusion)
+	static int GetHalo(float t, float epsilon = 1e-7f)
+	{
+		if (t <= 0) return 1;
+		double r = ((1.0 + t) - sqrt(1.0 + 2.0 * t)) / t;
+		int halo = (int)ceil(log((double)epsilon) / log(r));
+		return std::min(std::max(halo, 1), MAX_HALO);
+	}
+
+	// Finds the lines: runs of control points with the same line index (LineSet::GetControlPointLineIndices).
+	void SetLines(const unsigned int* controlPointLineIndices, int numControlPoints)
+	{
+		_LineStarts.clear();
+		_LineOfControlPoint.resize(numControlPoints);
+		for (int cp = 0; cp < numControlPoints; ++cp)
+		{
+			if (cp == 0 || controlPointLineIndices[cp] != controlPointLineIndices[cp - 1])
+				_LineStarts.push_back(cp);
+			_LineOfControlPoint[cp] = (unsigned int)_LineStarts.size() - 1;
+		}
+		_LineStarts.push_back(numControlPoints);
+	}
+
+	int GetNumberOfLines() const { return _LineStarts.empty() ? 0 : (int)_LineStarts.size() - 1; }
+	int GetNumberOfControlPoints() const { return _LineStarts.empty() ? 0 : _LineStarts.back(); }
+
+	// One implicit step with the diffusion time t on all lines. 'result' must not be 'alphas'.
+	void Smooth(const float* alphas, float t, float* result) const
+	{
+		ParallelFor(0, GetNumberOfLines(), 1 << 6, [&](long long first, long long last) {
+			std::vector<float> c;
+			for (long long line = first; line < last; ++line)
+			{
+				int begin = _LineStarts[line], end = _LineStarts[line + 1];
+				SolveLine(alphas + begin, end - begin, t, result + begin, c);
+			}
+		});
+	}
+
+	// The implicit step solved in chunks with halos, as in shader_SmoothAlpha. 'result' must not be 'alphas'.
+	// t is clamped to GetMaxDiffusion, like in the renderer (which warns about it when it is created).
+	void SmoothChunked(const float* alphas, float t, float* result) const
+	{
+		t = std::min(t, GetMaxDiffusion());
+		int n = GetNumberOfControlPoints();
+		int halo = GetHalo(t);
+		int numChunks = (n + CHUNK_SIZE - 1) / CHUNK_SIZE;
+		ParallelFor(0, numChunks, 1 << 6, [&](long long first, long long last) {
+			float forward[2 * CHUNK_SIZE];
+			for (long long chunk = first; chunk < last; ++chunk)
+				SolveChunk(alphas, (int)chunk * CHUNK_SIZE, std::min(n, ((int)chunk + 1) * CHUNK_SIZE), t, halo, result, forward);
+		});
+	}
+
+	// One Jacobi step of the weight w, as shader_SmoothAlpha_Jacobi.
+	void Jacobi(const float* alphas, float w, float* result) const
+	{
+		ParallelFor(0, GetNumberOfLines(), 1 << 6, [&](long long first, long long last) {
+			for (long long line = first; line < last; ++line)
+			{
+				int begin = _LineStarts[line], end = _LineStarts[line + 1];
+				for (int cp = begin; cp < end; ++cp)
+				{
+					float u = 1 - alphas[cp], target = 0, weight = 0;
+					if (cp > begin && IsValid(alphas[cp - 1])) { target += 1 - alphas[cp - 1]; weight += 1; }
+					if (cp + 1 < end && IsValid(alphas[cp + 1])) { target += 1 - alphas[cp + 1]; weight += 1; }
+					float smoothed = weight > 0 ? u + (target / weight - u) * w : 0;
+					result[cp] = 1 - smoothed;
+				}
+			}
+		});
+	}
+
+	// 'iterations' Jacobi steps of the weight w, fused per block. 'result' must not be 'alphas'.
+	void JacobiFused(const float* alphas, int iterations, float w, float* result) const
+	{
+		int n = GetNumberOfControlPoints();
+		if (iterations <= 0)
+		{
+			std::copy(alphas, alphas + n, result);
+			return;
+		}
+		int numBlocks = (n + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		ParallelFor(0, numBlocks, 1, [&](long long first, long long last) {
+			// u = 1 - alpha of the block and its halos, with a guard at both ends that belongs to no line
+			std::vector<float> ping, pong;
+			std::vector<unsigned int> lines;
+			for (long long block = first; block < last; ++block)
+			{
+				int begin = (int)block * BLOCK_SIZE, end = std::min(n, begin + BLOCK_SIZE);
+				int lo = std::max(begin - iterations, GetLineStart(begin));
+				int hi = std::min(end + iterations, GetLineEnd(end - 1));
+				int count = hi - lo;
+
+				ping.resize(count + 2);
+				pong.resize(count + 2);
+				lines.resize(count + 2);
+				ping[0] = ping[count + 1] = pong[0] = pong[count + 1] = 0;
+				lines[0] = lines[count + 1] = NO_LINE;
+				for (int i = 0; i < count; ++i)
+				{
+					ping[i + 1] = 1 - alphas[lo + i];
+					lines[i + 1] = _LineOfControlPoint[lo + i];
+				}
+
+				for (int s = 0; s < iterations; ++s)
+				{
+					Step(ping.data(), lines.data(), 1, count + 1, w, pong.data());
+					ping.swap(pong);
+				}
+
+				for (int cp = begin; cp < end; ++cp)
+					result[cp] = 1 - ping[cp - lo + 1];
+			}
+		});
+	}
+
+	// Compares 'iterations' Jacobi steps of the weight w (single and fused) with the direct solve (per line and in chunks): time
+	// per frame and the difference of the results. Returns false if the fused steps differ from the single ones or the chunks
+	// from the lines by more than rounding.
+	bool Benchmark(const float* alphas, int iterations, float w, int numFrames = 10) const
+	{
+		int n = GetNumberOfControlPoints();
+		std::vector<float> ping(n), pong(n), fused(n), direct(n), chunked(n);
+		float t = std::min(GetDiffusion(iterations, w), GetMaxDiffusion());	// of the direct and the chunked solve
+		double secondsJacobi = 0, secondsFused = 0, secondsDirect = 0, secondsChunked = 0;
+		for (int frame = 0; frame < numFrames; ++frame)
+		{
+			std::chrono::high_resolution_clock::time_point timeStart = std::chrono::high_resolution_clock::now();
+			std::copy(alphas, alphas + n, ping.begin());
+			for (int s = 0; s < iterations; ++s)
+			{
+				Jacobi(ping.data(), w, pong.data());
+				ping.swap(pong);
+			}
+			std::chrono::high_resolution_clock::time_point timeJacobi = std::chrono::high_resolution_clock::now();
+			JacobiFused(alphas, iterations, w, fused.data());
+			std::chrono::high_resolution_clock::time_point timeFused = std::chrono::high_resolution_clock::now();
+			Smooth(alphas, t, direct.data());
+			std::chrono::high_resolution_clock::time_point timeDirect = std::chrono::high_resolution_clock::now();
+			SmoothChunked(alphas, t, chunked.data());
+			std::chrono::high_resolution_clock::time_point timeEnd = std::chrono::high_resolution_clock::now();
+			secondsJacobi += std::chrono::duration<double>(timeJacobi - timeStart).count();
+			secondsFused += std::chrono::duration<double>(timeFused - timeJacobi).count();
+			secondsDirect += std::chrono::duration<double>(timeDirect - timeFused).count();
+			secondsChunked += std::chrono::duration<double>(timeEnd - timeDirect).count();
+		}
+
+		// the fused steps stay in u = 1 - alpha, the single ones round through alpha after every step
+		float maxFusedDifference = 0;
+		int numFusedMismatches = 0;
+		for (int cp = 0; cp < n; ++cp)
+		{
+			if (IsValid(ping[cp]) != IsValid(fused[cp])) numFusedMismatches++;
+			else if (IsValid(ping[cp])) maxFusedDifference = std::max(maxFusedDifference, fabsf(ping[cp] - fused[cp]));
+		}
+
+		float maxChunkedDifference = 0;
+		int numChunkedMismatches = 0;
+		for (int cp = 0; cp < n; ++cp)
+		{
+			if (IsValid(direct[cp]) != IsValid(chunked[cp])) numChunkedMismatches++;
+			else if (IsValid(direct[cp])) maxChunkedDifference = std::max(maxChunkedDifference, fabsf(direct[cp] - chunked[cp]));
+		}
+
+		double sumDifference = 0;
+		float maxDifference = 0;
+		int numValid = 0;
+		for (int cp = 0; cp < n; ++cp)
+		{
+			if (!IsValid(ping[cp]) || !IsValid(direct[cp])) continue;
+			float difference = fabsf(ping[cp] - direct[cp]);
+			sumDifference += difference;
+			maxDifference = std::max(maxDifference, difference);
+			numValid++;
+		}
+		printf("Smoothing of %i control points on %i lines (%i Jacobi steps of %.3f, t = %.3f", n, GetNumberOfLines(), iterations, w,
+			GetDiffusion(iterations, w));
+		if (t < GetDiffusion(iterations, w)) printf(", clamped to %.3f for the halo of at most %i", t, MAX_HALO);
+		printf(")\n");
+		printf("  jacobi: %8.3f ms / frame\n  fused : %8.3f ms / frame (difference to jacobi max %.2e, %i untouched mismatches)\n"
+			"  direct: %8.3f ms / frame (difference to jacobi mean %.2e max %.2e)\n"
+			"  chunks: %8.3f ms / frame (halo %i, difference to direct max %.2e, %i untouched mismatches)\n",
+			secondsJacobi * 1000 / std::max(numFrames, 1), secondsFused * 1000 / std::max(numFrames, 1), maxFusedDifference, numFusedMismatches,
+			secondsDirect * 1000 / std::max(numFrames, 1), numValid > 0 ? sumDifference / numValid : 0.0, maxDifference,
+			secondsChunked * 1000 / std::max(numFrames, 1), GetHalo(t), maxChunkedDifference, numChunkedMismatches);
+		return numFusedMismatches == 0 && maxFusedDifference <= 1e-5f && numChunkedMismatches == 0 && maxChunkedDifference <= 1e-5f;
+	}
+
+	// Solves the n control points of one line. 'c' is scratch memory.
+	static void SolveLine(const float* alphas, int n, float t, float* result, std::vector<float>& c)
+	{
+		c.resize(n);
+		int i = 0;
+		while (i < n)
+		{
+			if (!IsValid(alphas[i]))
+			{
+				bool hasNeighbor = (i > 0 && IsValid(alphas[i - 1])) || (i + 1 < n && IsValid(alphas[i + 1]));
+				result[i] = hasNeighbor ? alphas[i] : 1.0f;
+				++i;
+				continue;
+			}
+			int begin = i;
+			while (i < n && IsValid(alphas[i])) ++i;
+			SolveSegment(alphas + begin, i - begin, t, result + begin, c.data());
+		}
+	}
+
+private:
+
+	static const unsigned int NO_LINE = 0xffffffff;
+
+	static inline bool IsValid(float alpha) { return alpha == alpha; }
+
+	int GetLineStart(int cp) const { return _LineStarts[_LineOfControlPoint[cp]]; }
+	int GetLineEnd(int cp) const { return _LineStarts[_LineOfControlPoint[cp] + 1]; }
+
+	// the control points i and i + 1 are valid neighbors on the same line
+	inline bool IsConnected(const float* alphas, int i) const
+	{
+		return IsValid(alphas[i]) && IsValid(alphas[i + 1]) && _LineOfControlPoint[i] == _LineOfControlPoint[i + 1];
+	}
+
+	// Solves the chunk [first, last) in the window of 'halo' control points on both sides (see above). 'forward' holds the
+	// factors of the forward sweep (two per control point of the chunk).
+	void SolveChunk(const float* alphas, int first, int last, float t, int halo, float* result, float* forward) const
+	{
+		int n = GetNumberOfControlPoints();
+		int begin = std::max(0, first - halo), end = std::min(n, last + halo);
+		float b = 1 + t;
+
+		// forward sweep up to the control point before the last one of the chunk:  x_i = d_i - c_i x_(i+1)
+		float c = 0, d = 0;
+		for (int i = begin; i < last - 1; ++i)
+		{
+			if (IsValid(alphas[i]))
+			{
+				bool left = i > begin && IsConnected(alphas, i - 1), right = i + 1 < end && IsConnected(alphas, i);
+				float lower = left ? (right ? -0.5f * t : -t) : 0;
+				float upper = right ? (left ? -0.5f * t : -t) : 0;
+				float m = 1 / (b - lower * c);
+				c = upper * m;
+				d = ((1 - alphas[i]) - lower * d) * m;
+			}
+			if (i >= first - 1)
+			{
+				forward[2 * (i - first + 1)] = c;
+				forward[2 * (i - first + 1) + 1] = d;
+			}
+		}
+
+		// backward sweep down to the chunk:  x_i = e_i - f_i x_(i-1),  meets the forward sweep in every control point of the chunk
+		float f = 0, e = 0;
+		for (int i = end - 1; i >= first; --i)
+		{
+			bool left = i > begin && IsConnected(alphas, i - 1), right = i + 1 < end && IsConnected(alphas, i);
+			if (!IsValid(alphas[i]))
+			{
+				// untouched control points stay untouched next to valid ones, else 1
+				if (i < last)
+				{
+					bool hasNeighbor = (i > 0 && IsValid(alphas[i - 1]) && _LineOfControlPoint[i - 1] == _LineOfControlPoint[i]) ||
+						(i + 1 < n && IsValid(alphas[i + 1]) && _LineOfControlPoint[i + 1] == _LineOfControlPoint[i]);
+					result[i] = hasNeighbor ? alphas[i] : 1.0f;
+				}
+				continue;
+			}
+			float lower = left ? (right ? -0.5f * t : -t) : 0;
+			float upper = right ? (left ? -0.5f * t : -t) : 0;
+			float u = 1 - alphas[i];
+			if (i < last)
+			{
+				if (!left && !right) result[i] = 1;	// a single control point has no neighbors
+				else
+				{
+					float cLeft = left ? forward[2 * (i - first)] : 0, dLeft = left ? forward[2 * (i - first) + 1] : 0;
+					float x = (u - lower * dLeft - upper * e) / (b - lower * cLeft - upper * f);
+					result[i] = 1 - x;
+				}
+			}
+			float m = 1 / (b - upper * f);
+			f = lower * m;
+			e = (u - upper * e) * m;
+		}
+	}
+
+	// One Jacobi step on u = 1 - alpha for the entries [first, last), which have valid entries (or guards) on both sides.
+	static void Step(const float* u, const unsigned int* lines, int first, int last, float w, float* result)
+	{
+		int i = first;
+#ifdef SMOOTHING_SSE
+		const __m128 one = _mm_set1_ps(1.0f), half = _mm_set1_ps(0.5f), weight = _mm_set1_ps(w);
+		for (; i + 4 <= last; i += 4)
+		{
+			__m128 uLeft = _mm_loadu_ps(u + i - 1), uCenter = _mm_loadu_ps(u + i), uRight = _mm_loadu_ps(u + i + 1);
+			__m128i line = _mm_loadu_si128((const __m128i*)(lines + i));
+			__m128 left = _mm_and_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(lines + i - 1)), line)), _mm_cmpord_ps(uLeft, uLeft));
+			__m128 right = _mm_and_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(lines + i + 1)), line)), _mm_cmpord_ps(uRight, uRight));
+			__m128 target = _mm_add_ps(_mm_and_ps(left, uLeft), _mm_and_ps(right, uRight));
+			__m128 both = _mm_and_ps(left, right);
+			target = _mm_mul_ps(target, _mm_or_ps(_mm_and_ps(both, half), _mm_andnot_ps(both, one)));	// divided by the number of neighbors
+			__m128 smoothed = _mm_add_ps(uCenter, _mm_mul_ps(_mm_sub_ps(target, uCenter), weight));
+			_mm_storeu_ps(result + i, _mm_and_ps(_mm_or_ps(left, right), smoothed));	// 0 without neighbors
+		}
+#endif
+		for (; i < last; ++i)
+		{
+			float target = 0, numNeighbors = 0;
+			if (lines[i - 1] == lines[i] && IsValid(u[i - 1])) { target += u[i - 1]; numNeighbors += 1; }
+			if (lines[i + 1] == lines[i] && IsValid(u[i + 1])) { target += u[i + 1]; numNeighbors += 1; }
+			result[i] = numNeighbors > 0 ? u[i] + (target / numNeighbors - u[i]) * w : 0;
+		}
+	}
+
+	// Thomas algorithm on u = 1 - alpha. The rows of the end points have one neighbor, the inner ones two.
+	static void SolveSegment(const float* alphas, int n, float t, float* result, float* c)
+	{
+		if (n == 1)
+		{
+			result[0] = 1;
+			return;
+		}
+
+		// forward sweep: c receives the eliminated upper diagonal, result the eliminated right hand side
+		float b = 1 + t;
+		float cPrev = 0, dPrev = 0;
+		for (int i = 0; i < n; ++i)
+		{
+			float lower = i == 0 ? 0 : (i == n - 1 ? -t : -0.5f * t);
+			float upper = i == n - 1 ? 0 : (i == 0 ? -t : -0.5f * t);
+			float m = 1 / (b - lower * cPrev);
+			cPrev = upper * m;
+			dPrev = ((1 - alphas[i]) - lower * dPrev) * m;
+			c[i] = cPrev;
+			result[i] = dPrev;
+		}
+
+		// back substitution
+		float x = result[n - 1];
+		result[n - 1] = 1 - x;
+		for (int i = n - 2; i >= 0; --i)
+		{
+			x = result[i] - c[i] * x;
+			result[i] = 1 - x;
+		}
+	}
+
+	std::vector<int> _LineStarts;		// first control point of every line, and the number of control points at the end
+	std::vector<unsigned int> _LineOfControlPoint;
+};
@@ -0,0 +1,22 @@
+#pragma once
+
+// Small vector types of the platform-independent code (without DirectXMath, see math.hpp).
+
+struct Vec3f {
+	Vec3f() : x(0), y(0), z(0) {}
+	Vec3f(float X, float Y, float Z) : x(X), y(Y), z(Z) {}
+	float x;
+	float y;
+	float z;
+};
+
+struct Vec2i {
+	Vec2i(int X, int Y) : x(X), y(Y) {}
+	int x;
+	int y;
+};
+
+// Row-major 4x4 matrix for row vectors (p' = p * M), with the memory layout of XMFLOAT4X4.
+struct Mat4f {
+	float m[4][4];
+};